@@ -17,6 +17,10 @@
 
 #include <vde3.h>
 
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
 #include <vde3/common.h>
 
 vde_sobj *vde_sobj_from_string(const char *str)
@@ -33,3 +37,364 @@ vde_sobj *vde_sobj_from_string(const char *str)
   json_tokener_free(tok);
   return obj;
 }
+
+int vde_sobj_parser_feed(vde_sobj_parser *parser, const char *buf, size_t len,
+                         vde_sobj **obj, size_t *used)
+{
+  // the tokener takes an int length, larger buffers are fed in parts
+  if (len > INT_MAX) {
+    len = INT_MAX;
+  }
+
+  *obj = json_tokener_parse_ex(parser, buf, len);
+  *used = parser->char_offset;
+  if (*obj != NULL) {
+    json_tokener_reset(parser);
+    return 1;
+  }
+  if (parser->err == json_tokener_continue) {
+    *used = len;
+    return 0;
+  }
+
+  json_tokener_reset(parser);
+  errno = EINVAL;
+  return -1;
+}
+
+// nesting allowed in MessagePack data, the same as the json tokener
+#define MSGPACK_MAX_DEPTH 32
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+} msgpack_buf;
+
+static void msgpack_put(msgpack_buf *b, const void *data, size_t len)
+{
+  if (b->len + len > b->size) {
+    while (b->len + len > b->size) {
+      b->size *= 2;
+    }
+    b->data = vde_realloc(b->data, b->size);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+/*
+ * Write a type byte followed by the lowest sz bytes of val, big endian
+ */
+static void msgpack_put_hdr(msgpack_buf *b, unsigned char type, uint64_t val,
+                            unsigned int sz)
+{
+  unsigned char hdr[9];
+  unsigned int i;
+
+  hdr[0] = type;
+  for (i = sz; i > 0; i--) {
+    hdr[i] = val & 0xff;
+    val >>= 8;
+  }
+  msgpack_put(b, hdr, sz + 1);
+}
+
+/*
+ * Write the header of a string, array or map: the 32 bit type always follows
+ * the 16 bit one, strings have an 8 bit type as well
+ */
+static void msgpack_put_len(msgpack_buf *b, unsigned char fix, size_t fixmax,
+                            unsigned char type8, unsigned char type16,
+                            size_t len)
+{
+  if (len <= fixmax) {
+    msgpack_put_hdr(b, fix | len, 0, 0);
+  } else if (type8 && len <= UINT8_MAX) {
+    msgpack_put_hdr(b, type8, len, 1);
+  } else if (len <= UINT16_MAX) {
+    msgpack_put_hdr(b, type16, len, 2);
+  } else {
+    msgpack_put_hdr(b, type16 + 1, len, 4);
+  }
+}
+
+static void msgpack_put_int(msgpack_buf *b, int64_t i)
+{
+  if (i >= 0) {
+    if (i <= INT8_MAX) {
+      msgpack_put_hdr(b, i, 0, 0);
+    } else if (i <= UINT8_MAX) {
+      msgpack_put_hdr(b, 0xcc, i, 1);
+    } else if (i <= UINT16_MAX) {
+      msgpack_put_hdr(b, 0xcd, i, 2);
+    } else if (i <= UINT32_MAX) {
+      msgpack_put_hdr(b, 0xce, i, 4);
+    } else {
+      msgpack_put_hdr(b, 0xcf, i, 8);
+    }
+  } else {
+    if (i >= -32) {
+      msgpack_put_hdr(b, (unsigned char)i, 0, 0);
+    } else if (i >= INT8_MIN) {
+      msgpack_put_hdr(b, 0xd0, i, 1);
+    } else if (i >= INT16_MIN) {
+      msgpack_put_hdr(b, 0xd1, i, 2);
+    } else if (i >= INT32_MIN) {
+      msgpack_put_hdr(b, 0xd2, i, 4);
+    } else {
+      msgpack_put_hdr(b, 0xd3, i, 8);
+    }
+  }
+}
+
+static void msgpack_encode(msgpack_buf *b, vde_sobj *obj)
+{
+  const char *str;
+  double d;
+  uint64_t val;
+  int i, len;
+
+  switch (json_object_get_type(obj)) {
+    case json_type_boolean:
+      msgpack_put_hdr(b, json_object_get_boolean(obj) ? 0xc3 : 0xc2, 0, 0);
+      break;
+    case json_type_int:
+      msgpack_put_int(b, json_object_get_int64(obj));
+      break;
+    case json_type_double:
+      d = json_object_get_double(obj);
+      memcpy(&val, &d, sizeof(val));
+      msgpack_put_hdr(b, 0xcb, val, 8);
+      break;
+    case json_type_string:
+      str = json_object_get_string(obj);
+      len = json_object_get_string_len(obj);
+      msgpack_put_len(b, 0xa0, 31, 0xd9, 0xda, len);
+      msgpack_put(b, str, len);
+      break;
+    case json_type_array:
+      len = json_object_array_length(obj);
+      msgpack_put_len(b, 0x90, 15, 0, 0xdc, len);
+      for (i = 0; i < len; i++) {
+        msgpack_encode(b, json_object_array_get_idx(obj, i));
+      }
+      break;
+    case json_type_object:
+      msgpack_put_len(b, 0x80, 15, 0, 0xde,
+                      json_object_object_length(obj));
+      {
+        json_object_object_foreach(obj, key, value) {
+          len = strlen(key);
+          msgpack_put_len(b, 0xa0, 31, 0xd9, 0xda, len);
+          msgpack_put(b, key, len);
+          msgpack_encode(b, value);
+        }
+      }
+      break;
+    default:
+      msgpack_put_hdr(b, 0xc0, 0, 0);
+      break;
+  }
+}
+
+int vde_sobj_to_msgpack(vde_sobj *obj, char **buf, size_t *len)
+{
+  msgpack_buf b;
+
+  b.size = 256;
+  b.len = 0;
+  b.data = vde_alloc(b.size);
+  if (b.data == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  msgpack_encode(&b, obj);
+
+  *buf = b.data;
+  *len = b.len;
+  return 0;
+}
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  size_t off;
+} msgpack_reader;
+
+/*
+ * Read a big endian value of sz bytes
+ */
+static int msgpack_get(msgpack_reader *r, unsigned int sz, uint64_t *val)
+{
+  if (r->len - r->off < sz) {
+    return -1;
+  }
+  *val = 0;
+  while (sz-- > 0) {
+    *val = (*val << 8) | r->data[r->off++];
+  }
+  return 0;
+}
+
+static int msgpack_decode(msgpack_reader *r, unsigned int depth,
+                          vde_sobj **obj)
+{
+  unsigned char type;
+  uint64_t val, n, i;
+  unsigned int shift;
+  float f;
+  double d;
+  uint32_t f_val;
+  vde_sobj *key, *item;
+
+  if (depth > MSGPACK_MAX_DEPTH || msgpack_get(r, 1, &val)) {
+    return -1;
+  }
+  type = val;
+
+  if (type <= 0x7f) {
+    *obj = json_object_new_int64(type);
+    return 0;
+  } else if (type >= 0xe0) {
+    *obj = json_object_new_int64((int8_t)type);
+    return 0;
+  } else if ((type & 0xe0) == 0xa0) {
+    n = type & 0x1f;
+    goto string;
+  } else if ((type & 0xf0) == 0x90) {
+    n = type & 0x0f;
+    goto array;
+  } else if ((type & 0xf0) == 0x80) {
+    n = type & 0x0f;
+    goto map;
+  }
+
+  switch (type) {
+    case 0xc0:
+      *obj = NULL;
+      return 0;
+    case 0xc2:
+    case 0xc3:
+      *obj = json_object_new_boolean(type == 0xc3);
+      return 0;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+      if (msgpack_get(r, 1 << (type - 0xcc), &val) || val > INT64_MAX) {
+        return -1;
+      }
+      *obj = json_object_new_int64(val);
+      return 0;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+      if (msgpack_get(r, 1 << (type - 0xd0), &val)) {
+        return -1;
+      }
+      // sign extension
+      shift = 64 - 8 * (1 << (type - 0xd0));
+      *obj = json_object_new_int64((int64_t)(val << shift) >> shift);
+      return 0;
+    case 0xca:
+      if (msgpack_get(r, 4, &val)) {
+        return -1;
+      }
+      f_val = val;
+      memcpy(&f, &f_val, sizeof(f));
+      *obj = json_object_new_double(f);
+      return 0;
+    case 0xcb:
+      if (msgpack_get(r, 8, &val)) {
+        return -1;
+      }
+      memcpy(&d, &val, sizeof(d));
+      *obj = json_object_new_double(d);
+      return 0;
+    case 0xc4: case 0xc5: case 0xc6: // bin, loaded as a string
+      if (msgpack_get(r, 1 << (type - 0xc4), &n)) {
+        return -1;
+      }
+      goto string;
+    case 0xd9: case 0xda: case 0xdb:
+      if (msgpack_get(r, 1 << (type - 0xd9), &n)) {
+        return -1;
+      }
+      goto string;
+    case 0xdc: case 0xdd:
+      if (msgpack_get(r, 2 << (type - 0xdc), &n)) {
+        return -1;
+      }
+      goto array;
+    case 0xde: case 0xdf:
+      if (msgpack_get(r, 2 << (type - 0xde), &n)) {
+        return -1;
+      }
+      goto map;
+    default: // extension types, unused
+      return -1;
+  }
+
+string:
+  if (n > r->len - r->off || n > INT_MAX) {
+    return -1;
+  }
+  *obj = json_object_new_string_len((const char *)r->data + r->off, n);
+  r->off += n;
+  return 0;
+
+array:
+  // each item takes one byte at least, refuse lengths out of the data
+  if (n > r->len - r->off) {
+    return -1;
+  }
+  *obj = json_object_new_array();
+  for (i = 0; i < n; i++) {
+    if (msgpack_decode(r, depth + 1, &item)) {
+      json_object_put(*obj);
+      return -1;
+    }
+    json_object_array_add(*obj, item);
+  }
+  return 0;
+
+map:
+  if (n > (r->len - r->off) / 2) {
+    return -1;
+  }
+  *obj = json_object_new_object();
+  for (i = 0; i < n; i++) {
+    if (msgpack_decode(r, depth + 1, &key)) {
+      json_object_put(*obj);
+      return -1;
+    }
+    if (!json_object_is_type(key, json_type_string) ||
+        msgpack_decode(r, depth + 1, &item)) {
+      json_object_put(key);
+      json_object_put(*obj);
+      return -1;
+    }
+    // the key is copied
+    json_object_object_add(*obj, json_object_get_string(key), item);
+    json_object_put(key);
+  }
+  return 0;
+}
+
+int vde_sobj_from_msgpack(const char *buf, size_t len, vde_sobj **obj)
+{
+  msgpack_reader r;
+
+  r.data = (const unsigned char *)buf;
+  r.len = len;
+  r.off = 0;
+
+  if (msgpack_decode(&r, 0, obj)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // trailing data
+  if (r.off != len) {
+    json_object_put(*obj);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
@@ -20,6 +20,7 @@
 #include <vde3.h>
 
 #include <vde3/component.h>
+#include <vde3/context.h>
 #include <vde3/engine.h>
 #include <vde3/transport.h>
 #include <vde3/conn_manager.h>
@@ -137,21 +138,26 @@ void vde_component_delete(vde_component *component)
 
 void vde_component_get(vde_component *component, int *count)
 {
+  int refcount;
+
   vde_assert(component != NULL);
 
-  component->refcount++;
+  // components can be referenced by connections running in context workers
+  refcount = __sync_add_and_fetch(&component->refcount, 1);
   if(count) {
-      *count = component->refcount;
+      *count = refcount;
   }
 }
 
 void vde_component_put(vde_component *component, int *count)
 {
+  int refcount;
+
   vde_assert(component != NULL);
 
-  component->refcount--;
+  refcount = __sync_sub_and_fetch(&component->refcount, 1);
   if(count) {
-      *count = component->refcount;
+      *count = refcount;
   }
 }
 
@@ -159,10 +165,12 @@ int vde_component_put_if_last(vde_component *component, int *count)
 {
   vde_assert(component != NULL);
 
-  if (component->refcount != 1) {
+  if (!__sync_bool_compare_and_swap(&component->refcount, 1, 0)) {
     return 1;
   } else {
-    vde_component_put(component, count);
+    if(count) {
+        *count = 0;
+    }
     return 0;
   }
 }
@@ -261,6 +269,9 @@ int vde_component_command_add(vde_component *component,
   }
 
   vde_hash_insert(component->commands, (long)qname, command);
+  if (component->ctx != NULL) {
+    vde_context_bump_generation(component->ctx);
+  }
 
   return 0;
 }
@@ -283,6 +294,9 @@ int vde_component_command_del(vde_component *component,
     errno = ENOENT;
     return -1;
   }
+  if (component->ctx != NULL) {
+    vde_context_bump_generation(component->ctx);
+  }
 
   return 0;
 }
@@ -492,6 +506,26 @@ int vde_engine_new_connection(vde_component *engine, vde_connection *conn,
   return engine->eng_new_conn(engine, conn, req);
 }
 
+void vde_engine_signal_ports(vde_component *engine, const char *signal,
+                             unsigned int nports)
+{
+  vde_sobj *info;
+
+  vde_assert(engine != NULL);
+  vde_assert(engine->kind == VDE_ENGINE);
+
+  info = vde_sobj_new_array();
+  if (info == NULL) {
+    vde_error("%s: cannot allocate signal info", __PRETTY_FUNCTION__);
+    return;
+  }
+  // XXX print the port number instead of the total number of ports, it
+  // changes what listeners receive
+  vde_sobj_array_add(info, vde_sobj_new_int(nports));
+  vde_component_signal_raise(engine, signal, info);
+  vde_sobj_put(info);
+}
+
 /*
  * Transport-specific functions.
  *
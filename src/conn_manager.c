@@ -117,7 +117,15 @@ int conn_manager_connect(vde_component *component,
   cm = vde_component_get_priv(component);
   cm->pending_conns = vde_list_prepend(cm->pending_conns, pc);
 
-  return vde_transport_connect(cm->transport, conn);
+  if (vde_transport_connect(cm->transport, conn)) {
+    tmp_errno = errno;
+    cm->pending_conns = vde_list_remove(cm->pending_conns, pc);
+    vde_free(pc);
+    vde_connection_delete(conn);
+    errno = tmp_errno;
+    return -1;
+  }
+  return 0;
 }
 
 static int post_authorization(conn_manager *cm, struct pending_conn *pc)
@@ -199,8 +207,29 @@ void conn_manager_accept_cb(vde_connection *conn, void *arg)
 void conn_manager_error_cb(vde_connection *conn, int tr_errno,
                            void *arg)
 {
-  // if conn in pending_conn and there's an application callback call it,
-  // delete pending_conn and delete conn
+  struct pending_conn *pc;
+  vde_component *component = (vde_component *)arg;
+  conn_manager *cm = (conn_manager *)vde_component_get_priv(component);
+
+  if (!conn) {
+    vde_error("%s: transport error: %s", __PRETTY_FUNCTION__,
+              strerror(tr_errno));
+    return;
+  }
+  pc = lookup_pending_conn(cm, conn);
+  if (!pc) {
+    vde_error("%s: cannot lookup pending connection", __PRETTY_FUNCTION__);
+    return;
+  }
+  vde_error("%s: connection failed: %s", __PRETTY_FUNCTION__,
+            strerror(tr_errno));
+  if (pc->error_cb) {
+    pc->error_cb(cm->component, pc->connect_cb_arg);
+  }
+  cm->pending_conns = vde_list_remove(cm->pending_conns, pc);
+  vde_free(pc);
+  // the transport has already released its backend
+  vde_connection_delete(conn);
 }
 
 // in engine.new_conn: vde_conn_set_callbacks(conn, engine_callbacks..)
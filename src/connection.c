@@ -81,11 +81,50 @@ void vde_connection_set_callbacks(vde_connection *conn,
   vde_assert(read_cb != NULL && error_cb != NULL);
 
   conn->read_cb = read_cb;
+  conn->read_batch_cb = NULL;
   conn->write_cb = write_cb;
   conn->error_cb = error_cb;
   conn->cb_priv = cb_priv;
 }
 
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb)
+{
+  vde_assert(conn != NULL);
+
+  conn->read_batch_cb = read_batch_cb;
+}
+
+void vde_connection_set_be_write_batch(vde_connection *conn,
+                                       conn_be_write_batch be_write_batch)
+{
+  vde_assert(conn != NULL);
+
+  conn->be_write_batch = be_write_batch;
+}
+
+void vde_connection_set_be_queue_stats(vde_connection *conn,
+                                       conn_be_queue_stats be_queue_stats)
+{
+  vde_assert(conn != NULL);
+
+  conn->be_queue_stats = be_queue_stats;
+}
+
+int vde_connection_get_queue_stats(vde_connection *conn,
+                                   vde_conn_queue_stats *stats)
+{
+  vde_assert(conn != NULL);
+  vde_assert(stats != NULL);
+
+  if (conn->be_queue_stats == NULL) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  conn->be_queue_stats(conn, stats);
+  return 0;
+}
+
 unsigned int vde_connection_max_payload(vde_connection *conn)
 {
   vde_assert(conn != NULL);
@@ -94,6 +94,11 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
     return -1;
   }
   memcpy(&ctx->event_handler, handler, sizeof(vde_event_handler));
+  ctx->timers = vde_timer_wheel_new(handler);
+  if (ctx->timers == NULL) {
+    vde_error("%s: cannot create timer wheel", __PRETTY_FUNCTION__);
+    return -1;
+  }
   ctx->modules = NULL;
   ctx->components = vde_ordhash_new();
   ctx->initialized = 1;
@@ -101,11 +106,21 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
   if (vde_modules_load(ctx, modules_path)) {
     tmp_errno = errno;
     vde_error("%s: error while loading modules", __PRETTY_FUNCTION__);
-    errno = tmp_errno;
-    return -1;
+    goto cleanup;
   }
 
   return 0;
+
+cleanup:
+  vde_list_delete(ctx->modules);
+  ctx->modules = NULL;
+  vde_ordhash_delete(ctx->components);
+  ctx->components = NULL;
+  vde_timer_wheel_delete(ctx->timers);
+  ctx->timers = NULL;
+  ctx->initialized = 0;
+  errno = tmp_errno;
+  return -1;
 }
 
 void vde_context_fini(vde_context *ctx)
@@ -164,6 +179,13 @@ void vde_context_fini(vde_context *ctx)
 
   vde_ordhash_delete(ctx->components);
 
+  // components have released what they had pinned to workers by now
+  vde_context_set_workers(ctx, 0);
+
+  // components have deleted their timers by now
+  vde_timer_wheel_delete(ctx->timers);
+  ctx->timers = NULL;
+
   // XXX remove every module and dlclose() its handle, this works because at
   // this point no components should reference symbols in modules
   vde_list_delete(ctx->modules);
@@ -173,6 +195,57 @@ void vde_context_fini(vde_context *ctx)
   return;
 }
 
+int vde_context_set_workers(vde_context *ctx, unsigned int nworkers)
+{
+  if (ctx == NULL || ctx->initialized != 1) {
+    vde_error("%s: context not initialized", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (nworkers == ctx->nworkers) {
+    return 0;
+  }
+  if (nworkers != 0 && ctx->nworkers != 0) {
+    vde_error("%s: workers must be stopped before starting new ones",
+              __PRETTY_FUNCTION__);
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (nworkers == 0) {
+    vde_workers_stop(ctx->workers, ctx->nworkers);
+    ctx->workers = NULL;
+    ctx->nworkers = 0;
+    return 0;
+  }
+
+  ctx->workers = vde_workers_start(ctx, &ctx->event_handler, nworkers);
+  if (ctx->workers == NULL) {
+    vde_error("%s: cannot start workers, the event handler must keep a loop "
+              "per thread (e.g. epoll_eh)", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  ctx->nworkers = nworkers;
+  return 0;
+}
+
+unsigned int vde_context_get_workers(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  return ctx->nworkers;
+}
+
+int vde_context_worker_call(vde_context *ctx, unsigned int worker,
+                            void (*fn)(void *), void *arg, int wait)
+{
+  if (ctx == NULL || fn == NULL || worker >= ctx->nworkers) {
+    errno = EINVAL;
+    return -1;
+  }
+  return vde_worker_call(ctx->workers[worker], fn, arg, wait);
+}
+
 void vde_context_delete(vde_context *ctx)
 {
   if (ctx == NULL || ctx->initialized != 0) {
@@ -227,6 +300,7 @@ int vde_context_new_component(vde_context *ctx, vde_component_kind kind,
   // cast because vde_hash_insert keys are pointers
   vde_ordhash_insert(ctx->components, (void *)qname, *component);
   vde_component_get(*component, &refcount);
+  vde_context_bump_generation(ctx);
   return 0;
 }
 
@@ -299,6 +373,7 @@ int vde_context_component_del(vde_context *ctx, vde_component *component)
   }
 
   vde_ordhash_remove(ctx->components, (void *)qname);
+  vde_context_bump_generation(ctx);
 
   // here the component is deleted because it doesn't make sense to have it out
   // of the vde_context
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include <vde3/module.h>
 #include <vde3/engine.h>
@@ -28,7 +29,12 @@
 
 #include <engine_ctrl_commands.h>
 
-#define MAX_INBUF_SZ 8192
+// smallest packet allocated for replies, they are packed together
+#define OUT_PKT_SZ 4096
+
+// MessagePack messages are preceded by their length, 32 bit big endian
+#define FRAME_HDR_SZ 4
+#define MAX_FRAME_SZ (64 * 1024 * 1024)
 
 // XXX '/' is escaped by json
 #define SEP_CHAR '.'
@@ -37,6 +43,7 @@
 static char const * const builtin_commands[] = {
   "notify_add",
   "notify_del",
+  "set_encoding",
   NULL
 };
 
@@ -55,23 +62,258 @@ typedef struct {
   // XXX aliases table
   vde_list *ctrl_conns;
   vde_component *component;
+  vde_hash *methods; // method name -> ctrl_method, resolved calls
+  unsigned int methods_gen; // context generation the methods are valid for
 } ctrl_engine;
 
+/**
+ * @brief A method name resolved to its component and command
+ */
+typedef struct {
+  char *name;
+  vde_component *component;
+  vde_command *command;
+  int builtin; // ctrl engine builtin, called with the ctrl_conn
+} ctrl_method;
+
+typedef enum {
+  CTRL_ENC_JSON, // NUL terminated JSON strings
+  CTRL_ENC_MSGPACK // MessagePack objects framed with their length
+} ctrl_encoding;
+
 typedef struct {
   vde_connection *conn;
-  char inbuf[MAX_INBUF_SZ];
-  size_t inbuf_len;
+  vde_sobj_parser *parser; // keeps partial requests across packets
+  vde_sobj *in_sobj; // parsed request waiting for its separator
+  int in_bad; // the current request cannot be parsed, skip to its separator
+  unsigned char in_hdr[FRAME_HDR_SZ]; // MessagePack frame header
+  unsigned int in_hdr_len;
+  char *in_buf; // MessagePack frame spanning many packets
+  int in_errno; // the frame is skipped because of an error, not its content
+  size_t in_len;
+  size_t in_size;
+  ctrl_encoding encoding;
+  ctrl_encoding next_encoding; // set by set_encoding, used after its reply
   vde_queue *out_queue;
+  vde_pkt *out_pkt; // partially filled, more replies are packed into it
   vde_list *reg_signals;
   // - permission level
   ctrl_engine *engine;
 } ctrl_conn;
 
-static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
+static unsigned int ctrl_method_hash(const void *key)
+{
+  const unsigned char *name = (const unsigned char *)key;
+  uint32_t hash = 2166136261u;
+
+  while (*name != '\0') {
+    hash = (hash ^ *name++) * 16777619u;
+  }
+  return hash;
+}
+
+static int ctrl_method_equal(const void *a, const void *b)
+{
+  return strcmp((const char *)a, (const char *)b) == 0;
+}
+
+static void ctrl_method_free(void *key, void *value, void *arg)
+{
+  ctrl_method *method = (ctrl_method *)value;
+
+  vde_free(method->name);
+  vde_free(method);
+}
+
+/**
+ * @brief Drop all the resolved methods
+ */
+static void ctrl_methods_clear(ctrl_engine *ctrl)
+{
+  vde_hash_foreach(ctrl->methods, ctrl_method_free, NULL);
+  vde_hash_remove_all(ctrl->methods);
+}
+
+/**
+ * @brief Write queued packets to the connection, a batch at a time. Packets
+ * which cannot be written are left in the queue in the same order.
+ *
+ * The partially filled packet is queued as well, so replies packed so far go
+ * out.
+ *
+ * @param cc The control connection to flush
+ */
+static void ctrl_conn_flush(ctrl_conn *cc)
+{
+  int i, sent;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+
+  if (cc->out_pkt != NULL) {
+    vde_queue_push_head(cc->out_queue, cc->out_pkt);
+    cc->out_pkt = NULL;
+  }
+
+  do {
+    vde_pkt_batch_init(&batch);
+    pkt = vde_queue_pop_tail(cc->out_queue);
+    while (pkt != NULL) {
+      vde_pkt_batch_add(&batch, pkt);
+      if (vde_pkt_batch_full(&batch)) {
+        break;
+      }
+      pkt = vde_queue_pop_tail(cc->out_queue);
+    }
+    if (batch.len == 0) {
+      return;
+    }
+
+    sent = vde_connection_write_batch(cc->conn, &batch);
+    for (i = 0; i < sent; i++) {
+      vde_pkt_put(batch.pkts[i]);
+    }
+    // couldn't write, requeue the rest keeping the order
+    for (i = batch.len - 1; i >= sent; i--) {
+      vde_queue_push_tail(cc->out_queue, batch.pkts[i]);
+    }
+  } while (sent == (int)batch.len);
+}
+
+/**
+ * @brief Append data after the one already queued, packing it in packets as
+ * large as the connection allows. Nothing is written until ctrl_conn_flush()
+ * is called.
+ *
+ * @param cc The control connection
+ * @param data The data
+ * @param len The length of data
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately), part
+ * of data might have been queued
+ */
+static int ctrl_conn_queue_data(ctrl_conn *cc, const char *data, size_t len)
+{
+  unsigned int payload_sz, pkt_sz, cpy_sz;
+  vde_pkt *pkt;
+
+  payload_sz = vde_connection_max_payload(cc->conn);
+  if (payload_sz == 0) {
+    // no limit, packets are as large as the message
+    payload_sz = UINT_MAX;
+  }
+
+  while (len > 0) {
+    pkt = cc->out_pkt;
+    if (pkt == NULL) {
+      // room for this message, or for a few small ones
+      if (len < OUT_PKT_SZ) {
+        pkt_sz = OUT_PKT_SZ;
+      } else if (len < payload_sz) {
+        pkt_sz = len;
+      } else {
+        pkt_sz = payload_sz;
+      }
+      if (pkt_sz > payload_sz) {
+        pkt_sz = payload_sz;
+      }
+      pkt = vde_pkt_new(pkt_sz, 0, 0);
+      if (pkt == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+      pkt->hdr->pkt_len = 0;
+      // XXX: set type and version
+      cc->out_pkt = pkt;
+    }
+
+    cpy_sz = (pkt->tail - pkt->payload) - pkt->hdr->pkt_len;
+    if (cpy_sz > len) {
+      cpy_sz = len;
+    }
+    memcpy(pkt->payload + pkt->hdr->pkt_len, data, cpy_sz);
+    pkt->hdr->pkt_len += cpy_sz;
+    data += cpy_sz;
+    len -= cpy_sz;
+
+    if (pkt->payload + pkt->hdr->pkt_len == pkt->tail) {
+      vde_queue_push_head(cc->out_queue, pkt);
+      cc->out_pkt = NULL;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Drop the data queued after a point, restoring the packet which was
+ * being filled at that point
+ *
+ * @param cc The control connection
+ * @param queued The number of packets queued at that point
+ * @param last The packet being filled at that point, can be NULL
+ * @param last_len The length of last at that point
+ */
+static void ctrl_conn_unqueue(ctrl_conn *cc, unsigned int queued,
+                              vde_pkt *last, unsigned int last_len)
+{
+  vde_pkt *pkt;
+
+  if (cc->out_pkt != NULL && cc->out_pkt != last) {
+    vde_pkt_put(cc->out_pkt);
+  }
+  cc->out_pkt = NULL;
+  while (vde_queue_get_length(cc->out_queue) > queued) {
+    pkt = vde_queue_pop_head(cc->out_queue);
+    if (pkt != last) {
+      vde_pkt_put(pkt);
+    }
+  }
+  if (last != NULL) {
+    last->hdr->pkt_len = last_len;
+    cc->out_pkt = last;
+  }
+}
+
+/**
+ * @brief Serialize a message in the encoding of the connection and queue it
+ *
+ * @param cc The control connection
+ * @param out_obj The message
+ *
+ * @return zero on success, -1 on error
+ */
+static int ctrl_engine_conn_queue(ctrl_conn *cc, vde_sobj *out_obj) {
   const char *out_str;
-  vde_pkt *new_pkt, *send_pkt;
-  unsigned int out_len, payload_sz, last_chunk_sz, num_chunks, sent_chunks,
-               cpy_sz, rv;
+  char *out_buf;
+  unsigned char hdr[FRAME_HDR_SZ];
+  size_t out_len;
+  unsigned int queued, last_len;
+  vde_pkt *last;
+
+  // a message is queued whole or not at all, the peer would not find the
+  // ones after it otherwise
+  queued = vde_queue_get_length(cc->out_queue);
+  last = cc->out_pkt;
+  last_len = last != NULL ? last->hdr->pkt_len : 0;
+
+  if (cc->encoding == CTRL_ENC_MSGPACK) {
+    if (vde_sobj_to_msgpack(out_obj, &out_buf, &out_len)) {
+      vde_error("%s: cannot serialize out_obj", __PRETTY_FUNCTION__);
+      return -1;
+    }
+    hdr[0] = (out_len >> 24) & 0xff;
+    hdr[1] = (out_len >> 16) & 0xff;
+    hdr[2] = (out_len >> 8) & 0xff;
+    hdr[3] = out_len & 0xff;
+    if (ctrl_conn_queue_data(cc, (char *)hdr, FRAME_HDR_SZ) ||
+        ctrl_conn_queue_data(cc, out_buf, out_len)) {
+      vde_error("%s: cannot queue message, dropping it", __PRETTY_FUNCTION__);
+      ctrl_conn_unqueue(cc, queued, last, last_len);
+      vde_free(out_buf);
+      return -1;
+    }
+    vde_free(out_buf);
+    return 0;
+  }
 
   // no need to free out_str, will be garbage-collected when out_obj is
   // destroyed
@@ -82,49 +324,23 @@ static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
     return -1;
   }
 
-  out_len = strlen(out_str) + 1; // send \0 as well
-  payload_sz = vde_connection_max_payload(cc->conn);
-  last_chunk_sz = out_len % payload_sz;
-  num_chunks = out_len / payload_sz;
-  if (last_chunk_sz) {
-    // add non-full chunk
-    num_chunks++;
+  // send \0 as well
+  if (ctrl_conn_queue_data(cc, out_str, strlen(out_str) + 1)) {
+    vde_error("%s: cannot queue message, dropping it", __PRETTY_FUNCTION__);
+    ctrl_conn_unqueue(cc, queued, last, last_len);
+    return -1;
   }
 
-  // create packets
-  sent_chunks = 0;
-  while (num_chunks > sent_chunks) {
-
-    if ((num_chunks == sent_chunks + 1) && last_chunk_sz) {
-      // sending non-complete last chunk
-      cpy_sz = last_chunk_sz;
-    } else {
-      cpy_sz = payload_sz;
-    }
-
-    new_pkt = vde_pkt_new(cpy_sz, 0, 0);
-    // XXX check pkt NULL
-    new_pkt->hdr->pkt_len = cpy_sz;
-    // XXX: set type and version
-    memcpy(new_pkt->payload, out_str + (sent_chunks*payload_sz), cpy_sz);
-
-    vde_queue_push_head(cc->out_queue, new_pkt);
+  return 0;
+}
 
-    sent_chunks++;
+static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
+  if (ctrl_engine_conn_queue(cc, out_obj)) {
+    return -1;
   }
 
   // try to send packets
-  send_pkt = vde_queue_pop_tail(cc->out_queue);
-  while (send_pkt) {
-    rv = vde_connection_write(cc->conn, send_pkt);
-    if (rv != 0) {
-      // couldn't write, requeue
-      vde_queue_push_tail(cc->out_queue, send_pkt);
-      break;
-    }
-    vde_free(send_pkt);
-    send_pkt = vde_queue_pop_tail(cc->out_queue);
-  }
+  ctrl_conn_flush(cc);
 
   return 0;
 }
@@ -508,80 +724,144 @@ out:
   return rv;
 }
 
-static void ctrl_engine_deserialize_string(char *string, void *arg)
+int engine_ctrl_set_encoding(vde_component *component, const char *encoding,
+                             vde_sobj **out)
 {
-  ctrl_conn *cc = (ctrl_conn *)arg;
-  vde_sobj *in_sobj, *out_sobj = NULL, *mesg_id, *reply, *err_code;
-  const char *method_name;
-  char *component_name, *command_name;
-  command_func func;
-  int rv;
-
-  vde_command *command;
-  vde_component *component;
+  // builtin command, casting component
+  ctrl_conn *cc = (ctrl_conn *)component;
 
-  in_sobj = vde_sobj_from_string(string);
-  if (!in_sobj) {
-    // XXX: here and below check reply == NULL
-    // and check ctrl_engine_conn_write()
-    reply = rpc_XX_build_error_reply(NULL, EINVAL,
-                                     "Cannot deserialize command");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto out;
+  if (!strcmp(encoding, "json")) {
+    cc->next_encoding = CTRL_ENC_JSON;
+  } else if (!strcmp(encoding, "msgpack")) {
+    cc->next_encoding = CTRL_ENC_MSGPACK;
+  } else {
+    *out = vde_sobj_new_string("Unknown encoding");
+    errno = EINVAL;
+    return -1;
   }
 
-  if (rpc_10_sobj_validate_call(in_sobj)) {
-    reply = rpc_XX_build_error_reply(NULL, EINVAL,
-                                     "Invalid method call received");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleaninsobj;
-  }
+  *out = vde_sobj_new_string("Encoding set");
+  return 0;
+}
 
-  // mesg_id will be freed by vde_sobj_put(in_sobj)
-  mesg_id = vde_sobj_hash_lookup(in_sobj, "id");
+/**
+ * @brief Resolve a method name to its component and command
+ *
+ * Resolved methods are cached until components or commands of the context
+ * change, so that repeated calls cost a single lookup.
+ *
+ * @param ctrl The ctrl engine
+ * @param name The method name, component.command
+ * @param errmsg Reference to the error message, set on error
+ *
+ * @return the method on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static ctrl_method *ctrl_method_resolve(ctrl_engine *ctrl, const char *name,
+                                        const char **errmsg)
+{
+  char *component_name, *command_name;
+  vde_component *component;
+  vde_command *command;
+  ctrl_method *method;
+  vde_context *ctx = vde_component_get_context(ctrl->component);
 
-  // XXX command aliases resolution
+  if (ctrl->methods_gen != vde_context_get_generation(ctx)) {
+    ctrl_methods_clear(ctrl);
+    ctrl->methods_gen = vde_context_get_generation(ctx);
+  }
 
-  method_name = vde_sobj_get_string(vde_sobj_hash_lookup(in_sobj, "method"));
+  method = vde_hash_lookup(ctrl->methods, name);
+  if (method != NULL) {
+    return method;
+  }
 
-  if (check_split_path(method_name, &component_name, &command_name) == -1) {
+  if (check_split_path(name, &component_name, &command_name) == -1) {
     // XXX: what if errno == ENOMEM ?
-    reply = rpc_XX_build_error_reply(mesg_id, EINVAL,
-                                     "Method name not well-formed");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleaninsobj;
+    *errmsg = "Method name not well-formed";
+    errno = EINVAL;
+    return NULL;
   }
 
-  component = vde_context_get_component(vde_connection_get_context(cc->conn),
-                                        component_name);
+  component = vde_context_get_component(ctx, component_name);
   if (!component) {
-    reply = rpc_XX_build_error_reply(mesg_id, ENOENT, "Component not found");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
+    *errmsg = "Component not found";
+    errno = ENOENT;
     goto cleannames;
   }
 
   command = vde_component_command_get(component, command_name);
   if (!command) {
-    reply = rpc_XX_build_error_reply(mesg_id, ENOENT, "Command not found");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
+    *errmsg = "Command not found";
+    errno = ENOENT;
     goto cleannames;
   }
 
-  func = vde_command_get_func(command);
+  // failed lookups are not cached, names come from clients
+  method = vde_calloc(sizeof(ctrl_method));
+  if (method == NULL) {
+    *errmsg = "Cannot allocate method";
+    errno = ENOMEM;
+    goto cleannames;
+  }
+  method->name = vde_strdup(name);
+  method->component = component;
+  method->command = command;
+  method->builtin = component == ctrl->component && is_builtin(command);
+  vde_hash_insert(ctrl->methods, method->name, method);
+
+cleannames:
+  // using free as a result of using strdup as well instead of vde_free
+  free(component_name);
+  free(command_name);
+  return method;
+}
+
+/**
+ * @brief Run a single method call
+ *
+ * @param cc The control connection
+ * @param call The method call
+ *
+ * @return The reply to the call
+ */
+static vde_sobj *ctrl_engine_call(ctrl_conn *cc, vde_sobj *call)
+{
+  vde_sobj *out_sobj = NULL, *mesg_id, *reply, *err_code;
+  const char *method_name, *errmsg;
+  ctrl_method *method;
+  command_func func;
+  int rv;
+
+  // XXX: here and below check reply == NULL
+  if (rpc_10_sobj_validate_call(call)) {
+    return rpc_XX_build_error_reply(NULL, EINVAL,
+                                    "Invalid method call received");
+  }
+
+  // mesg_id will be freed by vde_sobj_put(call)
+  mesg_id = vde_sobj_hash_lookup(call, "id");
+
+  // XXX command aliases resolution
+
+  method_name = vde_sobj_get_string(vde_sobj_hash_lookup(call, "method"));
+
+  method = ctrl_method_resolve(cc->engine, method_name, &errmsg);
+  if (!method) {
+    return rpc_XX_build_error_reply(mesg_id, errno, errmsg);
+  }
+
+  func = vde_command_get_func(method->command);
   // XXX check permission level
 
-  if (component == cc->engine->component && is_builtin(command)) {
+  if (method->builtin) {
     // ctrl engine builtin commands just need ctrl connection, passing cc
     // instead of component
-    rv = func((vde_component *)cc, vde_sobj_hash_lookup(in_sobj, "params"),
+    rv = func((vde_component *)cc, vde_sobj_hash_lookup(call, "params"),
               &out_sobj);
   } else {
-    rv = func(component, vde_sobj_hash_lookup(in_sobj, "params"), &out_sobj);
+    rv = func(method->component, vde_sobj_hash_lookup(call, "params"),
+              &out_sobj);
   }
 
   if (rv) {
@@ -593,101 +873,228 @@ static void ctrl_engine_deserialize_string(char *string, void *arg)
     reply = rpc_10_build_reply(mesg_id, out_sobj, NULL);
     vde_sobj_put(out_sobj);
   }
-  // XXX check reply == NULL
+
+  return reply;
+}
+
+/**
+ * @brief Run a request and queue its reply, it is written by the caller
+ *
+ * A request is either a single method call or a batch, an array of calls
+ * which are run in order and replied with an array holding their replies.
+ *
+ * @param cc The control connection
+ * @param in_sobj The request, NULL if it could not be parsed. The reference is
+ * taken over.
+ */
+static void ctrl_engine_dispatch(ctrl_conn *cc, vde_sobj *in_sobj)
+{
+  vde_sobj *reply;
+  int i, len;
+
+  if (!in_sobj) {
+    reply = rpc_XX_build_error_reply(NULL, EINVAL,
+                                     "Cannot deserialize command");
+  } else if (vde_sobj_is_type(in_sobj, vde_sobj_type_array)) {
+    len = vde_sobj_array_length(in_sobj);
+    if (len == 0) {
+      reply = rpc_XX_build_error_reply(NULL, EINVAL, "Empty batch received");
+    } else {
+      reply = vde_sobj_new_array();
+      for (i = 0; i < len; i++) {
+        // the array takes over the reference
+        vde_sobj_array_add(reply,
+                           ctrl_engine_call(cc, vde_sobj_array_get_idx(in_sobj,
+                                                                       i)));
+      }
+    }
+  } else {
+    reply = ctrl_engine_call(cc, in_sobj);
+  }
 
   // XXX check error
-  ctrl_engine_conn_write(cc, reply);
+  ctrl_engine_conn_queue(cc, reply);
+  // the reply to set_encoding is in the old encoding
+  cc->encoding = cc->next_encoding;
 
   vde_sobj_put(reply);
+  if (in_sobj) {
+    vde_sobj_put(in_sobj);
+  }
+}
 
-cleannames:
-  // using free as a result of using strdup as well instead of vde_free
-  free(component_name);
-  free(command_name);
-cleaninsobj:
-  vde_sobj_put(in_sobj);
-out:
-  return;
+/**
+ * @brief Reply with an error to a request which has not been decoded
+ *
+ * @param cc The control connection
+ * @param err The error code
+ * @param msg The error message
+ */
+static void ctrl_engine_reply_error(ctrl_conn *cc, int err, const char *msg)
+{
+  vde_sobj *reply;
+
+  reply = rpc_XX_build_error_reply(NULL, err, msg);
+  // XXX check error
+  ctrl_engine_conn_queue(cc, reply);
+  vde_sobj_put(reply);
 }
 
 /**
- * @brief Split packet payload using \0 as separator
+ * @brief Parse JSON requests, separated by \0
  *
- * @param pkt The packet to operate on
- * @param inbuf A buffer where to put remainder string
- * @param inbuf_len Length of valid bytes inside inbuf
- * @param inbuf_sz Total length of inbuf
- * @param func The callback to call for each complete string found
- * @param priv A private data pointer passed to func
+ * Requests are parsed in place as packets arrive, one spanning many packets
+ * is kept by the parser with no size limit. Trailing bytes between a request
+ * and its separator are ignored.
  *
- * @return zero on success, an error code otherwise
+ * @param cc The control connection
+ * @param buf The data
+ * @param len The length of data
+ *
+ * @return The number of bytes used, up to the end of the first request
  */
-static int ctrl_split_payload(vde_pkt *pkt,
-                             char *inbuf, size_t *inbuf_len, int inbuf_sz,
-                             void (*func)(char *string, void *priv),
-                             void *priv)
+static size_t ctrl_parse_json(ctrl_conn *cc, const char *buf, size_t len)
 {
-  char *buf, *next, *inbuf_tmp = NULL, *to_serial;
-  int remaining, buf_len = 0, rv = 0;
+  const char *sep;
+  size_t used;
+  vde_sobj *in_sobj;
+
+  if (cc->in_sobj != NULL || cc->in_bad) {
+    // the request is over, look for its separator
+    sep = memchr(buf, 0, len);
+    if (!sep) {
+      return len;
+    }
 
-  buf = pkt->payload;
-  remaining = pkt->hdr->pkt_len;
-  while ((next = memchr(buf, 0, remaining))) {
-    // a token is present in buf
-    buf_len = next - buf;
-    if (*inbuf_len) {
-      // there is a partial string in inbuf, append that and buf into inbuf_tmp
-      inbuf_tmp = vde_alloc(sizeof(char) * (*inbuf_len + buf_len));
-      if (!inbuf_tmp) {
-        vde_error("%s: cannot allocate memory for temp buffer",
-                  __PRETTY_FUNCTION__);
-        // XXX document somewhere that inbuf is not reset in this case
-        errno = ENOMEM;
-        rv = -1;
-        goto exit;
-      }
-      memcpy(inbuf_tmp, inbuf, *inbuf_len);
-      memcpy(inbuf_tmp + *inbuf_len, buf, buf_len);
+    in_sobj = cc->in_sobj;
+    cc->in_sobj = NULL;
+    cc->in_bad = 0;
+    ctrl_engine_dispatch(cc, in_sobj);
+    return sep + 1 - buf;
+  }
 
-      *inbuf_len = 0;
-      to_serial = inbuf_tmp;
-    } else {
-      to_serial = buf;
-    }
+  switch (vde_sobj_parser_feed(cc->parser, buf, len, &cc->in_sobj, &used)) {
+    case 0:
+      return len;
+    case -1:
+      vde_debug("%s: cannot parse request", __PRETTY_FUNCTION__);
+      cc->in_bad = 1;
+      break;
+  }
+  return used;
+}
 
-    func(to_serial, priv);
+/**
+ * @brief Parse MessagePack requests, each preceded by its length
+ *
+ * A request contained in a packet is decoded in place, one spanning many
+ * packets is collected first.
+ *
+ * @param cc The control connection
+ * @param buf The data
+ * @param len The length of data
+ *
+ * @return The number of bytes used, up to the end of the first request
+ */
+static size_t ctrl_parse_msgpack(ctrl_conn *cc, const char *buf, size_t len)
+{
+  size_t used = 0, cpy_sz;
+  vde_sobj *in_sobj;
 
-    if (inbuf_tmp != NULL) {
-      vde_free(inbuf_tmp);
-      inbuf_tmp = NULL;
+  if (cc->in_hdr_len < FRAME_HDR_SZ) {
+    cpy_sz = FRAME_HDR_SZ - cc->in_hdr_len;
+    if (cpy_sz > len) {
+      cpy_sz = len;
     }
-
-    // recalc pointers for next cycle, +1 for separator
-    remaining = remaining - (buf_len + 1);
-    if (remaining > 0) {
-      buf = next + 1;
+    memcpy(cc->in_hdr + cc->in_hdr_len, buf, cpy_sz);
+    cc->in_hdr_len += cpy_sz;
+    used = cpy_sz;
+    if (cc->in_hdr_len < FRAME_HDR_SZ) {
+      return used;
     }
 
-    // XXX assert(remaining >= 0);
+    cc->in_size = ((size_t)cc->in_hdr[0] << 24) | (cc->in_hdr[1] << 16) |
+                  (cc->in_hdr[2] << 8) | cc->in_hdr[3];
+    cc->in_len = 0;
+    if (cc->in_size > MAX_FRAME_SZ) {
+      // skip it
+      vde_debug("%s: request too large", __PRETTY_FUNCTION__);
+      cc->in_bad = 1;
+    } else if (len - used >= cc->in_size) {
+      if (vde_sobj_from_msgpack(buf + used, cc->in_size, &in_sobj)) {
+        vde_debug("%s: cannot parse request", __PRETTY_FUNCTION__);
+        in_sobj = NULL;
+      }
+      cc->in_hdr_len = 0;
+      ctrl_engine_dispatch(cc, in_sobj);
+      return used + cc->in_size;
+    } else {
+      cc->in_buf = vde_alloc(cc->in_size);
+      if (cc->in_buf == NULL) {
+        vde_error("%s: cannot allocate request buffer", __PRETTY_FUNCTION__);
+        cc->in_bad = 1;
+        cc->in_errno = ENOMEM;
+      }
+    }
   }
 
-  // no token left, check if we need to store a partial string in inbuf
-  if (remaining > 0) {
-    if (remaining + *inbuf_len > inbuf_sz) {
-      *inbuf_len = 0;
-      vde_warning("%s: partial string too long for inbuf, dropping",
-                  __PRETTY_FUNCTION__);
-      errno = ENOSPC;
-      rv = -1;
-      goto exit;
+  cpy_sz = cc->in_size - cc->in_len;
+  if (cpy_sz > len - used) {
+    cpy_sz = len - used;
+  }
+  if (!cc->in_bad) {
+    memcpy(cc->in_buf + cc->in_len, buf + used, cpy_sz);
+  }
+  cc->in_len += cpy_sz;
+  used += cpy_sz;
+
+  if (cc->in_len == cc->in_size) {
+    in_sobj = NULL;
+    if (!cc->in_bad && vde_sobj_from_msgpack(cc->in_buf, cc->in_size,
+                                             &in_sobj)) {
+      vde_debug("%s: cannot parse request", __PRETTY_FUNCTION__);
+      in_sobj = NULL;
+    }
+    vde_free(cc->in_buf);
+    cc->in_buf = NULL;
+    cc->in_bad = 0;
+    cc->in_hdr_len = 0;
+    if (cc->in_errno) {
+      ctrl_engine_reply_error(cc, cc->in_errno, "Cannot receive command");
+      cc->in_errno = 0;
     } else {
-      memcpy(inbuf + *inbuf_len, buf, remaining);
-      *inbuf_len = *inbuf_len + remaining;
+      ctrl_engine_dispatch(cc, in_sobj);
     }
   }
 
-exit:
-  return rv;
+  return used;
+}
+
+/**
+ * @brief Feed packet payload to the parser of a control connection
+ *
+ * The encoding can change after any request, the rest of the payload is
+ * parsed with the new one.
+ *
+ * @param cc The control connection
+ * @param pkt The packet to operate on
+ */
+static void ctrl_parse_payload(ctrl_conn *cc, vde_pkt *pkt)
+{
+  const char *buf;
+  size_t remaining, used;
+
+  buf = pkt->payload;
+  remaining = pkt->hdr->pkt_len;
+  while (remaining > 0) {
+    if (cc->encoding == CTRL_ENC_MSGPACK) {
+      used = ctrl_parse_msgpack(cc, buf, remaining);
+    } else {
+      used = ctrl_parse_json(cc, buf, remaining);
+    }
+    remaining -= used;
+    buf += used;
+  }
 }
 
 static void ctrl_conn_fini_noengine(ctrl_conn *cc)
@@ -702,12 +1109,24 @@ static void ctrl_conn_fini_noengine(ctrl_conn *cc)
   // cleanup outgoing packets
   pkt = vde_queue_pop_tail(cc->out_queue);
   while (pkt != NULL) {
-    vde_free(pkt);
+    vde_pkt_put(pkt);
     pkt = vde_queue_pop_tail(cc->out_queue);
   }
   vde_queue_delete(cc->out_queue);
+  if (cc->out_pkt != NULL) {
+    vde_pkt_put(cc->out_pkt);
+  }
+
+  vde_sobj_parser_delete(cc->parser);
+  if (cc->in_buf != NULL) {
+    vde_free(cc->in_buf);
+  }
+  if (cc->in_sobj != NULL) {
+    vde_sobj_put(cc->in_sobj);
+  }
 
-  ctx = vde_connection_get_context(cc->conn);
+  // the connection can be deleted already
+  ctx = vde_component_get_context(cc->engine->component);
 
   // detach from all signals
   iter = vde_list_first(cc->reg_signals);
@@ -760,39 +1179,35 @@ int ctrl_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 
   // XXX check pkt type is CTRL
 
-  if (ctrl_split_payload(pkt, cc->inbuf, &cc->inbuf_len, MAX_INBUF_SZ,
-                        ctrl_engine_deserialize_string, (void *)cc)) {
+  ctrl_parse_payload(cc, pkt);
+  ctrl_conn_flush(cc);
 
-    // XXX gracefully handle cases where payload cannot fit in inbuf
-    vde_debug("%s: error splitting payload, closing", __PRETTY_FUNCTION__);
+  return 0;
+}
 
-    ctrl_conn_fini(cc);
+int ctrl_engine_readbatchcb(vde_connection *conn, vde_pkt_batch *batch,
+                            void *arg)
+{
+  ctrl_conn *cc = (ctrl_conn *)arg;
+  unsigned int i;
 
-    errno = EPIPE;
-    return -1;
+  // XXX check pkt type is CTRL
+
+  // replies to pipelined requests are packed and written together
+  for (i = 0; i < batch->len; i++) {
+    ctrl_parse_payload(cc, batch->pkts[i]);
   }
+  ctrl_conn_flush(cc);
 
   return 0;
 }
 
 int ctrl_engine_writecb(vde_connection *conn, vde_pkt *pkt, void *arg)
 {
-  vde_pkt *q_pkt;
-  int rv;
   ctrl_conn *cc = (ctrl_conn *)arg;
 
   // try to flush out queue if some packets are waiting
-  q_pkt = vde_queue_pop_tail(cc->out_queue);
-  while (q_pkt) {
-    rv = vde_connection_write(cc->conn, q_pkt);
-    if (rv != 0) {
-      // couldn't write, requeue
-      vde_queue_push_tail(cc->out_queue, q_pkt);
-      break;
-    }
-    vde_free(q_pkt);
-    q_pkt = vde_queue_pop_tail(cc->out_queue);
-  }
+  ctrl_conn_flush(cc);
 
   return 0;
 }
@@ -830,8 +1245,18 @@ int ctrl_engine_newconn(vde_component *component, vde_connection *conn,
     errno = ENOMEM;
     return -1;
   }
+  cc->parser = vde_sobj_parser_new();
+  if (cc->parser == NULL) {
+    vde_error("%s: could not allocate parser", __PRETTY_FUNCTION__);
+    vde_free(cc);
+    errno = ENOMEM;
+    return -1;
+  }
   cc->conn = conn;
   cc->out_queue = vde_queue_init();
+  cc->out_pkt = NULL;
+  cc->encoding = CTRL_ENC_JSON;
+  cc->next_encoding = CTRL_ENC_JSON;
   cc->engine = ctrl;
   cc->reg_signals = NULL;
 
@@ -839,6 +1264,7 @@ int ctrl_engine_newconn(vde_component *component, vde_connection *conn,
 
   vde_connection_set_callbacks(conn, &ctrl_engine_readcb, &ctrl_engine_writecb,
                                &ctrl_engine_errorcb, (void *)cc);
+  vde_connection_set_read_batch_cb(conn, &ctrl_engine_readbatchcb);
   vde_connection_set_pkt_properties(conn, 0, 0);
   /*
    * XXX: define send properties and policy for discarding packets
@@ -864,10 +1290,12 @@ static int engine_ctrl_init(vde_component *component, vde_sobj *params)
   }
 
   ctrl->component = component;
+  ctrl->methods = vde_hash_init_full(ctrl_method_hash, ctrl_method_equal);
 
   if (vde_component_commands_register(component, engine_ctrl_commands)) {
     tmp_errno = errno;
     vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    vde_hash_delete(ctrl->methods);
     vde_free(ctrl);
     errno = tmp_errno;
     return -1;
@@ -895,6 +1323,8 @@ void engine_ctrl_fini(vde_component *component)
   }
   vde_list_delete(ctrl->ctrl_conns);
 
+  ctrl_methods_clear(ctrl);
+  vde_hash_delete(ctrl->methods);
   vde_free(ctrl);
 }
 
@@ -43,46 +43,165 @@ static vde_signal engine_hub_signals [] = {
 // END temporary signals declaration
 
 
+// initial size of the ports array, it doubles when full
+#define PORTS_INITIAL_SIZE 16
+
+typedef struct hub_engine hub_engine;
+
 typedef struct {
+  vde_connection *conn;
+  hub_engine *hub;
+  unsigned int id; // port number, never reused
+  unsigned int idx; // position inside the ports arrays
+} hub_port;
+
+struct hub_engine {
   vde_component *component;
-  vde_list *ports;
-} hub_engine;
+  // dense arrays indexed by hub_port.idx, conns is walked on fan-out
+  vde_connection **conns;
+  hub_port **ports;
+  unsigned int nports;
+  unsigned int size;
+  // port id: hub_port *port
+  vde_hash *ports_by_id;
+  unsigned int next_id;
+};
+
+/**
+ * @brief Add a port to the hub, growing the arrays if needed
+ *
+ * @param hub The hub
+ * @param conn The connection of the new port
+ *
+ * @return the new port on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static hub_port *hub_port_add(hub_engine *hub, vde_connection *conn)
+{
+  unsigned int size;
+  hub_port *port, **ports;
+  vde_connection **conns;
+
+  if (hub->nports == hub->size) {
+    size = hub->size ? hub->size * 2 : PORTS_INITIAL_SIZE;
+    conns = (vde_connection **)vde_realloc(hub->conns,
+                                           size * sizeof(vde_connection *));
+    ports = (hub_port **)vde_realloc(hub->ports, size * sizeof(hub_port *));
+    hub->conns = conns;
+    hub->ports = ports;
+    hub->size = size;
+  }
+
+  port = (hub_port *)vde_calloc(sizeof(hub_port));
+  if (port == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  port->conn = conn;
+  port->hub = hub;
+  port->id = hub->next_id++;
+  port->idx = hub->nports;
+
+  hub->conns[port->idx] = conn;
+  hub->ports[port->idx] = port;
+  hub->nports++;
+  vde_hash_insert(hub->ports_by_id, (long)port->id, port);
+
+  return port;
+}
+
+/**
+ * @brief Remove a port from the hub, the last port takes its place
+ *
+ * @param hub The hub
+ * @param port The port to remove, it is freed
+ */
+static void hub_port_del(hub_engine *hub, hub_port *port)
+{
+  hub_port *last;
+
+  vde_hash_remove(hub->ports_by_id, (long)port->id);
+
+  hub->nports--;
+  if (port->idx != hub->nports) {
+    last = hub->ports[hub->nports];
+    last->idx = port->idx;
+    hub->ports[last->idx] = last;
+    hub->conns[last->idx] = last->conn;
+  }
+  vde_free(port);
+}
 
 int engine_hub_status(vde_component *component, vde_sobj **out)
 {
   hub_engine *hub = vde_component_get_priv(component);
 
-  *out = vde_sobj_new_int(vde_list_length(hub->ports));
+  *out = vde_sobj_new_int(hub->nports);
 
   return 0;
 }
 
 int engine_hub_printport(vde_component *component, int port, vde_sobj **out)
 {
-  char str[128];
+  hub_port *hport;
+  unsigned int max_payload;
+  vde_conn_queue_stats qstats;
+  hub_engine *hub = vde_component_get_priv(component);
+
+  hport = vde_hash_lookup(hub->ports_by_id, (long)port);
+  if (hport == NULL) {
+    *out = vde_sobj_new_string("Port not found");
+    return -1;
+  }
 
-  sprintf(str, "please print something useful for port %i", port);
-  *out = vde_sobj_new_string(str);
+  *out = vde_sobj_new_hash();
+  // XXX check out not null
+  vde_sobj_hash_insert(*out, "port", vde_sobj_new_int(hport->id));
+  max_payload = vde_connection_max_payload(hport->conn);
+  vde_sobj_hash_insert(*out, "max_payload", vde_sobj_new_int(max_payload));
+  if (!vde_connection_get_queue_stats(hport->conn, &qstats)) {
+    vde_sobj_hash_insert(*out, "queue_len", vde_sobj_new_int(qstats.length));
+    vde_sobj_hash_insert(*out, "queue_peak", vde_sobj_new_int(qstats.peak));
+    vde_sobj_hash_insert(*out, "queue_drops",
+                         vde_sobj_new_int64(qstats.drops));
+  }
 
   return 0;
 }
 
 int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 {
-  vde_list *iter;
-  vde_connection *port;
+  unsigned int i;
 
-  hub_engine *hub = (hub_engine *)arg;
+  hub_port *port = (hub_port *)arg;
+  hub_engine *hub = port->hub;
 
-  /* Send to all the ports */
-  iter = vde_list_first(hub->ports);
-  while (iter != NULL) {
-    port = vde_list_get_data(iter);
-    if (port != conn) {
+  /* Send to all the ports. A port which goes away while written is replaced
+   * by the last one, which has already been served going backwards */
+  for (i = hub->nports; i-- > 0; ) {
+    if (i < hub->nports && hub->conns[i] != conn) {
       // XXX: check write retval
-      vde_connection_write(port, pkt);
+      vde_connection_write(hub->conns[i], pkt);
+    }
+  }
+
+  return 0;
+}
+
+int hub_engine_readbatchcb(vde_connection *conn, vde_pkt_batch *batch,
+                           void *arg)
+{
+  unsigned int i;
+
+  hub_port *port = (hub_port *)arg;
+  hub_engine *hub = port->hub;
+
+  /* Send the whole burst to all the ports, backwards as above */
+  for (i = hub->nports; i-- > 0; ) {
+    if (i < hub->nports && hub->conns[i] != conn) {
+      // XXX: check write retval
+      vde_connection_write_batch(hub->conns[i], batch);
     }
-    iter = vde_list_next(iter);
   }
 
   return 0;
@@ -91,8 +210,8 @@ int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 int hub_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
                                   vde_conn_error err, void *arg)
 {
-  vde_sobj *info;
-  hub_engine *hub = (hub_engine *)arg;
+  hub_port *port = (hub_port *)arg;
+  hub_engine *hub = port->hub;
 
   if (err == CONN_WRITE_DELAY) {
     vde_warning("%s: dropping packet", __PRETTY_FUNCTION__);
@@ -101,14 +220,8 @@ int hub_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
 
   // XXX: handle different errors, the following is just the fatal case
 
-  hub->ports = vde_list_remove(hub->ports, conn);
-
-  info = vde_sobj_new_array();
-  // XXX check info not null
-  // XXX print new port number instead of the total number of ports in the hub
-  vde_sobj_array_add(info, vde_sobj_new_int(vde_list_length(hub->ports)));
-  vde_component_signal_raise(hub->component, "port_del", info);
-  vde_sobj_put(info);
+  hub_port_del(hub, port);
+  vde_engine_signal_ports(hub->component, "port_del", hub->nports);
 
   errno = EPIPE;
   return -1;
@@ -119,7 +232,7 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
 {
   unsigned int max_payload;
   struct timeval send_timeout;
-  vde_sobj *info;
+  hub_port *port;
   hub_engine *hub = vde_component_get_priv(component);
 
   max_payload = vde_connection_max_payload(conn);
@@ -128,24 +241,22 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
     return -1;
   }
 
-  // XXX: check ports not NULL
-  // XXX: here new port is added as the first one
-  hub->ports = vde_list_prepend(hub->ports, conn);
+  port = hub_port_add(hub, conn);
+  if (port == NULL) {
+    vde_error("%s: cannot add port", __PRETTY_FUNCTION__);
+    return -1;
+  }
 
   /* Setup connection */
   vde_connection_set_callbacks(conn, &hub_engine_readcb, NULL,
-                               &hub_engine_errorcb, (void *)hub);
+                               &hub_engine_errorcb, (void *)port);
+  vde_connection_set_read_batch_cb(conn, &hub_engine_readbatchcb);
   vde_connection_set_pkt_properties(conn, 0, 0);
   send_timeout.tv_sec = TIMEOUT;
   send_timeout.tv_usec = 0;
   vde_connection_set_send_properties(conn, TIMES, &send_timeout);
 
-  info = vde_sobj_new_array();
-  // XXX check info not null
-  // XXX print new port number instead of the total number of ports in the hub
-  vde_sobj_array_add(info, vde_sobj_new_int(vde_list_length(hub->ports)));
-  vde_component_signal_raise(component, "port_new", info);
-  vde_sobj_put(info);
+  vde_engine_signal_ports(hub->component, "port_new", hub->nports);
 
   return 0;
 }
@@ -166,6 +277,8 @@ static int engine_hub_init(vde_component *component, vde_sobj *params)
   }
 
   hub->component = component;
+  hub->next_id = 1;
+  hub->ports_by_id = vde_hash_init();
 
   // command registration phase
   // - the header for the wrappers has been included at the top
@@ -173,6 +286,7 @@ static int engine_hub_init(vde_component *component, vde_sobj *params)
   if (vde_component_commands_register(component, engine_hub_commands)) {
     tmp_errno = errno;
     vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    vde_hash_delete(hub->ports_by_id);
     vde_free(hub);
     errno = tmp_errno;
     return -1;
@@ -181,6 +295,7 @@ static int engine_hub_init(vde_component *component, vde_sobj *params)
   if (vde_component_signals_register(component, engine_hub_signals)) {
     tmp_errno = errno;
     vde_error("%s: could not register signals", __PRETTY_FUNCTION__);
+    vde_hash_delete(hub->ports_by_id);
     vde_free(hub);
     errno = tmp_errno;
     return -1;
@@ -192,21 +307,21 @@ static int engine_hub_init(vde_component *component, vde_sobj *params)
 
 void engine_hub_fini(vde_component *component)
 {
-
-  vde_list *iter;
-  vde_connection *port;
+  vde_connection *conn;
   hub_engine *hub = (hub_engine *)vde_component_get_priv(component);
 
-  iter = vde_list_first(hub->ports);
-  while (iter != NULL) {
-    port = vde_list_get_data(iter);
+  // the port is removed before closing its connection, closing might remove
+  // other ports as well
+  while (hub->nports > 0) {
+    conn = hub->conns[hub->nports - 1];
+    hub_port_del(hub, hub->ports[hub->nports - 1]);
     // XXX check if this is safe here
-    vde_connection_fini(port);
-    vde_connection_delete(port);
-
-    iter = vde_list_next(iter);
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
   }
-  vde_list_delete(hub->ports);
+  vde_free(hub->conns);
+  vde_free(hub->ports);
+  vde_hash_delete(hub->ports_by_id);
 
   vde_free(hub);
 
@@ -0,0 +1,618 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <vde3.h>
+
+#include <vde3/module.h>
+#include <vde3/engine.h>
+#include <vde3/context.h>
+#include <vde3/connection.h>
+#include <vde3/packet.h>
+
+#include <engine_switch_commands.h>
+
+// from vde_switch/packetq.c
+#define TIMEOUT 5
+#define TIMES 10
+// end from vde_switch/packetq.c
+
+#define ETH_P_8021Q 0x8100
+#define VLAN_VID_MASK 0x0fff
+
+// forwarding table defaults, the table size must be a power of two
+#define DEFAULT_TABLE_SIZE 4096
+#define DEFAULT_AGING 300 /* seconds */
+
+// the table is never filled over 3/4 to keep probe sequences short
+#define TABLE_MAX_LOAD(size) (((size) >> 2) * 3)
+
+// an entry key is the mac address in the low 48 bits, the vlan in the next 12
+// bits and this flag, so that an empty slot has key 0
+#define KEY_USED (1ULL << 63)
+
+
+// START temporary signals declaration
+// XXX as for commands, signals should be auto-generated
+#include <vde3/signal.h>
+static vde_signal engine_switch_signals [] = {
+  { "port_new", NULL, NULL, NULL },
+  { "port_del", NULL, NULL, NULL },
+  { NULL, NULL, NULL, NULL },
+};
+// END temporary signals declaration
+
+
+typedef struct switch_engine switch_engine;
+
+typedef struct {
+  vde_connection *conn;
+  switch_engine *sw;
+  vde_pkt_batch out; // packets of a burst forwarded to this port
+} switch_port;
+
+typedef struct {
+  uint64_t key;
+  switch_port *port;
+  time_t last_seen;
+} mac_entry;
+
+struct switch_engine {
+  vde_component *component;
+  vde_list *ports;
+  // forwarding table, open addressing with linear probing
+  mac_entry *table;
+  unsigned int table_mask;
+  unsigned int table_entries;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t learn_failures;
+  // ports with packets in their out batch, NULL if removed meanwhile
+  switch_port *pending[VDE_PKT_BATCH_MAX];
+  unsigned int npending;
+  // aging, now is refreshed by the aging timeout
+  unsigned int aging;
+  time_t now;
+  vde_timer *aging_timer;
+};
+
+static inline uint64_t mac_key(const unsigned char *mac, unsigned int vlan)
+{
+  return KEY_USED | ((uint64_t)vlan << 48) |
+         ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+         ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+         ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+static inline unsigned int mac_hash(switch_engine *sw, uint64_t key)
+{
+  // fibonacci hashing, high bits are the best mixed ones
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & sw->table_mask;
+}
+
+static mac_entry *mac_table_lookup(switch_engine *sw, uint64_t key)
+{
+  unsigned int i = mac_hash(sw, key);
+
+  while (sw->table[i].key != 0) {
+    if (sw->table[i].key == key) {
+      return &sw->table[i];
+    }
+    i = (i + 1) & sw->table_mask;
+  }
+  return NULL;
+}
+
+static void mac_table_learn(switch_engine *sw, uint64_t key, switch_port *port)
+{
+  unsigned int i = mac_hash(sw, key);
+
+  while (sw->table[i].key != 0) {
+    if (sw->table[i].key == key) {
+      sw->table[i].port = port;
+      sw->table[i].last_seen = sw->now;
+      return;
+    }
+    i = (i + 1) & sw->table_mask;
+  }
+
+  if (sw->table_entries >= TABLE_MAX_LOAD(sw->table_mask + 1)) {
+    sw->learn_failures++;
+    return;
+  }
+  sw->table[i].key = key;
+  sw->table[i].port = port;
+  sw->table[i].last_seen = sw->now;
+  sw->table_entries++;
+}
+
+/**
+ * @brief Remove the entry at index i, following entries of the same cluster
+ * are shifted back so that lookups don't need tombstones.
+ *
+ * @param sw The switch
+ * @param i The index of the entry to remove
+ */
+static void mac_table_remove_at(switch_engine *sw, unsigned int i)
+{
+  unsigned int j, home;
+
+  j = i;
+  while (1) {
+    j = (j + 1) & sw->table_mask;
+    if (sw->table[j].key == 0) {
+      break;
+    }
+    home = mac_hash(sw, sw->table[j].key);
+    // move j into the hole at i unless its home lies cyclically in (i, j]
+    if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j))) {
+      continue;
+    }
+    sw->table[i] = sw->table[j];
+    i = j;
+  }
+  sw->table[i].key = 0;
+  sw->table[i].port = NULL;
+  sw->table_entries--;
+}
+
+/**
+ * @brief Remove all the entries which match a port (all entries if port is
+ * NULL) or which are older than the aging time (if aged is not zero).
+ *
+ * @param sw The switch
+ * @param port The port to match, NULL to match all ports
+ * @param aged Remove aged entries only
+ */
+static void mac_table_purge(switch_engine *sw, switch_port *port, int aged)
+{
+  unsigned int i = 0;
+  mac_entry *e;
+
+  while (i <= sw->table_mask) {
+    e = &sw->table[i];
+    if (e->key != 0 && (port == NULL || e->port == port) &&
+        (!aged || sw->now - e->last_seen > sw->aging)) {
+      // another entry might have been shifted here, look again at i
+      mac_table_remove_at(sw, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+static void switch_aging_timeout(int fd, short events, void *arg)
+{
+  switch_engine *sw = (switch_engine *)arg;
+
+  sw->now = time(NULL);
+  mac_table_purge(sw, NULL, 1);
+}
+
+int engine_switch_status(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  *out = vde_sobj_new_hash();
+  // XXX check out not null
+  vde_sobj_hash_insert(*out, "ports",
+                       vde_sobj_new_int(vde_list_length(sw->ports)));
+  vde_sobj_hash_insert(*out, "table_size",
+                       vde_sobj_new_int(sw->table_mask + 1));
+  vde_sobj_hash_insert(*out, "table_entries",
+                       vde_sobj_new_int(sw->table_entries));
+  vde_sobj_hash_insert(*out, "hits", vde_sobj_new_int64(sw->hits));
+  vde_sobj_hash_insert(*out, "misses", vde_sobj_new_int64(sw->misses));
+  vde_sobj_hash_insert(*out, "learn_failures",
+                       vde_sobj_new_int64(sw->learn_failures));
+
+  return 0;
+}
+
+int engine_switch_flush(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  mac_table_purge(sw, NULL, 0);
+  *out = vde_sobj_new_string("Forwarding table flushed");
+
+  return 0;
+}
+
+static void switch_flood(switch_engine *sw, vde_connection *conn,
+                         vde_pkt_batch *batch)
+{
+  vde_list *iter;
+  switch_port *port;
+
+  iter = vde_list_first(sw->ports);
+  while (iter != NULL) {
+    port = vde_list_get_data(iter);
+    if (port->conn != conn) {
+      // XXX: check write retval
+      vde_connection_write_batch(port->conn, batch);
+    }
+    iter = vde_list_next(iter);
+  }
+}
+
+enum switch_route {
+  ROUTE_DROP,
+  ROUTE_UNICAST,
+  ROUTE_FLOOD,
+};
+
+/**
+ * @brief Learn the source of a packet and find where it must go
+ *
+ * @param sw The switch
+ * @param port The port the packet comes from
+ * @param pkt The packet
+ * @param dst The destination port, set if the packet goes to a single port
+ *
+ * @return how the packet must be forwarded
+ */
+static enum switch_route switch_route(switch_engine *sw, switch_port *port,
+                                      vde_pkt *pkt, switch_port **dst)
+{
+  unsigned int vlan = 0;
+  unsigned char *frame;
+  mac_entry *entry;
+  struct eth_hdr *hdr = (struct eth_hdr *)pkt->payload;
+
+  if (pkt->hdr->pkt_len < sizeof(struct eth_hdr)) {
+    return ROUTE_DROP;
+  }
+
+  frame = (unsigned char *)pkt->payload;
+  if (((hdr->proto[0] << 8) | hdr->proto[1]) == ETH_P_8021Q &&
+      pkt->hdr->pkt_len >= sizeof(struct eth_hdr) + 4) {
+    vlan = ((frame[14] << 8) | frame[15]) & VLAN_VID_MASK;
+  }
+
+  // learn the source, multicast addresses are never a source
+  if (!(hdr->src[0] & 0x01)) {
+    mac_table_learn(sw, mac_key(hdr->src, vlan), port);
+  }
+
+  // broadcast and multicast destinations are flooded
+  if (hdr->dest[0] & 0x01) {
+    return ROUTE_FLOOD;
+  }
+
+  entry = mac_table_lookup(sw, mac_key(hdr->dest, vlan));
+  if (entry == NULL) {
+    sw->misses++;
+    return ROUTE_FLOOD;
+  }
+
+  sw->hits++;
+  if (entry->port == port) {
+    return ROUTE_DROP;
+  }
+  *dst = entry->port;
+  return ROUTE_UNICAST;
+}
+
+/**
+ * @brief Write the packets queued in the out batch of each port
+ *
+ * @param sw The switch
+ */
+static void switch_flush_pending(switch_engine *sw)
+{
+  unsigned int i;
+  switch_port *port;
+  vde_pkt_batch out;
+
+  for (i = 0; i < sw->npending; i++) {
+    port = sw->pending[i];
+    if (port == NULL) {
+      continue;
+    }
+    // the port is gone if the write fails for good, don't touch it after
+    sw->pending[i] = NULL;
+    out = port->out;
+    vde_pkt_batch_init(&port->out);
+    // XXX: check write retval
+    vde_connection_write_batch(port->conn, &out);
+  }
+  sw->npending = 0;
+}
+
+int switch_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  vde_pkt_batch flood;
+  switch_port *dst;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+
+  switch (switch_route(sw, port, pkt, &dst)) {
+    case ROUTE_UNICAST:
+      // XXX: check write retval
+      vde_connection_write(dst->conn, pkt);
+      break;
+    case ROUTE_FLOOD:
+      vde_pkt_batch_init(&flood);
+      vde_pkt_batch_add(&flood, pkt);
+      switch_flood(sw, conn, &flood);
+      break;
+    case ROUTE_DROP:
+      break;
+  }
+
+  return 0;
+}
+
+int switch_engine_readbatchcb(vde_connection *conn, vde_pkt_batch *batch,
+                              void *arg)
+{
+  unsigned int i;
+  vde_pkt_batch flood;
+  switch_port *dst;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+
+  /* Packets going to the same port are written with a single call, as well as
+   * runs of flooded packets. The order seen by each port is kept by writing
+   * what is pending before switching between unicast and flooding. */
+  vde_pkt_batch_init(&flood);
+  for (i = 0; i < batch->len; i++) {
+    switch (switch_route(sw, port, batch->pkts[i], &dst)) {
+      case ROUTE_UNICAST:
+        if (flood.len > 0) {
+          switch_flood(sw, conn, &flood);
+          vde_pkt_batch_init(&flood);
+        }
+        if (dst->out.len == 0) {
+          sw->pending[sw->npending++] = dst;
+        }
+        vde_pkt_batch_add(&dst->out, batch->pkts[i]);
+        break;
+      case ROUTE_FLOOD:
+        switch_flush_pending(sw);
+        vde_pkt_batch_add(&flood, batch->pkts[i]);
+        break;
+      case ROUTE_DROP:
+        break;
+    }
+  }
+  if (flood.len > 0) {
+    switch_flood(sw, conn, &flood);
+  }
+  switch_flush_pending(sw);
+
+  return 0;
+}
+
+int switch_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
+                          vde_conn_error err, void *arg)
+{
+  unsigned int i;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+
+  if (err == CONN_WRITE_DELAY) {
+    vde_warning("%s: dropping packet", __PRETTY_FUNCTION__);
+    return 0;
+  }
+
+  // XXX: handle different errors, the following is just the fatal case
+
+  sw->ports = vde_list_remove(sw->ports, port);
+  mac_table_purge(sw, port, 0);
+  for (i = 0; i < sw->npending; i++) {
+    if (sw->pending[i] == port) {
+      sw->pending[i] = NULL;
+    }
+  }
+  vde_free(port);
+
+  vde_engine_signal_ports(sw->component, "port_del",
+                          vde_list_length(sw->ports));
+
+  errno = EPIPE;
+  return -1;
+}
+
+int switch_engine_newconn(vde_component *component, vde_connection *conn,
+                          vde_request *req)
+{
+  unsigned int max_payload;
+  struct timeval send_timeout, aging_tick;
+  switch_port *port;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  max_payload = vde_connection_max_payload(conn);
+  if (max_payload != 0 && max_payload < sizeof(struct eth_frame)) {
+    vde_warning("%s: connection can't handle full eth frames, rejecting",
+                __PRETTY_FUNCTION__);
+    return -1;
+  }
+
+  // start aging entries when the first port comes in
+  if (sw->aging_timer == NULL) {
+    // check every quarter of the aging time
+    aging_tick.tv_sec = (sw->aging + 3) / 4;
+    aging_tick.tv_usec = 0;
+    sw->now = time(NULL);
+    sw->aging_timer = vde_context_timer_new(
+                        vde_component_get_context(component),
+                        &switch_aging_timeout, (void *)sw);
+    if (sw->aging_timer == NULL) {
+      vde_error("%s: cannot create aging timer", __PRETTY_FUNCTION__);
+      return -1;
+    }
+    if (vde_timer_arm(sw->aging_timer, &aging_tick, VDE_EV_PERSIST)) {
+      vde_error("%s: cannot schedule aging timer", __PRETTY_FUNCTION__);
+      vde_timer_delete(sw->aging_timer);
+      sw->aging_timer = NULL;
+      return -1;
+    }
+  }
+
+  port = (switch_port *)vde_calloc(sizeof(switch_port));
+  if (port == NULL) {
+    vde_error("%s: cannot allocate port", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  port->conn = conn;
+  port->sw = sw;
+
+  // XXX: check ports not NULL
+  sw->ports = vde_list_prepend(sw->ports, port);
+
+  /* Setup connection */
+  vde_connection_set_callbacks(conn, &switch_engine_readcb, NULL,
+                               &switch_engine_errorcb, (void *)port);
+  vde_connection_set_read_batch_cb(conn, &switch_engine_readbatchcb);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+  send_timeout.tv_sec = TIMEOUT;
+  send_timeout.tv_usec = 0;
+  vde_connection_set_send_properties(conn, TIMES, &send_timeout);
+
+  vde_engine_signal_ports(component, "port_new", vde_list_length(sw->ports));
+
+  return 0;
+}
+
+static int engine_switch_init(vde_component *component, vde_sobj *params)
+{
+  int tmp_errno;
+  unsigned int size = DEFAULT_TABLE_SIZE, aging = DEFAULT_AGING;
+  vde_sobj *param;
+  switch_engine *sw;
+
+  vde_assert(component != NULL);
+
+  // optional parameters: table_size (rounded up to a power of two) and aging
+  // time in seconds
+  if (params && vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    param = vde_sobj_hash_lookup(params, "table_size");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < 4) {
+        vde_error("%s: table_size must be an integer not less than 4",
+                  __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      for (size = 4; size < vde_sobj_get_int(param); size <<= 1);
+    }
+    param = vde_sobj_hash_lookup(params, "aging");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < 1) {
+        vde_error("%s: aging must be a positive integer", __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      aging = vde_sobj_get_int(param);
+    }
+  }
+
+  sw = (switch_engine *)vde_calloc(sizeof(switch_engine));
+  if (sw == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  sw->table = (mac_entry *)vde_calloc(size * sizeof(mac_entry));
+  if (sw->table == NULL) {
+    vde_error("%s: could not allocate forwarding table", __PRETTY_FUNCTION__);
+    vde_free(sw);
+    errno = ENOMEM;
+    return -1;
+  }
+  sw->table_mask = size - 1;
+  sw->aging = aging;
+  sw->component = component;
+
+  // command registration phase
+  // - the header for the wrappers has been included at the top
+  // - register the commands array, the name is in the json definition
+  if (vde_component_commands_register(component, engine_switch_commands)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    vde_free(sw->table);
+    vde_free(sw);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  if (vde_component_signals_register(component, engine_switch_signals)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register signals", __PRETTY_FUNCTION__);
+    vde_component_commands_deregister(component, engine_switch_commands);
+    vde_free(sw->table);
+    vde_free(sw);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  vde_component_set_priv(component, (void *)sw);
+  return 0;
+}
+
+void engine_switch_fini(vde_component *component)
+{
+  vde_list *iter;
+  switch_port *port;
+  switch_engine *sw = (switch_engine *)vde_component_get_priv(component);
+
+  if (sw->aging_timer != NULL) {
+    vde_timer_delete(sw->aging_timer);
+  }
+
+  iter = vde_list_first(sw->ports);
+  while (iter != NULL) {
+    port = vde_list_get_data(iter);
+    // XXX check if this is safe here
+    vde_connection_fini(port->conn);
+    vde_connection_delete(port->conn);
+    vde_free(port);
+
+    iter = vde_list_next(iter);
+  }
+  vde_list_delete(sw->ports);
+
+  vde_free(sw->table);
+  vde_free(sw);
+
+  vde_component_commands_deregister(component, engine_switch_commands);
+  vde_component_signals_deregister(component, engine_switch_signals);
+}
+
+component_ops engine_switch_component_ops = {
+  .init = engine_switch_init,
+  .fini = engine_switch_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_ENGINE,
+  .family = "switch",
+  .cops = &engine_switch_component_ops,
+  .eng_new_conn = &switch_engine_newconn,
+};
@@ -0,0 +1,560 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include <vde3/common.h>
+#include <vde3/pool.h>
+#include <vde3/timeout_heap.h>
+
+/*
+ * vde_event_handler which uses epoll directly, usage is similar to
+ * libevent_eh:
+ *
+ * vde_epoll_init(0);
+ * ...
+ * vde_context_init(ctx, &epoll_eh, NULL);
+ * ...
+ * vde_epoll_dispatch();
+ *
+ * Each thread calling vde_epoll_init() gets its own loop. Events registered on
+ * the same fd are merged into a single epoll registration, timeouts are kept
+ * in a binary heap and event records come from a pool, so adding and deleting
+ * events doesn't hit malloc in steady state.
+ */
+
+#define EPOLL_DEFAULT_MAX_EVENTS 64
+#define EPOLL_REC_SLAB 64
+
+typedef unsigned long long epoll_usec;
+
+struct epoll_rec {
+  int fd; // -1 for timeouts
+  short events;
+  event_cb cb;
+  void *arg;
+  int has_timeout;
+  epoll_usec timeout;
+  vde_timeout timeout_node; // position in the timeout heap
+  int active; // zero once a non persistent event has been triggered
+  int dead; // deleted, waiting to be returned to the pool
+  struct epoll_rec *next; // next event on the same fd
+  struct epoll_rec *fire_next; // next expired timeout or deleted record
+};
+
+struct epoll_fdinfo {
+  struct epoll_rec *recs;
+  // bumped when the last event of the fd is deleted, epoll results carrying
+  // an old generation are stale and ignored
+  uint32_t gen;
+  uint32_t regmask; // mask registered with epoll, 0 if not registered
+  uint32_t reggen; // generation registered with epoll
+  int dirty;
+};
+
+struct epoll_loop {
+  int epfd;
+  struct epoll_event *evs;
+  unsigned int max_events;
+  vde_pool *rec_pool;
+  unsigned int nactive; // records waiting for events or timeouts
+  // fd info, indexed by fd
+  struct epoll_fdinfo *fds;
+  unsigned int nfds;
+  // fds whose registration must be updated before the next epoll_wait
+  int *changes;
+  unsigned int nchanges;
+  unsigned int changes_size;
+  // timeouts, ordered by deadline
+  vde_timeout_heap timeouts;
+  // deleted records
+  struct epoll_rec *gc;
+  int exit;
+};
+
+static __thread struct epoll_loop *loop;
+
+static epoll_usec epoll_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (epoll_usec)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct epoll_fdinfo *fd_get(int fd)
+{
+  unsigned int nfds = loop->nfds ? loop->nfds : 64;
+
+  if ((unsigned int)fd >= loop->nfds) {
+    while (nfds <= (unsigned int)fd) {
+      nfds *= 2;
+    }
+    loop->fds = vde_realloc(loop->fds, nfds * sizeof(struct epoll_fdinfo));
+    memset(loop->fds + loop->nfds, 0,
+           (nfds - loop->nfds) * sizeof(struct epoll_fdinfo));
+    loop->nfds = nfds;
+  }
+  return &loop->fds[fd];
+}
+
+static void fd_mark_dirty(int fd)
+{
+  struct epoll_fdinfo *fdi = &loop->fds[fd];
+
+  if (fdi->dirty) {
+    return;
+  }
+  if (loop->nchanges == loop->changes_size) {
+    loop->changes_size = loop->changes_size ? loop->changes_size * 2 : 16;
+    loop->changes = vde_realloc(loop->changes,
+                                loop->changes_size * sizeof(int));
+  }
+  loop->changes[loop->nchanges++] = fd;
+  fdi->dirty = 1;
+}
+
+/**
+ * @brief Update the epoll registration of a fd to match its active events
+ */
+static void fd_apply(int fd)
+{
+  struct epoll_fdinfo *fdi = &loop->fds[fd];
+  struct epoll_rec *rec;
+  struct epoll_event ev;
+  uint32_t mask = 0;
+  int op;
+
+  fdi->dirty = 0;
+
+  for (rec = fdi->recs; rec != NULL; rec = rec->next) {
+    if (!rec->active) {
+      continue;
+    }
+    if (rec->events & VDE_EV_READ) {
+      mask |= EPOLLIN;
+    }
+    if (rec->events & VDE_EV_WRITE) {
+      mask |= EPOLLOUT;
+    }
+    if (rec->events & VDE_EV_EDGE) {
+      mask |= EPOLLET;
+    }
+  }
+  if (!(mask & (EPOLLIN | EPOLLOUT))) {
+    mask = 0;
+  }
+  if (mask == fdi->regmask && (mask == 0 || fdi->reggen == fdi->gen)) {
+    return;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = mask;
+  ev.data.u64 = ((uint64_t)fdi->gen << 32) | (uint32_t)fd;
+
+  if (mask == 0) {
+    // the fd might have been closed already, which removes it from epoll
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+    fdi->regmask = 0;
+    return;
+  }
+
+  op = fdi->regmask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(loop->epfd, op, fd, &ev)) {
+    // the fd has been closed and reopened or was already registered
+    op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if ((errno != ENOENT && errno != EEXIST) ||
+        epoll_ctl(loop->epfd, op, fd, &ev)) {
+      vde_error("%s: cannot register fd %d: %s", __PRETTY_FUNCTION__, fd,
+                strerror(errno));
+      fdi->regmask = 0;
+      return;
+    }
+  }
+  fdi->regmask = mask;
+  fdi->reggen = fdi->gen;
+}
+
+static void rec_arm(struct epoll_rec *rec, epoll_usec now)
+{
+  if (!rec->active) {
+    rec->active = 1;
+    loop->nactive++;
+  }
+  if (rec->has_timeout) {
+    if (vde_timeout_is_queued(&rec->timeout_node)) {
+      vde_timeout_heap_remove(&loop->timeouts, &rec->timeout_node);
+    }
+    rec->timeout_node.deadline = now + rec->timeout;
+    vde_timeout_heap_insert(&loop->timeouts, &rec->timeout_node);
+  }
+  if (rec->fd >= 0) {
+    fd_mark_dirty(rec->fd);
+  }
+}
+
+static void rec_disarm(struct epoll_rec *rec)
+{
+  if (rec->active) {
+    rec->active = 0;
+    loop->nactive--;
+  }
+  if (vde_timeout_is_queued(&rec->timeout_node)) {
+    vde_timeout_heap_remove(&loop->timeouts, &rec->timeout_node);
+  }
+  if (rec->fd >= 0) {
+    fd_mark_dirty(rec->fd);
+  }
+}
+
+static struct epoll_rec *rec_new(int fd, short events,
+                                 const struct timeval *timeout, event_cb cb,
+                                 void *arg)
+{
+  struct epoll_rec *rec;
+  struct epoll_fdinfo *fdi;
+
+  if (loop == NULL) {
+    vde_error("%s: epoll loop not initialized in this thread",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rec = vde_cached_pool_alloc(loop->rec_pool);
+  if (rec == NULL) {
+    vde_error("%s: can't allocate memory for new event", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(rec, 0, sizeof(struct epoll_rec));
+  rec->fd = fd;
+  rec->events = events;
+  rec->cb = cb;
+  rec->arg = arg;
+  vde_timeout_init(&rec->timeout_node, rec);
+  if (timeout != NULL) {
+    rec->has_timeout = 1;
+    rec->timeout = (epoll_usec)timeout->tv_sec * 1000000 + timeout->tv_usec;
+  }
+
+  if (fd >= 0) {
+    fdi = fd_get(fd);
+    rec->next = fdi->recs;
+    fdi->recs = rec;
+  }
+
+  rec_arm(rec, epoll_now());
+  return rec;
+}
+
+static void rec_del(struct epoll_rec *rec)
+{
+  struct epoll_fdinfo *fdi;
+  struct epoll_rec **prev;
+
+  vde_assert(!rec->dead);
+
+  rec_disarm(rec);
+
+  if (rec->fd >= 0) {
+    fdi = &loop->fds[rec->fd];
+    for (prev = &fdi->recs; *prev != rec; prev = &(*prev)->next);
+    // rec->next is left alone: the dispatch loop might be walking through it
+    *prev = rec->next;
+    if (fdi->recs == NULL) {
+      fdi->gen++;
+    }
+  }
+
+  // records are returned to the pool at the end of the loop iteration
+  rec->dead = 1;
+  rec->fire_next = loop->gc;
+  loop->gc = rec;
+}
+
+static void gc_collect(void)
+{
+  struct epoll_rec *rec;
+
+  while (loop->gc != NULL) {
+    rec = loop->gc;
+    loop->gc = rec->fire_next;
+    vde_cached_pool_free(loop->rec_pool, rec);
+  }
+}
+
+/**
+ * @brief Call the callbacks of events triggered on a fd
+ */
+static void dispatch_fd(struct epoll_event *ev, epoll_usec now)
+{
+  int fd = (int)(ev->data.u64 & 0xffffffff);
+  uint32_t gen = (uint32_t)(ev->data.u64 >> 32);
+  struct epoll_rec *rec, *next;
+  short what = 0, fired;
+
+  if ((unsigned int)fd >= loop->nfds || loop->fds[fd].gen != gen) {
+    return;
+  }
+
+  if (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    what |= VDE_EV_READ;
+  }
+  if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+    what |= VDE_EV_WRITE;
+  }
+
+  // callbacks can add or delete events, new ones are inserted at the head of
+  // the list and deleted ones keep their next pointer until gc_collect()
+  for (rec = loop->fds[fd].recs; rec != NULL; rec = next) {
+    next = rec->next;
+    if (rec->dead || !rec->active) {
+      continue;
+    }
+    fired = rec->events & what;
+    if (!fired) {
+      continue;
+    }
+    if (!(rec->events & VDE_EV_PERSIST)) {
+      rec_disarm(rec);
+    } else if (rec->has_timeout) {
+      rec_arm(rec, now);
+    }
+    rec->cb(fd, fired, rec->arg);
+  }
+}
+
+/**
+ * @brief Call the callbacks of expired timeouts
+ */
+static void dispatch_timeouts(epoll_usec now)
+{
+  struct epoll_rec *rec, *head = NULL, **tail = &head;
+  vde_timeout *t;
+
+  // pick expired timeouts first, so that zero timeouts re-armed by their
+  // callback are not called again in this iteration
+  while ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL &&
+         t->deadline <= now) {
+    rec = (struct epoll_rec *)t->data;
+    vde_timeout_heap_remove(&loop->timeouts, t);
+    rec->fire_next = NULL;
+    *tail = rec;
+    tail = &rec->fire_next;
+  }
+
+  while (head != NULL) {
+    rec = head;
+    head = rec->fire_next;
+    if (rec->dead) {
+      continue;
+    }
+    if (rec->events & VDE_EV_PERSIST) {
+      rec_arm(rec, now);
+    } else {
+      rec_disarm(rec);
+    }
+    rec->cb(rec->fd, VDE_EV_TIMEOUT, rec->arg);
+  }
+}
+
+/**
+ * @brief Run a single loop iteration
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int epoll_loop_once(void)
+{
+  int i, n, wait_ms = -1;
+  epoll_usec now;
+  vde_timeout *t;
+
+  while (loop->nchanges > 0) {
+    fd_apply(loop->changes[--loop->nchanges]);
+  }
+
+  if ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL) {
+    now = epoll_now();
+    if (t->deadline <= now) {
+      wait_ms = 0;
+    } else {
+      // round up, waking up early would just cause another iteration
+      wait_ms = (t->deadline - now + 999) / 1000;
+    }
+  }
+
+  n = epoll_wait(loop->epfd, loop->evs, loop->max_events, wait_ms);
+  if (n < 0) {
+    if (errno != EINTR) {
+      vde_error("%s: epoll_wait failed: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      return -1;
+    }
+    n = 0;
+  }
+
+  now = epoll_now();
+  for (i = 0; i < n; i++) {
+    dispatch_fd(&loop->evs[i], now);
+  }
+  dispatch_timeouts(now);
+
+  gc_collect();
+  return 0;
+}
+
+int vde_epoll_init(unsigned int max_events)
+{
+  if (loop != NULL) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (max_events == 0) {
+    max_events = EPOLL_DEFAULT_MAX_EVENTS;
+  }
+
+  loop = (struct epoll_loop *)vde_calloc(sizeof(struct epoll_loop));
+  if (loop == NULL) {
+    vde_error("%s: can't allocate epoll loop", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd == -1) {
+    vde_error("%s: can't create epoll fd: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto cleanup_loop;
+  }
+
+  loop->rec_pool = vde_pool_new(sizeof(struct epoll_rec), EPOLL_REC_SLAB,
+                                EPOLL_REC_SLAB, 0);
+  if (loop->rec_pool == NULL) {
+    vde_error("%s: can't create event pool", __PRETTY_FUNCTION__);
+    goto cleanup_epfd;
+  }
+
+  loop->max_events = max_events;
+  loop->evs = vde_alloc(max_events * sizeof(struct epoll_event));
+
+  return 0;
+
+cleanup_epfd:
+  close(loop->epfd);
+cleanup_loop:
+  vde_free(loop);
+  loop = NULL;
+  return -1;
+}
+
+void vde_epoll_fini(void)
+{
+  unsigned int fd;
+  struct epoll_rec *rec;
+  vde_timeout *t;
+
+  if (loop == NULL) {
+    return;
+  }
+
+  // events still registered are leaked by their owners, just drop them
+  for (fd = 0; fd < loop->nfds; fd++) {
+    while ((rec = loop->fds[fd].recs) != NULL) {
+      rec_del(rec);
+    }
+  }
+  while ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL) {
+    rec_del((struct epoll_rec *)t->data);
+  }
+  gc_collect();
+
+  vde_pool_delete(loop->rec_pool);
+  close(loop->epfd);
+  vde_free(loop->evs);
+  vde_free(loop->fds);
+  vde_free(loop->changes);
+  vde_timeout_heap_fini(&loop->timeouts);
+  vde_free(loop);
+  loop = NULL;
+}
+
+int vde_epoll_dispatch(void)
+{
+  if (loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  loop->exit = 0;
+  while (!loop->exit && loop->nactive > 0) {
+    if (epoll_loop_once()) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void vde_epoll_loopexit(void)
+{
+  if (loop != NULL) {
+    loop->exit = 1;
+  }
+}
+
+void *epoll_event_add(int fd, short events, const struct timeval *timeout,
+                      event_cb cb, void *arg)
+{
+  if (fd < 0) {
+    errno = EBADF;
+    return NULL;
+  }
+  return rec_new(fd, events, timeout, cb, arg);
+}
+
+void epoll_event_del(void *event)
+{
+  rec_del((struct epoll_rec *)event);
+}
+
+void *epoll_timeout_add(const struct timeval *timeout, short events,
+                        event_cb cb, void *arg)
+{
+  if (timeout == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return rec_new(-1, events, timeout, cb, arg);
+}
+
+void epoll_timeout_del(void *timeout)
+{
+  rec_del((struct epoll_rec *)timeout);
+}
+
+vde_event_handler epoll_eh = {
+  .event_add = epoll_event_add,
+  .event_del = epoll_event_del,
+  .timeout_add = epoll_timeout_add,
+  .timeout_del = epoll_timeout_del,
+};
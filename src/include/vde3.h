@@ -52,6 +52,7 @@
 #define VDE_EV_WRITE    0x04
 #define VDE_EV_PERSIST  0x10
 #define VDE_EV_TIMEOUT  0x01
+#define VDE_EV_EDGE     0x20
 
 /**
  * @brief The callback to be called on events.
@@ -90,6 +91,9 @@ typedef struct {
    *   VDE_EV_WRITE to monitor write-availability
    *   VDE_EV_PERSIST to keep calling the callback even after an event has
    *                  occured
+   *   VDE_EV_EDGE to be notified only when the fd becomes readable/writable,
+   *               the callback must then read/write until EAGAIN. Handlers
+   *               which don't support it can treat it as level-triggered.
    *
    * If timeout is not NULL and no events occur within timeout then the callback
    * is called, if timeout is NULL then the callback is called only if events of
@@ -141,6 +145,78 @@ typedef struct {
   void (*timeout_del)(void *tout);
 } vde_event_handler;
 
+/**
+ * @brief Event handler based on epoll, shipped with the library.
+ *
+ * Before using it each thread must call vde_epoll_init() and then run its loop
+ * with vde_epoll_dispatch().
+ */
+extern vde_event_handler epoll_eh;
+
+/**
+ * @brief Initialize the epoll loop of the calling thread
+ *
+ * @param max_events The maximum number of events fetched by a single
+ * epoll_wait(), 0 for the default
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_epoll_init(unsigned int max_events);
+
+/**
+ * @brief Release the epoll loop of the calling thread
+ */
+void vde_epoll_fini(void);
+
+/**
+ * @brief Run the epoll loop of the calling thread until there are no more
+ * pending events or vde_epoll_loopexit() is called
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_epoll_dispatch(void);
+
+/**
+ * @brief Make vde_epoll_dispatch() return after the current iteration
+ */
+void vde_epoll_loopexit(void);
+
+/**
+ * @brief Event handler based on io_uring, shipped with the library.
+ *
+ * Before using it each thread must call vde_uring_init() and then run its loop
+ * with vde_uring_dispatch(). Besides events, components can submit their I/O
+ * directly to the ring through vde3/uring.h.
+ */
+extern vde_event_handler uring_eh;
+
+/**
+ * @brief Initialize the io_uring loop of the calling thread
+ *
+ * @param entries The size of the submission queue, 0 for the default
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_uring_init(unsigned int entries);
+
+/**
+ * @brief Release the io_uring loop of the calling thread
+ */
+void vde_uring_fini(void);
+
+/**
+ * @brief Run the io_uring loop of the calling thread until there are no more
+ * pending events or vde_uring_loopexit() is called
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_uring_dispatch(void);
+
+/**
+ * @brief Make vde_uring_dispatch() return after the current iteration
+ */
+void vde_uring_loopexit(void);
+
 /**
  * @brief Serializable object API
  *
@@ -150,12 +226,72 @@ typedef struct {
 typedef struct json_object vde_sobj;
 #define vde_sobj_to_string(o) json_object_to_json_string(o)
 vde_sobj *vde_sobj_from_string(const char *string);
+
+/**
+ * @brief Incremental parser, it keeps partial objects across calls so that
+ * a serialized object can be fed in pieces as they arrive
+ */
+typedef struct json_tokener vde_sobj_parser;
+#define vde_sobj_parser_new() json_tokener_new()
+#define vde_sobj_parser_delete(p) json_tokener_free(p)
+#define vde_sobj_parser_reset(p) json_tokener_reset(p)
+
+/**
+ * @brief Feed data to an incremental parser
+ *
+ * A NUL byte ends the current object, it is needed to complete an object which
+ * is a bare number. The parser is reset when an object is returned or on
+ * error.
+ *
+ * @param parser The parser
+ * @param buf The data
+ * @param len The length of data
+ * @param obj Reference to the parsed object, set when 1 is returned
+ * @param used Reference to the number of bytes used, on error the offset of
+ * the byte where parsing failed
+ *
+ * @return 1 if an object has been completed, zero if all data has been
+ * consumed and the object is still partial, -1 on error (and errno is set
+ * appropriately)
+ */
+int vde_sobj_parser_feed(vde_sobj_parser *parser, const char *buf, size_t len,
+                         vde_sobj **obj, size_t *used);
+
+/**
+ * @brief Serialize an object in MessagePack format
+ *
+ * Each type of serializable object has its MessagePack counterpart, integers
+ * take the smallest encoding which holds their value.
+ *
+ * @param obj The object to serialize
+ * @param buf Reference to the serialized data, to be freed with vde_free()
+ * @param len Reference to the length of data
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_sobj_to_msgpack(vde_sobj *obj, char **buf, size_t *len);
+
+/**
+ * @brief Deserialize an object in MessagePack format
+ *
+ * Binary data is loaded as a string, extension types and unsigned integers
+ * above the range of int64 are refused.
+ *
+ * @param buf The serialized data, exactly one object
+ * @param len The length of data
+ * @param obj Reference to the object, NULL for nil
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_sobj_from_msgpack(const char *buf, size_t len, vde_sobj **obj);
+
 #define vde_sobj_put(o) json_object_put(o)
 #define vde_sobj_get(o) json_object_get(o)
 
 #define vde_sobj_new_int(i) json_object_new_int(i)
+#define vde_sobj_new_int64(i) json_object_new_int64(i)
 #define vde_sobj_new_double(d) json_object_new_double(d)
-#define vde_sobj_new_bool(b) json_object_new_bool(b)
+#define vde_sobj_new_bool(b) json_object_new_boolean(b)
 #define vde_sobj_new_string(s) json_object_new_string(s)
 
 #define vde_sobj_new_array() json_object_new_array()
@@ -309,6 +445,46 @@ void vde_context_fini(vde_context *ctx);
  */
 void vde_context_delete(vde_context *ctx);
 
+/**
+ * @brief Set the number of workers of a VDE 3 context
+ *
+ * Workers are threads running their own event loop, see vde3/worker.h. They
+ * need an event handler keeping a loop per thread, like epoll_eh. Workers are
+ * stopped by vde_context_fini().
+ *
+ * @param ctx The context
+ * @param nworkers The number of workers, zero stops the running ones. Running
+ * workers must be stopped before starting a different number of them.
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_set_workers(vde_context *ctx, unsigned int nworkers);
+
+/**
+ * @brief Get the number of workers of a VDE 3 context
+ *
+ * @param ctx The context
+ *
+ * @return The number of running workers
+ */
+unsigned int vde_context_get_workers(vde_context *ctx);
+
+/**
+ * @brief Run a function in a worker of a VDE 3 context
+ *
+ * Events and timers added by fn belong to the worker and are dispatched by it.
+ *
+ * @param ctx The context
+ * @param worker The index of the worker
+ * @param fn The function
+ * @param arg The argument to pass to fn
+ * @param wait If not zero wait for fn to return
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_worker_call(vde_context *ctx, unsigned int worker,
+                            void (*fn)(void *), void *arg, int wait);
+
 /**
  * @brief Alloc a new VDE 3 component
  *
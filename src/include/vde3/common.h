@@ -39,12 +39,20 @@
 #define vde_cached_free_chunk(s, d) g_slice_free1(s, d)
  */
 
+/*
+ * Allocations from an object pool (see vde3/pool.h), to be used for objects
+ * allocated and freed at packet rate.
+ */
+#define vde_cached_pool_alloc(p) vde_pool_alloc(p)
+#define vde_cached_pool_free(p, d) vde_pool_free(p, d)
+
 /*
  * NOTE: g_malloc _aborts_ if the underlying malloc fails and
  * returns NULL only if s == 0
  */
 #define vde_alloc(s) g_malloc(s)
 #define vde_calloc(s) g_malloc0(s)
+#define vde_realloc(p, s) g_realloc(p, s)
 #define vde_free(s) g_free(s)
 
 typedef GList vde_list;
@@ -61,10 +69,15 @@ typedef GList vde_list;
 
 typedef GHashTable vde_hash;
 #define vde_hash_init() g_hash_table_new(NULL, NULL)
+// keys are pointers to data compared with hash and equal functions
+#define vde_hash_init_full(hash, equal) \
+  g_hash_table_new((GHashFunc)(hash), (GEqualFunc)(equal))
 #define vde_hash_insert(h, k, v) g_hash_table_insert(h, (gpointer)k, v)
 #define vde_hash_remove(h, k) g_hash_table_remove(h, (gconstpointer)k)
 #define vde_hash_lookup(h, k) g_hash_table_lookup(h, (gconstpointer)k)
 #define vde_hash_size(h) g_hash_table_size(h)
+#define vde_hash_foreach(h, f, arg) g_hash_table_foreach(h, (GHFunc)(f), arg)
+#define vde_hash_remove_all(h) g_hash_table_remove_all(h)
 #define vde_hash_delete(h) g_hash_table_destroy(h)
 
 typedef GQueue vde_queue;
@@ -102,6 +115,243 @@ typedef gchar vde_char;
 #define UNUSED
 #endif
 
+/*
+ * Fixed-capacity ring of pointers used on packet paths instead of vde_queue:
+ * slots are allocated once, so pushing and popping never allocate. It is safe
+ * to use as a lock-free queue with one producer (push) and one consumer
+ * (peek/pop/discard) in different threads.
+ */
+
+// keep producer and consumer indexes on different cache lines
+#define VDE_RING_CACHELINE 64
+
+typedef struct {
+  // written by the producer only
+  unsigned int tail __attribute__ ((aligned (VDE_RING_CACHELINE)));
+  unsigned int peak;
+  unsigned long drops;
+  // written by the consumer only
+  unsigned int head __attribute__ ((aligned (VDE_RING_CACHELINE)));
+  // constant after vde_ring_new()
+  unsigned int mask __attribute__ ((aligned (VDE_RING_CACHELINE)));
+  unsigned int limit;
+  void *slots[0];
+} vde_ring;
+
+/**
+ * @brief Alloc a new ring
+ *
+ * @param limit The maximum number of elements in the ring, slots are rounded up
+ * to a power of two but the ring never holds more than limit elements
+ *
+ * @return a ring on success, NULL on error (and errno is set appropriately)
+ */
+static inline vde_ring *vde_ring_new(unsigned int limit)
+{
+  unsigned int size = 1;
+  vde_ring *ring;
+
+  if (limit == 0 || limit > (1U << 31)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (size < limit) {
+    size <<= 1;
+  }
+
+  ring = (vde_ring *)vde_calloc(sizeof(vde_ring) + size * sizeof(void *));
+  if (ring == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ring->mask = size - 1;
+  ring->limit = limit;
+  return ring;
+}
+
+/**
+ * @brief Deallocate a ring, elements still in it are not touched
+ *
+ * @param ring The ring to delete
+ */
+static inline void vde_ring_delete(vde_ring *ring)
+{
+  vde_free(ring);
+}
+
+/**
+ * @brief Get the number of elements in a ring
+ *
+ * @param ring The ring
+ *
+ * @return The number of elements
+ */
+static inline unsigned int vde_ring_get_length(vde_ring *ring)
+{
+  return *(volatile unsigned int *)&ring->tail -
+         *(volatile unsigned int *)&ring->head;
+}
+
+/**
+ * @brief Tell if a ring is empty
+ *
+ * @param ring The ring
+ *
+ * @return 1 if the ring is empty, 0 otherwise
+ */
+static inline int vde_ring_is_empty(vde_ring *ring)
+{
+  return vde_ring_get_length(ring) == 0;
+}
+
+/**
+ * @brief Tell if a ring is full
+ *
+ * @param ring The ring
+ *
+ * @return 1 if the ring holds limit elements, 0 otherwise
+ */
+static inline int vde_ring_is_full(vde_ring *ring)
+{
+  return vde_ring_get_length(ring) >= ring->limit;
+}
+
+/**
+ * @brief Check that an element can be appended to a ring, called by the
+ * producer before preparing it. A full ring counts the element as dropped.
+ *
+ * @param ring The ring
+ *
+ * @return zero if the next push succeeds, -1 if the ring is full (and errno is
+ * set to ENOBUFS)
+ */
+static inline int vde_ring_check_push(vde_ring *ring)
+{
+  if (vde_ring_get_length(ring) >= ring->limit) {
+    ring->drops++;
+    errno = ENOBUFS;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Append an element to a ring, called by the producer
+ *
+ * @param ring The ring
+ * @param data The element
+ *
+ * @return zero on success, -1 if the ring is full (and errno is set to
+ * ENOBUFS)
+ */
+static inline int vde_ring_push(vde_ring *ring, void *data)
+{
+  unsigned int len = vde_ring_get_length(ring);
+
+  if (len >= ring->limit) {
+    ring->drops++;
+    errno = ENOBUFS;
+    return -1;
+  }
+  ring->slots[ring->tail & ring->mask] = data;
+  // the slot must be visible before the consumer sees the new tail
+  __sync_synchronize();
+  ring->tail++;
+
+  if (len + 1 > ring->peak) {
+    ring->peak = len + 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Get an element without removing it from the ring, called by the
+ * consumer
+ *
+ * @param ring The ring
+ * @param n The position of the element, 0 is the oldest one
+ *
+ * @return The element, NULL if the ring holds less than n + 1 elements
+ */
+static inline void *vde_ring_peek_nth(vde_ring *ring, unsigned int n)
+{
+  if (n >= vde_ring_get_length(ring)) {
+    return NULL;
+  }
+  // pairs with the barrier in vde_ring_push()
+  __sync_synchronize();
+  return ring->slots[(ring->head + n) & ring->mask];
+}
+
+/**
+ * @brief Get the oldest element without removing it from the ring, called by
+ * the consumer
+ *
+ * @param ring The ring
+ *
+ * @return The element, NULL if the ring is empty
+ */
+static inline void *vde_ring_peek(vde_ring *ring)
+{
+  return vde_ring_peek_nth(ring, 0);
+}
+
+/**
+ * @brief Remove the n oldest elements from a ring, called by the consumer
+ *
+ * @param ring The ring
+ * @param n The number of elements to remove, at most the ring length
+ */
+static inline void vde_ring_discard(vde_ring *ring, unsigned int n)
+{
+  vde_assert(n <= vde_ring_get_length(ring));
+
+  // slots must have been read before the producer can reuse them
+  __sync_synchronize();
+  ring->head += n;
+}
+
+/**
+ * @brief Remove the oldest element from a ring, called by the consumer
+ *
+ * @param ring The ring
+ *
+ * @return The element, NULL if the ring is empty
+ */
+static inline void *vde_ring_pop(vde_ring *ring)
+{
+  void *data = vde_ring_peek(ring);
+
+  if (data != NULL) {
+    vde_ring_discard(ring, 1);
+  }
+  return data;
+}
+
+/**
+ * @brief Get the maximum number of elements a ring can hold
+ */
+static inline unsigned int vde_ring_get_limit(vde_ring *ring)
+{
+  return ring->limit;
+}
+
+/**
+ * @brief Get the highest number of elements held at once by a ring
+ */
+static inline unsigned int vde_ring_get_peak(vde_ring *ring)
+{
+  return ring->peak;
+}
+
+/**
+ * @brief Get the number of elements rejected because the ring was full
+ */
+static inline unsigned long vde_ring_get_drops(vde_ring *ring)
+{
+  return ring->drops;
+}
+
 // logical XOR
 // use double negation to make it possible to compare truth values
 #define XOR(a, b) ((!!a) != (!!b))
@@ -55,19 +55,26 @@ typedef struct vde_connection vde_connection;
  *
  * @param conn The connection to send the packet to
  * @param pkt The packet to send, if the backend doesn't send the packet
- * immediately it must reserve its own copy of the packet.
+ * immediately it must keep a reference with vde_pkt_get() if the packet is
+ * shared or reserve its own copy of the packet otherwise.
  *
  * @return zero on success, an error code otherwise
  */
-/*
- * XXX(shammash): add a flag here to tell the connection backend if the packet
- * needs to be copied or the same memory area / pointer can be used? This can be
- * useful if, for instance, we have a send-queue in the engine and in the
- * connection: right now the engine would have its own copy of the packet which
- * needs to be copied again in the connection.
- */
 typedef int (*conn_be_write)(vde_connection *conn, vde_pkt *pkt);
 
+/**
+ * @brief (Optional) Backend implementation for writing a batch of packets
+ *
+ * @param conn The connection to send the packets to
+ * @param batch The packets to send, the same rules of conn_be_write apply to
+ * each of them.
+ *
+ * @return the number of packets taken care of, starting from the first one. If
+ * it is less than batch->len errno is set appropriately for the first packet
+ * which has not been taken.
+ */
+typedef int (*conn_be_write_batch)(vde_connection *conn, vde_pkt_batch *batch);
+
 /**
  * @brief Backend implementation for closing a connection, when called the
  * backend must free all its resources for this connection.
@@ -76,6 +83,25 @@ typedef int (*conn_be_write)(vde_connection *conn, vde_pkt *pkt);
  */
 typedef void (*conn_be_close)(vde_connection *conn);
 
+/**
+ * @brief Counters of the packets queued by a backend for sending
+ */
+typedef struct {
+  unsigned int length; // packets in the queue now
+  unsigned int peak; // highest number of packets in the queue at once
+  unsigned long drops; // packets refused because the queue was full
+} vde_conn_queue_stats;
+
+/**
+ * @brief (Optional) Backend implementation for reading the counters of its
+ * send queue
+ *
+ * @param conn The connection
+ * @param stats The counters to fill
+ */
+typedef void (*conn_be_queue_stats)(vde_connection *conn,
+                                    vde_conn_queue_stats *stats);
+
 
 /*
  * Functions set by a component which uses the connection.
@@ -99,6 +125,19 @@ typedef void (*conn_be_close)(vde_connection *conn);
  */
 typedef int (*conn_read_cb)(vde_connection *conn, vde_pkt *pkt, void *arg);
 
+/**
+ * @brief (Optional) Callback called when a connection has a burst of packets
+ * ready to serve, after this callback returns the packets will be free()d
+ *
+ * @param conn The connection with the packets ready
+ * @param batch The new packets
+ * @param arg The argument which has previously been set by connection user
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+typedef int (*conn_read_batch_cb)(vde_connection *conn, vde_pkt_batch *batch,
+                                  void *arg);
+
 /**
  * @brief (Optional) Callback called when a packet has been sent by the
  * connection, after this callback returns the pkt will be free()d.
@@ -142,9 +181,12 @@ struct vde_connection {
   unsigned int send_maxtries;
   struct timeval send_maxtimeout;
   conn_be_write be_write;
+  conn_be_write_batch be_write_batch;
+  conn_be_queue_stats be_queue_stats;
   conn_be_close be_close;
   void *be_priv;
   conn_read_cb read_cb;
+  conn_read_batch_cb read_batch_cb;
   conn_write_cb write_cb;
   conn_error_cb error_cb;
   void *cb_priv;
@@ -206,6 +248,36 @@ static inline int vde_connection_write(vde_connection *conn, vde_pkt *pkt)
   return conn->be_write(conn, pkt);
 }
 
+/**
+ * @brief Function used by connection user to send a batch of packets. If the
+ * backend has no batch implementation packets are written one by one.
+ *
+ * @param conn The connection to send the packets into
+ * @param batch The packets to send
+ *
+ * @return the number of packets taken care of, starting from the first one. If
+ * it is less than batch->len errno is set appropriately for the first packet
+ * which has not been taken.
+ */
+static inline int vde_connection_write_batch(vde_connection *conn,
+                                             vde_pkt_batch *batch)
+{
+  unsigned int i;
+
+  vde_assert(conn != NULL);
+  vde_assert(batch != NULL);
+
+  if (conn->be_write_batch != NULL) {
+    return conn->be_write_batch(conn, batch);
+  }
+  for (i = 0; i < batch->len; i++) {
+    if (conn->be_write(conn, batch->pkts[i])) {
+      break;
+    }
+  }
+  return i;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * new packet is available.
@@ -224,6 +296,45 @@ static inline int vde_connection_call_read(vde_connection *conn, vde_pkt *pkt)
   return conn->read_cb(conn, pkt, conn->cb_priv);
 }
 
+/**
+ * @brief Function called by connection backend to tell the connection user a
+ * burst of packets is available. If the user has no batch callback packets are
+ * delivered one by one.
+ *
+ * @param conn The connection whom backend has new packets available
+ * @param batch The new packets, the same rules of vde_connection_call_read()
+ * apply to each of them
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static inline int vde_connection_call_read_batch(vde_connection *conn,
+                                                 vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int rv = 0, cb_errno = 0;
+
+  vde_assert(conn != NULL);
+  vde_assert(batch != NULL);
+
+  if (conn->read_batch_cb != NULL) {
+    return conn->read_batch_cb(conn, batch, conn->cb_priv);
+  }
+
+  vde_assert(conn->read_cb != NULL);
+  for (i = 0; i < batch->len; i++) {
+    if (conn->read_cb(conn, batch->pkts[i], conn->cb_priv)) {
+      rv = -1;
+      cb_errno = errno;
+      // the connection is going to be closed, don't bother with the others
+      if (cb_errno == EPIPE) {
+        break;
+      }
+    }
+  }
+  errno = cb_errno;
+  return rv;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * packet has been successfully sent.
@@ -278,6 +389,62 @@ void vde_connection_set_callbacks(vde_connection *conn,
                                   conn_error_cb error_cb,
                                   void *cb_priv);
 
+/**
+ * @brief Set the user's batch read callback, must be called after
+ * vde_connection_set_callbacks() which resets it.
+ *
+ * @param conn The connection to set the callback to
+ * @param read_batch_cb Function called when a burst of packets is available
+ */
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb);
+
+/**
+ * @brief Set the backend implementation for writing a batch of packets, it is
+ * called by the backend after vde_connection_init().
+ *
+ * @param conn The connection to set the implementation to
+ * @param be_write_batch The backend batch write implementation
+ */
+void vde_connection_set_be_write_batch(vde_connection *conn,
+                                       conn_be_write_batch be_write_batch);
+
+/**
+ * @brief Set the backend implementation for reading the send queue counters,
+ * it is called by the backend after vde_connection_init().
+ *
+ * @param conn The connection to set the implementation to
+ * @param be_queue_stats The backend implementation
+ */
+void vde_connection_set_be_queue_stats(vde_connection *conn,
+                                       conn_be_queue_stats be_queue_stats);
+
+/**
+ * @brief Get the counters of the packets queued for sending
+ *
+ * @param conn The connection
+ * @param stats The counters to fill
+ *
+ * @return zero on success, -1 if the backend does not queue packets (and errno
+ * is set to ENOTSUP)
+ */
+int vde_connection_get_queue_stats(vde_connection *conn,
+                                   vde_conn_queue_stats *stats);
+
+/**
+ * @brief Fill the send queue counters of a backend queueing packets in a ring
+ *
+ * @param ring The send queue
+ * @param stats The counters to fill
+ */
+static inline void vde_connection_ring_stats(vde_ring *ring,
+                                             vde_conn_queue_stats *stats)
+{
+  stats->length = vde_ring_get_length(ring);
+  stats->peak = vde_ring_get_peak(ring);
+  stats->drops = vde_ring_get_drops(ring);
+}
+
 /**
  * @brief Get connection context
  *
@@ -422,20 +589,25 @@ vde_attributes *vde_connection_get_attributes(vde_connection *conn);
 /*
  * Memory management:
  * - a connection calls read_cb iff a packet is ready
- * - when write() is called the connection must be responsible for copying the
- * packet because because it will be free()ed right after write() returns
- * - a local connection duplicate the packet passed with write(), calls its
- * peer's read_cb and then free()s the duplicated packet
+ * - when write() is called the connection must either take a reference to the
+ * packet (if vde_pkt_is_shared()) or copy it, because the caller drops its own
+ * reference / frees the packet right after write() returns
+ * - a packet received by read_cb() must not be modified in place unless it has
+ * been obtained through vde_pkt_make_writable()
+ * - a local connection passes the packet written by its peer to read_cb()
  *
  * DGRAM/STACK flow:
- * - connection: read on stack space
+ * - connection: read into a shared packet from its pool (stack space if the
+ * pool is exhausted)
  * - connection: call read_cb()
- * - engine/cm: does stuff considering that when read_cb() returns the packet
- * will be free()d. e.g.:
+ * - engine/cm: does stuff considering that when read_cb() returns the
+ * connection drops its reference. e.g.:
  * for each c in connections:
  * if c != incoming_connection:
  * c.write(pkt)
- * - connection: memcpy(pkt) -> add(packetq)
+ * - connection: get(pkt) -> add(packetq), memcpy(pkt) only if not shared
+ * - connection: put(pkt) when sent, the last put gives the packet back to the
+ * pool of the connection which read it
  *
  * STREAM/BUFFER, incoming flow:
  * n = 0;
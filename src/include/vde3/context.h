@@ -22,7 +22,9 @@
 #define __VDE3_CONTEXT_H__
 
 #include <vde3/module.h>
+#include <vde3/timer.h>
 #include <vde3/vde_ordhash.h>
+#include <vde3/worker.h>
 
 /**
  * @brief A vde context
@@ -30,10 +32,17 @@
 struct vde_context {
   int initialized;
   vde_event_handler event_handler;
+  // timers of components, driven by the event handler
+  vde_timer_wheel *timers;
+  // threads running their own event loop, see vde_context_set_workers()
+  vde_worker **workers;
+  unsigned int nworkers;
   // hash table vde_quark component_name: vde_component *component
   vde_ordhash *components;
   // list of vde_module*
   vde_list *modules;
+  // changes whenever components or their commands change
+  unsigned int generation;
   // configuration path
   // list of startup commands (from configuration)
 };
@@ -87,4 +96,60 @@ static inline void vde_context_timeout_del(vde_context *ctx, void *timeout)
   ctx->event_handler.timeout_del(timeout);
 }
 
+/**
+ * @brief Alloc a new timer from the context timer wheel
+ *
+ * Timers are cheaper than event handler timeouts and should be preferred by
+ * components which arm and cancel timeouts often or have many of them. See
+ * vde3/timer.h for how to arm and cancel them. Timers created from a worker
+ * run in that worker and must be used only there.
+ *
+ * @param ctx The context
+ * @param cb The function to call when the timer expires
+ * @param arg The argument to pass to the callback
+ *
+ * @return a new timer, NULL on error (and errno is set appropriately)
+ */
+static inline vde_timer *vde_context_timer_new(vde_context *ctx, event_cb cb,
+                                               void *arg)
+{
+  vde_timer_wheel *tw = vde_worker_current_timers();
+
+  vde_assert(ctx != NULL);
+  vde_assert(ctx->initialized == 1);
+
+  // each worker has its own wheel
+  return vde_timer_new(tw ? tw : ctx->timers, cb, arg);
+}
+
+/**
+ * @brief Get the generation of a context
+ *
+ * The generation changes whenever a component is added to or removed from the
+ * context, or commands are registered or deregistered by a component. Lookups
+ * of components and commands can be cached as long as it stays the same.
+ *
+ * @param ctx The context
+ *
+ * @return the current generation
+ */
+static inline unsigned int vde_context_get_generation(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  return ctx->generation;
+}
+
+/**
+ * @brief Start a new generation of a context, invalidating cached lookups
+ *
+ * @param ctx The context
+ */
+static inline void vde_context_bump_generation(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  ctx->generation++;
+}
+
 #endif /* __VDE3_CONTEXT_H__ */
@@ -35,4 +35,15 @@
 int vde_engine_new_connection(vde_component *engine, vde_connection *conn,
                               vde_request *req);
 
+/**
+ * @brief Raise a port_new or port_del signal, whose info is the number of
+ * ports of the engine
+ *
+ * @param engine The engine raising the signal
+ * @param signal The signal name
+ * @param nports The number of ports of the engine
+ */
+void vde_engine_signal_ports(vde_component *engine, const char *signal,
+                             unsigned int nports);
+
 #endif /* __VDE3_ENGINE_H__ */
@@ -34,18 +34,21 @@
  * triggered on its peer and vice-versa. A connection keeps reference of its
  * peer in vde_connection private data.
  *
- * There are two kinds of local connection: queued and unqueued.
+ * There are three kinds of local connection: queued, unqueued and threaded.
  *
  * Queued connections behave exactly like non-local connection: when an
- * engine delivers the packet a packet copy is performed and an event is
- * registered to deliver the copy to the other engine. After the read callback
- * on the second engine has returned with success a write callback on the first
- * one is called.
+ * engine delivers the packet it is queued (by reference if shared, otherwise
+ * as a copy) and an event is registered to deliver it to the other engine.
+ * After the read callback on the second engine has returned with success a
+ * write callback on the first one is called.
  *
  * Non queued connections deliver the packet to the second engine as soon as a
  * write is called, so they don't create a copy of the packet and neither they
  * call the write callback of the first engine when the second engine reads the
  * packet.
+ *
+ * Threaded connections link engines served by different threads, each
+ * direction is a lock-free ring drained by the thread of the reader.
  */
 
 /**
@@ -64,5 +67,60 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
                                  vde_request *req1, vde_component *engine2,
                                  vde_request *req2);
 
+/**
+ * @brief Connect two engines together using a queued local connection.
+ *
+ * Each direction has a queue of at most qlen packets, a write on a full queue
+ * fails with EAGAIN. Queued packets are delivered in bursts from the event
+ * loop, at most budget of them before yielding to other events. Packets
+ * refused by the reader are reported to the writer with CONN_WRITE_DELAY.
+ *
+ * @param ctx The context of the two engines.
+ * @param engine1 The first engine to connect
+ * @param req1 The request for the first engine
+ * @param engine2 The second engine to connect
+ * @param req2 The request for the second engine
+ * @param qlen The maximum number of packets queued per direction, 0 for the
+ * default
+ * @param budget The maximum number of packets delivered at once, 0 for the
+ * default
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_connect_engines_queued(vde_context *ctx, vde_component *engine1,
+                               vde_request *req1, vde_component *engine2,
+                               vde_request *req2, unsigned int qlen,
+                               unsigned int budget);
+
+/**
+ * @brief Connect two engines served by different threads using a threaded
+ * local connection.
+ *
+ * Each engine must be used only from its thread, which is either a worker of
+ * the context or the context thread. Packets are passed by lock-free rings and
+ * the reader is woken up only when its ring stops being empty, delivered
+ * packets do not trigger the write callback of the writer. A write on a full
+ * ring fails with EAGAIN. This function must be called from the context
+ * thread.
+ *
+ * @param ctx The context of the two engines.
+ * @param engine1 The first engine to connect
+ * @param req1 The request for the first engine
+ * @param worker1 The worker serving the first engine, -1 for the context
+ * thread
+ * @param engine2 The second engine to connect
+ * @param req2 The request for the second engine
+ * @param worker2 The worker serving the second engine, -1 for the context
+ * thread
+ * @param qlen The maximum number of packets queued per direction, 0 for the
+ * default
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_connect_engines_threaded(vde_context *ctx, vde_component *engine1,
+                                 vde_request *req1, int worker1,
+                                 vde_component *engine2, vde_request *req2,
+                                 int worker2, unsigned int qlen);
+
 #endif /* __VDE3_LOCALCONNECTION_H__ */
 
@@ -32,6 +32,9 @@
 // - allocated/freed by the same connection (probably using cached memory)
 // - copied mostly by connections, but also by engines if they need to cache it
 //   or to mangle it in particular ways
+// - shared packets are reference counted: instead of copying them a
+//   connection can keep a reference, the memory is given back to its owner by
+//   the release callback when the last reference is dropped
 
 /**
  * @brief A vde packet header.
@@ -45,27 +48,68 @@ typedef struct {
 
 
 /**
- * @brief A vde packet.
+ * @brief Offload metadata of a packet.
+ *
+ * It mirrors the virtio-net header, so that transports talking to kernels or
+ * hypervisors (e.g. tap with IFF_VNET_HDR) can leave checksums and
+ * segmentation of large frames to their peer instead of doing them in
+ * software. Offsets are relative to the payload.
  */
 typedef struct {
+  uint8_t flags; //!< VDE_PKT_CSUM_* flags
+  uint8_t gso_type; //!< VDE_PKT_GSO_* type of segmentation needed
+  uint16_t hdr_len; //!< Length of the headers to replicate in each segment
+  uint16_t gso_size; //!< Payload size of each segment
+  uint16_t csum_start; //!< Where checksumming starts
+  uint16_t csum_offset; //!< Where the checksum is stored, from csum_start
+} vde_pkt_offload;
+
+#define VDE_PKT_CSUM_PARTIAL 1 //!< The checksum must be completed
+#define VDE_PKT_CSUM_VALID 2 //!< The checksum has already been verified
+
+#define VDE_PKT_GSO_NONE 0 //!< A plain frame
+#define VDE_PKT_GSO_TCPV4 1 //!< A TCPv4 segment larger than gso_size
+#define VDE_PKT_GSO_UDP 3 //!< An UDP datagram to be fragmented
+#define VDE_PKT_GSO_TCPV6 4 //!< A TCPv6 segment larger than gso_size
+#define VDE_PKT_GSO_ECN 0x80 //!< TCP segmentation with the CWR bit set
+
+typedef struct vde_pkt vde_pkt;
+
+/**
+ * @brief Callback called when the last reference to a shared packet is
+ * dropped, it must give the packet memory back to its owner.
+ *
+ * @param pkt The packet to release
+ * @param arg The argument set with vde_pkt_set_release()
+ */
+typedef void (*vde_pkt_release_cb)(vde_pkt *pkt, void *arg);
+
+/**
+ * @brief A vde packet.
+ */
+struct vde_pkt {
   vde_hdr *hdr; //!< Pointer to vde_header inside data
   char *head; //!< Pointer to an empty head space inside data
   char *payload; //!< Pointer to payload inside data
   char *tail; //!< Pointer to an empty tail space inside data
   unsigned int data_size; //!< The total size of memory allocated in data
+  int refcount; //!< Number of references held on a shared packet
+  vde_pkt_release_cb release; //!< Release callback, NULL if not shared
+  void *release_arg; //!< Argument of the release callback
+  vde_pkt_offload offload; //!< Checksum and segmentation metadata
   char data[0]; //!< Allocated memory
-} vde_pkt;
+};
 
 /**
- * @brief Initialize vde packet fields.
+ * @brief Set the pointers of a vde packet, ownership fields are untouched.
  *
- * @param pkt The packet to initialize
+ * @param pkt The packet to lay out
  * @param data The size of preallocated memory
  * @param head The size of the space before payload
  * @param tail The size of the space after payload
  */
-static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
-                                unsigned int head, unsigned int tail) {
+static inline void vde_pkt_layout(vde_pkt *pkt, unsigned int data,
+                                  unsigned int head, unsigned int tail) {
   pkt->hdr = (vde_hdr *)pkt->data;
   pkt->head = pkt->data + sizeof(vde_hdr);
   pkt->payload = pkt->head + head;
@@ -74,7 +118,90 @@ static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
 }
 
 /**
- * @brief Allocate and initialize a new vde_pkt
+ * @brief Initialize vde packet fields. The packet is not shared, the caller is
+ * its only user.
+ *
+ * @param pkt The packet to initialize
+ * @param data The size of preallocated memory
+ * @param head The size of the space before payload
+ * @param tail The size of the space after payload
+ */
+static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
+                                unsigned int head, unsigned int tail) {
+  vde_pkt_layout(pkt, data, head, tail);
+  pkt->refcount = 1;
+  pkt->release = NULL;
+  pkt->release_arg = NULL;
+  memset(&pkt->offload, 0, sizeof(vde_pkt_offload));
+}
+
+/**
+ * @brief Turn a packet into a shared one. The caller holds the only reference
+ * and will drop it with vde_pkt_put().
+ *
+ * @param pkt The packet
+ * @param release The function which gives back the packet memory
+ * @param arg The argument passed to release
+ */
+static inline void vde_pkt_set_release(vde_pkt *pkt, vde_pkt_release_cb release,
+                                       void *arg) {
+  vde_assert(release != NULL);
+
+  pkt->refcount = 1;
+  pkt->release = release;
+  pkt->release_arg = arg;
+}
+
+/**
+ * @brief Tell if a packet is shared, i.e. a reference can be kept with
+ * vde_pkt_get() instead of copying it.
+ *
+ * @param pkt The packet
+ *
+ * @return 1 if the packet is shared, 0 otherwise
+ */
+static inline int vde_pkt_is_shared(vde_pkt *pkt) {
+  return pkt->release != NULL;
+}
+
+/**
+ * @brief Take a reference to a shared packet
+ *
+ * @param pkt The packet
+ *
+ * @return The packet itself
+ */
+static inline vde_pkt *vde_pkt_get(vde_pkt *pkt) {
+  vde_assert(vde_pkt_is_shared(pkt));
+
+  __sync_add_and_fetch(&pkt->refcount, 1);
+  return pkt;
+}
+
+/**
+ * @brief Drop a reference to a shared packet, when the last one is dropped
+ * the packet is released.
+ *
+ * @param pkt The packet
+ */
+static inline void vde_pkt_put(vde_pkt *pkt) {
+  vde_assert(vde_pkt_is_shared(pkt));
+  vde_assert(pkt->refcount > 0);
+
+  if (__sync_sub_and_fetch(&pkt->refcount, 1) == 0) {
+    pkt->release(pkt, pkt->release_arg);
+  }
+}
+
+/**
+ * @brief Release callback of packets allocated by vde_pkt_new(). Unlike pool
+ * backed packets these can be released by any thread.
+ */
+void vde_pkt_free(vde_pkt *pkt, void *arg);
+
+/**
+ * @brief Allocate and initialize a new shared vde_pkt, the caller holds the
+ * only reference and must release it with vde_pkt_put().
  *
  * @param payload_sz The size of the payload
  * @param head The size of the space before payload
@@ -96,35 +223,180 @@ static inline vde_pkt *vde_pkt_new(unsigned int payload_sz, unsigned int head,
     return NULL;
   }
   vde_pkt_init(pkt, data_sz, head, tail);
+  vde_pkt_set_release(pkt, vde_pkt_free, NULL);
   return pkt;
 }
 
 /**
- * @brief Copy the content of a packet into another pre-allocated packet
+ * @brief Copy the content of a packet into another pre-allocated packet, the
+ * ownership of the destination is not changed.
  *
  * @param dst The destination of the copy, the user of this function must check
  * in advance that the destination data_size can contain the copy.
  * @param src The source of the copy
  */
 static inline void vde_pkt_cpy(vde_pkt *dst, vde_pkt *src) {
-  vde_pkt_init(dst, src->data_size,
-               src->payload - src->head,
-               src->data + src->data_size - src->tail);
+  vde_pkt_layout(dst, src->data_size,
+                 src->payload - src->head,
+                 src->data + src->data_size - src->tail);
   memcpy(&dst->data, &src->data, src->data_size);
+  dst->offload = src->offload;
 }
 
 /**
  * @brief Copy the content of a packet into another pre-allocated packet. Does
- * not keep head/tail space
+ * not keep head/tail space, the ownership of the destination is not changed.
  *
  * @param dst The destination of the copy, the user of this function must check
- * in advance that the destination data_size can contain the copy.
+ * in advance that the destination can contain the header and the payload.
  * @param src The source of the copy
  */
 static inline void vde_pkt_compact_cpy(vde_pkt *dst, vde_pkt *src) {
-  vde_pkt_init(dst, src->data_size, 0, 0);
+  vde_pkt_layout(dst, sizeof(vde_hdr) + src->hdr->pkt_len, 0, 0);
   memcpy(dst->hdr, src->hdr, sizeof(vde_hdr));
   memcpy(dst->payload, src->payload, src->hdr->pkt_len);
+  dst->offload = src->offload;
+}
+
+/**
+ * @brief Get a packet which can be modified (copy-on-write). An engine must
+ * call this function before changing a packet it has received, because other
+ * connections might be holding a reference to the same memory.
+ *
+ * @param pkt The packet to modify
+ *
+ * @return The packet itself if nobody else references it, otherwise a new
+ * private copy which the caller must release with vde_pkt_put(). NULL on error
+ * (and errno is set appropriately)
+ */
+static inline vde_pkt *vde_pkt_make_writable(vde_pkt *pkt) {
+  vde_pkt *copy;
+
+  if (pkt->refcount == 1) {
+    return pkt;
+  }
+  copy = vde_pkt_new(pkt->data_size - sizeof(vde_hdr), 0, 0);
+  if (copy == NULL) {
+    return NULL;
+  }
+  vde_pkt_cpy(copy, pkt);
+  return copy;
+}
+
+/**
+ * @brief Tell if a packet needs segmentation before leaving through a
+ * transport which does not handle offloads.
+ *
+ * @param pkt The packet
+ *
+ * @return 1 if the packet is larger than a frame, 0 otherwise
+ */
+static inline int vde_pkt_needs_gso(vde_pkt *pkt) {
+  return (pkt->offload.gso_type & ~VDE_PKT_GSO_ECN) != VDE_PKT_GSO_NONE;
+}
+
+/**
+ * @brief Hash the addresses of an ethernet frame, frames of the same flow get
+ * the same hash. Used by transports with several queues to keep flows in
+ * order.
+ *
+ * @param pkt The packet
+ *
+ * @return The hash of IPv4/IPv6 addresses, or of ethernet addresses for other
+ * protocols. Ports are left out to keep fragments together.
+ */
+static inline uint32_t vde_pkt_flow_hash(vde_pkt *pkt) {
+  unsigned char *frame = (unsigned char *)pkt->payload;
+  unsigned char *l3 = frame + sizeof(struct eth_hdr);
+  unsigned int i, start, end, l3_len;
+  uint32_t hash = 2166136261u; // FNV-1a
+
+  if (pkt->hdr->pkt_len < sizeof(struct eth_hdr)) {
+    return 0;
+  }
+  l3_len = pkt->hdr->pkt_len - sizeof(struct eth_hdr);
+  if (frame[12] == 0x08 && frame[13] == 0x00 && l3_len >= 20) {
+    start = 12;
+    end = 20;
+  } else if (frame[12] == 0x86 && frame[13] == 0xdd && l3_len >= 40) {
+    start = 8;
+    end = 40;
+  } else {
+    l3 = frame;
+    start = 0;
+    end = 2 * ETH_ALEN;
+  }
+  for (i = start; i < end; i++) {
+    hash = (hash ^ l3[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Complete the partial checksum of a frame in software, for transports
+ * which do not handle offloads. The frame must not be shared with anyone.
+ *
+ * @param offload The offload metadata of the frame, VDE_PKT_CSUM_PARTIAL is
+ * replaced by VDE_PKT_CSUM_VALID
+ * @param frame The frame
+ * @param len The length of the frame
+ *
+ * @return zero on success, -1 if the offsets are out of the frame (and errno
+ * is set to EINVAL)
+ */
+int vde_pkt_csum_complete(vde_pkt_offload *offload, void *frame,
+                          unsigned int len);
+
+/**
+ * @brief Maximum number of packets in a batch
+ */
+#define VDE_PKT_BATCH_MAX 32
+
+/**
+ * @brief A burst of packets delivered with a single call. The batch does not
+ * own the packets, it is only a vector of pointers.
+ */
+typedef struct {
+  unsigned int len; //!< Number of packets in pkts
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX]; //!< The packets
+} vde_pkt_batch;
+
+/**
+ * @brief Empty a batch
+ *
+ * @param batch The batch to initialize
+ */
+static inline void vde_pkt_batch_init(vde_pkt_batch *batch) {
+  batch->len = 0;
+}
+
+/**
+ * @brief Tell if a batch is full
+ *
+ * @param batch The batch
+ *
+ * @return 1 if no more packets can be added, 0 otherwise
+ */
+static inline int vde_pkt_batch_full(vde_pkt_batch *batch) {
+  return batch->len == VDE_PKT_BATCH_MAX;
+}
+
+/**
+ * @brief Append a packet to a batch
+ *
+ * @param batch The batch
+ * @param pkt The packet to append
+ *
+ * @return zero on success, -1 if the batch is full (and errno is set to
+ * ENOBUFS)
+ */
+static inline int vde_pkt_batch_add(vde_pkt_batch *batch, vde_pkt *pkt) {
+  if (vde_pkt_batch_full(batch)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  batch->pkts[batch->len++] = pkt;
+  return 0;
 }
 
 // When a packet is read from the network by a connection the payload always
@@ -132,6 +404,8 @@ static inline void vde_pkt_compact_cpy(vde_pkt *dst, vde_pkt *src) {
 // If a connection implementation does not handle generic vde data but specific
 // payload types (e.g.: vde2-compatibile transport or tap transport) it will
 // populate the header of a new packet.
+// Transports which understand offloads (tap) fill pkt->offload, the others
+// complete partial checksums and drop frames needing segmentation.
 
 // An engine/connection_manager can instruct the connection to pre-allocate
 // additional memory around the payload for further elaboration:
@@ -0,0 +1,103 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file
+ */
+
+#ifndef __VDE3_POOL_H__
+#define __VDE3_POOL_H__
+
+#include <vde3/common.h>
+
+/**
+ * @brief VDE 3 object pool
+ *
+ * A pool hands out fixed-size objects carved from slabs which are allocated
+ * on demand and kept until the pool is deleted, so that once the pool has
+ * grown to its working size allocations and frees never reach the heap.
+ *
+ * Objects are allocated only by the pool owner, but they can be returned by
+ * anyone: freed objects are pushed on a lock-free list which the owner takes
+ * over as a whole when it runs out of objects.
+ *
+ */
+typedef struct vde_pool vde_pool;
+
+/**
+ * @brief Statistics of a pool
+ */
+typedef struct {
+  unsigned int slabs; //!< Number of slabs allocated
+  unsigned int objects; //!< Number of objects carved from slabs
+  unsigned int in_use; //!< Number of objects currently allocated
+  unsigned int peak; //!< Highest number of objects allocated at once
+  unsigned long allocs; //!< Number of successful allocations
+  unsigned long frees; //!< Number of objects returned to the pool
+  unsigned long failures; //!< Number of allocations over the high watermark
+} vde_pool_stats;
+
+/**
+ * @brief Alloc a new pool
+ *
+ * @param obj_size The size of a single object
+ * @param slab_objs The number of objects in a slab
+ * @param low_wm The number of objects preallocated when the pool is created
+ * @param high_wm The maximum number of objects the pool can hold, 0 for
+ * unlimited
+ *
+ * @return a pool on success, NULL on error (and errno is set appropriately)
+ */
+vde_pool *vde_pool_new(size_t obj_size, unsigned int slab_objs,
+                       unsigned int low_wm, unsigned int high_wm);
+
+/**
+ * @brief Deallocate a pool and all its slabs. Objects still allocated keep the
+ * pool alive, in that case the pool is deallocated when the last one is
+ * returned.
+ *
+ * @param pool The pool to delete
+ */
+void vde_pool_delete(vde_pool *pool);
+
+/**
+ * @brief Get an object from the pool, must be called by the pool owner
+ *
+ * @param pool The pool to get the object from
+ *
+ * @return an object on success, NULL if the high watermark has been reached
+ * (and errno is set to ENOBUFS)
+ */
+void *vde_pool_alloc(vde_pool *pool);
+
+/**
+ * @brief Return an object to the pool, can be called from any thread
+ *
+ * @param pool The pool the object has been allocated from
+ * @param obj The object to return
+ */
+void vde_pool_free(vde_pool *pool, void *obj);
+
+/**
+ * @brief Get pool statistics
+ *
+ * @param pool The pool to get statistics from
+ * @param stats The structure to fill
+ */
+void vde_pool_get_stats(vde_pool *pool, vde_pool_stats *stats);
+
+#endif /* __VDE3_POOL_H__ */
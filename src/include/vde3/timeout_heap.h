@@ -0,0 +1,110 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file
+ */
+
+#ifndef __VDE3_TIMEOUT_HEAP_H__
+#define __VDE3_TIMEOUT_HEAP_H__
+
+#include <vde3/common.h>
+
+/**
+ * @brief A timeout kept in a vde_timeout_heap
+ *
+ * The timeout is embedded in the record of the event loop which owns it, the
+ * heap only orders the timeouts by deadline.
+ */
+typedef struct {
+  unsigned long long deadline; // microseconds, CLOCK_MONOTONIC
+  int idx; // position in the heap, -1 if not in it
+  void *data; // the owner of the timeout
+} vde_timeout;
+
+/**
+ * @brief A binary min-heap of timeouts, ordered by deadline
+ *
+ * A zeroed heap is empty and ready to use.
+ */
+typedef struct {
+  vde_timeout **timeouts;
+  unsigned int len;
+  unsigned int size;
+} vde_timeout_heap;
+
+/**
+ * @brief Initialize a timeout which is not in any heap
+ *
+ * @param t The timeout
+ * @param data The owner of the timeout
+ */
+static inline void vde_timeout_init(vde_timeout *t, void *data)
+{
+  t->deadline = 0;
+  t->idx = -1;
+  t->data = data;
+}
+
+/**
+ * @brief Tell whether a timeout is in a heap
+ *
+ * @param t The timeout
+ *
+ * @return 1 if the timeout is in a heap, 0 otherwise
+ */
+static inline int vde_timeout_is_queued(vde_timeout *t)
+{
+  return t->idx >= 0;
+}
+
+/**
+ * @brief Insert a timeout in the heap, its deadline must be set
+ *
+ * @param heap The heap
+ * @param t The timeout, not in any heap
+ */
+void vde_timeout_heap_insert(vde_timeout_heap *heap, vde_timeout *t);
+
+/**
+ * @brief Remove a timeout from the heap
+ *
+ * @param heap The heap
+ * @param t The timeout, in the heap
+ */
+void vde_timeout_heap_remove(vde_timeout_heap *heap, vde_timeout *t);
+
+/**
+ * @brief Get the timeout with the earliest deadline
+ *
+ * @param heap The heap
+ *
+ * @return The first timeout, NULL if the heap is empty
+ */
+static inline vde_timeout *vde_timeout_heap_first(vde_timeout_heap *heap)
+{
+  return heap->len > 0 ? heap->timeouts[0] : NULL;
+}
+
+/**
+ * @brief Release the memory used by the heap, which must be empty
+ *
+ * @param heap The heap
+ */
+void vde_timeout_heap_fini(vde_timeout_heap *heap);
+
+#endif /* __VDE3_TIMEOUT_HEAP_H__ */
@@ -0,0 +1,112 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_TIMER_H__
+#define __VDE3_TIMER_H__
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+
+/**
+ * @brief VDE 3 timer wheel
+ *
+ * A hierarchical timer wheel with a resolution of one millisecond. Arming and
+ * cancelling a timer are O(1) and timers expiring in the same tick are run in
+ * a batch. The wheel needs a single timeout from the event handler, armed only
+ * while there are timers pending.
+ */
+typedef struct vde_timer_wheel vde_timer_wheel;
+
+/**
+ * @brief A timer of a timer wheel
+ *
+ * Timers are allocated from a pool once and can then be armed and cancelled
+ * any number of times.
+ */
+typedef struct vde_timer vde_timer;
+
+/**
+ * @brief Alloc a new timer wheel
+ *
+ * @param handler The event handler used to wake up the wheel, it is copied
+ *
+ * @return a timer wheel on success, NULL on error (and errno is set
+ * appropriately)
+ */
+vde_timer_wheel *vde_timer_wheel_new(vde_event_handler *handler);
+
+/**
+ * @brief Deallocate a timer wheel, its timers must have been deleted already
+ *
+ * @param tw The timer wheel to delete
+ */
+void vde_timer_wheel_delete(vde_timer_wheel *tw);
+
+/**
+ * @brief Alloc a new timer, not armed
+ *
+ * @param tw The timer wheel
+ * @param cb The function to call when the timer expires, it receives -1 as fd
+ * and VDE_EV_TIMEOUT as events
+ * @param arg The argument to pass to the callback
+ *
+ * @return a timer on success, NULL on error (and errno is set appropriately)
+ */
+vde_timer *vde_timer_new(vde_timer_wheel *tw, event_cb cb, void *arg);
+
+/**
+ * @brief Cancel and deallocate a timer, it can be called inside the timer
+ * callback
+ *
+ * @param timer The timer to delete
+ */
+void vde_timer_delete(vde_timer *timer);
+
+/**
+ * @brief Arm a timer, re-arming it if already armed
+ *
+ * @param timer The timer to arm
+ * @param timeout The time after which the timer expires
+ * @param events VDE_EV_PERSIST to re-arm the timer every timeout, zero
+ * otherwise
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_timer_arm(vde_timer *timer, const struct timeval *timeout,
+                  short events);
+
+/**
+ * @brief Cancel a timer, nothing happens if it is not armed
+ *
+ * @param timer The timer to cancel
+ */
+void vde_timer_cancel(vde_timer *timer);
+
+/**
+ * @brief Tell if a timer is armed
+ *
+ * @param timer The timer
+ *
+ * @return 1 if the timer is going to expire, 0 otherwise
+ */
+int vde_timer_is_armed(vde_timer *timer);
+
+#endif /* __VDE3_TIMER_H__ */
@@ -65,9 +65,12 @@ int vde_transport_listen(vde_component *transport);
  * @brief Connect using the given transport
  *
  * @param transport The transport
- * @param conn The connection to use
+ * @param conn The connection to use, the transport initializes it once
+ * connected
  *
- * @return zero on success, -1 on error (and errno is set appropriately)
+ * @return zero if the connection is being set up, the outcome is reported by
+ * the connection manager connect or error callback. -1 on error (and errno is
+ * set appropriately), conn is left untouched.
  */
 int vde_transport_connect(vde_component *transport, vde_connection *conn);
 
@@ -111,7 +114,8 @@ void vde_transport_call_cm_accept_cb(vde_component *transport,
  *
  * @param transport The calling transport
  * @param conn The connection which was being created when error occurred (can
- * be NULL)
+ * be NULL). The transport has released everything it allocated for it, the
+ * connection manager deletes it.
  * @param tr_errno The errno value
  */
 void vde_transport_call_cm_error_cb(vde_component *transport,
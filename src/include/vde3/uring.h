@@ -0,0 +1,144 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file
+ */
+
+#ifndef __VDE3_URING_H__
+#define __VDE3_URING_H__
+
+#include <sys/socket.h>
+
+#include <vde3.h>
+#include <vde3/packet.h>
+
+/**
+ * @brief I/O on a socket through the io_uring loop of the calling thread
+ *
+ * Besides readiness callbacks, uring_eh lets components submit their I/O to
+ * the ring: received datagrams and send completions are reported by callbacks
+ * and all the requests of a loop iteration, from every component, travel in
+ * the same io_uring_enter(). The socket is registered as a fixed file when
+ * possible.
+ *
+ * An I/O object must be used only by the thread which created it.
+ */
+typedef struct vde_uring_io vde_uring_io;
+
+/**
+ * @brief Called for each datagram received
+ *
+ * @param io The I/O object
+ * @param data The payload, valid only until the callback returns
+ * @param len The payload length
+ * @param name The address of the sender
+ * @param namelen The length of name
+ * @param arg The argument given to vde_uring_io_new()
+ */
+typedef void (*vde_uring_recv_cb)(vde_uring_io *io, void *data,
+                                  unsigned int len, struct sockaddr *name,
+                                  socklen_t namelen, void *arg);
+
+/**
+ * @brief Called once per loop iteration after the datagrams of the iteration
+ * have been passed to vde_uring_recv_cb
+ *
+ * @param io The I/O object
+ * @param arg The argument given to vde_uring_io_new()
+ */
+typedef void (*vde_uring_flush_cb)(vde_uring_io *io, void *arg);
+
+/**
+ * @brief Called when a send completes
+ *
+ * @param io The I/O object
+ * @param pkt The packet sent
+ * @param res The bytes sent or a negated errno, -ECANCELED if a previous
+ * packet of the same vde_uring_io_sendv() failed
+ * @param arg The argument given to vde_uring_io_new()
+ */
+typedef void (*vde_uring_send_cb)(vde_uring_io *io, vde_pkt *pkt, int res,
+                                  void *arg);
+
+/**
+ * @brief Tell if I/O objects can be used by components of a context
+ *
+ * @param ctx The context
+ *
+ * @return 1 if ctx runs on uring_eh in the calling thread, 0 otherwise
+ */
+int vde_uring_io_available(vde_context *ctx);
+
+/**
+ * @brief Alloc a new I/O object on a socket
+ *
+ * @param fd The socket, it can be closed once the I/O object is deleted
+ * @param arg The argument passed to callbacks
+ *
+ * @return the I/O object on success, NULL on error (and errno is set
+ * appropriately)
+ */
+vde_uring_io *vde_uring_io_new(int fd, void *arg);
+
+/**
+ * @brief Delete an I/O object
+ *
+ * Requests in flight are cancelled or left to complete, in any case no
+ * callback is called anymore.
+ *
+ * @param io The I/O object
+ */
+void vde_uring_io_delete(vde_uring_io *io);
+
+/**
+ * @brief Start receiving datagrams with a multishot request, into a ring of
+ * buffers provided to the kernel
+ *
+ * @param io The I/O object
+ * @param size The largest payload received
+ * @param nbufs The number of buffers, rounded up to a power of 2
+ * @param recv_cb The function called for each datagram
+ * @param flush_cb The function called at the end of the loop iteration,
+ * can be NULL
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_uring_io_recv(vde_uring_io *io, unsigned int size, unsigned int nbufs,
+                      vde_uring_recv_cb recv_cb, vde_uring_flush_cb flush_cb);
+
+/**
+ * @brief Send packets as datagrams, in order
+ *
+ * The sends are linked: if one fails the following complete with
+ * -ECANCELED. A reference is held on each packet until its callback has been
+ * called, so they must be shared.
+ *
+ * @param io The I/O object
+ * @param pkts The packets
+ * @param n The number of packets, at most VDE_PKT_BATCH_MAX
+ * @param to The destination address, can be NULL for connected sockets
+ * @param tolen The length of to
+ * @param cb The function called for each packet
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_uring_io_sendv(vde_uring_io *io, vde_pkt **pkts, unsigned int n,
+                       const struct sockaddr *to, socklen_t tolen,
+                       vde_uring_send_cb cb);
+
+#endif /* __VDE3_URING_H__ */
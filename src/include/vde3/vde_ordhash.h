@@ -31,16 +31,21 @@
  * track of elements' insertion time. The provided iterator is guaranteed to
  * start from the oldest element and end to the most recent one.
  *
+ * Elements are stored contiguously in insertion order and found through an
+ * open-addressing index, so lookup, insertion and removal are O(1).
+ *
  */
 typedef struct vde_ordhash vde_ordhash;
 
 /**
  * @brief VDE 3 ordered hash entry
  *
- * An element handled by ordhash iterator.
+ * An element handled by ordhash iterator. Entries stay valid when other
+ * elements are removed but an insertion might move them, so don't insert
+ * elements while iterating.
  *
  */
-typedef vde_list vde_ordhash_entry;
+typedef struct vde_ordhash_entry vde_ordhash_entry;
 
 
 /**
@@ -0,0 +1,89 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_WORKER_H__
+#define __VDE3_WORKER_H__
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/timer.h>
+
+/**
+ * @brief A context worker
+ *
+ * A worker is a thread running its own event loop. Components pin objects
+ * (usually connections) to a worker by registering their events from a
+ * function run in the worker with vde_context_worker_call(): the event handler
+ * keeps a loop per thread, so those events are dispatched by the worker.
+ * Objects pinned to a worker must be handled only from that worker.
+ */
+typedef struct vde_worker vde_worker;
+
+/**
+ * @brief Start workers
+ *
+ * @param ctx The context
+ * @param handler The event handler of the context, it must keep a separate
+ * loop per thread
+ * @param nworkers The number of workers to start
+ *
+ * @return an array of nworkers workers on success, NULL on error (and errno is
+ * set appropriately)
+ */
+vde_worker **vde_workers_start(vde_context *ctx, vde_event_handler *handler,
+                               unsigned int nworkers);
+
+/**
+ * @brief Stop workers, waiting for their threads to exit
+ *
+ * @param workers The workers, as returned by vde_workers_start()
+ * @param nworkers The number of workers
+ */
+void vde_workers_stop(vde_worker **workers, unsigned int nworkers);
+
+/**
+ * @brief Run a function in a worker
+ *
+ * @param worker The worker
+ * @param fn The function
+ * @param arg The argument to pass to fn
+ * @param wait If not zero wait for fn to return
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_worker_call(vde_worker *worker, void (*fn)(void *), void *arg,
+                    int wait);
+
+/**
+ * @brief Get the timer wheel of the calling thread if it is a worker
+ *
+ * @return The timer wheel, NULL if not called from a worker
+ */
+vde_timer_wheel *vde_worker_current_timers(void);
+
+/**
+ * @brief Get the index of the calling worker
+ *
+ * @return The index of the worker, -1 if not called from a worker
+ */
+int vde_worker_current(void);
+
+#endif /* __VDE3_WORKER_H__ */
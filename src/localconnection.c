@@ -15,9 +15,15 @@
  *
  */
 
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include <vde3/localconnection.h>
 
 #include <vde3/common.h>
+#include <vde3/context.h>
 #include <vde3/engine.h>
 
 /*
@@ -36,11 +42,13 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
   int tmp_errno;
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer == NULL) {
+    errno = EPIPE;
     return -1;
   }
+  peer_conn = peer->conn;
   if (vde_connection_call_read(peer_conn, pkt)) {
     tmp_errno = errno;
     if (errno == EPIPE) {
@@ -53,13 +61,36 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
   return 0;
 }
 
+int vde_lc_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  int tmp_errno;
+  vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
+  vde_lc *peer = lc->peer;
+
+  if (peer == NULL) {
+    errno = EPIPE;
+    return 0;
+  }
+  if (vde_connection_call_read_batch(peer->conn, batch)) {
+    tmp_errno = errno;
+    if (errno == EPIPE) {
+      vde_connection_fini(peer->conn);
+      vde_connection_delete(peer->conn);
+    }
+    errno = tmp_errno;
+    return 0;
+  }
+  return batch->len;
+}
+
 void vde_lc_close(vde_connection *conn)
 {
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer != NULL) {
+    peer_conn = peer->conn;
     peer->peer = NULL; // detach from peer to avoid circular close calls
     if (vde_connection_call_error(peer_conn, NULL, CONN_READ_CLOSED) &&
         (errno == EPIPE)) {
@@ -113,6 +144,8 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
 
   vde_connection_init(c1, ctx, 0, &vde_lc_write, &vde_lc_close, (void *)lc1);
   vde_connection_init(c2, ctx, 0, &vde_lc_write, &vde_lc_close, (void *)lc2);
+  vde_connection_set_be_write_batch(c1, &vde_lc_write_batch);
+  vde_connection_set_be_write_batch(c2, &vde_lc_write_batch);
 
   if (vde_engine_new_connection(engine1, c1, req1) != 0) {
     vde_error("%s: cannot connect to first engine");
@@ -144,3 +177,740 @@ err_out:
   return -1;
 }
 
+
+/*
+ * Queued Local Connection
+ * Packets written on a connection are put in a bounded queue and delivered to
+ * the peer in bursts by a zero timeout, the write callback is called once the
+ * peer has read them.
+ *
+ */
+
+#define QLC_DEFAULT_QLEN 1024
+#define QLC_DEFAULT_BUDGET 64
+
+typedef struct __vde_qlc {
+  vde_connection *conn;
+  struct __vde_qlc *peer;
+  // packets written on conn, waiting to be read by the peer
+  vde_ring *queue;
+  unsigned int budget; // max packets delivered by a single drain
+  void *drain_timeout;
+} vde_qlc;
+
+static void vde_qlc_drain(int fd, short events, void *arg);
+
+static int vde_qlc_schedule_drain(vde_qlc *qlc)
+{
+  struct timeval now = { 0, 0 };
+
+  if (qlc->drain_timeout != NULL) {
+    return 0;
+  }
+  qlc->drain_timeout = vde_context_timeout_add(
+                         vde_connection_get_context(qlc->conn), 0, &now,
+                         &vde_qlc_drain, (void *)qlc);
+  if (qlc->drain_timeout == NULL) {
+    vde_error("%s: cannot schedule queue drain", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Close a local connection from inside a drain, the connection must not
+ * be used afterwards
+ */
+static void vde_qlc_conn_close(vde_connection *conn)
+{
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
+}
+
+static void vde_qlc_drain(int fd, short events, void *arg)
+{
+  vde_pkt_batch batch;
+  unsigned int i, delivered = 0;
+  int cb_errno = 0;
+  vde_qlc *qlc = (vde_qlc *)arg;
+  vde_connection *conn = qlc->conn;
+  vde_connection *peer_conn;
+
+  // one-shot timeouts are released by timeout_del after they fire
+  vde_context_timeout_del(vde_connection_get_context(conn),
+                          qlc->drain_timeout);
+  qlc->drain_timeout = NULL;
+
+  while (!vde_ring_is_empty(qlc->queue) && delivered < qlc->budget) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_full(&batch) && delivered + batch.len < qlc->budget &&
+           batch.len < vde_ring_get_length(qlc->queue)) {
+      vde_pkt_batch_add(&batch, vde_ring_peek_nth(qlc->queue, batch.len));
+    }
+    vde_ring_discard(qlc->queue, batch.len);
+    delivered += batch.len;
+
+    if (qlc->peer == NULL) {
+      // the peer is gone, drop what's left
+      for (i = 0; i < batch.len; i++) {
+        vde_pkt_put(batch.pkts[i]);
+      }
+      continue;
+    }
+
+    peer_conn = qlc->peer->conn;
+    if (vde_connection_call_read_batch(peer_conn, &batch)) {
+      if (errno == EPIPE) {
+        for (i = 0; i < batch.len; i++) {
+          vde_pkt_put(batch.pkts[i]);
+        }
+        // closing the peer might close this side too and free qlc
+        vde_qlc_conn_close(peer_conn);
+        return;
+      }
+      // the peer refused the packets but it's still alive
+      for (i = 0; i < batch.len; i++) {
+        if (cb_errno != EPIPE &&
+            vde_connection_call_error(conn, batch.pkts[i], CONN_WRITE_DELAY)) {
+          cb_errno = errno;
+        }
+        vde_pkt_put(batch.pkts[i]);
+      }
+    } else {
+      for (i = 0; i < batch.len; i++) {
+        if (cb_errno != EPIPE &&
+            vde_connection_call_write(conn, batch.pkts[i])) {
+          cb_errno = errno;
+        }
+        vde_pkt_put(batch.pkts[i]);
+      }
+    }
+    if (cb_errno == EPIPE) {
+      vde_qlc_conn_close(conn);
+      return;
+    }
+  }
+
+  if (!vde_ring_is_empty(qlc->queue)) {
+    // budget exhausted, let the event loop run other callbacks
+    vde_qlc_schedule_drain(qlc);
+  }
+}
+
+/**
+ * @brief Put a packet in the queue of a local connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde_qlc_enqueue(vde_qlc *qlc, vde_pkt *pkt)
+{
+  vde_pkt *copy;
+
+  if (qlc->peer == NULL) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (vde_ring_check_push(qlc->queue)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (vde_pkt_is_shared(pkt)) {
+    vde_ring_push(qlc->queue, vde_pkt_get(pkt));
+    return 0;
+  }
+
+  // XXX: consider a packet pool, the size of packets is not bounded here
+  copy = vde_pkt_new(pkt->data_size - sizeof(vde_hdr), 0, 0);
+  if (copy == NULL) {
+    return -1;
+  }
+  vde_pkt_cpy(copy, pkt);
+  vde_ring_push(qlc->queue, copy);
+  return 0;
+}
+
+int vde_qlc_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde_qlc *qlc = (vde_qlc *)vde_connection_get_priv(conn);
+
+  if (vde_qlc_enqueue(qlc, pkt)) {
+    return -1;
+  }
+  // the packet is queued already, the next write will retry the schedule
+  vde_qlc_schedule_drain(qlc);
+  return 0;
+}
+
+int vde_qlc_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  vde_qlc *qlc = (vde_qlc *)vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (vde_qlc_enqueue(qlc, batch->pkts[i])) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    vde_qlc_schedule_drain(qlc);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+void vde_qlc_queue_stats(vde_connection *conn, vde_conn_queue_stats *stats)
+{
+  vde_qlc *qlc = (vde_qlc *)vde_connection_get_priv(conn);
+
+  vde_connection_ring_stats(qlc->queue, stats);
+}
+
+void vde_qlc_close(vde_connection *conn)
+{
+  vde_pkt *pkt;
+  vde_qlc *qlc = (vde_qlc *)vde_connection_get_priv(conn);
+  vde_qlc *peer = qlc->peer;
+  vde_connection *peer_conn;
+
+  if (qlc->drain_timeout != NULL) {
+    vde_context_timeout_del(vde_connection_get_context(conn),
+                            qlc->drain_timeout);
+  }
+  while ((pkt = vde_ring_pop(qlc->queue)) != NULL) {
+    vde_pkt_put(pkt);
+  }
+  vde_ring_delete(qlc->queue);
+
+  if (peer != NULL) {
+    peer->peer = NULL; // detach from peer to avoid circular close calls
+    // closing the peer connection frees peer
+    peer_conn = peer->conn;
+    if (vde_connection_call_error(peer_conn, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+        vde_connection_fini(peer_conn);
+        vde_connection_delete(peer_conn);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+  }
+
+  vde_free(qlc);
+}
+
+static vde_qlc *vde_qlc_new(unsigned int qlen, unsigned int budget)
+{
+  vde_qlc *qlc;
+
+  qlc = (vde_qlc *)vde_calloc(sizeof(vde_qlc));
+  if (qlc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  qlc->queue = vde_ring_new(qlen);
+  if (qlc->queue == NULL) {
+    vde_free(qlc);
+    return NULL;
+  }
+  qlc->budget = budget;
+  return qlc;
+}
+
+int vde_connect_engines_queued(vde_context *ctx, vde_component *engine1,
+                               vde_request *req1, vde_component *engine2,
+                               vde_request *req2, unsigned int qlen,
+                               unsigned int budget)
+{
+  int tmp_errno;
+  vde_connection *c1, *c2;
+  vde_qlc *qlc1, *qlc2;
+
+  vde_assert(ctx != NULL);
+  vde_assert(engine1 != NULL);
+  vde_assert(engine2 != NULL);
+
+  if (qlen == 0) {
+    qlen = QLC_DEFAULT_QLEN;
+  }
+  if (budget == 0) {
+    budget = QLC_DEFAULT_BUDGET;
+  }
+
+  qlc1 = vde_qlc_new(qlen, budget);
+  if (qlc1 == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    goto err_out;
+  }
+  qlc2 = vde_qlc_new(qlen, budget);
+  if (qlc2 == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    goto err_qlc1;
+  }
+
+  if (vde_connection_new(&c1)) {
+    tmp_errno = errno;
+    goto err_qlc2;
+  }
+  if (vde_connection_new(&c2)) {
+    tmp_errno = errno;
+    vde_connection_delete(c1);
+    goto err_qlc2;
+  }
+
+  qlc1->conn = c1;
+  qlc2->conn = c2;
+
+  qlc1->peer = qlc2;
+  qlc2->peer = qlc1;
+
+  vde_connection_init(c1, ctx, 0, &vde_qlc_write, &vde_qlc_close,
+                      (void *)qlc1);
+  vde_connection_init(c2, ctx, 0, &vde_qlc_write, &vde_qlc_close,
+                      (void *)qlc2);
+  vde_connection_set_be_write_batch(c1, &vde_qlc_write_batch);
+  vde_connection_set_be_write_batch(c2, &vde_qlc_write_batch);
+  vde_connection_set_be_queue_stats(c1, &vde_qlc_queue_stats);
+  vde_connection_set_be_queue_stats(c2, &vde_qlc_queue_stats);
+
+  if (vde_engine_new_connection(engine1, c1, req1) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to first engine", __PRETTY_FUNCTION__);
+    vde_connection_delete(c2);
+    vde_connection_delete(c1);
+    goto err_qlc2;
+  }
+  if (vde_engine_new_connection(engine2, c2, req2) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to second engine", __PRETTY_FUNCTION__);
+    vde_connection_delete(c2);
+    // c1 has been taken by the first engine, which closes it and frees qlc1
+    vde_ring_delete(qlc2->queue);
+    vde_free(qlc2);
+    qlc1->peer = NULL;
+    if (vde_connection_call_error(c1, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(c1);
+      vde_connection_delete(c1);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+    goto err_out;
+  }
+
+  return 0;
+
+err_qlc2:
+  vde_ring_delete(qlc2->queue);
+  vde_free(qlc2);
+err_qlc1:
+  vde_ring_delete(qlc1->queue);
+  vde_free(qlc1);
+err_out:
+  errno = tmp_errno;
+  return -1;
+}
+
+
+/*
+ * Threaded Local Connection
+ * The two peers are served by different threads (workers or the context
+ * thread). Each direction is a lock-free ring with one producer and one
+ * consumer, a reader waiting for packets sleeps on an eventfd doorbell which
+ * the writer rings only when the reader is idle, so a burst of packets costs a
+ * single wakeup. Only packets which can be released by any thread cross the
+ * rings by reference, the others are copied.
+ *
+ */
+
+#define TLC_DEFAULT_QLEN 1024
+#define TLC_BUDGET 64
+
+typedef struct __vde_tlc_link vde_tlc_link;
+
+typedef struct __vde_tlc {
+  vde_connection *conn;
+  vde_tlc_link *link;
+  struct __vde_tlc *peer; // valid until the link is released
+  int worker; // -1 for the context thread
+  // packets written by the peer, consumed by this side
+  vde_ring *rx;
+  int doorbell; // eventfd rung by the peer
+  void *doorbell_ev;
+  int idle; // waiting for the doorbell, written by both threads
+  int closed; // written once by this side, read by the peer
+} vde_tlc;
+
+struct __vde_tlc_link {
+  vde_tlc side[2];
+  int refcount; // one per side still open
+};
+
+static void vde_tlc_link_put(vde_tlc_link *link)
+{
+  int i;
+  vde_pkt *pkt;
+
+  if (__sync_sub_and_fetch(&link->refcount, 1) != 0) {
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    if (link->side[i].rx != NULL) {
+      while ((pkt = vde_ring_pop(link->side[i].rx)) != NULL) {
+        vde_pkt_put(pkt);
+      }
+      vde_ring_delete(link->side[i].rx);
+    }
+    if (link->side[i].doorbell >= 0) {
+      close(link->side[i].doorbell);
+    }
+  }
+  vde_free(link);
+}
+
+static void vde_tlc_ring(vde_tlc *tlc)
+{
+  uint64_t one = 1;
+
+  if (write(tlc->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot ring doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+}
+
+/**
+ * @brief Wake up the reader of a side if it is waiting for packets
+ */
+static void vde_tlc_wakeup(vde_tlc *tlc)
+{
+  // packets must be visible before idle is checked, pairs with vde_tlc_sleep()
+  __sync_synchronize();
+  if (tlc->idle && __sync_bool_compare_and_swap(&tlc->idle, 1, 0)) {
+    vde_tlc_ring(tlc);
+  }
+}
+
+/**
+ * @brief Wait for the doorbell, unless packets arrived in the meantime
+ */
+static void vde_tlc_sleep(vde_tlc *tlc)
+{
+  tlc->idle = 1;
+  __sync_synchronize();
+  if (!vde_ring_is_empty(tlc->rx) &&
+      __sync_bool_compare_and_swap(&tlc->idle, 1, 0)) {
+    vde_tlc_ring(tlc);
+  }
+}
+
+/**
+ * @brief Stop serving a side and drop its reference to the link, called from
+ * the thread of the side
+ */
+static void vde_tlc_detach(vde_tlc *tlc)
+{
+  vde_tlc *peer = tlc->peer;
+
+  if (tlc->doorbell_ev != NULL) {
+    vde_context_event_del(vde_connection_get_context(tlc->conn),
+                          tlc->doorbell_ev);
+    tlc->doorbell_ev = NULL;
+  }
+  tlc->closed = 1;
+  __sync_synchronize();
+  // the peer notices the close even if it is busy
+  vde_tlc_ring(peer);
+  vde_tlc_link_put(tlc->link);
+}
+
+static void vde_tlc_read_event(int fd, short events, void *arg)
+{
+  uint64_t count;
+  vde_pkt_batch batch;
+  unsigned int i, delivered = 0;
+  vde_tlc *tlc = (vde_tlc *)arg;
+  vde_connection *conn = tlc->conn;
+
+  if (read(tlc->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot read doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+
+  while (!vde_ring_is_empty(tlc->rx) && delivered < TLC_BUDGET) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_full(&batch) && delivered + batch.len < TLC_BUDGET &&
+           batch.len < vde_ring_get_length(tlc->rx)) {
+      vde_pkt_batch_add(&batch, vde_ring_peek_nth(tlc->rx, batch.len));
+    }
+    vde_ring_discard(tlc->rx, batch.len);
+    delivered += batch.len;
+
+    // packets refused by the engine are dropped, the writer has already been
+    // told they were sent
+    if (vde_connection_call_read_batch(conn, &batch) && errno == EPIPE) {
+      for (i = 0; i < batch.len; i++) {
+        vde_pkt_put(batch.pkts[i]);
+      }
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return;
+    }
+    for (i = 0; i < batch.len; i++) {
+      vde_pkt_put(batch.pkts[i]);
+    }
+  }
+
+  if (!vde_ring_is_empty(tlc->rx)) {
+    // budget exhausted, come back after other events
+    vde_tlc_ring(tlc);
+    return;
+  }
+  vde_tlc_sleep(tlc);
+
+  if (tlc->peer->closed) {
+    if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+  }
+}
+
+/**
+ * @brief Put a packet in the ring of the peer, without waking it up
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde_tlc_enqueue(vde_tlc *tlc, vde_pkt *pkt)
+{
+  vde_pkt *copy;
+  vde_tlc *peer = tlc->peer;
+
+  if (peer->closed) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (vde_ring_check_push(peer->rx)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  // the last reference might be dropped by the peer thread
+  if (vde_pkt_is_shared(pkt) && pkt->release == &vde_pkt_free) {
+    vde_ring_push(peer->rx, vde_pkt_get(pkt));
+    return 0;
+  }
+
+  copy = vde_pkt_new(pkt->data_size - sizeof(vde_hdr), 0, 0);
+  if (copy == NULL) {
+    return -1;
+  }
+  vde_pkt_cpy(copy, pkt);
+  vde_ring_push(peer->rx, copy);
+  return 0;
+}
+
+int vde_tlc_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde_tlc *tlc = (vde_tlc *)vde_connection_get_priv(conn);
+
+  if (vde_tlc_enqueue(tlc, pkt)) {
+    return -1;
+  }
+  vde_tlc_wakeup(tlc->peer);
+  return 0;
+}
+
+int vde_tlc_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  vde_tlc *tlc = (vde_tlc *)vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (vde_tlc_enqueue(tlc, batch->pkts[i])) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    vde_tlc_wakeup(tlc->peer);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+void vde_tlc_queue_stats(vde_connection *conn, vde_conn_queue_stats *stats)
+{
+  vde_tlc *tlc = (vde_tlc *)vde_connection_get_priv(conn);
+
+  // the length is a snapshot, the peer thread consumes the ring
+  vde_connection_ring_stats(tlc->peer->rx, stats);
+}
+
+void vde_tlc_close(vde_connection *conn)
+{
+  vde_tlc *tlc = (vde_tlc *)vde_connection_get_priv(conn);
+
+  vde_tlc_detach(tlc);
+}
+
+struct tlc_attach {
+  vde_tlc *tlc;
+  vde_component *engine;
+  vde_request *req;
+  int rv;
+  int tmp_errno;
+};
+
+/**
+ * @brief Give a side to its engine, run in the thread of the side
+ */
+static void vde_tlc_attach(void *arg)
+{
+  struct tlc_attach *attach = (struct tlc_attach *)arg;
+  vde_tlc *tlc = attach->tlc;
+  vde_connection *conn = tlc->conn;
+
+  attach->rv = 0;
+  tlc->doorbell_ev = vde_context_event_add(vde_connection_get_context(conn),
+                                           tlc->doorbell,
+                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                           &vde_tlc_read_event, (void *)tlc);
+  if (tlc->doorbell_ev == NULL) {
+    attach->tmp_errno = errno;
+    vde_error("%s: cannot add doorbell event", __PRETTY_FUNCTION__);
+    goto err;
+  }
+  if (vde_engine_new_connection(attach->engine, conn, attach->req) != 0) {
+    attach->tmp_errno = errno;
+    vde_error("%s: cannot connect to engine", __PRETTY_FUNCTION__);
+    goto err;
+  }
+  // packets written before the event was added
+  vde_tlc_sleep(tlc);
+  return;
+
+err:
+  // detach reads the context from the connection, delete it afterwards
+  vde_tlc_detach(tlc);
+  vde_connection_delete(conn);
+  attach->rv = -1;
+}
+
+static int vde_tlc_run_attach(vde_context *ctx, int worker,
+                              struct tlc_attach *attach)
+{
+  if (worker < 0) {
+    vde_tlc_attach(attach);
+  } else if (vde_context_worker_call(ctx, worker, &vde_tlc_attach, attach,
+                                     1)) {
+    attach->tmp_errno = errno;
+    vde_tlc_detach(attach->tlc);
+    vde_connection_delete(attach->tlc->conn);
+    return -1;
+  }
+  return attach->rv;
+}
+
+int vde_connect_engines_threaded(vde_context *ctx, vde_component *engine1,
+                                 vde_request *req1, int worker1,
+                                 vde_component *engine2, vde_request *req2,
+                                 int worker2, unsigned int qlen)
+{
+  int i, tmp_errno;
+  vde_tlc_link *link;
+  vde_tlc *tlc;
+  struct tlc_attach attach1, attach2;
+
+  vde_assert(ctx != NULL);
+  vde_assert(engine1 != NULL);
+  vde_assert(engine2 != NULL);
+
+  if (worker1 >= (int)vde_context_get_workers(ctx) ||
+      worker2 >= (int)vde_context_get_workers(ctx)) {
+    vde_error("%s: no such worker", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (qlen == 0) {
+    qlen = TLC_DEFAULT_QLEN;
+  }
+
+  link = (vde_tlc_link *)vde_calloc(sizeof(vde_tlc_link));
+  if (link == NULL) {
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  link->refcount = 2;
+  for (i = 0; i < 2; i++) {
+    link->side[i].link = link;
+    link->side[i].peer = &link->side[1 - i];
+    link->side[i].doorbell = -1;
+  }
+  link->side[0].worker = worker1;
+  link->side[1].worker = worker2;
+
+  for (i = 0; i < 2; i++) {
+    tlc = &link->side[i];
+    tlc->rx = vde_ring_new(qlen);
+    if (tlc->rx == NULL) {
+      tmp_errno = errno;
+      goto err_link;
+    }
+    tlc->doorbell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (tlc->doorbell < 0) {
+      tmp_errno = errno;
+      goto err_link;
+    }
+    if (vde_connection_new(&tlc->conn)) {
+      tmp_errno = errno;
+      goto err_link;
+    }
+    vde_connection_init(tlc->conn, ctx, 0, &vde_tlc_write, &vde_tlc_close,
+                        (void *)tlc);
+    vde_connection_set_be_write_batch(tlc->conn, &vde_tlc_write_batch);
+    vde_connection_set_be_queue_stats(tlc->conn, &vde_tlc_queue_stats);
+  }
+
+  attach1.tlc = &link->side[0];
+  attach1.engine = engine1;
+  attach1.req = req1;
+  attach2.tlc = &link->side[1];
+  attach2.engine = engine2;
+  attach2.req = req2;
+
+  if (vde_tlc_run_attach(ctx, worker1, &attach1)) {
+    tmp_errno = attach1.tmp_errno;
+    // the second side has not been given to its engine yet
+    vde_connection_delete(attach2.tlc->conn);
+    vde_tlc_link_put(link);
+    errno = tmp_errno;
+    return -1;
+  }
+  if (vde_tlc_run_attach(ctx, worker2, &attach2)) {
+    // the first engine is told by its own thread that the peer is gone
+    errno = attach2.tmp_errno;
+    return -1;
+  }
+  return 0;
+
+err_link:
+  vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+  for (i = 0; i < 2; i++) {
+    if (link->side[i].conn != NULL) {
+      vde_connection_delete(link->side[i].conn);
+    }
+  }
+  link->refcount = 1;
+  vde_tlc_link_put(link);
+  errno = tmp_errno;
+  return -1;
+}
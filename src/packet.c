@@ -0,0 +1,69 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stdint.h>
+
+#include <vde3/common.h>
+#include <vde3/packet.h>
+
+void vde_pkt_free(vde_pkt *pkt, void *arg)
+{
+  vde_free(pkt);
+}
+
+int vde_pkt_csum_complete(vde_pkt_offload *offload, void *frame,
+                          unsigned int len)
+{
+  uint8_t *data = (uint8_t *)frame;
+  uint32_t sum = 0;
+  uint16_t csum;
+  unsigned int i;
+
+  if (!(offload->flags & VDE_PKT_CSUM_PARTIAL)) {
+    return 0;
+  }
+  if (offload->csum_start >= len ||
+      offload->csum_start + offload->csum_offset + 2 > len) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // the checksum field already holds the sum of the pseudo header
+  for (i = offload->csum_start; i + 1 < len; i += 2) {
+    sum += (data[i] << 8) | data[i + 1];
+  }
+  if (i < len) {
+    sum += data[i] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  csum = ~sum;
+  // zero means no checksum for UDP, the two are the same for TCP
+  if (csum == 0) {
+    csum = 0xffff;
+  }
+
+  i = offload->csum_start + offload->csum_offset;
+  data[i] = csum >> 8;
+  data[i + 1] = csum & 0xff;
+  offload->flags = (offload->flags & ~VDE_PKT_CSUM_PARTIAL) |
+                   VDE_PKT_CSUM_VALID;
+  return 0;
+}
@@ -0,0 +1,214 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <vde3/pool.h>
+
+// objects are aligned to this boundary inside a slab
+#define POOL_ALIGN (2 * sizeof(void *))
+#define POOL_ROUND(s) (((s) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+struct pool_obj {
+  struct pool_obj *next;
+};
+
+struct pool_slab {
+  struct pool_slab *next;
+};
+
+struct vde_pool {
+  size_t obj_size;
+  unsigned int slab_objs;
+  unsigned int high_wm;
+  // objects usable by the owner without atomic operations
+  struct pool_obj *local_free;
+  // objects returned by vde_pool_free(), taken over by the owner at once
+  struct pool_obj *shared_free;
+  struct pool_slab *slabs;
+  // one reference held by the owner plus one for each allocated object
+  int refs;
+  unsigned int nslabs;
+  unsigned int nobjects;
+  unsigned int peak;
+  unsigned long allocs;
+  unsigned long failures;
+};
+
+/**
+ * @brief Allocate a new slab and put its objects in the local free list
+ *
+ * @param pool The pool to grow
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int pool_grow(vde_pool *pool)
+{
+  unsigned int i, nobjs;
+  char *base;
+  struct pool_obj *obj;
+  struct pool_slab *slab;
+
+  nobjs = pool->slab_objs;
+  if (pool->high_wm) {
+    if (pool->nobjects >= pool->high_wm) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    if (pool->nobjects + nobjs > pool->high_wm) {
+      nobjs = pool->high_wm - pool->nobjects;
+    }
+  }
+
+  slab = (struct pool_slab *)vde_alloc(POOL_ROUND(sizeof(struct pool_slab)) +
+                                       nobjs * pool->obj_size);
+  if (slab == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  // thread objects in reverse order so that they are handed out in memory
+  // order
+  base = (char *)slab + POOL_ROUND(sizeof(struct pool_slab));
+  for (i = nobjs; i > 0; i--) {
+    obj = (struct pool_obj *)(base + (i - 1) * pool->obj_size);
+    obj->next = pool->local_free;
+    pool->local_free = obj;
+  }
+
+  pool->nslabs++;
+  pool->nobjects += nobjs;
+  return 0;
+}
+
+vde_pool *vde_pool_new(size_t obj_size, unsigned int slab_objs,
+                       unsigned int low_wm, unsigned int high_wm)
+{
+  vde_pool *pool;
+
+  if (obj_size == 0 || slab_objs == 0 || (high_wm && low_wm > high_wm)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pool = (vde_pool *)vde_calloc(sizeof(vde_pool));
+  if (pool == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (obj_size < sizeof(struct pool_obj)) {
+    obj_size = sizeof(struct pool_obj);
+  }
+  pool->obj_size = POOL_ROUND(obj_size);
+  pool->slab_objs = slab_objs;
+  pool->high_wm = high_wm;
+  pool->refs = 1;
+
+  while (pool->nobjects < low_wm) {
+    if (pool_grow(pool)) {
+      vde_pool_delete(pool);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+static void pool_destroy(vde_pool *pool)
+{
+  struct pool_slab *slab;
+
+  while (pool->slabs != NULL) {
+    slab = pool->slabs;
+    pool->slabs = slab->next;
+    vde_free(slab);
+  }
+  vde_free(pool);
+}
+
+void vde_pool_delete(vde_pool *pool)
+{
+  vde_assert(pool != NULL);
+
+  if (__sync_sub_and_fetch(&pool->refs, 1) == 0) {
+    pool_destroy(pool);
+  }
+}
+
+void *vde_pool_alloc(vde_pool *pool)
+{
+  unsigned int in_use;
+  struct pool_obj *obj;
+
+  vde_assert(pool != NULL);
+
+  if (pool->local_free == NULL) {
+    pool->local_free = __sync_lock_test_and_set(&pool->shared_free, NULL);
+    if (pool->local_free == NULL && pool_grow(pool)) {
+      pool->failures++;
+      return NULL;
+    }
+  }
+
+  obj = pool->local_free;
+  pool->local_free = obj->next;
+
+  pool->allocs++;
+  in_use = __sync_add_and_fetch(&pool->refs, 1) - 1;
+  if (in_use > pool->peak) {
+    pool->peak = in_use;
+  }
+
+  return obj;
+}
+
+void vde_pool_free(vde_pool *pool, void *obj)
+{
+  struct pool_obj *head, *o = (struct pool_obj *)obj;
+
+  vde_assert(pool != NULL);
+  vde_assert(obj != NULL);
+
+  do {
+    head = pool->shared_free;
+    o->next = head;
+  } while (!__sync_bool_compare_and_swap(&pool->shared_free, head, o));
+
+  // the pool has already been deleted by its owner and this was the last
+  // object around
+  if (__sync_sub_and_fetch(&pool->refs, 1) == 0) {
+    pool_destroy(pool);
+  }
+}
+
+void vde_pool_get_stats(vde_pool *pool, vde_pool_stats *stats)
+{
+  vde_assert(pool != NULL);
+  vde_assert(stats != NULL);
+
+  stats->slabs = pool->nslabs;
+  stats->objects = pool->nobjects;
+  stats->in_use = pool->refs - 1;
+  stats->allocs = pool->allocs;
+  stats->frees = stats->allocs - stats->in_use;
+  stats->peak = pool->peak;
+  stats->failures = pool->failures;
+}
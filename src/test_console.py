@@ -18,41 +18,206 @@
 import sys
 import readline
 import socket
-import tempfile
 import os
 import struct
 import atexit
 import termios
 import threading
 import select
+import optparse
+import json
 
 PROMPT='vde> '
-_MAXPATH=1024
-_MAXRECV=4096
+_MAXRECV=65536
+_HDR_FMT='!BBH' # version, type, payload length
+_HDR_SZ=struct.calcsize(_HDR_FMT)
+_PAYLOAD_MAX=65535
+_FRAME_FMT='!I' # msgpack message length
+_FRAME_SZ=struct.calcsize(_FRAME_FMT)
 
-pack_unpack = { 'darwin': ('<IIIh104s128s', '<h104s'),
-                'linux2': ('<IIIh108s128s', '<h108s'),
-              }
-
-PACK_STR, UNPACK_STR = pack_unpack[sys.platform]
-
-data = None
 ctl = None
 quit = False
+encoding = 'json'
+inbuf = '' # received data, not yet split in packets
+stream = '' # payload of the packets, not yet split in messages
 
-def get_from_data():
+def get_from_ctl():
   global quit
 
   while not quit:
-    rlist, wlist, xlist = select.select([data, ctl], [], [], 1.0)
-    if data in rlist:
-      read = data.recv(_MAXRECV)
-      print repr(read)
+    rlist, wlist, xlist = select.select([ctl], [], [], 1.0)
+    if ctl in rlist:
+      if not recv_packets():
+        print "Connection closed by remote side"
+        quit = True
+        break
+      msg = next_message()
+      while msg is not None:
+        print repr(msg)
+        msg = next_message()
       sys.stdout.write(PROMPT)
       sys.stdout.flush()
-    if ctl in rlist and ctl.recv(0) == '':
-      print "Connection closed by remote side"
-      quit = True
+
+def recv_packets():
+  # read from ctl and collect the payload of complete packets, False on close
+  global inbuf, stream
+
+  read = ctl.recv(_MAXRECV)
+  if read == '':
+    return False
+  inbuf += read
+  while len(inbuf) >= _HDR_SZ:
+    version, type, length = struct.unpack(_HDR_FMT, inbuf[:_HDR_SZ])
+    if len(inbuf) < _HDR_SZ + length:
+      break
+    stream += inbuf[_HDR_SZ:_HDR_SZ + length]
+    inbuf = inbuf[_HDR_SZ + length:]
+  return True
+
+def next_message():
+  # return the first complete message in the current encoding, or None
+  global stream
+
+  if encoding == 'msgpack':
+    if len(stream) < _FRAME_SZ:
+      return None
+    length, = struct.unpack(_FRAME_FMT, stream[:_FRAME_SZ])
+    if len(stream) < _FRAME_SZ + length:
+      return None
+    msg = msgpack_unpack(stream[_FRAME_SZ:_FRAME_SZ + length])[0]
+    stream = stream[_FRAME_SZ + length:]
+  else:
+    sep = stream.find('\x00')
+    if sep < 0:
+      return None
+    msg = stream[:sep]
+    stream = stream[sep + 1:]
+  return msg
+
+def send_request(text):
+  # send a request typed as JSON in the current encoding
+
+  if encoding == 'msgpack':
+    try:
+      data = msgpack_pack(json.loads(text))
+    except ValueError, e:
+      print 'Invalid request: %s' % e
+      return
+    stream_send(ctl, struct.pack(_FRAME_FMT, len(data)) + data)
+  else:
+    stream_send(ctl, text + '\x00')
+
+def set_encoding(name):
+  # switch the connection to another encoding, before the getter starts
+  global encoding
+
+  send_request(json.dumps({'id': 0, 'method': 'ctrl.set_encoding',
+                           'params': [name]}))
+  # the reply is in the old encoding, the following ones in the new
+  msg = next_message()
+  while msg is None:
+    if not recv_packets():
+      return False
+    msg = next_message()
+  print repr(msg)
+  if json.loads(msg)['error'] is not None:
+    return False
+  encoding = name
+  return True
+
+def _pack_len(length, fix, fixmax, type8, type16):
+  if length <= fixmax:
+    return chr(fix | length)
+  if type8 and length <= 0xff:
+    return chr(type8) + chr(length)
+  if length <= 0xffff:
+    return chr(type16) + struct.pack('!H', length)
+  return chr(type16 + 1) + struct.pack('!I', length)
+
+def msgpack_pack(obj):
+  # serialize a JSON-like object in MessagePack format
+
+  if obj is None:
+    return '\xc0'
+  if obj is True:
+    return '\xc3'
+  if obj is False:
+    return '\xc2'
+  if isinstance(obj, (int, long)):
+    if 0 <= obj <= 0x7f:
+      return chr(obj)
+    if -32 <= obj < 0:
+      return struct.pack('!b', obj)
+    return '\xd3' + struct.pack('!q', obj)
+  if isinstance(obj, float):
+    return '\xcb' + struct.pack('!d', obj)
+  if isinstance(obj, unicode):
+    obj = obj.encode('utf-8')
+  if isinstance(obj, str):
+    return _pack_len(len(obj), 0xa0, 31, 0xd9, 0xda) + obj
+  if isinstance(obj, (list, tuple)):
+    return (_pack_len(len(obj), 0x90, 15, None, 0xdc) +
+            ''.join([msgpack_pack(o) for o in obj]))
+  if isinstance(obj, dict):
+    return (_pack_len(len(obj), 0x80, 15, None, 0xde) +
+            ''.join([msgpack_pack(k) + msgpack_pack(v)
+                     for k, v in obj.iteritems()]))
+  raise ValueError('cannot serialize %r' % obj)
+
+def _unpack_str(data, off, length):
+  return data[off:off + length], off + length
+
+def _unpack_array(data, off, length):
+  res = []
+  for i in range(length):
+    obj, off = msgpack_unpack(data, off)
+    res.append(obj)
+  return res, off
+
+def _unpack_map(data, off, length):
+  res = {}
+  for i in range(length):
+    key, off = msgpack_unpack(data, off)
+    res[key], off = msgpack_unpack(data, off)
+  return res, off
+
+_MSGPACK_FIXED = {0xca: '!f', 0xcb: '!d', 0xcc: '!B', 0xcd: '!H', 0xce: '!I',
+                  0xcf: '!Q', 0xd0: '!b', 0xd1: '!h', 0xd2: '!i', 0xd3: '!q'}
+_MSGPACK_SIZED = {0xc4: (_unpack_str, '!B'), 0xc5: (_unpack_str, '!H'),
+                  0xc6: (_unpack_str, '!I'), 0xd9: (_unpack_str, '!B'),
+                  0xda: (_unpack_str, '!H'), 0xdb: (_unpack_str, '!I'),
+                  0xdc: (_unpack_array, '!H'), 0xdd: (_unpack_array, '!I'),
+                  0xde: (_unpack_map, '!H'), 0xdf: (_unpack_map, '!I')}
+
+def msgpack_unpack(data, off=0):
+  # return the object serialized at off and the offset following it
+
+  type = ord(data[off])
+  off += 1
+  if type <= 0x7f:
+    return type, off
+  if type >= 0xe0:
+    return type - 0x100, off
+  if (type & 0xe0) == 0xa0:
+    return _unpack_str(data, off, type & 0x1f)
+  if (type & 0xf0) == 0x90:
+    return _unpack_array(data, off, type & 0x0f)
+  if (type & 0xf0) == 0x80:
+    return _unpack_map(data, off, type & 0x0f)
+  if type == 0xc0:
+    return None, off
+  if type in (0xc2, 0xc3):
+    return type == 0xc3, off
+  if type in _MSGPACK_FIXED:
+    fmt = _MSGPACK_FIXED[type]
+    size = struct.calcsize(fmt)
+    return struct.unpack(fmt, data[off:off + size])[0], off + size
+  if type in _MSGPACK_SIZED:
+    unpack, fmt = _MSGPACK_SIZED[type]
+    size = struct.calcsize(fmt)
+    length, = struct.unpack(fmt, data[off:off + size])
+    return unpack(data, off + size, length)
+  raise ValueError('unsupported type 0x%02x' % type)
 
 def setterm():
   old = termios.tcgetattr(sys.stdin)
@@ -69,20 +234,27 @@ def setterm():
 
 
 def main():
-  global data, ctl
+  global ctl
   global quit
-  ctl, datasock, peername = vde2_connect('/tmp/vde3_test_ctrl/ctl')
-  print 'connected to %s.' % peername
-  data = datasock
+  parser = optparse.OptionParser()
+  parser.add_option('-m', '--msgpack', action='store_true', default=False,
+                    help='exchange MessagePack messages, requests are still '
+                    'typed as JSON')
+  (options, args) = parser.parse_args()
+
+  ctl = stream_connect('/tmp/vde3_test_ctrl')
+  print 'connected to %s.' % ctl.getpeername()
 
-  atexit.register(os.remove, data.getsockname())
+  if options.msgpack and not set_encoding('msgpack'):
+    print 'Cannot switch to MessagePack'
+    return 1
 
   #setterm()
 
   #sys.stdout.write(PROMPT)
   #sys.stdout.flush()
 
-  th = threading.Thread(target = get_from_data, name = 'getter')
+  th = threading.Thread(target = get_from_ctl, name = 'getter')
   th.start()
   while not quit:
     try:
@@ -92,42 +264,30 @@ def main():
       quit = True
       break
     if cmd:
-      data.sendto(cmd + '\x00', peername)
+      send_request(cmd)
 
   print 'Quitting.'
   th.join(1)
 
   return 0
 
-def vde2_connect(remote_address, local_address=None):
-  # connect to vde2 socket on remote_address
-  # return (ctl_socket, data_socket, peer_address)
+def stream_connect(remote_address):
+  # connect to the stream transport socket on remote_address
 
   # XXX error checking
 
-  ctl_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-  ctl_sock.connect(remote_address)
-
-  data_sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
-  if local_address is None:
-    (fd, name) = tempfile.mkstemp()
-    os.close(fd) # yes, this is racy
-    local_address = name
-
-  try:
-    os.remove(local_address)
-  except OSError:
-    pass
+  sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  sock.connect(remote_address)
 
-  data_sock.bind(local_address)
-  data = struct.pack(PACK_STR, 0xfeedface, 3, 0, 1, local_address,
-                     "vde minimal console")
-  ctl_sock.send(data)
+  return sock
 
-  data = ctl_sock.recv(_MAXPATH)
-  peer_address = struct.unpack(UNPACK_STR, data)[1].split('\x00')[0]
+def stream_send(sock, data):
+  # send data framed in packets of at most _PAYLOAD_MAX bytes
 
-  return (ctl_sock, data_sock, peer_address)
+  while data:
+    chunk = data[:_PAYLOAD_MAX]
+    data = data[_PAYLOAD_MAX:]
+    sock.sendall(struct.pack(_HDR_FMT, 0, 0, len(chunk)) + chunk)
 
 if __name__ == '__main__':
   histfile = os.path.join(".vde_console_hist")
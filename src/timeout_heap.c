@@ -0,0 +1,101 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/timeout_heap.h>
+
+static void heap_set(vde_timeout_heap *heap, unsigned int idx, vde_timeout *t)
+{
+  heap->timeouts[idx] = t;
+  t->idx = idx;
+}
+
+static void heap_up(vde_timeout_heap *heap, unsigned int idx)
+{
+  vde_timeout *t = heap->timeouts[idx];
+  unsigned int parent;
+
+  while (idx > 0) {
+    parent = (idx - 1) / 2;
+    if (heap->timeouts[parent]->deadline <= t->deadline) {
+      break;
+    }
+    heap_set(heap, idx, heap->timeouts[parent]);
+    idx = parent;
+  }
+  heap_set(heap, idx, t);
+}
+
+static void heap_down(vde_timeout_heap *heap, unsigned int idx)
+{
+  vde_timeout *t = heap->timeouts[idx];
+  unsigned int child;
+
+  while ((child = 2 * idx + 1) < heap->len) {
+    if (child + 1 < heap->len &&
+        heap->timeouts[child + 1]->deadline < heap->timeouts[child]->deadline) {
+      child++;
+    }
+    if (t->deadline <= heap->timeouts[child]->deadline) {
+      break;
+    }
+    heap_set(heap, idx, heap->timeouts[child]);
+    idx = child;
+  }
+  heap_set(heap, idx, t);
+}
+
+void vde_timeout_heap_insert(vde_timeout_heap *heap, vde_timeout *t)
+{
+  vde_assert(t->idx < 0);
+
+  if (heap->len == heap->size) {
+    heap->size = heap->size ? heap->size * 2 : 16;
+    heap->timeouts = vde_realloc(heap->timeouts,
+                                 heap->size * sizeof(vde_timeout *));
+  }
+  heap_set(heap, heap->len++, t);
+  heap_up(heap, t->idx);
+}
+
+void vde_timeout_heap_remove(vde_timeout_heap *heap, vde_timeout *t)
+{
+  unsigned int idx = t->idx;
+  vde_timeout *last;
+
+  vde_assert(t->idx >= 0);
+
+  t->idx = -1;
+  last = heap->timeouts[--heap->len];
+  if (last == t) {
+    return;
+  }
+  heap_set(heap, idx, last);
+  heap_up(heap, idx);
+  heap_down(heap, last->idx);
+}
+
+void vde_timeout_heap_fini(vde_timeout_heap *heap)
+{
+  vde_assert(heap->len == 0);
+
+  vde_free(heap->timeouts);
+  heap->timeouts = NULL;
+  heap->size = 0;
+}
@@ -0,0 +1,425 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <vde3/timer.h>
+#include <vde3/pool.h>
+
+/*
+ * The wheel has TW_LEVELS levels of TW_SLOTS slots each, a slot of level n
+ * covers TW_SLOTS^n ticks. Timers are put in the lowest level able to hold
+ * their expiration and are moved down (cascaded) every time the level below
+ * completes a round, as in the Linux kernel timer wheel. Timers expiring
+ * after the range of the wheel are parked in the last level and cascaded
+ * again until they fit.
+ */
+
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_MAX_TICKS ((1ULL << (TW_SLOT_BITS * TW_LEVELS)) - 1)
+
+#define TW_POOL_SLAB 64
+
+// level of timers which have expired and wait for their callback to be called
+#define TW_EXPIRED TW_LEVELS
+
+typedef unsigned long long tw_tick;
+
+struct vde_timer {
+  struct vde_timer *next;
+  struct vde_timer **pprev; // NULL if the timer is not armed
+  int level;
+  int slot;
+  tw_tick expire;
+  tw_tick interval; // zero for one-shot timers
+  event_cb cb;
+  void *arg;
+  vde_timer_wheel *tw;
+};
+
+struct vde_timer_wheel {
+  vde_event_handler handler;
+  vde_pool *pool;
+  tw_tick start; // monotonic time of tick zero, in ms
+  tw_tick current; // first tick not processed yet
+  unsigned int armed;
+  uint64_t bitmap[TW_LEVELS]; // non-empty slots
+  vde_timer *slots[TW_LEVELS][TW_SLOTS];
+  vde_timer *expired;
+  // event handler timeout waking up the wheel at tick wakeup
+  void *wakeup_timeout;
+  tw_tick wakeup;
+  int running;
+};
+
+static tw_tick tw_now(vde_timer_wheel *tw)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (tw_tick)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - tw->start;
+}
+
+static void tw_link(vde_timer_wheel *tw, vde_timer *t, int level, int slot)
+{
+  vde_timer **head;
+
+  head = (level == TW_EXPIRED) ? &tw->expired : &tw->slots[level][slot];
+  t->level = level;
+  t->slot = slot;
+  t->next = *head;
+  if (t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+  if (level != TW_EXPIRED) {
+    tw->bitmap[level] |= 1ULL << slot;
+  }
+}
+
+static void tw_unlink(vde_timer_wheel *tw, vde_timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->pprev = NULL;
+  if (t->level != TW_EXPIRED && tw->slots[t->level][t->slot] == NULL) {
+    tw->bitmap[t->level] &= ~(1ULL << t->slot);
+  }
+}
+
+/**
+ * @brief Put a timer in the slot matching its expiration
+ */
+static void tw_insert(vde_timer_wheel *tw, vde_timer *t)
+{
+  tw_tick expire = t->expire, delta;
+  int level;
+
+  if (expire < tw->current) {
+    expire = tw->current;
+  }
+  delta = expire - tw->current;
+  if (delta > TW_MAX_TICKS) {
+    expire = tw->current + TW_MAX_TICKS;
+    delta = TW_MAX_TICKS;
+  }
+
+  for (level = 0; level < TW_LEVELS - 1; level++) {
+    if (delta < (1ULL << (TW_SLOT_BITS * (level + 1)))) {
+      break;
+    }
+  }
+  tw_link(tw, t, level, (expire >> (TW_SLOT_BITS * level)) & TW_MASK);
+}
+
+/**
+ * @brief Move the timers of a slot to lower levels
+ *
+ * @return The slot index
+ */
+static int tw_cascade(vde_timer_wheel *tw, int level, int slot)
+{
+  vde_timer *t;
+
+  while ((t = tw->slots[level][slot]) != NULL) {
+    tw_unlink(tw, t);
+    tw_insert(tw, t);
+  }
+  return slot;
+}
+
+/**
+ * @brief Get the next tick at which the wheel has work to do
+ *
+ * @return The tick, only meaningful if there are timers armed
+ */
+static tw_tick tw_next_tick(vde_timer_wheel *tw)
+{
+  int idx = tw->current & TW_MASK, level;
+  uint64_t pending;
+  tw_tick cascade, next;
+
+  // a tick with index zero cascades the upper levels before expiring timers
+  cascade = idx ? tw->current + TW_SLOTS - idx : tw->current;
+  next = cascade;
+
+  pending = tw->bitmap[0] >> idx;
+  if (pending) {
+    return tw->current + __builtin_ctzll(pending);
+  }
+  // slots before idx are in the next round
+  pending = idx ? tw->bitmap[0] & ((1ULL << idx) - 1) : 0;
+  if (pending) {
+    next = tw->current + TW_SLOTS - idx + __builtin_ctzll(pending);
+  }
+  for (level = 1; level < TW_LEVELS; level++) {
+    if (tw->bitmap[level]) {
+      return cascade;
+    }
+  }
+  return next;
+}
+
+static void tw_wakeup_cb(int fd, short events, void *arg);
+
+/**
+ * @brief Make sure the event handler wakes up the wheel in time
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int tw_schedule(vde_timer_wheel *tw)
+{
+  tw_tick next, now;
+  struct timeval tv;
+
+  if (tw->running || tw->armed == 0) {
+    return 0;
+  }
+  next = tw_next_tick(tw);
+  if (tw->wakeup_timeout != NULL) {
+    if (tw->wakeup <= next) {
+      return 0;
+    }
+    tw->handler.timeout_del(tw->wakeup_timeout);
+    tw->wakeup_timeout = NULL;
+  }
+
+  now = tw_now(tw);
+  next = (next > now) ? next - now : 0;
+  tv.tv_sec = next / 1000;
+  tv.tv_usec = (next % 1000) * 1000;
+  tw->wakeup_timeout = tw->handler.timeout_add(&tv, 0, &tw_wakeup_cb, tw);
+  if (tw->wakeup_timeout == NULL) {
+    vde_error("%s: cannot schedule timer wheel", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  tw->wakeup = now + next;
+  return 0;
+}
+
+/**
+ * @brief Expire all the timers up to a tick
+ */
+static void tw_advance(vde_timer_wheel *tw, tw_tick now)
+{
+  int idx, level;
+  vde_timer *t;
+
+  while (tw->current <= now) {
+    if (tw->armed == 0) {
+      tw->current = now + 1;
+      break;
+    }
+
+    idx = tw->current & TW_MASK;
+    if (idx == 0) {
+      for (level = 1; level < TW_LEVELS; level++) {
+        if (tw_cascade(tw, level,
+                       (tw->current >> (TW_SLOT_BITS * level)) & TW_MASK)) {
+          break;
+        }
+      }
+    }
+
+    if (!(tw->bitmap[0] & (1ULL << idx))) {
+      // skip empty slots up to the next cascade
+      if (!(tw->bitmap[0] >> idx)) {
+        tw->current += TW_SLOTS - idx;
+        if (tw->current > now + 1) {
+          tw->current = now + 1;
+        }
+      } else {
+        tw->current++;
+      }
+      continue;
+    }
+
+    // move the whole slot to the expired list, timers re-armed by their
+    // callbacks go to later ticks
+    while ((t = tw->slots[0][idx]) != NULL) {
+      tw_unlink(tw, t);
+      tw_link(tw, t, TW_EXPIRED, 0);
+    }
+    tw->current++;
+
+    while ((t = tw->expired) != NULL) {
+      tw_unlink(tw, t);
+      if (t->interval) {
+        t->expire += t->interval;
+        if (t->expire <= now) {
+          // don't try to catch up with missed expirations
+          t->expire = now + t->interval;
+        }
+        tw_insert(tw, t);
+      } else {
+        tw->armed--;
+      }
+      // t could be deleted by its callback
+      t->cb(-1, VDE_EV_TIMEOUT, t->arg);
+    }
+  }
+}
+
+static void tw_wakeup_cb(int fd, short events, void *arg)
+{
+  vde_timer_wheel *tw = (vde_timer_wheel *)arg;
+
+  // one-shot timeouts are released by timeout_del after they fire
+  tw->handler.timeout_del(tw->wakeup_timeout);
+  tw->wakeup_timeout = NULL;
+
+  tw->running = 1;
+  tw_advance(tw, tw_now(tw));
+  tw->running = 0;
+
+  tw_schedule(tw);
+}
+
+vde_timer_wheel *vde_timer_wheel_new(vde_event_handler *handler)
+{
+  vde_timer_wheel *tw;
+
+  if (handler == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tw = (vde_timer_wheel *)vde_calloc(sizeof(vde_timer_wheel));
+  if (tw == NULL) {
+    vde_error("%s: cannot alloc timer wheel", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  tw->pool = vde_pool_new(sizeof(vde_timer), TW_POOL_SLAB, TW_POOL_SLAB, 0);
+  if (tw->pool == NULL) {
+    vde_error("%s: cannot alloc timer pool", __PRETTY_FUNCTION__);
+    vde_free(tw);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(&tw->handler, handler, sizeof(vde_event_handler));
+  tw->start = tw_now(tw);
+  return tw;
+}
+
+void vde_timer_wheel_delete(vde_timer_wheel *tw)
+{
+  vde_assert(tw != NULL);
+
+  if (tw->armed) {
+    vde_warning("%s: deleting timer wheel with %u timers armed",
+                __PRETTY_FUNCTION__, tw->armed);
+  }
+  if (tw->wakeup_timeout != NULL) {
+    tw->handler.timeout_del(tw->wakeup_timeout);
+  }
+  // timers not deleted keep the pool alive
+  vde_pool_delete(tw->pool);
+  vde_free(tw);
+}
+
+vde_timer *vde_timer_new(vde_timer_wheel *tw, event_cb cb, void *arg)
+{
+  vde_timer *timer;
+
+  if (tw == NULL || cb == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  timer = vde_cached_pool_alloc(tw->pool);
+  if (timer == NULL) {
+    vde_error("%s: cannot alloc timer", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(timer, 0, sizeof(vde_timer));
+  timer->tw = tw;
+  timer->cb = cb;
+  timer->arg = arg;
+  return timer;
+}
+
+void vde_timer_delete(vde_timer *timer)
+{
+  vde_assert(timer != NULL);
+
+  vde_timer_cancel(timer);
+  vde_cached_pool_free(timer->tw->pool, timer);
+}
+
+int vde_timer_arm(vde_timer *timer, const struct timeval *timeout,
+                  short events)
+{
+  vde_timer_wheel *tw;
+  tw_tick ticks;
+
+  vde_assert(timer != NULL);
+
+  if (timeout == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  tw = timer->tw;
+  vde_timer_cancel(timer);
+
+  // round up, expiring early is not allowed
+  ticks = (tw_tick)timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+  if (ticks == 0) {
+    ticks = 1;
+  }
+  if (tw->armed == 0 && !tw->running) {
+    // nothing to expire in between, catch up with the clock
+    tw->current = tw_now(tw);
+  }
+  // the current tick is partly elapsed already
+  timer->expire = tw_now(tw) + ticks + 1;
+  timer->interval = (events & VDE_EV_PERSIST) ? ticks : 0;
+  tw_insert(tw, timer);
+  tw->armed++;
+
+  return tw_schedule(tw);
+}
+
+void vde_timer_cancel(vde_timer *timer)
+{
+  vde_assert(timer != NULL);
+
+  if (timer->pprev == NULL) {
+    return;
+  }
+  tw_unlink(timer->tw, timer);
+  timer->tw->armed--;
+}
+
+int vde_timer_is_armed(vde_timer *timer)
+{
+  vde_assert(timer != NULL);
+
+  return timer->pprev != NULL;
+}
@@ -0,0 +1,835 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/worker.h>
+
+/*
+ * Packet transport
+ *
+ * Bridges a host interface through AF_PACKET sockets with TPACKET_V3 rings
+ * mapped in the process. Like a tap the interface is a single connection,
+ * with one socket per queue joined in a PACKET_FANOUT_HASH group so that the
+ * kernel spreads flows among them.
+ *
+ * The kernel fills whole blocks of frames and hands them over at once: each
+ * block is delivered to the engine in batches without copies. Every frame is
+ * preceded by room reserved with PACKET_RESERVE, where the vde_pkt describing
+ * it is built. These packets are not shared: the kernel never skips a block
+ * owned by us, so a reference kept to a single frame would stop the whole
+ * ring. Whoever needs a frame after the read callback copies it, as with any
+ * private packet, and the block is given back as soon as it is delivered.
+ *
+ * Frames are sent by copying them in the free slots of the tx ring, the kernel
+ * is kicked once per write or batch.
+ */
+
+#define PACKET_DEFAULT_BLOCK_SZ (1 << 20)
+#define PACKET_DEFAULT_BLOCKS 64
+#define PACKET_DEFAULT_TIMEOUT 1 // ms before a partially filled block is retired
+#define PACKET_MAX_QUEUES 256
+#define PACKET_BUDGET 8 // max blocks delivered by a single read event
+
+#define PACKET_TX_BLOCK_SZ (1 << 16)
+#define PACKET_TX_FRAME_SZ 2048
+#define PACKET_TX_FRAMES_PER_BLOCK (PACKET_TX_BLOCK_SZ / PACKET_TX_FRAME_SZ)
+#define PACKET_DEFAULT_TX_BLOCKS 16
+
+#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
+#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
+#define VLAN_TAG_SZ 4 /* room to put back a tag stripped by the kernel */
+// room before each frame: the packet, the header, head space, a vlan tag and
+// slack for alignment
+#define PACKET_RESERVE_SZ (sizeof(vde_pkt) + sizeof(vde_hdr) + MAX_HEAD_SZ \
+                           + VLAN_TAG_SZ + sizeof(void *))
+
+// where a frame to send starts in a tx slot
+#define PACKET_TX_DATA_OFF (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct packet_conn packet_conn;
+
+// a socket and the memory it shares with the kernel: rx blocks followed by tx
+// slots
+typedef struct {
+  int fd;
+  unsigned char *map;
+  size_t map_sz;
+  unsigned int nblocks;
+  unsigned int block_sz;
+  unsigned char *tx_slots;
+  unsigned int tx_nslots;
+} packet_ring;
+
+typedef struct {
+  packet_ring *ring;
+  void *ev;
+  unsigned int rx_next; // next block to look at
+  unsigned int tx_next; // next slot to fill
+  unsigned int tx_pending; // slots filled since the last kick
+  vde_timer *kick_timer; // kicks again when the kernel was busy
+  packet_conn *pc;
+} packet_queue;
+
+struct packet_conn {
+  char ifname[IFNAMSIZ];
+  packet_queue *queues;
+  unsigned int nqueues;
+  vde_context *context;
+  vde_connection *conn;
+};
+
+typedef struct {
+  char ifname[IFNAMSIZ];
+  unsigned int queues;
+  unsigned int blocks;
+  unsigned int block_sz;
+  unsigned int timeout;
+  unsigned int tx_blocks;
+  int fanout;
+  int promisc;
+} packet_tr;
+
+static void packet_ring_close(packet_ring *ring)
+{
+  munmap(ring->map, ring->map_sz);
+  close(ring->fd);
+  vde_free(ring);
+}
+
+static inline struct tpacket3_hdr *packet_ring_tx_slot(packet_ring *ring,
+                                                       unsigned int idx)
+{
+  return (struct tpacket3_hdr *)(ring->tx_slots +
+                                 (size_t)(idx % ring->tx_nslots) *
+                                 PACKET_TX_FRAME_SZ);
+}
+
+static inline struct tpacket_block_desc *packet_ring_block(packet_ring *ring,
+                                                           unsigned int idx)
+{
+  return (struct tpacket_block_desc *)(ring->map +
+                                       (size_t)idx * ring->block_sz);
+}
+
+static void packet_conn_free(packet_conn *pc)
+{
+  unsigned int i;
+  packet_queue *q;
+
+  for (i = 0; i < pc->nqueues; i++) {
+    q = &pc->queues[i];
+    if (q->ev != NULL) {
+      vde_context_event_del(pc->context, q->ev);
+    }
+    if (q->kick_timer != NULL) {
+      vde_timer_delete(q->kick_timer);
+    }
+    if (q->ring != NULL) {
+      packet_ring_close(q->ring);
+    }
+  }
+  vde_free(pc->queues);
+  vde_free(pc);
+}
+
+static void packet_conn_close_fatal(packet_queue *q)
+{
+  vde_connection *conn = q->pc->conn;
+
+  if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+      (errno == EPIPE)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_warning("%s: got fatal error on packet fd %d but connection not closed",
+              __PRETTY_FUNCTION__, q->ring->fd);
+}
+
+/**
+ * @brief Build a packet in the room reserved before a received frame
+ *
+ * @return the packet, NULL if the frame must be skipped
+ */
+static vde_pkt *packet_frame_to_pkt(struct tpacket3_hdr *h)
+{
+  struct sockaddr_ll *sll;
+  unsigned char *frame;
+  unsigned int len;
+  uint16_t tpid;
+  vde_pkt *pkt;
+
+  sll = (struct sockaddr_ll *)((unsigned char *)h +
+                               TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+  // frames we sent ourselves
+  if (sll->sll_pkttype == PACKET_OUTGOING) {
+    return NULL;
+  }
+  frame = (unsigned char *)h + h->tp_mac;
+  len = h->tp_snaplen;
+  if (len < h->tp_len || len < sizeof(struct eth_hdr)) {
+    // truncated, e.g. coalesced by GRO beyond the block size
+    return NULL;
+  }
+
+  if (h->tp_status & TP_STATUS_VLAN_VALID) {
+    // put back the tag stripped by the kernel
+    tpid = h->tp_status & TP_STATUS_VLAN_TPID_VALID ? h->hv1.tp_vlan_tpid :
+                                                      ETH_P_8021Q;
+    memmove(frame - VLAN_TAG_SZ, frame, 2 * ETH_ALEN);
+    frame -= VLAN_TAG_SZ;
+    *(uint16_t *)(frame + 2 * ETH_ALEN) = htons(tpid);
+    *(uint16_t *)(frame + 2 * ETH_ALEN + 2) = htons(h->hv1.tp_vlan_tci);
+    len += VLAN_TAG_SZ;
+  }
+  if (len > UINT16_MAX) {
+    return NULL;
+  }
+
+  pkt = (vde_pkt *)((uintptr_t)(frame - MAX_HEAD_SZ - sizeof(vde_hdr) -
+                                sizeof(vde_pkt)) & ~(sizeof(void *) - 1));
+  vde_pkt_init(pkt, frame + len - (unsigned char *)pkt->data,
+               frame - (unsigned char *)pkt->data - sizeof(vde_hdr), 0);
+  if (h->tp_status & TP_STATUS_CSUM_VALID) {
+    pkt->offload.flags = VDE_PKT_CSUM_VALID;
+  }
+  // XXX: set hdr version and type
+  pkt->hdr->pkt_len = len;
+  return pkt;
+}
+
+/**
+ * @brief Deliver a batch, its packets are gone when this function returns
+ *
+ * @return zero on success, -1 if the connection has been closed
+ */
+static int packet_deliver(packet_conn *pc, vde_pkt_batch *batch)
+{
+  int cb_errno = 0;
+  vde_connection *conn = pc->conn;
+
+  if (batch->len > 0 && vde_connection_call_read_batch(conn, batch)) {
+    cb_errno = errno;
+  }
+  vde_pkt_batch_init(batch);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+void packet_conn_read_event(int fd, short event_type, void *arg)
+{
+  struct tpacket_block_desc *desc;
+  struct tpacket3_hdr *h;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  unsigned int i, n;
+  int sock_err = 0;
+  socklen_t optlen = sizeof(sock_err);
+  packet_queue *q = (packet_queue *)arg;
+  packet_ring *ring = q->ring;
+  packet_conn *pc = q->pc;
+
+  if ( (vde_connection_get_pkt_headsize(pc->conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(pc->conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    return;
+  }
+
+  vde_pkt_batch_init(&batch);
+  for (n = 0; n < PACKET_BUDGET; n++) {
+    desc = packet_ring_block(ring, q->rx_next);
+    if (!(desc->hdr.bh1.block_status & TP_STATUS_USER)) {
+      break;
+    }
+    // pairs with the kernel publishing the block
+    __sync_synchronize();
+    q->rx_next = (q->rx_next + 1) % ring->nblocks;
+
+    h = (struct tpacket3_hdr *)((unsigned char *)desc +
+                                desc->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < desc->hdr.bh1.num_pkts; i++) {
+      pkt = packet_frame_to_pkt(h);
+      if (pkt != NULL) {
+        vde_pkt_batch_add(&batch, pkt);
+        if (vde_pkt_batch_full(&batch) && packet_deliver(pc, &batch)) {
+          // the ring is gone with the connection
+          return;
+        }
+      }
+      h = (struct tpacket3_hdr *)((unsigned char *)h + h->tp_next_offset);
+    }
+    if (packet_deliver(pc, &batch)) {
+      return;
+    }
+    // frames must have been read before the kernel can reuse the block
+    __sync_synchronize();
+    desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  }
+
+  if (n == 0) {
+    // woken up with nothing to read, the interface might have gone down
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sock_err, &optlen) < 0) {
+      sock_err = errno;
+    }
+    if (sock_err == ENETDOWN && if_nametoindex(pc->ifname) == 0) {
+      vde_error("%s: interface %s has been removed", __PRETTY_FUNCTION__,
+                pc->ifname);
+      packet_conn_close_fatal(q);
+    } else if (sock_err) {
+      vde_warning("%s: error on packet fd %d: %s", __PRETTY_FUNCTION__, fd,
+                  strerror(sock_err));
+    }
+  }
+}
+
+static void packet_queue_kick(packet_queue *q)
+{
+  struct timeval tv = { 0, 1000 };
+
+  if (q->tx_pending == 0) {
+    return;
+  }
+  if (send(q->ring->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+      errno != ENOBUFS) {
+    vde_warning("%s: cannot send on packet fd %d: %s", __PRETTY_FUNCTION__,
+                q->ring->fd, strerror(errno));
+  }
+  // the last slot still waiting means the kernel stopped early, try again
+  // soon
+  if (packet_ring_tx_slot(q->ring, q->tx_next + q->ring->tx_nslots - 1)->
+        tp_status == TP_STATUS_SEND_REQUEST) {
+    vde_timer_arm(q->kick_timer, &tv, 0);
+    return;
+  }
+  q->tx_pending = 0;
+}
+
+static void packet_kick_timeout(int fd, short events, void *arg)
+{
+  packet_queue_kick((packet_queue *)arg);
+}
+
+/**
+ * @brief Copy a frame in the next free tx slot of the queue of its flow
+ *
+ * @return the queue on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static packet_queue *packet_conn_enqueue(packet_conn *pc, vde_pkt *pkt)
+{
+  struct tpacket3_hdr *h;
+  vde_pkt_offload offload;
+  packet_queue *q;
+  int worker;
+  unsigned char *data;
+
+  if (pc->nqueues == 1) {
+    q = &pc->queues[0];
+  } else if ((worker = vde_worker_current()) >= 0) {
+    // workers do not share queues
+    q = &pc->queues[worker % pc->nqueues];
+  } else {
+    q = &pc->queues[vde_pkt_flow_hash(pkt) % pc->nqueues];
+  }
+
+  if (vde_pkt_needs_gso(pkt)) {
+    vde_warning("%s: packet needs segmentation, discarding",
+                __PRETTY_FUNCTION__);
+    errno = EMSGSIZE;
+    return NULL;
+  }
+  if (pkt->hdr->pkt_len > PACKET_TX_FRAME_SZ - PACKET_TX_DATA_OFF) {
+    vde_warning("%s: packet size larger than a slot, discarding",
+                __PRETTY_FUNCTION__);
+    errno = EBADMSG;
+    return NULL;
+  }
+
+  h = packet_ring_tx_slot(q->ring, q->tx_next);
+  if (h->tp_status != TP_STATUS_AVAILABLE &&
+      h->tp_status != TP_STATUS_WRONG_FORMAT) {
+    errno = EAGAIN;
+    return NULL;
+  }
+  // the slot is ours until marked for sending
+  __sync_synchronize();
+  data = (unsigned char *)h + PACKET_TX_DATA_OFF;
+  memcpy(data, pkt->payload, pkt->hdr->pkt_len);
+  offload = pkt->offload;
+  if (vde_pkt_csum_complete(&offload, data, pkt->hdr->pkt_len)) {
+    vde_warning("%s: bad checksum offsets, discarding", __PRETTY_FUNCTION__);
+    errno = EBADMSG;
+    return NULL;
+  }
+  h->tp_len = pkt->hdr->pkt_len;
+  h->tp_snaplen = pkt->hdr->pkt_len;
+  __sync_synchronize();
+  h->tp_status = TP_STATUS_SEND_REQUEST;
+
+  q->tx_next = (q->tx_next + 1) % q->ring->tx_nslots;
+  q->tx_pending++;
+  return q;
+}
+
+int packet_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  packet_queue *q;
+
+  q = packet_conn_enqueue(vde_connection_get_priv(conn), pkt);
+  if (q == NULL) {
+    return -1;
+  }
+  packet_queue_kick(q);
+  return 0;
+}
+
+int packet_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i, j;
+  int tmp_errno;
+  packet_conn *pc = vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (packet_conn_enqueue(pc, batch->pkts[i]) == NULL) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    // a single kick per queue for the whole batch
+    for (j = 0; j < pc->nqueues; j++) {
+      packet_queue_kick(&pc->queues[j]);
+    }
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+void packet_conn_close(vde_connection *conn)
+{
+  packet_conn_free(vde_connection_get_priv(conn));
+}
+
+/**
+ * @brief Open a socket bound to the interface, with its rings mapped
+ *
+ * @param tr The transport
+ * @param group The fanout group to join, if negative a new one is created and
+ * its id is stored here
+ *
+ * @return the ring on success, NULL on error (and errno is set appropriately)
+ */
+static packet_ring *packet_ring_open(packet_tr *tr, int *group)
+{
+  int fd, tmp_errno;
+  int version = TPACKET_V3;
+  int one = 1;
+  int fanout;
+  unsigned int reserve = PACKET_RESERVE_SZ;
+  socklen_t optlen = sizeof(fanout);
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct packet_mreq mreq;
+  packet_ring *ring;
+
+  ring = (packet_ring *)vde_calloc(sizeof(packet_ring));
+  if (ring == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // no protocol until bound to the interface, or frames of any interface
+  // would fill the ring
+  fd = socket(AF_PACKET, SOCK_RAW|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create packet socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_ring;
+  }
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_RESERVE, &reserve,
+                 sizeof(reserve)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set TPACKET_V3: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_fd;
+  }
+  // frames we send would come back on rx otherwise, older kernels only have
+  // the check on packet type
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = tr->block_sz;
+  req.tp_block_nr = tr->blocks;
+  req.tp_frame_size = TPACKET_ALIGNMENT << 7; // ignored for v3 rx
+  req.tp_frame_nr = tr->block_sz / req.tp_frame_size * tr->blocks;
+  req.tp_retire_blk_tov = tr->timeout;
+  req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create rx ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_fd;
+  }
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = PACKET_TX_BLOCK_SZ;
+  req.tp_block_nr = tr->tx_blocks;
+  req.tp_frame_size = PACKET_TX_FRAME_SZ;
+  req.tp_frame_nr = tr->tx_blocks * PACKET_TX_FRAMES_PER_BLOCK;
+  if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create tx ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_fd;
+  }
+
+  ring->map_sz = (size_t)tr->block_sz * tr->blocks +
+                 (size_t)PACKET_TX_BLOCK_SZ * tr->tx_blocks;
+  ring->map = mmap(NULL, ring->map_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_LOCKED|MAP_POPULATE, fd, 0);
+  if (ring->map == MAP_FAILED) {
+    // locking might be forbidden, the ring works anyway
+    ring->map = mmap(NULL, ring->map_sz, PROT_READ|PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+  }
+  if (ring->map == MAP_FAILED) {
+    tmp_errno = errno;
+    vde_error("%s: cannot map rings: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_fd;
+  }
+  ring->fd = fd;
+  ring->nblocks = tr->blocks;
+  ring->block_sz = tr->block_sz;
+  ring->tx_slots = ring->map + (size_t)tr->block_sz * tr->blocks;
+  ring->tx_nslots = tr->tx_blocks * PACKET_TX_FRAMES_PER_BLOCK;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = if_nametoindex(tr->ifname);
+  if (sll.sll_ifindex == 0 ||
+      bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    tmp_errno = sll.sll_ifindex == 0 ? ENODEV : errno;
+    vde_error("%s: cannot bind to %s: %s", __PRETTY_FUNCTION__, tr->ifname,
+              strerror(tmp_errno));
+    goto err_map;
+  }
+  if (tr->promisc) {
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = sll.sll_ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: cannot set %s promiscuous: %s", __PRETTY_FUNCTION__,
+                tr->ifname, strerror(errno));
+      goto err_map;
+    }
+  }
+  if (tr->queues > 1) {
+    if (*group < 0) {
+      fanout = (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    } else {
+      fanout = *group | (PACKET_FANOUT_HASH << 16);
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                   sizeof(fanout)) < 0 ||
+        getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout, &optlen) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: cannot join fanout group: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto err_map;
+    }
+    *group = fanout & 0xffff;
+  }
+  return ring;
+
+err_map:
+  munmap(ring->map, ring->map_sz);
+err_fd:
+  close(fd);
+err_ring:
+  vde_free(ring);
+  errno = tmp_errno;
+  return NULL;
+}
+
+/**
+ * @brief Open the sockets of the interface and initialize conn over them
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int packet_conn_open(vde_component *component, vde_connection *conn)
+{
+  unsigned int i;
+  int tmp_errno;
+  int group;
+  packet_conn *pc;
+  packet_queue *q;
+  vde_context *ctx = vde_component_get_context(component);
+  packet_tr *tr = (packet_tr *)vde_component_get_priv(component);
+
+  pc = (packet_conn *)vde_calloc(sizeof(packet_conn));
+  if (pc == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  snprintf(pc->ifname, IFNAMSIZ, "%s", tr->ifname);
+  pc->context = ctx;
+  pc->conn = conn;
+  pc->queues = (packet_queue *)vde_calloc(tr->queues * sizeof(packet_queue));
+  if (pc->queues == NULL) {
+    vde_error("%s: cannot create queues", __PRETTY_FUNCTION__);
+    vde_free(pc);
+    errno = ENOMEM;
+    return -1;
+  }
+  pc->nqueues = tr->queues;
+
+  group = tr->fanout;
+  for (i = 0; i < pc->nqueues; i++) {
+    q = &pc->queues[i];
+    q->pc = pc;
+    q->ring = packet_ring_open(tr, &group);
+    if (q->ring == NULL) {
+      tmp_errno = errno;
+      goto error;
+    }
+    q->kick_timer = vde_context_timer_new(ctx, &packet_kick_timeout,
+                                          (void *)q);
+    if (q->kick_timer == NULL) {
+      vde_error("%s: cannot create kick timer", __PRETTY_FUNCTION__);
+      tmp_errno = ENOMEM;
+      goto error;
+    }
+  }
+
+  vde_connection_init(conn, ctx, PACKET_TX_FRAME_SZ - PACKET_TX_DATA_OFF,
+                      &packet_conn_write, &packet_conn_close, (void *)pc);
+  vde_connection_set_be_write_batch(conn, &packet_conn_write_batch);
+
+  for (i = 0; i < pc->nqueues; i++) {
+    q = &pc->queues[i];
+    q->ev = vde_context_event_add(ctx, q->ring->fd,
+                                  VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                  &packet_conn_read_event, (void *)q);
+    if (q->ev == NULL) {
+      vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+      tmp_errno = EIO;
+      goto error;
+    }
+  }
+  return 0;
+
+error:
+  packet_conn_free(pc);
+  errno = tmp_errno;
+  return -1;
+}
+
+int packet_listen(vde_component *component)
+{
+  int tmp_errno;
+  vde_connection *conn;
+
+  if (vde_connection_new(&conn)) {
+    return -1;
+  }
+  if (packet_conn_open(component, conn)) {
+    tmp_errno = errno;
+    vde_connection_delete(conn);
+    errno = tmp_errno;
+    return -1;
+  }
+  vde_transport_call_cm_accept_cb(component, conn);
+  return 0;
+}
+
+int packet_connect(vde_component *component, vde_connection *conn)
+{
+  // the interface is ready as soon as the sockets are bound
+  if (packet_conn_open(component, conn)) {
+    return -1;
+  }
+  vde_transport_call_cm_connect_cb(component, conn);
+  return 0;
+}
+
+/**
+ * @brief Get an optional integer parameter
+ *
+ * @return zero on success, -1 if it is not an integer between min and max (and
+ * errno is set to EINVAL)
+ */
+static int packet_param_int(vde_sobj *params, const char *name, int *value,
+                            int min, int max)
+{
+  vde_sobj *sobj = vde_sobj_hash_lookup(params, name);
+
+  if (!sobj) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(sobj, vde_sobj_type_int) ||
+      vde_sobj_get_int(sobj) < min || vde_sobj_get_int(sobj) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(sobj);
+  return 0;
+}
+
+static int transport_packet_init(vde_component *component, vde_sobj *params)
+{
+  packet_tr *tr;
+  vde_sobj *ifname_sobj, *promisc_sobj;
+  const char *ifname;
+  int queues, blocks = PACKET_DEFAULT_BLOCKS;
+  int block_sz = PACKET_DEFAULT_BLOCK_SZ, timeout = PACKET_DEFAULT_TIMEOUT;
+  int tx_blocks = PACKET_DEFAULT_TX_BLOCKS, fanout = -1;
+  int promisc = 1;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ifname_sobj = vde_sobj_hash_lookup(params, "ifname");
+  if (!ifname_sobj || !vde_sobj_is_type(ifname_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no interface name received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  ifname = vde_sobj_get_string(ifname_sobj);
+  if (strlen(ifname) >= IFNAMSIZ) {
+    vde_error("%s: interface name is too long", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: number of sockets in the fanout group, by default one per
+  // worker of the context
+  queues = vde_context_get_workers(vde_component_get_context(component));
+  if (queues == 0) {
+    queues = 1;
+  }
+  // optional: ring geometry, the block size must be a multiple of the page
+  // size and larger than the largest frame. The fanout group id is picked by
+  // the kernel if missing.
+  if (packet_param_int(params, "queues", &queues, 1, PACKET_MAX_QUEUES) ||
+      packet_param_int(params, "blocks", &blocks, 1, 65536) ||
+      packet_param_int(params, "block_size", &block_sz, PACKET_TX_BLOCK_SZ,
+                       1 << 30) ||
+      packet_param_int(params, "timeout", &timeout, 0, 1000) ||
+      packet_param_int(params, "tx_blocks", &tx_blocks, 1, 65536) ||
+      packet_param_int(params, "fanout", &fanout, 0, 0xffff)) {
+    return -1;
+  }
+  if (block_sz % getpagesize()) {
+    vde_error("%s: block_size must be a multiple of the page size",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: receive frames for any address, as a bridge does
+  promisc_sobj = vde_sobj_hash_lookup(params, "promisc");
+  if (promisc_sobj) {
+    if (!vde_sobj_is_type(promisc_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: promisc must be a boolean", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    promisc = vde_sobj_get_bool(promisc_sobj);
+  }
+
+  tr = (packet_tr *)vde_calloc(sizeof(packet_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  strncpy(tr->ifname, ifname, IFNAMSIZ - 1);
+  tr->queues = queues;
+  tr->blocks = blocks;
+  tr->block_sz = block_sz;
+  tr->timeout = timeout;
+  tr->tx_blocks = tx_blocks;
+  tr->fanout = fanout;
+  tr->promisc = promisc;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_packet_fini(vde_component *component)
+{
+  vde_assert(component != NULL);
+
+  // an open interface belongs to its engine, which closes it
+  vde_free(vde_component_get_priv(component));
+}
+
+component_ops transport_packet_component_ops = {
+  .init = transport_packet_init,
+  .fini = transport_packet_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "packet",
+  .cops = &transport_packet_component_ops,
+  .tr_listen = &packet_listen,
+  .tr_connect = &packet_connect,
+};
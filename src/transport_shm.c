@@ -0,0 +1,1104 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+/*
+ * Shared memory transport
+ *
+ * Two processes on the same host exchange frames through a pair of rings in a
+ * memfd, one per direction. The rings are negotiated over a unix stream
+ * socket: the client sends a hello, the server creates the memory and two
+ * eventfds and passes them back with SCM_RIGHTS. From then on frames are
+ * copied in and out of the rings without syscalls, a reader polls its ring for
+ * a while after draining it and then sleeps on its eventfd, which the writer
+ * signals only when the reader is sleeping. Polling runs inside the event
+ * loop, so it is bounded by time as well as by iterations. The memory is
+ * sealed before it is passed so that the peer cannot resize it under us. The
+ * stream socket stays open to detect the peer going away.
+ */
+
+#define LISTEN_QUEUE 15
+#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
+#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
+#define PKT_DATA_SZ (sizeof(vde_hdr) + MAX_HEAD_SZ + sizeof(struct eth_frame) \
+                     + MAX_TAIL_SZ)
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+#define SHM_MAGIC 0x76646573 // "vdes"
+#define SHM_VERSION 1
+#define SHM_DEFAULT_SLOTS 1024
+#define SHM_MAX_SLOTS 65536
+#define SHM_DEFAULT_SPIN 1024 // max polling iterations before sleeping
+#define SHM_SPIN_MAX_NS 20000 // max time spent polling by a single read event
+#define SHM_SPIN_CHECK 64 // polling iterations between clock reads
+#define SHM_SEALS (F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL)
+#define SHM_BUDGET 64 // max packets delivered by a single read event
+
+// packets pool of a connection, it grows up to the number of slots
+#define PKT_POOL_SLAB 64
+#define PKT_POOL_LOW_WM 64
+
+#define SHM_CACHELINE 64
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots; // slots per ring, 0 to let the server choose
+} __attribute__((packed)) shm_hello;
+
+// fds passed by the server: the memory, the doorbell of the server and the
+// doorbell of the client
+#define SHM_NFDS 3
+
+/*
+ * Control block of a ring in shared memory. Indexes grow freely and are
+ * masked on access. The peer might be buggy or hostile, so everything read
+ * from shared memory is checked before use.
+ */
+typedef struct {
+  volatile uint32_t tail __attribute__ ((aligned (SHM_CACHELINE)));
+  volatile uint32_t head __attribute__ ((aligned (SHM_CACHELINE)));
+  // set by the reader while it waits for the doorbell
+  volatile uint32_t idle __attribute__ ((aligned (SHM_CACHELINE)));
+} shm_ring;
+
+typedef struct {
+  uint32_t len;
+  uint32_t reserved;
+  unsigned char frame[sizeof(struct eth_frame)];
+} shm_slot;
+
+#define SHM_SLOT_SZ ((sizeof(shm_slot) + SHM_CACHELINE - 1) & \
+                     ~(SHM_CACHELINE - 1))
+
+/*
+ * memory layout: ring 0 control, ring 1 control, ring 0 slots, ring 1 slots.
+ * The server writes ring 0 and the client writes ring 1.
+ */
+#define SHM_REGION_SZ(slots) (2 * sizeof(shm_ring) + 2 * (slots) * SHM_SLOT_SZ)
+
+typedef struct {
+  vde_pkt pkt;
+  char data[PKT_DATA_SZ];
+} shm_pkt;
+
+typedef struct {
+  int ctl_fd;
+  void *ctl_ev;
+  int doorbell; // rung by the peer when rx is no longer empty
+  void *doorbell_ev;
+  int peer_doorbell;
+  void *region;
+  size_t region_sz;
+  uint32_t slots;
+  shm_ring *tx;
+  shm_ring *rx;
+  unsigned char *tx_slots;
+  unsigned char *rx_slots;
+  unsigned int spin; // current polling iterations, adapted to the traffic
+  unsigned int max_spin;
+  vde_pool *pkt_pool;
+  vde_connection *conn;
+  vde_component *transport;
+  int server; // accepted connection, conn is initialized while negotiating
+} shm_conn;
+
+typedef struct {
+  char *path;
+  uint32_t slots;
+  unsigned int spin;
+  int listen_fd;
+  void *listen_event;
+  vde_list *pending_conns;
+} shm_tr;
+
+static inline shm_slot *shm_slot_at(unsigned char *slots, uint32_t nslots,
+                                    uint32_t idx)
+{
+  return (shm_slot *)(slots + (idx & (nslots - 1)) * SHM_SLOT_SZ);
+}
+
+static void shm_ring_doorbell(int fd)
+{
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot ring doorbell %d: %s", __PRETTY_FUNCTION__, fd,
+                strerror(errno));
+  }
+}
+
+/**
+ * @brief Publish packets written in tx and wake up the peer if it is sleeping
+ */
+static void shm_conn_publish(shm_conn *sc, uint32_t n)
+{
+  // slots must be visible before the new tail
+  __sync_synchronize();
+  sc->tx->tail += n;
+  // the tail must be visible before idle is checked, pairs with
+  // shm_conn_sleep()
+  __sync_synchronize();
+  if (sc->tx->idle && __sync_bool_compare_and_swap(&sc->tx->idle, 1, 0)) {
+    shm_ring_doorbell(sc->peer_doorbell);
+  }
+}
+
+/**
+ * @brief Wait for the doorbell, unless packets arrived in the meantime
+ */
+static void shm_conn_sleep(shm_conn *sc)
+{
+  sc->rx->idle = 1;
+  __sync_synchronize();
+  if (sc->rx->tail != sc->rx->head &&
+      __sync_bool_compare_and_swap(&sc->rx->idle, 1, 0)) {
+    shm_ring_doorbell(sc->doorbell);
+  }
+}
+
+/**
+ * @brief Release callback of packets allocated from a connection pool
+ */
+static void shm_pkt_release(vde_pkt *pkt, void *arg)
+{
+  vde_pool *pool = (vde_pool *)arg;
+
+  // pkt is the first member of shm_pkt
+  vde_cached_pool_free(pool, pkt);
+}
+
+static void shm_conn_close_fatal(shm_conn *sc)
+{
+  vde_connection *conn = sc->conn;
+
+  if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+      (errno == EPIPE)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_warning("%s: got fatal error on ctl_fd %d but connection not closed",
+              __PRETTY_FUNCTION__, sc->ctl_fd);
+}
+
+/**
+ * @brief Deliver up to a batch of packets from the rx ring
+ *
+ * @return the number of packets taken from the ring, -1 if the connection has
+ * been closed
+ */
+static int shm_conn_deliver(shm_conn *sc, unsigned int max)
+{
+  shm_pkt stack_pkt;
+  shm_pkt *s_pkt;
+  shm_slot *slot;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  uint32_t head, avail, len;
+  unsigned int i, n;
+  int cb_errno = 0;
+  vde_connection *conn = sc->conn;
+
+  head = sc->rx->head;
+  avail = sc->rx->tail - head;
+  if (avail > sc->slots) {
+    vde_error("%s: corrupted ring on ctl_fd %d", __PRETTY_FUNCTION__,
+              sc->ctl_fd);
+    shm_conn_close_fatal(sc);
+    return -1;
+  }
+  // pairs with the barrier in shm_conn_publish()
+  __sync_synchronize();
+
+  if (max > VDE_PKT_BATCH_MAX) {
+    max = VDE_PKT_BATCH_MAX;
+  }
+  vde_pkt_batch_init(&batch);
+  for (n = 0; n < avail && n < max; n++) {
+    slot = shm_slot_at(sc->rx_slots, sc->slots, head + n);
+    len = slot->len;
+
+    s_pkt = vde_cached_pool_alloc(sc->pkt_pool);
+    if (s_pkt != NULL) {
+      pkt = &s_pkt->pkt;
+      vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
+                   vde_connection_get_pkt_tailsize(conn));
+      vde_pkt_set_release(pkt, shm_pkt_release, sc->pkt_pool);
+    } else if (n == 0) {
+      // the pool is exhausted, deliver a single private packet
+      pkt = &stack_pkt.pkt;
+      vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
+                   vde_connection_get_pkt_tailsize(conn));
+      max = 1;
+    } else {
+      break;
+    }
+
+    if (len < sizeof(struct eth_hdr) || len > sizeof(struct eth_frame)) {
+      vde_warning("%s: bad frame length %u on ctl_fd %d, discarding",
+                  __PRETTY_FUNCTION__, len, sc->ctl_fd);
+      if (vde_pkt_is_shared(pkt)) {
+        vde_pkt_put(pkt);
+      }
+      continue;
+    }
+    memcpy(pkt->payload, slot->frame, len);
+    // XXX: set hdr version and type
+    pkt->hdr->pkt_len = len;
+    vde_pkt_batch_add(&batch, pkt);
+  }
+
+  // slots must have been read before the peer can reuse them
+  __sync_synchronize();
+  sc->rx->head = head + n;
+
+  if (batch.len > 0 && vde_connection_call_read_batch(conn, &batch)) {
+    cb_errno = errno;
+  }
+  // whoever still needs a packet holds its own reference
+  for (i = 0; i < batch.len; i++) {
+    if (vde_pkt_is_shared(batch.pkts[i])) {
+      vde_pkt_put(batch.pkts[i]);
+    }
+  }
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return n;
+}
+
+/**
+ * @brief Poll the receive ring for at most sc->spin iterations and
+ * SHM_SPIN_MAX_NS nanoseconds, the loop is blocked meanwhile
+ *
+ * @return 1 if the ring is not empty, 0 otherwise
+ */
+static int shm_conn_poll(shm_conn *sc)
+{
+  unsigned int i;
+  struct timespec start, now;
+
+  if (sc->spin == 0) {
+    return sc->rx->tail != sc->rx->head;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 1; i <= sc->spin; i++) {
+    __sync_synchronize();
+    if (sc->rx->tail != sc->rx->head) {
+      return 1;
+    }
+    if (i % SHM_SPIN_CHECK == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - start.tv_sec) * 1000000000L +
+          (now.tv_nsec - start.tv_nsec) > SHM_SPIN_MAX_NS) {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+void shm_conn_read_data_event(int fd, short event_type, void *arg)
+{
+  uint64_t count;
+  unsigned int delivered = 0;
+  int n;
+  shm_conn *sc = (shm_conn *)arg;
+
+  if ( (vde_connection_get_pkt_headsize(sc->conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(sc->conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    return;
+  }
+
+  if (read(sc->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot read doorbell %d: %s", __PRETTY_FUNCTION__,
+                sc->doorbell, strerror(errno));
+  }
+
+  while (delivered < SHM_BUDGET) {
+    if (sc->rx->tail == sc->rx->head) {
+      // poll for a while before going to sleep, the more polling pays off
+      // the longer we poll
+      if (!shm_conn_poll(sc)) {
+        sc->spin /= 2;
+        shm_conn_sleep(sc);
+        return;
+      }
+      sc->spin = sc->spin ? sc->spin * 2 : 1;
+      if (sc->spin > sc->max_spin) {
+        sc->spin = sc->max_spin;
+      }
+    }
+    n = shm_conn_deliver(sc, SHM_BUDGET - delivered);
+    if (n < 0) {
+      return;
+    }
+    if (n == 0) {
+      // only when the pool is exhausted, retry later
+      break;
+    }
+    delivered += n;
+  }
+
+  // budget exhausted, come back after other events
+  shm_ring_doorbell(sc->doorbell);
+}
+
+void shm_conn_read_ctl_event(int ctl_fd, short event_type, void *arg)
+{
+  int len;
+  char buf[64];
+  shm_conn *sc = (shm_conn *)arg;
+
+  len = read(sc->ctl_fd, buf, sizeof(buf));
+  if (len < 0 && errno == EAGAIN) {
+    return;
+  }
+  if (len > 0) {
+    vde_warning("%s: unexpected data exchange on ctl_fd", __PRETTY_FUNCTION__);
+    return;
+  }
+  shm_conn_close_fatal(sc);
+}
+
+/**
+ * @brief Copy a packet in the next free slot, it is not published
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_conn_enqueue(shm_conn *sc, vde_pkt *pkt, uint32_t pending)
+{
+  shm_slot *slot;
+  vde_pkt_offload offload;
+  uint32_t tail = sc->tx->tail + pending;
+
+  if (tail - sc->tx->head >= sc->slots) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (pkt->hdr->pkt_len > sizeof(struct eth_frame)) {
+    vde_warning("%s: packet size larger than a slot, discarding",
+                __PRETTY_FUNCTION__);
+    errno = EBADMSG;
+    return -1;
+  }
+  slot = shm_slot_at(sc->tx_slots, sc->slots, tail);
+  slot->len = pkt->hdr->pkt_len;
+  memcpy(slot->frame, pkt->payload, pkt->hdr->pkt_len);
+  // the peer gets plain frames, partial checksums are completed in the slot
+  offload = pkt->offload;
+  if (vde_pkt_csum_complete(&offload, slot->frame, slot->len)) {
+    vde_warning("%s: bad checksum offsets, discarding", __PRETTY_FUNCTION__);
+    errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+int shm_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  shm_conn *sc = vde_connection_get_priv(conn);
+
+  if (shm_conn_enqueue(sc, pkt, 0)) {
+    return -1;
+  }
+  shm_conn_publish(sc, 1);
+  return 0;
+}
+
+int shm_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  shm_conn *sc = vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (shm_conn_enqueue(sc, batch->pkts[i], i)) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    // a single wakeup for the whole batch
+    shm_conn_publish(sc, i);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+static void shm_conn_free(shm_conn *sc)
+{
+  vde_context *ctx = vde_component_get_context(sc->transport);
+
+  if (sc->ctl_ev != NULL) {
+    vde_context_event_del(ctx, sc->ctl_ev);
+  }
+  if (sc->doorbell_ev != NULL) {
+    vde_context_event_del(ctx, sc->doorbell_ev);
+  }
+  if (sc->ctl_fd >= 0) {
+    close(sc->ctl_fd);
+  }
+  if (sc->doorbell >= 0) {
+    close(sc->doorbell);
+  }
+  if (sc->peer_doorbell >= 0) {
+    close(sc->peer_doorbell);
+  }
+  if (sc->region != NULL) {
+    munmap(sc->region, sc->region_sz);
+  }
+  // packets of this connection still referenced elsewhere keep the pool alive
+  if (sc->pkt_pool != NULL) {
+    vde_pool_delete(sc->pkt_pool);
+  }
+  vde_free(sc);
+}
+
+void shm_conn_close(vde_connection *conn)
+{
+  shm_conn *sc = vde_connection_get_priv(conn);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  shm_conn_free(sc);
+}
+
+static shm_conn *shm_conn_new(vde_component *component, vde_connection *conn,
+                              int ctl_fd)
+{
+  shm_conn *sc;
+
+  sc = (shm_conn *)vde_calloc(sizeof(shm_conn));
+  if (sc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  sc->ctl_fd = ctl_fd;
+  sc->doorbell = -1;
+  sc->peer_doorbell = -1;
+  sc->conn = conn;
+  sc->transport = component;
+  return sc;
+}
+
+/**
+ * @brief Map the rings and start serving a connection
+ *
+ * @param sc The connection
+ * @param mem_fd The memfd holding the rings
+ * @param server 1 if called by the server, 0 by the client
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_conn_start(shm_conn *sc, int mem_fd, int server)
+{
+  unsigned int low_wm;
+  shm_ring *rings;
+  unsigned char *slots;
+  vde_context *ctx = vde_component_get_context(sc->transport);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  sc->region_sz = SHM_REGION_SZ(sc->slots);
+  sc->region = mmap(NULL, sc->region_sz, PROT_READ|PROT_WRITE, MAP_SHARED,
+                    mem_fd, 0);
+  if (sc->region == MAP_FAILED) {
+    sc->region = NULL;
+    vde_error("%s: cannot map shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  rings = (shm_ring *)sc->region;
+  slots = (unsigned char *)(rings + 2);
+  sc->tx = &rings[server ? 0 : 1];
+  sc->rx = &rings[server ? 1 : 0];
+  sc->tx_slots = slots + (server ? 0 : sc->slots) * SHM_SLOT_SZ;
+  sc->rx_slots = slots + (server ? sc->slots : 0) * SHM_SLOT_SZ;
+  sc->max_spin = tr->spin;
+  sc->spin = tr->spin;
+
+  low_wm = sc->slots < PKT_POOL_LOW_WM ? sc->slots : PKT_POOL_LOW_WM;
+  sc->pkt_pool = vde_pool_new(sizeof(shm_pkt), PKT_POOL_SLAB, low_wm,
+                              sc->slots);
+  if (sc->pkt_pool == NULL) {
+    vde_error("%s: cannot create packets pool", __PRETTY_FUNCTION__);
+    return -1;
+  }
+
+  sc->ctl_ev = vde_context_event_add(ctx, sc->ctl_fd,
+                                     VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                     &shm_conn_read_ctl_event, (void *)sc);
+  if (sc->ctl_ev == NULL) {
+    vde_error("%s: cannot add control event", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  sc->doorbell_ev = vde_context_event_add(ctx, sc->doorbell,
+                                          VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                          &shm_conn_read_data_event,
+                                          (void *)sc);
+  if (sc->doorbell_ev == NULL) {
+    vde_error("%s: cannot add doorbell event", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  // frames might have been written before the doorbell event was added
+  shm_conn_sleep(sc);
+  return 0;
+}
+
+/**
+ * @brief Choose the number of slots per ring, a power of two
+ */
+static uint32_t shm_slots_negotiate(uint32_t local, uint32_t remote)
+{
+  uint32_t slots = local;
+
+  if (remote != 0 && remote < slots) {
+    slots = remote;
+  }
+  while (slots & (slots - 1)) {
+    slots &= slots - 1;
+  }
+  return slots;
+}
+
+void shm_srv_get_hello(int ctl_fd, short event_type, void *arg)
+{
+  int len, i;
+  int fds[SHM_NFDS] = { -1, -1, -1 };
+  shm_hello hello;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  shm_conn *sc = (shm_conn *)arg;
+  vde_connection *conn = sc->conn;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+  vde_context *ctx = vde_component_get_context(sc->transport);
+
+  vde_context_event_del(ctx, sc->ctl_ev);
+  sc->ctl_ev = NULL;
+
+  // XXX: define a behaviour when called if event timeout expired
+  len = read(sc->ctl_fd, &hello, sizeof(hello));
+  if (len != sizeof(hello)) {
+    vde_error("%s: cannot read request", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION ||
+      hello.slots > SHM_MAX_SLOTS) {
+    vde_error("%s: received an invalid request", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  sc->slots = shm_slots_negotiate(tr->slots, hello.slots);
+
+  fds[0] = memfd_create("vde3_shm", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (fds[0] < 0) {
+    vde_error("%s: cannot create shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (ftruncate(fds[0], SHM_REGION_SZ(sc->slots)) < 0) {
+    vde_error("%s: cannot size shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  // the peer maps it too, a truncation would fault our accesses
+  if (fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) < 0) {
+    vde_error("%s: cannot seal shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (fds[1] < 0 || fds[2] < 0) {
+    vde_error("%s: cannot create doorbells: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  hello.magic = SHM_MAGIC;
+  hello.version = SHM_VERSION;
+  hello.slots = sc->slots;
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(sc->ctl_fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+    vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  sc->doorbell = fds[1];
+  sc->peer_doorbell = fds[2];
+  fds[1] = fds[2] = -1;
+  if (shm_conn_start(sc, fds[0], 1)) {
+    goto error;
+  }
+  // the mapping keeps the memory
+  close(fds[0]);
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  vde_transport_call_cm_accept_cb(sc->transport, conn);
+  return;
+
+error:
+  // XXX: call connection manager error callback here?
+  for (i = 0; i < SHM_NFDS; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
+}
+
+void shm_accept(int listen_fd, short event_type, void *arg)
+{
+  struct sockaddr_un sa;
+  socklen_t sa_len = sizeof(sa);
+  int new;
+  vde_connection *conn;
+  shm_conn *sc;
+  vde_component *component = (vde_component *)arg;
+  vde_context *ctx = vde_component_get_context(component);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+
+  new = accept4(listen_fd, (struct sockaddr *)&sa, &sa_len,
+                SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (new < 0) {
+    vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+    return;
+  }
+  if (vde_connection_new(&conn)) {
+    vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+    close(new);
+    return;
+  }
+  sc = shm_conn_new(component, conn, new);
+  if (sc == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    vde_connection_delete(conn);
+    close(new);
+    return;
+  }
+
+  sc->server = 1;
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, sc);
+
+  vde_connection_init(conn, ctx, sizeof(struct eth_frame), &shm_conn_write,
+                      &shm_conn_close, (void *)sc);
+  vde_connection_set_be_write_batch(conn, &shm_conn_write_batch);
+
+  // XXX: check event NULL and define a timeout
+  sc->ctl_ev = vde_context_event_add(ctx, sc->ctl_fd, VDE_EV_READ, NULL,
+                                     &shm_srv_get_hello, (void *)sc);
+}
+
+int shm_listen(vde_component *component)
+{
+  int tmp_errno;
+  struct sockaddr_un sa_unix;
+  vde_context *ctx = vde_component_get_context(component);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = socket(PF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (tr->listen_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  memset(&sa_unix, 0, sizeof(sa_unix));
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s", tr->path);
+  // a stale socket left by a dead process is replaced
+  if (unlink(sa_unix.sun_path) < 0 && errno != ENOENT) {
+    tmp_errno = errno;
+    vde_error("%s: Could not remove %s: %s", __PRETTY_FUNCTION__, tr->path,
+              strerror(errno));
+    goto error_close;
+  }
+  if (bind(tr->listen_fd, (struct sockaddr *)&sa_unix, sizeof(sa_unix)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not bind to %s: %s", __PRETTY_FUNCTION__, tr->path,
+              strerror(errno));
+    goto error_close;
+  }
+  if (listen(tr->listen_fd, LISTEN_QUEUE) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not listen: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_unlink;
+  }
+
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &shm_accept, (void *)component);
+  if (tr->listen_event == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: Could not add listen event", __PRETTY_FUNCTION__);
+    goto error_unlink;
+  }
+
+  return 0;
+
+error_unlink:
+  unlink(sa_unix.sun_path);
+error_close:
+  close(tr->listen_fd);
+  tr->listen_fd = -1;
+error:
+  errno = tmp_errno;
+  return -1;
+}
+
+void shm_cli_get_hello(int ctl_fd, short event_type, void *arg)
+{
+  int len, i, nfds = 0, tmp_errno = EPROTO;
+  int fds[SHM_NFDS] = { -1, -1, -1 };
+  shm_hello hello;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  struct stat st;
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  shm_conn *sc = (shm_conn *)arg;
+  vde_connection *conn = sc->conn;
+  vde_component *component = sc->transport;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+  vde_context *ctx = vde_component_get_context(component);
+
+  vde_context_event_del(ctx, sc->ctl_ev);
+  sc->ctl_ev = NULL;
+
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  len = recvmsg(sc->ctl_fd, &msg, MSG_CMSG_CLOEXEC);
+  if (len < 0) {
+    tmp_errno = errno;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (nfds > SHM_NFDS) {
+        nfds = SHM_NFDS;
+      }
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+      break;
+    }
+  }
+  if (len != sizeof(hello) || nfds != SHM_NFDS ||
+      (msg.msg_flags & MSG_CTRUNC)) {
+    vde_error("%s: cannot read reply", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION ||
+      hello.slots == 0 || hello.slots > SHM_MAX_SLOTS ||
+      (hello.slots & (hello.slots - 1))) {
+    vde_error("%s: received an invalid reply", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  sc->slots = hello.slots;
+  if (fstat(fds[0], &st) < 0 ||
+      (size_t)st.st_size < SHM_REGION_SZ(sc->slots)) {
+    vde_error("%s: shared memory too small", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  if ((fcntl(fds[0], F_GET_SEALS) & SHM_SEALS) != SHM_SEALS) {
+    vde_error("%s: shared memory not sealed", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  sc->doorbell = fds[2];
+  sc->peer_doorbell = fds[1];
+  fds[1] = fds[2] = -1;
+  vde_connection_init(conn, ctx, sizeof(struct eth_frame), &shm_conn_write,
+                      &shm_conn_close, (void *)sc);
+  vde_connection_set_be_write_batch(conn, &shm_conn_write_batch);
+  if (shm_conn_start(sc, fds[0], 0)) {
+    tmp_errno = errno;
+    goto error;
+  }
+  close(fds[0]);
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  vde_transport_call_cm_connect_cb(component, conn);
+  return;
+
+error:
+  for (i = 0; i < SHM_NFDS; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  shm_conn_free(sc);
+  // the connection manager owns conn
+  vde_transport_call_cm_error_cb(component, conn, tmp_errno);
+}
+
+int shm_connect(vde_component *component, vde_connection *conn)
+{
+  int fd, tmp_errno;
+  struct sockaddr_un sa_unix;
+  shm_hello hello;
+  shm_conn *sc;
+  vde_context *ctx = vde_component_get_context(component);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+
+  fd = socket(PF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  memset(&sa_unix, 0, sizeof(sa_unix));
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s", tr->path);
+  if (connect(fd, (struct sockaddr *)&sa_unix, sizeof(sa_unix)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not connect to %s: %s", __PRETTY_FUNCTION__,
+              tr->path, strerror(errno));
+    goto error_close;
+  }
+  hello.magic = SHM_MAGIC;
+  hello.version = SHM_VERSION;
+  hello.slots = tr->slots;
+  if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+    tmp_errno = errno;
+    vde_error("%s: Could not send request: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+
+  sc = shm_conn_new(component, conn, fd);
+  if (sc == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    goto error_close;
+  }
+  // XXX: define a timeout
+  sc->ctl_ev = vde_context_event_add(ctx, fd, VDE_EV_READ, NULL,
+                                     &shm_cli_get_hello, (void *)sc);
+  if (sc->ctl_ev == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot add control event", __PRETTY_FUNCTION__);
+    // closes fd
+    shm_conn_free(sc);
+    goto error;
+  }
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, sc);
+  return 0;
+
+error_close:
+  close(fd);
+error:
+  errno = tmp_errno;
+  return -1;
+}
+
+static int transport_shm_init(vde_component *component, vde_sobj *params)
+{
+  shm_tr *tr;
+  vde_sobj *path_sobj, *slots_sobj, *spin_sobj;
+  const char *path;
+  int slots = SHM_DEFAULT_SLOTS;
+  int spin = SHM_DEFAULT_SPIN;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (!path_sobj || !vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no socket path received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  path = vde_sobj_get_string(path_sobj);
+
+  if (strlen(path) >= UNIX_PATH_MAX) {
+    vde_error("%s: socket path is too long", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: frames per ring, rounded down to a power of two
+  slots_sobj = vde_sobj_hash_lookup(params, "slots");
+  if (slots_sobj) {
+    if (!vde_sobj_is_type(slots_sobj, vde_sobj_type_int)) {
+      vde_error("%s: slots must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    slots = vde_sobj_get_int(slots_sobj);
+    if (slots < 1 || slots > SHM_MAX_SLOTS) {
+      vde_error("%s: slots must be between 1 and %d", __PRETTY_FUNCTION__,
+                SHM_MAX_SLOTS);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  // optional: max polling iterations on an empty ring, 0 to always sleep
+  spin_sobj = vde_sobj_hash_lookup(params, "spin");
+  if (spin_sobj) {
+    if (!vde_sobj_is_type(spin_sobj, vde_sobj_type_int)) {
+      vde_error("%s: spin must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    spin = vde_sobj_get_int(spin_sobj);
+    if (spin < 0) {
+      vde_error("%s: spin must not be negative", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  tr = (shm_tr *)vde_calloc(sizeof(shm_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tr->slots = shm_slots_negotiate(slots, 0);
+  tr->spin = spin;
+  tr->listen_fd = -1;
+  tr->path = strdup(path);
+  if (tr->path == NULL) {
+    vde_free(tr);
+    vde_error("%s: could not allocate private path", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_shm_fini(vde_component *component)
+{
+  vde_connection *conn;
+  shm_conn *sc;
+  shm_tr *tr;
+
+  vde_assert(component != NULL);
+
+  tr = (shm_tr *)vde_component_get_priv(component);
+
+  // connections still negotiating
+  while (tr->pending_conns != NULL) {
+    sc = (shm_conn *)vde_list_get_data(tr->pending_conns);
+    conn = sc->conn;
+    if (sc->server) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    } else {
+      // the connection manager owns conn
+      tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+      shm_conn_free(sc);
+      vde_transport_call_cm_error_cb(component, conn, ECANCELED);
+    }
+  }
+  if (tr->listen_event != NULL) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->listen_event);
+  }
+  if (tr->listen_fd >= 0) {
+    close(tr->listen_fd);
+    unlink(tr->path);
+  }
+  free(tr->path);
+  vde_free(tr);
+}
+
+component_ops transport_shm_component_ops = {
+  .init = transport_shm_init,
+  .fini = transport_shm_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "shm",
+  .cops = &transport_shm_component_ops,
+  .tr_listen = &shm_listen,
+  .tr_connect = &shm_connect,
+};
@@ -0,0 +1,920 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+/*
+ * Stream transport
+ *
+ * Packets travel over a TCP or unix stream socket, each one preceded by a
+ * 4 bytes header: version (1 byte), type (1 byte) and payload length (2 bytes,
+ * network byte order), as in vde_hdr. The largest payload is then 65535 bytes.
+ *
+ * Packets written to a connection are queued and sent by the write event with
+ * a single writev() for the whole queue, received data is parsed in as many
+ * packets as it contains and handed over in batches.
+ */
+
+#define LISTEN_QUEUE 15
+#define STREAM_HDR_SZ 4
+#define STREAM_PAYLOAD_MAX 65535 // as vde_hdr.pkt_len
+#define STREAM_RX_BUF_SZ (4 * (STREAM_HDR_SZ + STREAM_PAYLOAD_MAX))
+#define STREAM_IOV_MAX 128 // iovecs per writev(), two per packet
+#define STREAM_QUEUE_LEN 1024
+
+#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
+#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
+#define PKT_DATA_SZ (sizeof(vde_hdr) + MAX_HEAD_SZ + sizeof(struct eth_frame) \
+                     + MAX_TAIL_SZ)
+
+// packets pool of a connection, for ethernet sized packets
+#define PKT_POOL_SLAB 64
+#define PKT_POOL_LOW_WM 64
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+typedef struct {
+  int fd;
+  void *rd_ev;
+  void *wr_ev;
+  unsigned char *rx_buf;
+  unsigned int rx_len; // bytes received, not parsed yet
+  vde_ring *tx_queue;
+  unsigned int tx_off; // bytes of the head packet already sent, header included
+  vde_pool *pkt_pool;
+  vde_context *context;
+  vde_connection *conn;
+  vde_component *transport; // set while connecting
+} stream_conn;
+
+typedef struct {
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  unsigned int queue_len;
+  int listen_fd;
+  void *listen_event;
+  vde_list *pending_conns;
+} stream_tr;
+
+/**
+ * @brief Release callback of packets allocated from a connection pool
+ */
+static void stream_pkt_release(vde_pkt *pkt, void *arg)
+{
+  vde_pool *pool = (vde_pool *)arg;
+
+  vde_cached_pool_free(pool, pkt);
+}
+
+/**
+ * @brief Alloc a packet for a payload of len bytes, from the pool of the
+ * connection when it fits
+ */
+static vde_pkt *stream_conn_pkt_alloc(stream_conn *sc, unsigned int len,
+                                      unsigned int head, unsigned int tail)
+{
+  vde_pkt *pkt;
+
+  if (sizeof(vde_hdr) + head + len + tail > PKT_DATA_SZ) {
+    return vde_pkt_new(len, head, tail);
+  }
+  pkt = vde_cached_pool_alloc(sc->pkt_pool);
+  if (pkt == NULL) {
+    return NULL;
+  }
+  vde_pkt_init(pkt, PKT_DATA_SZ, head, tail);
+  vde_pkt_set_release(pkt, stream_pkt_release, sc->pkt_pool);
+  return pkt;
+}
+
+static void stream_conn_free(stream_conn *sc)
+{
+  vde_pkt *pkt;
+
+  if (sc->rd_ev != NULL) {
+    vde_context_event_del(sc->context, sc->rd_ev);
+  }
+  if (sc->wr_ev != NULL) {
+    vde_context_event_del(sc->context, sc->wr_ev);
+  }
+  if (sc->fd >= 0) {
+    close(sc->fd);
+  }
+  pkt = vde_ring_pop(sc->tx_queue);
+  while (pkt != NULL) {
+    vde_pkt_put(pkt);
+    pkt = vde_ring_pop(sc->tx_queue);
+  }
+  vde_ring_delete(sc->tx_queue);
+  vde_free(sc->rx_buf);
+  // packets of this connection still referenced elsewhere keep the pool alive
+  vde_pool_delete(sc->pkt_pool);
+  vde_free(sc);
+}
+
+static void stream_conn_close_fatal(stream_conn *sc, vde_pkt *pkt,
+                                    vde_conn_error err)
+{
+  vde_connection *conn = sc->conn;
+
+  if (vde_connection_call_error(conn, pkt, err) && (errno == EPIPE)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_warning("%s: got fatal error on stream fd %d but connection not closed",
+              __PRETTY_FUNCTION__, sc->fd);
+}
+
+/**
+ * @brief Hand a batch of received packets over and drop our references
+ *
+ * @return zero on success, -1 if the connection has been closed
+ */
+static int stream_conn_deliver(stream_conn *sc, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int cb_errno = 0;
+  vde_connection *conn = sc->conn;
+
+  if (batch->len == 0) {
+    return 0;
+  }
+  if (vde_connection_call_read_batch(conn, batch)) {
+    cb_errno = errno;
+  }
+  // whoever still needs a packet holds its own reference
+  for (i = 0; i < batch->len; i++) {
+    vde_pkt_put(batch->pkts[i]);
+  }
+  vde_pkt_batch_init(batch);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+void stream_conn_read_event(int fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  unsigned char *buf;
+  unsigned int len, off = 0;
+  ssize_t n;
+  stream_conn *sc = (stream_conn *)arg;
+  vde_connection *conn = sc->conn;
+
+  if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    return;
+  }
+
+  n = read(sc->fd, sc->rx_buf + sc->rx_len, STREAM_RX_BUF_SZ - sc->rx_len);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return;
+    }
+    vde_error("%s: error reading from stream fd %d: %s", __PRETTY_FUNCTION__,
+              sc->fd, strerror(errno));
+    stream_conn_close_fatal(sc, NULL, CONN_READ_CLOSED);
+    return;
+  }
+  if (n == 0) {
+    stream_conn_close_fatal(sc, NULL, CONN_READ_CLOSED);
+    return;
+  }
+  sc->rx_len += n;
+
+  // every complete packet in the buffer, a batch at a time
+  vde_pkt_batch_init(&batch);
+  while (sc->rx_len - off >= STREAM_HDR_SZ) {
+    buf = sc->rx_buf + off;
+    len = (buf[2] << 8) | buf[3];
+    if (sc->rx_len - off < STREAM_HDR_SZ + len) {
+      break;
+    }
+    off += STREAM_HDR_SZ + len;
+    if (len == 0) {
+      continue;
+    }
+
+    pkt = stream_conn_pkt_alloc(sc, len, vde_connection_get_pkt_headsize(conn),
+                                vde_connection_get_pkt_tailsize(conn));
+    if (pkt == NULL) {
+      vde_warning("%s: cannot alloc new pkt, discarding", __PRETTY_FUNCTION__);
+      continue;
+    }
+    pkt->hdr->version = buf[0];
+    pkt->hdr->type = buf[1];
+    pkt->hdr->pkt_len = len;
+    memcpy(pkt->payload, buf + STREAM_HDR_SZ, len);
+    vde_pkt_batch_add(&batch, pkt);
+    if (vde_pkt_batch_full(&batch) && stream_conn_deliver(sc, &batch)) {
+      return;
+    }
+  }
+  if (stream_conn_deliver(sc, &batch)) {
+    return;
+  }
+
+  // keep the partial packet for the next read
+  sc->rx_len -= off;
+  if (sc->rx_len > 0 && off > 0) {
+    memmove(sc->rx_buf, sc->rx_buf + off, sc->rx_len);
+  }
+}
+
+void stream_conn_write_event(int fd, short event_type, void *arg)
+{
+  struct iovec iovs[STREAM_IOV_MAX];
+  unsigned char hdrs[STREAM_IOV_MAX / 2][STREAM_HDR_SZ];
+  vde_pkt *pkt;
+  unsigned int i, n, niovs, skip, pkt_sz;
+  ssize_t nsent;
+  int cb_errno = 0;
+  stream_conn *sc = (stream_conn *)arg;
+  vde_connection *conn = sc->conn;
+
+  while (!vde_ring_is_empty(sc->tx_queue)) {
+    // the head of the queue, as many packets as fit in a writev()
+    niovs = 0;
+    for (n = 0; n < STREAM_IOV_MAX / 2; n++) {
+      pkt = vde_ring_peek_nth(sc->tx_queue, n);
+      if (pkt == NULL) {
+        break;
+      }
+      hdrs[n][0] = pkt->hdr->version;
+      hdrs[n][1] = pkt->hdr->type;
+      hdrs[n][2] = pkt->hdr->pkt_len >> 8;
+      hdrs[n][3] = pkt->hdr->pkt_len & 0xff;
+      iovs[niovs].iov_base = hdrs[n];
+      iovs[niovs].iov_len = STREAM_HDR_SZ;
+      niovs++;
+      iovs[niovs].iov_base = pkt->payload;
+      iovs[niovs].iov_len = pkt->hdr->pkt_len;
+      niovs++;
+    }
+    // the head packet might have been partially sent already
+    skip = sc->tx_off;
+    for (i = 0; skip > 0; i++) {
+      if (skip < iovs[i].iov_len) {
+        iovs[i].iov_base = (char *)iovs[i].iov_base + skip;
+        iovs[i].iov_len -= skip;
+        break;
+      }
+      skip -= iovs[i].iov_len;
+      iovs[i].iov_len = 0;
+    }
+
+    nsent = writev(sc->fd, iovs, niovs);
+    if (nsent < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return;
+      }
+      vde_error("%s: error writing to stream fd %d: %s", __PRETTY_FUNCTION__,
+                sc->fd, strerror(errno));
+      stream_conn_close_fatal(sc, NULL, CONN_WRITE_CLOSED);
+      return;
+    }
+
+    // drop the packets sent as a whole
+    nsent += sc->tx_off;
+    for (i = 0; i < n; i++) {
+      pkt = vde_ring_peek(sc->tx_queue);
+      pkt_sz = STREAM_HDR_SZ + pkt->hdr->pkt_len;
+      if ((size_t)nsent < pkt_sz) {
+        break;
+      }
+      nsent -= pkt_sz;
+      vde_ring_discard(sc->tx_queue, 1);
+      if (vde_connection_call_write(conn, pkt)) {
+        cb_errno = errno;
+      }
+      vde_pkt_put(pkt);
+      if (cb_errno == EPIPE) {
+        vde_connection_fini(conn);
+        vde_connection_delete(conn);
+        return;
+      }
+    }
+    sc->tx_off = nsent;
+    if (i < n) {
+      // the socket buffer is full
+      return;
+    }
+  }
+
+  vde_context_event_del(sc->context, sc->wr_ev);
+  sc->wr_ev = NULL;
+}
+
+/**
+ * @brief Put a packet in the send queue of a connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int stream_conn_enqueue(stream_conn *sc, vde_pkt *pkt)
+{
+  vde_pkt *copy;
+
+  if (vde_ring_check_push(sc->tx_queue)) {
+    vde_warning("%s: packet queue for %d is full, discarding",
+                __PRETTY_FUNCTION__, sc->fd);
+    errno = EAGAIN;
+    return -1;
+  }
+  if (vde_pkt_needs_gso(pkt)) {
+    // offload metadata does not travel with the packet
+    vde_warning("%s: packet needs segmentation, discarding",
+                __PRETTY_FUNCTION__);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  // partial checksums are completed on a private copy
+  if (vde_pkt_is_shared(pkt) &&
+      !(pkt->offload.flags & VDE_PKT_CSUM_PARTIAL)) {
+    // keep a reference, the packet is not going to change under us
+    vde_ring_push(sc->tx_queue, vde_pkt_get(pkt));
+    return 0;
+  }
+
+  copy = stream_conn_pkt_alloc(sc, pkt->hdr->pkt_len, 0, 0);
+  if (copy == NULL) {
+    vde_warning("%s: cannot alloc new pkt, discarding", __PRETTY_FUNCTION__);
+    errno = ENOBUFS;
+    return -1;
+  }
+  vde_pkt_compact_cpy(copy, pkt);
+  if (vde_pkt_csum_complete(&copy->offload, copy->payload,
+                            copy->hdr->pkt_len)) {
+    vde_warning("%s: bad checksum offsets, discarding", __PRETTY_FUNCTION__);
+    vde_pkt_put(copy);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  // cannot fail, the ring is not full
+  vde_ring_push(sc->tx_queue, copy);
+  return 0;
+}
+
+static void stream_conn_schedule_write(stream_conn *sc)
+{
+  if (sc->wr_ev == NULL) {
+    // XXX: check event not NULL
+    sc->wr_ev = vde_context_event_add(sc->context, sc->fd,
+                                      VDE_EV_WRITE|VDE_EV_PERSIST, NULL,
+                                      &stream_conn_write_event, (void *)sc);
+  }
+}
+
+int stream_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  stream_conn *sc = vde_connection_get_priv(conn);
+
+  if (stream_conn_enqueue(sc, pkt)) {
+    return -1;
+  }
+  stream_conn_schedule_write(sc);
+  return 0;
+}
+
+int stream_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  stream_conn *sc = vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (stream_conn_enqueue(sc, batch->pkts[i])) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    stream_conn_schedule_write(sc);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+void stream_conn_queue_stats(vde_connection *conn, vde_conn_queue_stats *stats)
+{
+  stream_conn *sc = vde_connection_get_priv(conn);
+
+  vde_connection_ring_stats(sc->tx_queue, stats);
+}
+
+void stream_conn_close(vde_connection *conn)
+{
+  stream_conn_free(vde_connection_get_priv(conn));
+}
+
+/**
+ * @brief Alloc the backend of a connection, with no socket yet
+ *
+ * @return the backend on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static stream_conn *stream_conn_new(vde_component *component,
+                                    vde_connection *conn)
+{
+  unsigned int low_wm;
+  stream_conn *sc;
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  sc = (stream_conn *)vde_calloc(sizeof(stream_conn));
+  if (sc == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sc->fd = -1;
+  sc->conn = conn;
+  sc->context = vde_component_get_context(component);
+
+  sc->rx_buf = (unsigned char *)vde_alloc(STREAM_RX_BUF_SZ);
+  sc->tx_queue = vde_ring_new(tr->queue_len);
+  low_wm = tr->queue_len < PKT_POOL_LOW_WM ? tr->queue_len : PKT_POOL_LOW_WM;
+  sc->pkt_pool = vde_pool_new(sizeof(vde_pkt) + PKT_DATA_SZ, PKT_POOL_SLAB,
+                              low_wm, tr->queue_len + VDE_PKT_BATCH_MAX);
+  if (sc->rx_buf == NULL || sc->tx_queue == NULL || sc->pkt_pool == NULL) {
+    vde_error("%s: cannot create connection buffers", __PRETTY_FUNCTION__);
+    vde_free(sc->rx_buf);
+    if (sc->tx_queue != NULL) {
+      vde_ring_delete(sc->tx_queue);
+    }
+    if (sc->pkt_pool != NULL) {
+      vde_pool_delete(sc->pkt_pool);
+    }
+    vde_free(sc);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return sc;
+}
+
+/**
+ * @brief Start reading from a connected socket and initialize conn over it
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int stream_conn_start(stream_conn *sc)
+{
+  int one = 1;
+
+  // packets are already coalesced by writev()
+  setsockopt(sc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  sc->rd_ev = vde_context_event_add(sc->context, sc->fd,
+                                    VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                    &stream_conn_read_event, (void *)sc);
+  if (sc->rd_ev == NULL) {
+    vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+    errno = EIO;
+    return -1;
+  }
+  vde_connection_init(sc->conn, sc->context, STREAM_PAYLOAD_MAX,
+                      &stream_conn_write, &stream_conn_close, (void *)sc);
+  vde_connection_set_be_write_batch(sc->conn, &stream_conn_write_batch);
+  vde_connection_set_be_queue_stats(sc->conn, &stream_conn_queue_stats);
+  return 0;
+}
+
+void stream_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  vde_connection *conn;
+  stream_conn *sc;
+  vde_component *component = (vde_component *)arg;
+
+  new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (new < 0) {
+    vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+    return;
+  }
+  if (vde_connection_new(&conn)) {
+    vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+    goto error_close;
+  }
+  sc = stream_conn_new(component, conn);
+  if (sc == NULL) {
+    goto error_conn_del;
+  }
+  sc->fd = new;
+  if (stream_conn_start(sc)) {
+    stream_conn_free(sc);
+    vde_connection_delete(conn);
+    return;
+  }
+
+  vde_transport_call_cm_accept_cb(component, conn);
+  return;
+
+error_conn_del:
+  vde_connection_delete(conn);
+error_close:
+  close(new);
+}
+
+static int stream_remove_sock_if_unused(struct sockaddr_un *sa_unix)
+{
+  int test_fd, ret = 1;
+
+  if ((test_fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+    vde_error("%s: socket %s", __PRETTY_FUNCTION__, strerror(errno));
+    return 1;
+  }
+  if (connect(test_fd, (struct sockaddr *) sa_unix, sizeof(*sa_unix)) < 0) {
+    if (errno == ECONNREFUSED) {
+      if (unlink(sa_unix->sun_path) < 0) {
+        vde_error("%s: failed to removed unused socket '%s': %s",
+            __PRETTY_FUNCTION__, sa_unix->sun_path, strerror(errno));
+      }
+      ret = 0;
+    } else {
+      vde_error("%s: connect %s", __PRETTY_FUNCTION__, strerror(errno));
+    }
+  }
+  close(test_fd);
+  return ret;
+}
+
+int stream_listen(vde_component *component)
+{
+  int tmp_errno;
+  int one = 1;
+  vde_context *ctx = vde_component_get_context(component);
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = socket(tr->sa.ss_family, SOCK_STREAM|SOCK_NONBLOCK|
+                         SOCK_CLOEXEC, 0);
+  if (tr->listen_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (tr->sa.ss_family != AF_UNIX &&
+      setsockopt(tr->listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
+                 sizeof(one)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set socket options: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  if (bind(tr->listen_fd, (struct sockaddr *)&tr->sa, tr->sa_len) < 0) {
+    if (tr->sa.ss_family == AF_UNIX && errno == EADDRINUSE &&
+        !stream_remove_sock_if_unused((struct sockaddr_un *)&tr->sa)) {
+      if (bind(tr->listen_fd, (struct sockaddr *)&tr->sa, tr->sa_len) < 0) {
+        tmp_errno = errno;
+        vde_error("%s: Could not bind: %s", __PRETTY_FUNCTION__,
+                  strerror(errno));
+        goto error_close;
+      }
+    } else {
+      tmp_errno = errno;
+      vde_error("%s: Could not bind: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error_close;
+    }
+  }
+  if (listen(tr->listen_fd, LISTEN_QUEUE) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not listen: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_unlink;
+  }
+
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                           &stream_accept, (void *)component);
+  if (tr->listen_event == NULL) {
+    vde_error("%s: Could not add listen event", __PRETTY_FUNCTION__);
+    tmp_errno = EIO;
+    goto error_unlink;
+  }
+  return 0;
+
+error_unlink:
+  if (tr->sa.ss_family == AF_UNIX) {
+    unlink(((struct sockaddr_un *)&tr->sa)->sun_path);
+  }
+error_close:
+  close(tr->listen_fd);
+  tr->listen_fd = -1;
+error:
+  errno = tmp_errno;
+  return -1;
+}
+
+/**
+ * @brief Abort a connection being set up by stream_connect()
+ */
+static void stream_cli_error(stream_conn *sc, int tr_errno)
+{
+  vde_connection *conn = sc->conn;
+  vde_component *component = sc->transport;
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  stream_conn_free(sc);
+  // the connection manager owns conn
+  vde_transport_call_cm_error_cb(component, conn, tr_errno);
+}
+
+void stream_cli_connected(int fd, short event_type, void *arg)
+{
+  int sock_err = 0;
+  socklen_t sock_err_len = sizeof(sock_err);
+  stream_conn *sc = (stream_conn *)arg;
+  vde_component *component = sc->transport;
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  vde_context_event_del(sc->context, sc->wr_ev);
+  sc->wr_ev = NULL;
+
+  if (getsockopt(sc->fd, SOL_SOCKET, SO_ERROR, &sock_err,
+                 &sock_err_len) < 0) {
+    sock_err = errno;
+  }
+  if (sock_err) {
+    vde_error("%s: Could not connect: %s", __PRETTY_FUNCTION__,
+              strerror(sock_err));
+    stream_cli_error(sc, sock_err);
+    return;
+  }
+  if (stream_conn_start(sc)) {
+    stream_cli_error(sc, errno);
+    return;
+  }
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  sc->transport = NULL;
+  vde_transport_call_cm_connect_cb(component, sc->conn);
+}
+
+int stream_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  stream_conn *sc;
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  sc = stream_conn_new(component, conn);
+  if (sc == NULL) {
+    return -1;
+  }
+  sc->transport = component;
+
+  sc->fd = socket(tr->sa.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (sc->fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (connect(sc->fd, (struct sockaddr *)&tr->sa, tr->sa_len) < 0 &&
+      errno != EINPROGRESS) {
+    tmp_errno = errno;
+    vde_error("%s: Could not connect: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  // the outcome is known once the socket is writable
+  sc->wr_ev = vde_context_event_add(sc->context, sc->fd, VDE_EV_WRITE, NULL,
+                                    &stream_cli_connected, (void *)sc);
+  if (sc->wr_ev == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: Could not add connect event", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, sc);
+  return 0;
+
+error:
+  stream_conn_free(sc);
+  errno = tmp_errno;
+  return -1;
+}
+
+/**
+ * @brief Parse a TCP address given as "host:port" or "[host]:port"
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int stream_resolve(const char *str, struct sockaddr_storage *ss,
+                          socklen_t *ss_len)
+{
+  struct addrinfo hints, *res;
+  char host[256];
+  const char *sep;
+  size_t host_len;
+  int rv;
+
+  sep = strrchr(str, ':');
+  if (sep == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  host_len = sep - str;
+  if (str[0] == '[' && host_len >= 2 && str[host_len - 1] == ']') {
+    str++;
+    host_len -= 2;
+  }
+  if (host_len >= sizeof(host)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(host, str, host_len);
+  host[host_len] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE|AI_NUMERICSERV;
+  rv = getaddrinfo(host_len > 0 ? host : NULL, sep + 1, &hints, &res);
+  if (rv) {
+    vde_error("%s: cannot resolve %s: %s", __PRETTY_FUNCTION__, str,
+              gai_strerror(rv));
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(ss, res->ai_addr, res->ai_addrlen);
+  *ss_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int transport_stream_init(vde_component *component, vde_sobj *params)
+{
+  stream_tr *tr;
+  struct sockaddr_un *sa_unix;
+  vde_sobj *path_sobj, *address_sobj, *qlen_sobj;
+  const char *path = NULL, *address = NULL;
+  int queue_len = STREAM_QUEUE_LEN;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // one between a unix socket path and a TCP address
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (path_sobj) {
+    if (!vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+      vde_error("%s: path must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    path = vde_sobj_get_string(path_sobj);
+    if (strlen(path) >= UNIX_PATH_MAX) {
+      vde_error("%s: socket path is too long", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  address_sobj = vde_sobj_hash_lookup(params, "address");
+  if (address_sobj) {
+    if (!vde_sobj_is_type(address_sobj, vde_sobj_type_string)) {
+      vde_error("%s: address must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    address = vde_sobj_get_string(address_sobj);
+  }
+  if ((path == NULL) == (address == NULL)) {
+    vde_error("%s: either path or address must be given", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: maximum number of packets queued for sending by a connection
+  qlen_sobj = vde_sobj_hash_lookup(params, "queue_len");
+  if (qlen_sobj) {
+    if (!vde_sobj_is_type(qlen_sobj, vde_sobj_type_int)) {
+      vde_error("%s: queue_len must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    queue_len = vde_sobj_get_int(qlen_sobj);
+    if (queue_len < 1) {
+      vde_error("%s: queue_len must be positive", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  tr = (stream_tr *)vde_calloc(sizeof(stream_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  tr->listen_fd = -1;
+  tr->queue_len = queue_len;
+
+  if (path != NULL) {
+    sa_unix = (struct sockaddr_un *)&tr->sa;
+    sa_unix->sun_family = AF_UNIX;
+    strncpy(sa_unix->sun_path, path, sizeof(sa_unix->sun_path) - 1);
+    tr->sa_len = sizeof(struct sockaddr_un);
+  } else if (stream_resolve(address, &tr->sa, &tr->sa_len)) {
+    vde_error("%s: invalid address %s", __PRETTY_FUNCTION__, address);
+    vde_free(tr);
+    errno = EINVAL;
+    return -1;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_stream_fini(vde_component *component)
+{
+  stream_conn *sc;
+  vde_context *ctx = vde_component_get_context(component);
+  stream_tr *tr = (stream_tr *)vde_component_get_priv(component);
+
+  vde_assert(component != NULL);
+
+  // connections still being set up are aborted, open ones belong to their
+  // engine
+  while (tr->pending_conns != NULL) {
+    sc = vde_list_get_data(vde_list_first(tr->pending_conns));
+    stream_cli_error(sc, ECANCELED);
+  }
+  if (tr->listen_event != NULL) {
+    vde_context_event_del(ctx, tr->listen_event);
+  }
+  if (tr->listen_fd >= 0) {
+    close(tr->listen_fd);
+    if (tr->sa.ss_family == AF_UNIX) {
+      unlink(((struct sockaddr_un *)&tr->sa)->sun_path);
+    }
+  }
+  vde_free(tr);
+}
+
+component_ops transport_stream_component_ops = {
+  .init = transport_stream_init,
+  .fini = transport_stream_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "stream",
+  .cops = &transport_stream_component_ops,
+  .tr_listen = &stream_listen,
+  .tr_connect = &stream_connect,
+};
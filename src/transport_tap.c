@@ -0,0 +1,709 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/worker.h>
+
+/*
+ * Tap transport
+ *
+ * A tap interface is a single connection, which can be opened either by
+ * listening or by connecting. The interface can have several queues, each one
+ * with its own file descriptor: the kernel spreads flows among them and every
+ * queue is read by the connection. Frames written to the interface are
+ * steered by flow, so that a flow is never reordered.
+ *
+ * With vnet_hdr each frame is preceded by a virtio-net header, which carries
+ * the offload metadata of the packet: partial checksums and segmentation of
+ * large TCP frames are then left to whoever finally needs them.
+ */
+
+#define TAP_CLONE_DEV "/dev/net/tun"
+#define TAP_MAX_QUEUES 256 // as MAX_TAP_QUEUES in the kernel
+#define TAP_FRAME_MAX 65535 // the largest payload of a vde packet
+#define TAP_GSO_OFFLOADS (TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6|TUN_F_TSO_ECN)
+
+#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
+#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
+#define PKT_DATA_SZ(frame_max) (sizeof(vde_hdr) + MAX_HEAD_SZ + (frame_max) \
+                                + MAX_TAIL_SZ)
+
+// packets pool of a connection, frames can be large so keep it small
+#define PKT_POOL_SLAB 16
+#define PKT_POOL_LOW_WM 16
+#define PKT_POOL_HIGH_WM 1024
+
+typedef struct tap_conn tap_conn;
+
+typedef struct {
+  int fd;
+  void *ev;
+  tap_conn *tc;
+} tap_queue;
+
+struct tap_conn {
+  tap_queue *queues;
+  unsigned int nqueues;
+  int vnet_hdr;
+  unsigned int frame_max;
+  vde_pool *pkt_pool;
+  vde_pkt *spare_pkt; // private packet used when the pool is exhausted
+  vde_context *context;
+  vde_connection *conn;
+};
+
+typedef struct {
+  char ifname[IFNAMSIZ];
+  unsigned int queues;
+  int vnet_hdr;
+  unsigned int offload; // TUN_F_* offloads accepted from the kernel
+} tap_tr;
+
+/**
+ * @brief Release callback of packets allocated from a connection pool
+ */
+static void tap_pkt_release(vde_pkt *pkt, void *arg)
+{
+  vde_pool *pool = (vde_pool *)arg;
+
+  vde_cached_pool_free(pool, pkt);
+}
+
+/**
+ * @brief Fill the offload metadata of a packet from a virtio-net header
+ *
+ * @return zero on success, -1 if the header asks for an unknown offload
+ */
+static int tap_offload_from_vnet(vde_pkt_offload *offload,
+                                 struct virtio_net_hdr *vnet)
+{
+  offload->flags = 0;
+  if (vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+    offload->flags |= VDE_PKT_CSUM_PARTIAL;
+  }
+  if (vnet->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+    offload->flags |= VDE_PKT_CSUM_VALID;
+  }
+  switch (vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+      offload->gso_type = VDE_PKT_GSO_NONE;
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+      offload->gso_type = VDE_PKT_GSO_TCPV4;
+      break;
+    case VIRTIO_NET_HDR_GSO_UDP:
+      offload->gso_type = VDE_PKT_GSO_UDP;
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+      offload->gso_type = VDE_PKT_GSO_TCPV6;
+      break;
+    default:
+      return -1;
+  }
+  if (vnet->gso_type & VIRTIO_NET_HDR_GSO_ECN) {
+    offload->gso_type |= VDE_PKT_GSO_ECN;
+  }
+  offload->hdr_len = vnet->hdr_len;
+  offload->gso_size = vnet->gso_size;
+  offload->csum_start = vnet->csum_start;
+  offload->csum_offset = vnet->csum_offset;
+  return 0;
+}
+
+static void tap_offload_to_vnet(struct virtio_net_hdr *vnet,
+                                vde_pkt_offload *offload)
+{
+  memset(vnet, 0, sizeof(struct virtio_net_hdr));
+  if (offload->flags & VDE_PKT_CSUM_PARTIAL) {
+    vnet->flags |= VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  }
+  if (offload->flags & VDE_PKT_CSUM_VALID) {
+    vnet->flags |= VIRTIO_NET_HDR_F_DATA_VALID;
+  }
+  switch (offload->gso_type & ~VDE_PKT_GSO_ECN) {
+    case VDE_PKT_GSO_TCPV4:
+      vnet->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+      break;
+    case VDE_PKT_GSO_UDP:
+      vnet->gso_type = VIRTIO_NET_HDR_GSO_UDP;
+      break;
+    case VDE_PKT_GSO_TCPV6:
+      vnet->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+      break;
+    default:
+      vnet->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+      break;
+  }
+  if (offload->gso_type & VDE_PKT_GSO_ECN) {
+    vnet->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+  }
+  vnet->hdr_len = offload->hdr_len;
+  vnet->gso_size = offload->gso_size;
+  vnet->csum_start = offload->csum_start;
+  vnet->csum_offset = offload->csum_offset;
+}
+
+static void tap_conn_free(tap_conn *tc)
+{
+  unsigned int i;
+
+  for (i = 0; i < tc->nqueues; i++) {
+    if (tc->queues[i].ev != NULL) {
+      vde_context_event_del(tc->context, tc->queues[i].ev);
+    }
+    if (tc->queues[i].fd >= 0) {
+      close(tc->queues[i].fd);
+    }
+  }
+  vde_free(tc->queues);
+  if (tc->spare_pkt != NULL) {
+    vde_free(tc->spare_pkt);
+  }
+  // packets of this connection still referenced elsewhere keep the pool alive
+  if (tc->pkt_pool != NULL) {
+    vde_pool_delete(tc->pkt_pool);
+  }
+  vde_free(tc);
+}
+
+static void tap_conn_close_fatal(tap_queue *q)
+{
+  vde_connection *conn = q->tc->conn;
+
+  if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+      (errno == EPIPE)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_warning("%s: got fatal error on tap fd %d but connection not closed",
+              __PRETTY_FUNCTION__, q->fd);
+}
+
+void tap_conn_read_event(int fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  struct virtio_net_hdr vnet;
+  struct iovec iov[2];
+  unsigned int i;
+  ssize_t n, len;
+  int cb_errno = 0, read_errno = 0;
+  tap_queue *q = (tap_queue *)arg;
+  tap_conn *tc = q->tc;
+  vde_connection *conn = tc->conn;
+
+  if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    return;
+  }
+
+  // a frame per read(), until the queue is empty or the batch is full
+  vde_pkt_batch_init(&batch);
+  while (!vde_pkt_batch_full(&batch)) {
+    pkt = vde_cached_pool_alloc(tc->pkt_pool);
+    if (pkt != NULL) {
+      vde_pkt_init(pkt, PKT_DATA_SZ(tc->frame_max),
+                   vde_connection_get_pkt_headsize(conn),
+                   vde_connection_get_pkt_tailsize(conn));
+      vde_pkt_set_release(pkt, tap_pkt_release, tc->pkt_pool);
+    } else if (batch.len == 0) {
+      // the pool is exhausted, deliver a single private packet
+      pkt = tc->spare_pkt;
+      vde_pkt_init(pkt, PKT_DATA_SZ(tc->frame_max),
+                   vde_connection_get_pkt_headsize(conn),
+                   vde_connection_get_pkt_tailsize(conn));
+    } else {
+      break;
+    }
+
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = pkt->payload;
+    iov[1].iov_len = tc->frame_max;
+    if (tc->vnet_hdr) {
+      n = readv(q->fd, iov, 2);
+      len = n - sizeof(vnet);
+    } else {
+      n = readv(q->fd, &iov[1], 1);
+      len = n;
+    }
+    if (n < 0) {
+      read_errno = errno;
+      if (vde_pkt_is_shared(pkt)) {
+        vde_pkt_put(pkt);
+      }
+      break;
+    }
+    if (len < (ssize_t)sizeof(struct eth_hdr) ||
+        (tc->vnet_hdr && tap_offload_from_vnet(&pkt->offload, &vnet))) {
+      vde_warning("%s: bad frame on tap fd %d, discarding",
+                  __PRETTY_FUNCTION__, q->fd);
+      if (vde_pkt_is_shared(pkt)) {
+        vde_pkt_put(pkt);
+      }
+      continue;
+    }
+    // XXX: set hdr version and type
+    pkt->hdr->pkt_len = len;
+    vde_pkt_batch_add(&batch, pkt);
+    if (!vde_pkt_is_shared(pkt)) {
+      break;
+    }
+  }
+
+  if (batch.len > 0 && vde_connection_call_read_batch(conn, &batch)) {
+    cb_errno = errno;
+  }
+  // whoever still needs a packet holds its own reference
+  for (i = 0; i < batch.len; i++) {
+    if (vde_pkt_is_shared(batch.pkts[i])) {
+      vde_pkt_put(batch.pkts[i]);
+    }
+  }
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (read_errno && read_errno != EAGAIN && read_errno != EINTR) {
+    // the interface has gone away
+    vde_error("%s: error reading from tap fd %d: %s", __PRETTY_FUNCTION__,
+              q->fd, strerror(read_errno));
+    tap_conn_close_fatal(q);
+  }
+}
+
+/**
+ * @brief Write a frame to the queue of its flow. Writes to a tap never block,
+ * when the kernel cannot keep up it drops frames itself.
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int tap_conn_send(tap_conn *tc, vde_pkt *pkt)
+{
+  struct virtio_net_hdr vnet;
+  struct iovec iov[2];
+  tap_queue *q;
+  vde_pkt *wpkt = pkt;
+  int worker, rv, tmp_errno;
+
+  if (tc->nqueues == 1) {
+    q = &tc->queues[0];
+  } else if ((worker = vde_worker_current()) >= 0) {
+    // workers do not share queues
+    q = &tc->queues[worker % tc->nqueues];
+  } else {
+    q = &tc->queues[vde_pkt_flow_hash(pkt) % tc->nqueues];
+  }
+
+  if (tc->vnet_hdr) {
+    tap_offload_to_vnet(&vnet, &pkt->offload);
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = pkt->payload;
+    iov[1].iov_len = pkt->hdr->pkt_len;
+    rv = writev(q->fd, iov, 2);
+  } else {
+    // without the header offloads must be done here
+    if (vde_pkt_needs_gso(pkt)) {
+      vde_warning("%s: packet needs segmentation, discarding",
+                  __PRETTY_FUNCTION__);
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (pkt->offload.flags & VDE_PKT_CSUM_PARTIAL) {
+      wpkt = vde_pkt_make_writable(pkt);
+      if (wpkt == NULL) {
+        return -1;
+      }
+      if (vde_pkt_csum_complete(&wpkt->offload, wpkt->payload,
+                                wpkt->hdr->pkt_len)) {
+        vde_warning("%s: bad checksum offsets, discarding",
+                    __PRETTY_FUNCTION__);
+        if (wpkt != pkt) {
+          vde_pkt_put(wpkt);
+        }
+        errno = EBADMSG;
+        return -1;
+      }
+    }
+    rv = write(q->fd, wpkt->payload, wpkt->hdr->pkt_len);
+    tmp_errno = errno;
+    if (wpkt != pkt) {
+      vde_pkt_put(wpkt);
+    }
+    errno = tmp_errno;
+  }
+
+  if (rv < 0) {
+    vde_warning("%s: cannot write to tap fd %d: %s", __PRETTY_FUNCTION__,
+                q->fd, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int tap_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  return tap_conn_send(vde_connection_get_priv(conn), pkt);
+}
+
+int tap_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  tap_conn *tc = vde_connection_get_priv(conn);
+
+  // XXX: a tap has no vectored write of several frames, one syscall each
+  for (i = 0; i < batch->len; i++) {
+    if (tap_conn_send(tc, batch->pkts[i])) {
+      break;
+    }
+  }
+  return i;
+}
+
+void tap_conn_close(vde_connection *conn)
+{
+  tap_conn_free(vde_connection_get_priv(conn));
+}
+
+/**
+ * @brief Open a queue of the tap interface, the first queue opened sets
+ * tr->ifname when the kernel chooses it
+ *
+ * @return the queue fd on success, -1 on error (and errno is set
+ * appropriately)
+ */
+static int tap_open_queue(tap_tr *tr)
+{
+  int fd, tmp_errno;
+  int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+  struct ifreq ifr;
+
+  fd = open(TAP_CLONE_DEV, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+  if (fd < 0) {
+    vde_error("%s: cannot open %s: %s", __PRETTY_FUNCTION__, TAP_CLONE_DEV,
+              strerror(errno));
+    return -1;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
+  if (tr->vnet_hdr) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+  if (tr->queues > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  snprintf(ifr.ifr_name, IFNAMSIZ, "%s", tr->ifname);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot attach to tap %s: %s", __PRETTY_FUNCTION__,
+              tr->ifname[0] ? tr->ifname : "(new)", strerror(errno));
+    goto error;
+  }
+  // further queues attach to the same interface
+  snprintf(tr->ifname, IFNAMSIZ, "%s", ifr.ifr_name);
+
+  if (tr->vnet_hdr) {
+    if (ioctl(fd, TUNSETVNETHDRSZ, &vnet_hdr_sz) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: cannot set vnet header size: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error;
+    }
+    if (ioctl(fd, TUNSETOFFLOAD, tr->offload) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: cannot set offloads: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error;
+    }
+  }
+  return fd;
+
+error:
+  close(fd);
+  errno = tmp_errno;
+  return -1;
+}
+
+/**
+ * @brief Open the tap interface and initialize conn over it
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int tap_conn_open(vde_component *component, vde_connection *conn)
+{
+  unsigned int i;
+  int tmp_errno;
+  tap_conn *tc;
+  vde_context *ctx = vde_component_get_context(component);
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(component);
+
+  tc = (tap_conn *)vde_calloc(sizeof(tap_conn));
+  if (tc == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  tc->context = ctx;
+  tc->conn = conn;
+  tc->vnet_hdr = tr->vnet_hdr;
+  // without offloads the kernel sends frames up to the interface mtu
+  tc->frame_max = tr->offload & TAP_GSO_OFFLOADS & ~TUN_F_CSUM ?
+                  TAP_FRAME_MAX : sizeof(struct eth_frame);
+
+  tc->queues = (tap_queue *)vde_calloc(tr->queues * sizeof(tap_queue));
+  if (tc->queues == NULL) {
+    vde_error("%s: cannot create queues", __PRETTY_FUNCTION__);
+    vde_free(tc);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < tr->queues; i++) {
+    tc->queues[i].fd = -1;
+    tc->queues[i].tc = tc;
+  }
+  tc->nqueues = tr->queues;
+
+  tc->pkt_pool = vde_pool_new(sizeof(vde_pkt) + PKT_DATA_SZ(tc->frame_max),
+                              PKT_POOL_SLAB, PKT_POOL_LOW_WM,
+                              PKT_POOL_HIGH_WM);
+  tc->spare_pkt = (vde_pkt *)vde_alloc(sizeof(vde_pkt) +
+                                       PKT_DATA_SZ(tc->frame_max));
+  if (tc->pkt_pool == NULL || tc->spare_pkt == NULL) {
+    vde_error("%s: cannot create packets pool", __PRETTY_FUNCTION__);
+    tmp_errno = ENOMEM;
+    goto error;
+  }
+
+  for (i = 0; i < tc->nqueues; i++) {
+    tc->queues[i].fd = tap_open_queue(tr);
+    if (tc->queues[i].fd < 0) {
+      tmp_errno = errno;
+      goto error;
+    }
+  }
+
+  vde_connection_init(conn, ctx, tc->frame_max, &tap_conn_write,
+                      &tap_conn_close, (void *)tc);
+  vde_connection_set_be_write_batch(conn, &tap_conn_write_batch);
+
+  for (i = 0; i < tc->nqueues; i++) {
+    tc->queues[i].ev = vde_context_event_add(ctx, tc->queues[i].fd,
+                                             VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                             &tap_conn_read_event,
+                                             (void *)&tc->queues[i]);
+    if (tc->queues[i].ev == NULL) {
+      vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+      tmp_errno = EIO;
+      goto error;
+    }
+  }
+  return 0;
+
+error:
+  tap_conn_free(tc);
+  errno = tmp_errno;
+  return -1;
+}
+
+int tap_listen(vde_component *component)
+{
+  int tmp_errno;
+  vde_connection *conn;
+
+  if (vde_connection_new(&conn)) {
+    return -1;
+  }
+  if (tap_conn_open(component, conn)) {
+    tmp_errno = errno;
+    vde_connection_delete(conn);
+    errno = tmp_errno;
+    return -1;
+  }
+  vde_transport_call_cm_accept_cb(component, conn);
+  return 0;
+}
+
+int tap_connect(vde_component *component, vde_connection *conn)
+{
+  // the interface is ready as soon as it is open
+  if (tap_conn_open(component, conn)) {
+    return -1;
+  }
+  vde_transport_call_cm_connect_cb(component, conn);
+  return 0;
+}
+
+static int transport_tap_init(vde_component *component, vde_sobj *params)
+{
+  tap_tr *tr;
+  vde_sobj *ifname_sobj, *queues_sobj, *vnet_sobj, *offload_sobj;
+  const char *ifname = "";
+  const char *offload = "csum";
+  int queues;
+  int vnet_hdr = 1;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: the interface to attach to, the kernel chooses one otherwise
+  ifname_sobj = vde_sobj_hash_lookup(params, "ifname");
+  if (ifname_sobj) {
+    if (!vde_sobj_is_type(ifname_sobj, vde_sobj_type_string)) {
+      vde_error("%s: ifname must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    ifname = vde_sobj_get_string(ifname_sobj);
+    if (strlen(ifname) >= IFNAMSIZ) {
+      vde_error("%s: interface name is too long", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  // optional: number of queues, by default one per worker of the context
+  queues = vde_context_get_workers(vde_component_get_context(component));
+  if (queues == 0) {
+    queues = 1;
+  }
+  queues_sobj = vde_sobj_hash_lookup(params, "queues");
+  if (queues_sobj) {
+    if (!vde_sobj_is_type(queues_sobj, vde_sobj_type_int)) {
+      vde_error("%s: queues must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    queues = vde_sobj_get_int(queues_sobj);
+  }
+  if (queues < 1 || queues > TAP_MAX_QUEUES) {
+    vde_error("%s: queues must be between 1 and %d", __PRETTY_FUNCTION__,
+              TAP_MAX_QUEUES);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // optional: exchange a virtio-net header with each frame
+  vnet_sobj = vde_sobj_hash_lookup(params, "vnet_hdr");
+  if (vnet_sobj) {
+    if (!vde_sobj_is_type(vnet_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: vnet_hdr must be a boolean", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    vnet_hdr = vde_sobj_get_bool(vnet_sobj);
+  }
+
+  // optional: offloads accepted from the kernel, "tso" lets large TCP frames
+  // through and should be used only when every connection they can reach
+  // handles offloads
+  offload_sobj = vde_sobj_hash_lookup(params, "offload");
+  if (offload_sobj) {
+    if (!vde_sobj_is_type(offload_sobj, vde_sobj_type_string)) {
+      vde_error("%s: offload must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    offload = vde_sobj_get_string(offload_sobj);
+  }
+  if (strcmp(offload, "none") && strcmp(offload, "csum") &&
+      strcmp(offload, "tso")) {
+    vde_error("%s: offload must be one of none, csum, tso",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (!vnet_hdr && strcmp(offload, "none")) {
+    vde_error("%s: offloads need vnet_hdr", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (tap_tr *)vde_calloc(sizeof(tap_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  strncpy(tr->ifname, ifname, IFNAMSIZ - 1);
+  tr->queues = queues;
+  tr->vnet_hdr = vnet_hdr;
+  if (!strcmp(offload, "tso")) {
+    tr->offload = TAP_GSO_OFFLOADS;
+  } else if (!strcmp(offload, "csum")) {
+    tr->offload = TUN_F_CSUM;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_tap_fini(vde_component *component)
+{
+  vde_assert(component != NULL);
+
+  // an open interface belongs to its engine, which closes it
+  vde_free(vde_component_get_priv(component));
+}
+
+component_ops transport_tap_component_ops = {
+  .init = transport_tap_init,
+  .fini = transport_tap_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "tap",
+  .cops = &transport_tap_component_ops,
+  .tr_listen = &tap_listen,
+  .tr_connect = &tap_connect,
+};
@@ -0,0 +1,1214 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#include <transport_udp_commands.h>
+
+/*
+ * UDP transport
+ *
+ * Frames to and from other hosts travel in UDP datagrams, all of them through
+ * a single socket. Each remote peer, identified by its address and port, is a
+ * connection: peers are either listed in the configuration or, while
+ * listening, learned from the first datagram they send. In VXLAN mode every
+ * frame is preceded by a VXLAN header carrying the configured network
+ * identifier, which makes the transport interoperate with Linux vxlan
+ * interfaces.
+ *
+ * Frames sent to a peer with a single write are coalesced into few datagrams
+ * of equal sized segments which the kernel splits (UDP_SEGMENT), received
+ * datagrams are coalesced by the kernel too (UDP_GRO) and split here.
+ */
+
+#define UDP_VXLAN_PORT 4789 // IANA assigned
+#define UDP_VXLAN_HDR_SZ 8
+#define UDP_VXLAN_FLAG_VNI 0x08
+#define UDP_VXLAN_VNI_MAX 0xffffff
+
+#define UDP_FRAME_MAX sizeof(struct eth_frame)
+#define UDP_MAX_SEGMENTS 64 // as UDP_MAX_SEGMENTS in the kernel
+#define UDP_GSO_MAX_SZ 65000 // leave room for the ip and udp headers
+#define UDP_GRO_BUF_SZ 65536
+#define UDP_GRO_BUFS 8 // coalesced datagrams read with a single syscall
+#define UDP_SOCK_BUF_SZ (4 * 1024 * 1024) // capped by net.core.[rw]mem_max
+
+#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
+#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
+#define PKT_DATA_SZ (sizeof(vde_hdr) + MAX_HEAD_SZ + UDP_FRAME_MAX \
+                     + MAX_TAIL_SZ)
+
+// packets pool of the socket, shared by all its peers
+#define PKT_POOL_SLAB 64
+#define PKT_POOL_LOW_WM 64
+#define PKT_POOL_HIGH_WM 4096
+
+typedef struct udp_sock udp_sock;
+
+typedef struct {
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+  uint64_t rx_drops;
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  uint64_t tx_drops;
+} udp_counters;
+
+typedef struct {
+  struct sockaddr_storage addr; // key of the peers hash
+  socklen_t addr_len;
+  char name[INET6_ADDRSTRLEN + 8];
+  int configured; // listed in the configuration, never forgotten
+  udp_counters stats;
+  vde_pkt_batch rx_batch;
+  udp_sock *sock;
+  vde_connection *conn; // NULL while the peer is not attached
+} udp_peer;
+
+struct udp_sock {
+  int fd;
+  void *ev;
+  int vxlan;
+  unsigned char vxlan_hdr[UDP_VXLAN_HDR_SZ];
+  int gso;
+  int gro;
+  int accept; // learn peers from unknown sources
+  uint16_t port; // local port, in network byte order
+  unsigned int refs; // the transport and each attached peer
+  vde_hash *peers_by_addr;
+  vde_list *peers;
+  uint64_t rx_unknown; // datagrams dropped since the source is unknown
+  unsigned char *rx_bufs;
+  unsigned int rx_buf_sz;
+  unsigned int rx_nbufs;
+  vde_pool *pkt_pool;
+  vde_context *context;
+  vde_component *component; // NULL once the transport is gone
+};
+
+typedef struct {
+  struct sockaddr_storage local;
+  socklen_t local_len;
+  struct sockaddr_storage *peers;
+  socklen_t *peers_len;
+  unsigned int npeers;
+  int vxlan;
+  uint32_t vni;
+  int gso;
+  int gro;
+  int accept;
+  unsigned int batch;
+  udp_sock *sock; // opened by the first listen or connect
+} udp_tr;
+
+static inline uint16_t udp_addr_port(const struct sockaddr_storage *ss)
+{
+  if (ss->ss_family == AF_INET6) {
+    return ((const struct sockaddr_in6 *)ss)->sin6_port;
+  }
+  return ((const struct sockaddr_in *)ss)->sin_port;
+}
+
+static inline void udp_addr_set_port(struct sockaddr_storage *ss,
+                                     uint16_t port)
+{
+  if (ss->ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)ss)->sin6_port = port;
+  } else {
+    ((struct sockaddr_in *)ss)->sin_port = port;
+  }
+}
+
+/**
+ * @brief Hash of the host part of a peer address, for the peers hash of a
+ * VXLAN socket
+ */
+static unsigned int udp_host_hash(const void *key)
+{
+  const struct sockaddr_storage *ss = (const struct sockaddr_storage *)key;
+  const unsigned char *addr;
+  unsigned int i, len;
+  uint32_t hash = 2166136261u; // FNV-1a
+
+  if (ss->ss_family == AF_INET6) {
+    addr = ((const struct sockaddr_in6 *)ss)->sin6_addr.s6_addr;
+    len = sizeof(struct in6_addr);
+  } else {
+    addr = (const unsigned char *)&((const struct sockaddr_in *)ss)->sin_addr;
+    len = sizeof(struct in_addr);
+  }
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ addr[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int udp_host_equal(const void *a, const void *b)
+{
+  const struct sockaddr_storage *sa = (const struct sockaddr_storage *)a;
+  const struct sockaddr_storage *sb = (const struct sockaddr_storage *)b;
+
+  if (sa->ss_family != sb->ss_family) {
+    return 0;
+  }
+  if (sa->ss_family == AF_INET6) {
+    return !memcmp(&((const struct sockaddr_in6 *)sa)->sin6_addr,
+                   &((const struct sockaddr_in6 *)sb)->sin6_addr,
+                   sizeof(struct in6_addr));
+  }
+  return ((const struct sockaddr_in *)sa)->sin_addr.s_addr ==
+         ((const struct sockaddr_in *)sb)->sin_addr.s_addr;
+}
+
+/**
+ * @brief Hash of a peer address, for the peers hash
+ */
+static unsigned int udp_addr_hash(const void *key)
+{
+  uint16_t port = udp_addr_port((const struct sockaddr_storage *)key);
+  uint32_t hash = udp_host_hash(key);
+
+  hash = (hash ^ (port & 0xff)) * 16777619u;
+  hash = (hash ^ (port >> 8)) * 16777619u;
+  return hash;
+}
+
+static int udp_addr_equal(const void *a, const void *b)
+{
+  return udp_host_equal(a, b) &&
+         udp_addr_port((const struct sockaddr_storage *)a) ==
+         udp_addr_port((const struct sockaddr_storage *)b);
+}
+
+static void udp_addr_name(struct sockaddr_storage *ss, char *name,
+                          size_t name_sz)
+{
+  char addr[INET6_ADDRSTRLEN];
+
+  if (ss->ss_family == AF_INET6) {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ss)->sin6_addr, addr,
+              sizeof(addr));
+    snprintf(name, name_sz, "[%s]:%u", addr,
+             ntohs(((struct sockaddr_in6 *)ss)->sin6_port));
+  } else {
+    inet_ntop(AF_INET, &((struct sockaddr_in *)ss)->sin_addr, addr,
+              sizeof(addr));
+    snprintf(name, name_sz, "%s:%u", addr,
+             ntohs(((struct sockaddr_in *)ss)->sin_port));
+  }
+}
+
+/**
+ * @brief Release callback of packets allocated from the socket pool
+ */
+static void udp_pkt_release(vde_pkt *pkt, void *arg)
+{
+  vde_pool *pool = (vde_pool *)arg;
+
+  vde_cached_pool_free(pool, pkt);
+}
+
+static udp_peer *udp_peer_new(udp_sock *sock, struct sockaddr_storage *addr,
+                              socklen_t addr_len, int configured)
+{
+  udp_peer *peer;
+
+  peer = (udp_peer *)vde_calloc(sizeof(udp_peer));
+  if (peer == NULL) {
+    vde_error("%s: cannot create peer", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(&peer->addr, addr, addr_len);
+  peer->addr_len = addr_len;
+  udp_addr_name(&peer->addr, peer->name, sizeof(peer->name));
+  peer->configured = configured;
+  peer->sock = sock;
+  vde_pkt_batch_init(&peer->rx_batch);
+
+  vde_hash_insert(sock->peers_by_addr, &peer->addr, peer);
+  sock->peers = vde_list_append(sock->peers, peer);
+  return peer;
+}
+
+static void udp_peer_free(udp_peer *peer)
+{
+  udp_sock *sock = peer->sock;
+
+  vde_hash_remove(sock->peers_by_addr, &peer->addr);
+  sock->peers = vde_list_remove(sock->peers, peer);
+  vde_free(peer);
+}
+
+static void udp_sock_put(udp_sock *sock)
+{
+  vde_list *iter;
+
+  if (--sock->refs > 0) {
+    return;
+  }
+
+  // only peers without a connection are left
+  iter = vde_list_first(sock->peers);
+  while (iter != NULL) {
+    vde_free(vde_list_get_data(iter));
+    iter = vde_list_next(iter);
+  }
+  vde_list_delete(sock->peers);
+  vde_hash_delete(sock->peers_by_addr);
+  if (sock->ev != NULL) {
+    vde_context_event_del(sock->context, sock->ev);
+  }
+  if (sock->fd >= 0) {
+    close(sock->fd);
+  }
+  vde_free(sock->rx_bufs);
+  // packets still referenced elsewhere keep the pool alive
+  if (sock->pkt_pool != NULL) {
+    vde_pool_delete(sock->pkt_pool);
+  }
+  vde_free(sock);
+}
+
+/**
+ * @brief Hand the frames read for a peer to its connection
+ *
+ * @return zero if the peer is still attached, -1 if its connection has been
+ * closed
+ */
+static int udp_peer_deliver(udp_peer *peer)
+{
+  vde_pkt_batch batch;
+  unsigned int i;
+  int cb_errno = 0;
+  vde_connection *conn = peer->conn;
+
+  if (peer->rx_batch.len == 0) {
+    return 0;
+  }
+  // the connection can be closed by the callback, which frees the peer
+  batch = peer->rx_batch;
+  vde_pkt_batch_init(&peer->rx_batch);
+
+  if (vde_connection_call_read_batch(conn, &batch)) {
+    cb_errno = errno;
+  }
+  // whoever still needs a packet holds its own reference
+  for (i = 0; i < batch.len; i++) {
+    vde_pkt_put(batch.pkts[i]);
+  }
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy a frame received from a peer in a packet of its next batch
+ *
+ * @return zero if the peer is still attached, -1 if its connection has been
+ * closed
+ */
+static int udp_peer_rx_frame(udp_peer *peer, unsigned char *data,
+                             unsigned int len)
+{
+  vde_pkt *pkt;
+  udp_sock *sock = peer->sock;
+  vde_connection *conn = peer->conn;
+
+  if (sock->vxlan) {
+    // the header must carry our network identifier
+    if (len < UDP_VXLAN_HDR_SZ || !(data[0] & UDP_VXLAN_FLAG_VNI) ||
+        memcmp(&data[4], &sock->vxlan_hdr[4], 3)) {
+      peer->stats.rx_drops++;
+      return 0;
+    }
+    data += UDP_VXLAN_HDR_SZ;
+    len -= UDP_VXLAN_HDR_SZ;
+  }
+  if (len < sizeof(struct eth_hdr) || len > UDP_FRAME_MAX) {
+    peer->stats.rx_drops++;
+    return 0;
+  }
+
+  if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    peer->stats.rx_drops++;
+    return 0;
+  }
+  pkt = vde_cached_pool_alloc(sock->pkt_pool);
+  if (pkt == NULL) {
+    peer->stats.rx_drops++;
+    return 0;
+  }
+  vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
+               vde_connection_get_pkt_tailsize(conn));
+  vde_pkt_set_release(pkt, udp_pkt_release, sock->pkt_pool);
+  // XXX: set hdr version and type
+  memcpy(pkt->payload, data, len);
+  pkt->hdr->pkt_len = len;
+
+  peer->stats.rx_packets++;
+  peer->stats.rx_bytes += len;
+  vde_pkt_batch_add(&peer->rx_batch, pkt);
+  if (vde_pkt_batch_full(&peer->rx_batch)) {
+    return udp_peer_deliver(peer);
+  }
+  return 0;
+}
+
+static int udp_peer_attach(udp_peer *peer, vde_connection *conn);
+
+/**
+ * @brief Create a connection for a datagram from an unknown source, if the
+ * transport is listening for them
+ *
+ * @return the new peer, NULL if the source is not accepted
+ */
+static udp_peer *udp_sock_accept_peer(udp_sock *sock,
+                                      struct sockaddr_storage *addr,
+                                      socklen_t addr_len)
+{
+  udp_peer *peer;
+  vde_connection *conn;
+
+  if (!sock->accept || sock->component == NULL) {
+    return NULL;
+  }
+  if (vde_connection_new(&conn)) {
+    return NULL;
+  }
+  if (sock->vxlan) {
+    // VTEPs spread flows among source ports, they listen on the VXLAN port
+    udp_addr_set_port(addr, sock->port);
+  }
+  peer = udp_peer_new(sock, addr, addr_len, 0);
+  if (peer == NULL) {
+    vde_connection_delete(conn);
+    return NULL;
+  }
+  udp_peer_attach(peer, conn);
+  vde_transport_call_cm_accept_cb(sock->component, conn);
+  // the connection manager might have closed it already
+  return vde_hash_lookup(sock->peers_by_addr, addr);
+}
+
+void udp_sock_read_event(int fd, short event_type, void *arg)
+{
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iovs[VDE_PKT_BATCH_MAX];
+  struct sockaddr_storage addrs[VDE_PKT_BATCH_MAX];
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } cmsgs[VDE_PKT_BATCH_MAX];
+  struct cmsghdr *cmsg;
+  udp_peer *peer, *cur = NULL;
+  unsigned char *data;
+  unsigned int len, off, seg, frame_len;
+  unsigned int i;
+  int nmsgs;
+  udp_sock *sock = (udp_sock *)arg;
+
+  memset(msgs, 0, sock->rx_nbufs * sizeof(struct mmsghdr));
+  for (i = 0; i < sock->rx_nbufs; i++) {
+    iovs[i].iov_base = sock->rx_bufs + i * sock->rx_buf_sz;
+    iovs[i].iov_len = sock->rx_buf_sz;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    if (sock->gro) {
+      msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+    }
+  }
+
+  // drain the socket with a single syscall
+  nmsgs = recvmmsg(sock->fd, msgs, sock->rx_nbufs, MSG_DONTWAIT, NULL);
+  if (nmsgs < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      vde_warning("%s: error reading from udp fd %d: %s", __PRETTY_FUNCTION__,
+                  sock->fd, strerror(errno));
+    }
+    return;
+  }
+
+  // a peer closed while delivering must not take the socket with it
+  sock->refs++;
+  for (i = 0; i < (unsigned int)nmsgs; i++) {
+    data = (unsigned char *)iovs[i].iov_base;
+    len = msgs[i].msg_len;
+    // without GRO a datagram is a single segment
+    seg = len;
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        seg = *(int *)CMSG_DATA(cmsg);
+      }
+    }
+    if (seg == 0 || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+      continue;
+    }
+
+    peer = vde_hash_lookup(sock->peers_by_addr, &addrs[i]);
+    if (peer == NULL) {
+      peer = udp_sock_accept_peer(sock, &addrs[i],
+                                  msgs[i].msg_hdr.msg_namelen);
+    }
+    if (peer == NULL || peer->conn == NULL) {
+      if (peer != NULL) {
+        peer->stats.rx_drops += (len + seg - 1) / seg;
+      } else {
+        sock->rx_unknown += (len + seg - 1) / seg;
+      }
+      continue;
+    }
+    // frames are handed over in order, a batch per run of the same peer
+    if (peer != cur) {
+      if (cur != NULL) {
+        udp_peer_deliver(cur);
+      }
+      cur = peer;
+    }
+    for (off = 0; off < len; off += seg) {
+      frame_len = len - off < seg ? len - off : seg;
+      if (udp_peer_rx_frame(peer, data + off, frame_len)) {
+        // the rest of the datagram is lost with the connection
+        cur = NULL;
+        break;
+      }
+    }
+  }
+  if (cur != NULL) {
+    udp_peer_deliver(cur);
+  }
+  udp_sock_put(sock);
+}
+
+/**
+ * @brief Send frames to a peer, runs of frames of the same size leave as a
+ * single datagram which the kernel segments.
+ *
+ * @return the number of packets sent, if it is less than npkts errno is set
+ * appropriately for the first packet which has not been sent
+ */
+static int udp_peer_send(udp_peer *peer, vde_pkt **pkts, unsigned int npkts)
+{
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iovs[2 * VDE_PKT_BATCH_MAX];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } cmsgs[VDE_PKT_BATCH_MAX];
+  struct cmsghdr *cmsg;
+  unsigned int msg_segs[VDE_PKT_BATCH_MAX];
+  unsigned int msg_seg_sz[VDE_PKT_BATCH_MAX];
+  unsigned int msg_bytes[VDE_PKT_BATCH_MAX];
+  vde_pkt *copies[VDE_PKT_BATCH_MAX];
+  unsigned int i, niovs = 0, nmsgs = 0, ncopies = 0, nsent, taken, seg_len;
+  int run_closed = 1, rv, fail_errno = 0, gso_failed = 0;
+  unsigned int hdr_sz = peer->sock->vxlan ? UDP_VXLAN_HDR_SZ : 0;
+  udp_sock *sock = peer->sock;
+  vde_pkt *pkt;
+
+  if (npkts > VDE_PKT_BATCH_MAX) {
+    npkts = VDE_PKT_BATCH_MAX;
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < npkts; i++) {
+    pkt = pkts[i];
+    if (vde_pkt_needs_gso(pkt)) {
+      // peers expect ethernet sized frames
+      vde_warning("%s: packet needs segmentation, discarding",
+                  __PRETTY_FUNCTION__);
+      fail_errno = EMSGSIZE;
+      break;
+    }
+    if (pkt->offload.flags & VDE_PKT_CSUM_PARTIAL) {
+      pkt = vde_pkt_make_writable(pkt);
+      if (pkt == NULL) {
+        fail_errno = errno;
+        break;
+      }
+      if (pkt != pkts[i]) {
+        copies[ncopies++] = pkt;
+      }
+      if (vde_pkt_csum_complete(&pkt->offload, pkt->payload,
+                                pkt->hdr->pkt_len)) {
+        vde_warning("%s: bad checksum offsets, discarding",
+                    __PRETTY_FUNCTION__);
+        fail_errno = EBADMSG;
+        break;
+      }
+    }
+
+    // segments are cut at gso size, only the last one can be shorter
+    seg_len = hdr_sz + pkt->hdr->pkt_len;
+    if (run_closed || !sock->gso || seg_len > msg_seg_sz[nmsgs - 1] ||
+        msg_segs[nmsgs - 1] == UDP_MAX_SEGMENTS ||
+        msg_bytes[nmsgs - 1] + seg_len > UDP_GSO_MAX_SZ) {
+      msgs[nmsgs].msg_hdr.msg_name = &peer->addr;
+      msgs[nmsgs].msg_hdr.msg_namelen = peer->addr_len;
+      msgs[nmsgs].msg_hdr.msg_iov = &iovs[niovs];
+      msg_segs[nmsgs] = 0;
+      msg_seg_sz[nmsgs] = seg_len;
+      msg_bytes[nmsgs] = 0;
+      nmsgs++;
+      run_closed = 0;
+    }
+    if (seg_len < msg_seg_sz[nmsgs - 1]) {
+      run_closed = 1;
+    }
+    if (hdr_sz > 0) {
+      iovs[niovs].iov_base = sock->vxlan_hdr;
+      iovs[niovs].iov_len = hdr_sz;
+      niovs++;
+    }
+    iovs[niovs].iov_base = pkt->payload;
+    iovs[niovs].iov_len = pkt->hdr->pkt_len;
+    niovs++;
+    msgs[nmsgs - 1].msg_hdr.msg_iovlen = &iovs[niovs] -
+                                         msgs[nmsgs - 1].msg_hdr.msg_iov;
+    msg_segs[nmsgs - 1]++;
+    msg_bytes[nmsgs - 1] += seg_len;
+  }
+  taken = i;
+
+  for (i = 0; i < nmsgs; i++) {
+    if (msg_segs[i] < 2) {
+      continue;
+    }
+    msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+    msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+    cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(cmsg) = msg_seg_sz[i];
+  }
+
+  nsent = 0;
+  for (i = 0; i < nmsgs; i += rv) {
+    rv = sendmmsg(sock->fd, &msgs[i], nmsgs - i, MSG_DONTWAIT);
+    if (rv < 0) {
+      fail_errno = errno;
+      // the path cannot carry segmented datagrams, e.g. the mtu is too small
+      gso_failed = msg_segs[i] > 1 && (errno == EINVAL || errno == EIO);
+      taken = nsent;
+      break;
+    }
+    for (rv += i; i < rv; i++) {
+      nsent += msg_segs[i];
+      peer->stats.tx_bytes += msg_bytes[i] - msg_segs[i] * hdr_sz;
+    }
+    rv = 0;
+  }
+  peer->stats.tx_packets += nsent;
+
+  for (i = 0; i < ncopies; i++) {
+    vde_pkt_put(copies[i]);
+  }
+
+  if (gso_failed) {
+    vde_warning("%s: cannot send segmented datagrams to %s (%s), disabling "
+                "segmentation", __PRETTY_FUNCTION__, peer->name,
+                strerror(fail_errno));
+    sock->gso = 0;
+    return nsent + udp_peer_send(peer, pkts + nsent, npkts - nsent);
+  }
+  if (taken < npkts) {
+    if (fail_errno != EMSGSIZE && fail_errno != EBADMSG) {
+      vde_warning("%s: cannot send to %s: %s", __PRETTY_FUNCTION__,
+                  peer->name, strerror(fail_errno));
+    }
+    // the caller drops what is left
+    peer->stats.tx_drops += npkts - taken;
+    errno = fail_errno;
+  }
+  return taken;
+}
+
+int udp_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  udp_peer *peer = vde_connection_get_priv(conn);
+
+  return udp_peer_send(peer, &pkt, 1) == 1 ? 0 : -1;
+}
+
+int udp_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  udp_peer *peer = vde_connection_get_priv(conn);
+
+  return udp_peer_send(peer, batch->pkts, batch->len);
+}
+
+void udp_conn_close(vde_connection *conn)
+{
+  udp_peer *peer = vde_connection_get_priv(conn);
+  udp_sock *sock = peer->sock;
+
+  peer->conn = NULL;
+  // learned peers are learned again if they come back
+  if (!peer->configured) {
+    udp_peer_free(peer);
+  }
+  udp_sock_put(sock);
+}
+
+/**
+ * @brief Initialize conn as the connection of a peer
+ */
+static int udp_peer_attach(udp_peer *peer, vde_connection *conn)
+{
+  vde_connection_init(conn, peer->sock->context, UDP_FRAME_MAX,
+                      &udp_conn_write, &udp_conn_close, (void *)peer);
+  vde_connection_set_be_write_batch(conn, &udp_conn_write_batch);
+  peer->conn = conn;
+  peer->sock->refs++;
+  return 0;
+}
+
+/**
+ * @brief Open the socket of the transport and create its configured peers
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int udp_sock_open(vde_component *component)
+{
+  udp_sock *sock;
+  unsigned int i;
+  int tmp_errno, on = 1, off = 0, buf_sz = UDP_SOCK_BUF_SZ;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  if (tr->sock != NULL) {
+    return 0;
+  }
+
+  sock = (udp_sock *)vde_calloc(sizeof(udp_sock));
+  if (sock == NULL) {
+    vde_error("%s: cannot create socket backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  sock->fd = -1;
+  sock->refs = 1;
+  sock->context = vde_component_get_context(component);
+  sock->component = component;
+  sock->vxlan = tr->vxlan;
+  sock->vxlan_hdr[0] = UDP_VXLAN_FLAG_VNI;
+  sock->vxlan_hdr[4] = (tr->vni >> 16) & 0xff;
+  sock->vxlan_hdr[5] = (tr->vni >> 8) & 0xff;
+  sock->vxlan_hdr[6] = tr->vni & 0xff;
+  // VXLAN peers are hosts, the source port changes with the flow
+  if (sock->vxlan) {
+    sock->peers_by_addr = vde_hash_init_full(udp_host_hash, udp_host_equal);
+  } else {
+    sock->peers_by_addr = vde_hash_init_full(udp_addr_hash, udp_addr_equal);
+  }
+  sock->port = udp_addr_port(&tr->local);
+
+  sock->fd = socket(tr->local.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                    0);
+  if (sock->fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create udp socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (bind(sock->fd, (struct sockaddr *)&tr->local, tr->local_len) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot bind udp socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  // bursts of datagrams must not overflow the default buffers
+  setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &buf_sz, sizeof(buf_sz));
+  setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &buf_sz, sizeof(buf_sz));
+
+  // both offloads depend on the kernel version, go without them if missing
+  if (tr->gso) {
+    sock->gso = !setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &off,
+                            sizeof(off));
+  }
+  if (tr->gro) {
+    sock->gro = !setsockopt(sock->fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+  }
+  if ((tr->gso && !sock->gso) || (tr->gro && !sock->gro)) {
+    vde_warning("%s: udp segmentation offloads not available",
+                __PRETTY_FUNCTION__);
+  }
+
+  sock->rx_buf_sz = sock->gro ? UDP_GRO_BUF_SZ :
+                    UDP_VXLAN_HDR_SZ + UDP_FRAME_MAX;
+  sock->rx_nbufs = sock->gro && tr->batch > UDP_GRO_BUFS ? UDP_GRO_BUFS :
+                   tr->batch;
+  sock->rx_bufs = (unsigned char *)vde_alloc(sock->rx_nbufs *
+                                             sock->rx_buf_sz);
+  sock->pkt_pool = vde_pool_new(sizeof(vde_pkt) + PKT_DATA_SZ, PKT_POOL_SLAB,
+                                PKT_POOL_LOW_WM, PKT_POOL_HIGH_WM);
+  if (sock->rx_bufs == NULL || sock->pkt_pool == NULL) {
+    vde_error("%s: cannot create receive buffers", __PRETTY_FUNCTION__);
+    tmp_errno = ENOMEM;
+    goto error;
+  }
+
+  for (i = 0; i < tr->npeers; i++) {
+    if (udp_peer_new(sock, &tr->peers[i], tr->peers_len[i], 1) == NULL) {
+      tmp_errno = errno;
+      goto error;
+    }
+  }
+
+  sock->ev = vde_context_event_add(sock->context, sock->fd,
+                                   VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                   &udp_sock_read_event, (void *)sock);
+  if (sock->ev == NULL) {
+    vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+    tmp_errno = EIO;
+    goto error;
+  }
+
+  tr->sock = sock;
+  return 0;
+
+error:
+  udp_sock_put(sock);
+  errno = tmp_errno;
+  return -1;
+}
+
+int udp_listen(vde_component *component)
+{
+  vde_list *iter;
+  udp_peer *peer;
+  vde_connection *conn;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  if (udp_sock_open(component)) {
+    return -1;
+  }
+  tr->sock->accept = tr->accept;
+
+  // configured peers are up from the start
+  iter = vde_list_first(tr->sock->peers);
+  while (iter != NULL) {
+    peer = vde_list_get_data(iter);
+    iter = vde_list_next(iter);
+    if (!peer->configured || peer->conn != NULL) {
+      continue;
+    }
+    if (vde_connection_new(&conn)) {
+      return -1;
+    }
+    udp_peer_attach(peer, conn);
+    vde_transport_call_cm_accept_cb(component, conn);
+  }
+  return 0;
+}
+
+int udp_connect(vde_component *component, vde_connection *conn)
+{
+  vde_list *iter;
+  udp_peer *peer;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  if (udp_sock_open(component)) {
+    return -1;
+  }
+
+  // attach the first configured peer which is not connected yet
+  iter = vde_list_first(tr->sock->peers);
+  while (iter != NULL) {
+    peer = vde_list_get_data(iter);
+    if (peer->configured && peer->conn == NULL) {
+      break;
+    }
+    iter = vde_list_next(iter);
+  }
+  if (iter == NULL) {
+    vde_error("%s: no configured peer left to connect to",
+              __PRETTY_FUNCTION__);
+    errno = tr->npeers > 0 ? EISCONN : EDESTADDRREQ;
+    return -1;
+  }
+  udp_peer_attach(peer, conn);
+  vde_transport_call_cm_connect_cb(component, conn);
+  return 0;
+}
+
+int transport_udp_peers(vde_component *component, vde_sobj **out)
+{
+  vde_list *iter;
+  udp_peer *peer;
+  vde_sobj *peer_sobj;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_array();
+  if (tr->sock == NULL) {
+    return 0;
+  }
+  iter = vde_list_first(tr->sock->peers);
+  while (iter != NULL) {
+    peer = vde_list_get_data(iter);
+    // XXX check peer_sobj not null
+    peer_sobj = vde_sobj_new_hash();
+    vde_sobj_hash_insert(peer_sobj, "peer", vde_sobj_new_string(peer->name));
+    vde_sobj_hash_insert(peer_sobj, "connected",
+                         vde_sobj_new_bool(peer->conn != NULL));
+    vde_sobj_hash_insert(peer_sobj, "rx_packets",
+                         vde_sobj_new_int64(peer->stats.rx_packets));
+    vde_sobj_hash_insert(peer_sobj, "rx_bytes",
+                         vde_sobj_new_int64(peer->stats.rx_bytes));
+    vde_sobj_hash_insert(peer_sobj, "rx_drops",
+                         vde_sobj_new_int64(peer->stats.rx_drops));
+    vde_sobj_hash_insert(peer_sobj, "tx_packets",
+                         vde_sobj_new_int64(peer->stats.tx_packets));
+    vde_sobj_hash_insert(peer_sobj, "tx_bytes",
+                         vde_sobj_new_int64(peer->stats.tx_bytes));
+    vde_sobj_hash_insert(peer_sobj, "tx_drops",
+                         vde_sobj_new_int64(peer->stats.tx_drops));
+    vde_sobj_array_add(*out, peer_sobj);
+    iter = vde_list_next(iter);
+  }
+  return 0;
+}
+
+int transport_udp_status(vde_component *component, vde_sobj **out)
+{
+  struct sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  char name[INET6_ADDRSTRLEN + 8];
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "mode",
+                       vde_sobj_new_string(tr->vxlan ? "vxlan" : "raw"));
+  if (tr->vxlan) {
+    vde_sobj_hash_insert(*out, "vni", vde_sobj_new_int(tr->vni));
+  }
+  if (tr->sock == NULL) {
+    vde_sobj_hash_insert(*out, "open", vde_sobj_new_bool(0));
+    return 0;
+  }
+  vde_sobj_hash_insert(*out, "open", vde_sobj_new_bool(1));
+  if (!getsockname(tr->sock->fd, (struct sockaddr *)&local, &local_len)) {
+    udp_addr_name(&local, name, sizeof(name));
+    vde_sobj_hash_insert(*out, "local", vde_sobj_new_string(name));
+  }
+  vde_sobj_hash_insert(*out, "gso", vde_sobj_new_bool(tr->sock->gso));
+  vde_sobj_hash_insert(*out, "gro", vde_sobj_new_bool(tr->sock->gro));
+  vde_sobj_hash_insert(*out, "peers",
+                       vde_sobj_new_int(vde_list_length(tr->sock->peers)));
+  vde_sobj_hash_insert(*out, "rx_unknown",
+                       vde_sobj_new_int64(tr->sock->rx_unknown));
+  return 0;
+}
+
+/**
+ * @brief Resolve an address given as "host:port" or "[host]:port", the port
+ * can be omitted when def_port is not zero
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int udp_resolve(const char *str, int family, int flags,
+                       unsigned int def_port, struct sockaddr_storage *ss,
+                       socklen_t *ss_len)
+{
+  struct addrinfo hints, *res;
+  char host[256], port[8];
+  const char *sep, *end;
+  size_t host_len;
+  int rv;
+
+  end = str + strlen(str);
+  if (str[0] == '[') {
+    sep = strchr(str, ']');
+    if (sep == NULL) {
+      errno = EINVAL;
+      return -1;
+    }
+    host_len = sep - str - 1;
+    str++;
+    sep = sep[1] == ':' ? sep + 1 : (sep[1] ? NULL : end);
+  } else {
+    sep = strrchr(str, ':');
+    // more than one colon is a bare ipv6 address
+    if (sep == NULL || strchr(str, ':') != sep) {
+      sep = end;
+    }
+    host_len = sep - str;
+  }
+  if (sep == NULL || host_len >= sizeof(host) ||
+      (*sep == '\0' && def_port == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(host, str, host_len);
+  host[host_len] = '\0';
+  if (*sep == ':') {
+    snprintf(port, sizeof(port), "%s", sep + 1);
+  } else {
+    snprintf(port, sizeof(port), "%u", def_port);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = flags|AI_NUMERICSERV;
+  rv = getaddrinfo(host_len > 0 ? host : NULL, port, &hints, &res);
+  if (rv) {
+    vde_error("%s: cannot resolve %s: %s", __PRETTY_FUNCTION__, host,
+              gai_strerror(rv));
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(ss, res->ai_addr, res->ai_addrlen);
+  *ss_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int transport_udp_init(vde_component *component, vde_sobj *params)
+{
+  udp_tr *tr;
+  vde_sobj *local_sobj, *peers_sobj, *peer_sobj, *vxlan_sobj, *vni_sobj,
+           *offload_sobj, *accept_sobj, *batch_sobj;
+  const char *local = "0.0.0.0";
+  int vxlan = 0, vni = 0, offload = 1, batch = VDE_PKT_BATCH_MAX;
+  unsigned int i, npeers = 0;
+  int tmp_errno;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (udp_tr *)vde_calloc(sizeof(udp_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // optional: VXLAN encapsulation with network identifier vni
+  vxlan_sobj = vde_sobj_hash_lookup(params, "vxlan");
+  if (vxlan_sobj) {
+    if (!vde_sobj_is_type(vxlan_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: vxlan must be a boolean", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    vxlan = vde_sobj_get_bool(vxlan_sobj);
+  }
+  vni_sobj = vde_sobj_hash_lookup(params, "vni");
+  if (vni_sobj) {
+    if (!vde_sobj_is_type(vni_sobj, vde_sobj_type_int)) {
+      vde_error("%s: vni must be an integer", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    vni = vde_sobj_get_int(vni_sobj);
+    if (vni < 0 || vni > UDP_VXLAN_VNI_MAX) {
+      vde_error("%s: vni must be between 0 and %d", __PRETTY_FUNCTION__,
+                UDP_VXLAN_VNI_MAX);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+  }
+
+  // optional: local address and port, "host:port", the port defaults to
+  // the VXLAN one
+  local_sobj = vde_sobj_hash_lookup(params, "local");
+  if (local_sobj) {
+    if (!vde_sobj_is_type(local_sobj, vde_sobj_type_string)) {
+      vde_error("%s: local must be a string", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    local = vde_sobj_get_string(local_sobj);
+  }
+  if (udp_resolve(local, AF_UNSPEC, AI_PASSIVE|AI_NUMERICHOST,
+                  UDP_VXLAN_PORT, &tr->local, &tr->local_len)) {
+    vde_error("%s: invalid local address %s", __PRETTY_FUNCTION__, local);
+    tmp_errno = EINVAL;
+    goto error;
+  }
+
+  // optional: remote peers, "host:port", of the same family as local
+  peers_sobj = vde_sobj_hash_lookup(params, "peers");
+  if (peers_sobj) {
+    if (!vde_sobj_is_type(peers_sobj, vde_sobj_type_array)) {
+      vde_error("%s: peers must be an array", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    npeers = vde_sobj_array_length(peers_sobj);
+  }
+  if (npeers > 0) {
+    tr->peers = (struct sockaddr_storage *)
+                vde_calloc(npeers * sizeof(struct sockaddr_storage));
+    tr->peers_len = (socklen_t *)vde_calloc(npeers * sizeof(socklen_t));
+    if (tr->peers == NULL || tr->peers_len == NULL) {
+      vde_error("%s: could not allocate peers", __PRETTY_FUNCTION__);
+      tmp_errno = ENOMEM;
+      goto error;
+    }
+  }
+  for (i = 0; i < npeers; i++) {
+    peer_sobj = vde_sobj_array_get_idx(peers_sobj, i);
+    if (!vde_sobj_is_type(peer_sobj, vde_sobj_type_string) ||
+        udp_resolve(vde_sobj_get_string(peer_sobj), tr->local.ss_family, 0,
+                    UDP_VXLAN_PORT, &tr->peers[i], &tr->peers_len[i])) {
+      vde_error("%s: invalid peer at index %u", __PRETTY_FUNCTION__, i);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+  }
+  tr->npeers = npeers;
+
+  // optional: learn peers from their first datagram while listening, by
+  // default only if no peer is configured
+  tr->accept = npeers == 0;
+  accept_sobj = vde_sobj_hash_lookup(params, "accept");
+  if (accept_sobj) {
+    if (!vde_sobj_is_type(accept_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: accept must be a boolean", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    tr->accept = vde_sobj_get_bool(accept_sobj);
+  }
+
+  // optional: segmentation offloads, used when the kernel has them
+  offload_sobj = vde_sobj_hash_lookup(params, "offload");
+  if (offload_sobj) {
+    if (!vde_sobj_is_type(offload_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: offload must be a boolean", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    offload = vde_sobj_get_bool(offload_sobj);
+  }
+
+  // optional: datagrams read with a single syscall
+  batch_sobj = vde_sobj_hash_lookup(params, "batch");
+  if (batch_sobj) {
+    if (!vde_sobj_is_type(batch_sobj, vde_sobj_type_int)) {
+      vde_error("%s: batch must be an integer", __PRETTY_FUNCTION__);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+    batch = vde_sobj_get_int(batch_sobj);
+    if (batch < 1 || batch > VDE_PKT_BATCH_MAX) {
+      vde_error("%s: batch must be between 1 and %d", __PRETTY_FUNCTION__,
+                VDE_PKT_BATCH_MAX);
+      tmp_errno = EINVAL;
+      goto error;
+    }
+  }
+
+  tr->vxlan = vxlan;
+  tr->vni = vni;
+  tr->gso = offload;
+  tr->gro = offload;
+  tr->batch = batch;
+
+  // command registration phase
+  // - the header for the wrappers has been included at the top
+  // - register the commands array, the name is in the json definition
+  if (vde_component_commands_register(component, transport_udp_commands)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+
+error:
+  vde_free(tr->peers);
+  vde_free(tr->peers_len);
+  vde_free(tr);
+  errno = tmp_errno;
+  return -1;
+}
+
+void transport_udp_fini(vde_component *component)
+{
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  vde_assert(component != NULL);
+
+  vde_component_commands_deregister(component, transport_udp_commands);
+
+  // connected peers belong to their engine and keep the socket open
+  if (tr->sock != NULL) {
+    tr->sock->component = NULL;
+    tr->sock->accept = 0;
+    udp_sock_put(tr->sock);
+  }
+  vde_free(tr->peers);
+  vde_free(tr->peers_len);
+  vde_free(tr);
+}
+
+component_ops transport_udp_component_ops = {
+  .init = transport_udp_init,
+  .fini = transport_udp_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "udp",
+  .cops = &transport_udp_component_ops,
+  .tr_listen = &udp_listen,
+  .tr_connect = &udp_connect,
+};
@@ -32,6 +32,8 @@
 #include <vde3/transport.h>
 #include <vde3/context.h>
 #include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/uring.h>
 
 #define LISTEN_QUEUE 15
 #define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
@@ -53,11 +55,24 @@
 #define MAXQLEN 4192
 // end of vde2 packetq.c
 
+// packets pool of a connection, it grows up to the queue length
+#define PKT_POOL_SLAB 64
+#define PKT_POOL_LOW_WM 64
+
 // taken from vde2 datasock.c
 #define DATA_BUF_SIZE 131072
 #define SWITCH_MAGIC 0xfeedface
 #define REQBUFLEN 256
 
+// where clients create their datagram sockets, as libvdeplug does
+#define VDE2_CLIENT_SOCK_DIR "/tmp"
+
+// datagrams sent to many ports by a single sendmmsg() on the shared socket
+#define SHARED_SEND_MAX 256
+
+// receive buffers provided to the kernel for each connection on io_uring
+#define URING_RX_BUFS 64
+
 enum request_type { REQ_NEW_CONTROL, REQ_NEW_PORT0 };
 
 // this is request_v3
@@ -71,7 +86,6 @@ typedef struct {
 // end of vde2 datasock.c
 
 typedef struct {
-  unsigned int numtries;
   vde_pkt pkt;
   char data[PKT_DATA_SZ];
 } vde2_pkt;
@@ -80,24 +94,64 @@ typedef struct {
   int data_fd;
   void *data_ev_rd;
   void *data_ev_wr;
+  vde_timer *send_timer; // retries sending when data_fd stays not writable
   int ctl_fd;
   void *ctl_ev;
-  vde_queue *pkt_queue;
+  vde_ring *pkt_queue;
+  unsigned int numtries; // send attempts of the packet at the queue head
+  int batch; // max packets moved by a single recvmmsg()/sendmmsg()
+  vde_pool *pkt_pool;
   struct sockaddr_un local_sa;
   struct sockaddr_un remote_sa;
   vde2_request *remote_request;
+  int shared; // data goes through the transport shared socket
+  int wr_pending; // in the send list of the shared socket
+  int wr_blocked; // got EAGAIN in the current shared send round
+  vde_uring_io *uring; // data_fd I/O goes through the io_uring loop
+  unsigned int uring_inflight; // sends submitted and not completed yet
+  vde_pkt_batch uring_rx; // received in this loop iteration, not delivered
   vde_connection *conn;
   vde_component *transport;
 } vde2_conn;
 
 typedef struct {
   char *vdesock_dir;
+  int batch;
+  unsigned int queue_len;
   int listen_fd;
   void *listen_event;
   unsigned int connections;
   vde_list *pending_conns;
+  int shared_socket; // accepted ports share a single data socket
+  int shared_fd;
+  void *shared_ev_rd;
+  void *shared_ev_wr;
+  struct sockaddr_un shared_sa;
+  vde_hash *shared_conns; // peer socket path -> vde2_conn
+  vde_list *shared_wr_conns; // ports with packets to send
+  vde_list *shared_ports; // every port on the shared socket
+  int shared_writing; // running vde2_shared_write_event()
+  vde_list *shared_closed; // ports closed meanwhile, freed once it is done
+  vde_pool *shared_pool;
 } vde2_tr;
 
+static unsigned int vde2_path_hash(const void *key)
+{
+  const unsigned char *path = (const unsigned char *)key;
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+
+  for (i = 0; i < UNIX_PATH_MAX && path[i] != '\0'; i++) {
+    hash = (hash ^ path[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int vde2_path_equal(const void *a, const void *b)
+{
+  return strncmp((const char *)a, (const char *)b, UNIX_PATH_MAX) == 0;
+}
+
 void vde2_conn_read_ctl_event(int ctl_fd, short event_type, void *arg)
 {
   int len;
@@ -140,39 +194,71 @@ err_close:
   vde_connection_delete(conn);
 }
 
+/**
+ * @brief Release callback of packets allocated from a connection pool
+ */
+static void vde2_pkt_release(vde_pkt *pkt, void *arg)
+{
+  vde_pool *pool = (vde_pool *)arg;
+
+  // pkt is the first member of vde2_pkt
+  vde_cached_pool_free(pool, pkt);
+}
+
 void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
 {
   vde2_pkt stack_pkt;
-  vde_pkt *pkt;
-  struct sockaddr sock;
-  int len;
+  vde2_pkt *v2_pkt;
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX];
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iovs[VDE_PKT_BATCH_MAX];
+  vde_pkt_batch batch;
+  int i, n, nmsgs;
   int cb_errno = 0;
-  socklen_t socklen = sizeof(sock);
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
 
-  if ( (vde_connection_get_pkt_headsize(conn) <= MAX_HEAD_SZ)
-        && (vde_connection_get_pkt_tailsize(conn) <= MAX_TAIL_SZ) ) {
-    pkt = &stack_pkt.pkt;
-    vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
-                 vde_connection_get_pkt_tailsize(conn));
-  } else {
+  if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
     // XXX: perform dynamic allocation
     vde_warning("%s: requested head + tail size too large, skipping",
                 __PRETTY_FUNCTION__);
     return;
   }
 
-  len = recvfrom(v2_conn->data_fd, pkt->payload, sizeof(struct eth_frame), 0,
-                 &sock, &socklen);
-  // XXX: check received sock with remote path??
-  if (len >= sizeof(struct eth_hdr)) {
-    // XXX: set hdr version and type
-    pkt->hdr->pkt_len = len;
-    if (vde_connection_call_read(conn, pkt)) {
-      cb_errno = errno;
+  // read into shared packets so that the connections they are written to can
+  // keep a reference instead of copying them, if the pool is exhausted fall
+  // back to a single private packet on the stack
+  for (n = 0; n < v2_conn->batch; n++) {
+    v2_pkt = vde_cached_pool_alloc(v2_conn->pkt_pool);
+    if (v2_pkt == NULL) {
+      break;
     }
-  } else if (len < 0) {
+    vde_pkt_init(&v2_pkt->pkt, PKT_DATA_SZ,
+                 vde_connection_get_pkt_headsize(conn),
+                 vde_connection_get_pkt_tailsize(conn));
+    vde_pkt_set_release(&v2_pkt->pkt, vde2_pkt_release, v2_conn->pkt_pool);
+    pkts[n] = &v2_pkt->pkt;
+  }
+  if (n == 0) {
+    vde_pkt_init(&stack_pkt.pkt, PKT_DATA_SZ,
+                 vde_connection_get_pkt_headsize(conn),
+                 vde_connection_get_pkt_tailsize(conn));
+    pkts[n++] = &stack_pkt.pkt;
+  }
+
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  for (i = 0; i < n; i++) {
+    iovs[i].iov_base = pkts[i]->payload;
+    iovs[i].iov_len = sizeof(struct eth_frame);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // drain the socket with a single syscall
+  nmsgs = recvmmsg(v2_conn->data_fd, msgs, n, MSG_DONTWAIT, NULL);
+  // XXX: check received sock with remote path??
+  if (nmsgs < 0) {
     if (errno == EAGAIN) {
       vde_warning("%s: got EAGAIN on data_fd %d", __PRETTY_FUNCTION__,
                   v2_conn->data_fd);
@@ -181,12 +267,32 @@ void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
     vde_warning("%s: error reading from data_fd %d: %s", __PRETTY_FUNCTION__,
                 v2_conn->data_fd, strerror(errno));
     }
-  } else if (len == 0) {
-    vde_warning("%s: EOF from data_fd %d: %s", __PRETTY_FUNCTION__,
-                v2_conn->data_fd, strerror(errno));
+    nmsgs = 0;
+  }
+
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < nmsgs; i++) {
+    if (msgs[i].msg_len == 0) {
+      vde_warning("%s: EOF from data_fd %d", __PRETTY_FUNCTION__,
+                  v2_conn->data_fd);
+    } else if (msgs[i].msg_len >= sizeof(struct eth_hdr)) {
+      // XXX: set hdr version and type
+      pkts[i]->hdr->pkt_len = msgs[i].msg_len;
+      vde_pkt_batch_add(&batch, pkts[i]);
+    }
+  }
+
+  if (batch.len > 0 && vde_connection_call_read_batch(conn, &batch)) {
+    cb_errno = errno;
   }
 
-  // XXX: free packet if previously allocated with dynamic allocation
+  // drop our references, whoever still needs a packet holds its own. This
+  // gives back to the pool unused packets as well.
+  for (i = 0; i < n; i++) {
+    if (vde_pkt_is_shared(pkts[i])) {
+      vde_pkt_put(pkts[i]);
+    }
+  }
 
   if (cb_errno == EPIPE) {
     vde_connection_fini(conn);
@@ -194,65 +300,309 @@ void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
   }
 }
 
-void vde2_conn_write_data_event(int data_fd, short event_type, void *arg)
+/**
+ * @brief Hand the packets received through io_uring to the connection
+ *
+ * @return zero on success, -1 if the connection has been closed
+ */
+static int vde2_uring_deliver(vde2_conn *v2_conn)
 {
-  int len;
-  vde2_pkt *v2_pkt;
-  vde_pkt *pkt;
+  unsigned int i;
   int cb_errno = 0;
+  vde_connection *conn = v2_conn->conn;
+
+  if (v2_conn->uring_rx.len == 0) {
+    return 0;
+  }
+  if (vde_connection_call_read_batch(conn, &v2_conn->uring_rx)) {
+    cb_errno = errno;
+  }
+  for (i = 0; i < v2_conn->uring_rx.len; i++) {
+    vde_pkt_put(v2_conn->uring_rx.pkts[i]);
+  }
+  vde_pkt_batch_init(&v2_conn->uring_rx);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+static void vde2_uring_recv(vde_uring_io *io, void *data, unsigned int len,
+                            struct sockaddr *name, socklen_t namelen,
+                            void *arg)
+{
+  vde2_pkt stack_pkt;
+  vde2_pkt *v2_pkt;
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
 
-  v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  while (v2_pkt != NULL) {
-    pkt = &v2_pkt->pkt;
-    len = sendto(v2_conn->data_fd, pkt->payload, pkt->hdr->pkt_len, 0,
-                 (const struct sockaddr *)&v2_conn->remote_sa,
-                 sizeof(struct sockaddr_un));
-    if (len == pkt->hdr->pkt_len) {
-      if (vde_connection_call_write(conn, pkt)) {
-        cb_errno = errno;
+  // XXX: check received sock with remote path??
+  if (len == 0) {
+    vde_warning("%s: EOF from data_fd %d", __PRETTY_FUNCTION__,
+                v2_conn->data_fd);
+    return;
+  }
+  if (len < sizeof(struct eth_hdr) || len > sizeof(struct eth_frame)) {
+    return;
+  }
+  if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+        || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
+    // XXX: perform dynamic allocation
+    vde_warning("%s: requested head + tail size too large, skipping",
+                __PRETTY_FUNCTION__);
+    return;
+  }
+
+  // the kernel buffer is given back as soon as we return, copy the frame into
+  // a shared packet delivered with the others at the end of the iteration
+  v2_pkt = vde_cached_pool_alloc(v2_conn->pkt_pool);
+  if (v2_pkt == NULL) {
+    // the pending packets may give some back
+    if (vde2_uring_deliver(v2_conn)) {
+      return;
+    }
+    v2_pkt = vde_cached_pool_alloc(v2_conn->pkt_pool);
+  }
+  if (v2_pkt == NULL) {
+    // a single private packet on the stack, delivered right away
+    vde_pkt_init(&stack_pkt.pkt, PKT_DATA_SZ,
+                 vde_connection_get_pkt_headsize(conn),
+                 vde_connection_get_pkt_tailsize(conn));
+    memcpy(stack_pkt.pkt.payload, data, len);
+    stack_pkt.pkt.hdr->pkt_len = len;
+    if (vde_connection_call_read(conn, &stack_pkt.pkt) && errno == EPIPE) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+    return;
+  }
+
+  vde_pkt_init(&v2_pkt->pkt, PKT_DATA_SZ,
+               vde_connection_get_pkt_headsize(conn),
+               vde_connection_get_pkt_tailsize(conn));
+  vde_pkt_set_release(&v2_pkt->pkt, vde2_pkt_release, v2_conn->pkt_pool);
+  // XXX: set hdr version and type
+  memcpy(v2_pkt->pkt.payload, data, len);
+  v2_pkt->pkt.hdr->pkt_len = len;
+  vde_pkt_batch_add(&v2_conn->uring_rx, &v2_pkt->pkt);
+  if (vde_pkt_batch_full(&v2_conn->uring_rx)) {
+    vde2_uring_deliver(v2_conn);
+  }
+}
+
+static void vde2_uring_flush(vde_uring_io *io, void *arg)
+{
+  vde2_uring_deliver((vde2_conn *)arg);
+}
+
+/**
+ * @brief Hand a batch of packets received on the shared socket to a port
+ *
+ * @return zero on success, -1 if the connection has been closed
+ */
+static int vde2_shared_deliver(vde2_conn *v2_conn, vde_pkt_batch *batch)
+{
+  int cb_errno = 0;
+  vde_connection *conn = v2_conn->conn;
+
+  if (vde_connection_call_read_batch(conn, batch)) {
+    cb_errno = errno;
+  }
+  vde_pkt_batch_init(batch);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+void vde2_shared_read_event(int data_fd, short event_type, void *arg)
+{
+  vde2_pkt stack_pkt;
+  vde2_pkt *v2_pkt;
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX];
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iovs[VDE_PKT_BATCH_MAX];
+  struct sockaddr_un addrs[VDE_PKT_BATCH_MAX];
+  vde_pkt_batch batch;
+  int i, n, nmsgs;
+  vde2_conn *v2_conn = NULL;
+  vde_connection *conn;
+  vde_component *component = (vde_component *)arg;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  // the port of a packet is known once received, leave room for the largest
+  // head any of them can ask for
+  for (n = 0; n < tr->batch; n++) {
+    v2_pkt = vde_cached_pool_alloc(tr->shared_pool);
+    if (v2_pkt == NULL) {
+      break;
+    }
+    vde_pkt_init(&v2_pkt->pkt, PKT_DATA_SZ, MAX_HEAD_SZ, MAX_TAIL_SZ);
+    vde_pkt_set_release(&v2_pkt->pkt, vde2_pkt_release, tr->shared_pool);
+    pkts[n] = &v2_pkt->pkt;
+  }
+  if (n == 0) {
+    vde_pkt_init(&stack_pkt.pkt, PKT_DATA_SZ, MAX_HEAD_SZ, MAX_TAIL_SZ);
+    pkts[n++] = &stack_pkt.pkt;
+  }
+
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  // a sender path filling sun_path is not NUL terminated
+  memset(addrs, 0, n * sizeof(struct sockaddr_un));
+  for (i = 0; i < n; i++) {
+    iovs[i].iov_base = pkts[i]->payload;
+    iovs[i].iov_len = sizeof(struct eth_frame);
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  nmsgs = recvmmsg(tr->shared_fd, msgs, n, MSG_DONTWAIT, NULL);
+  if (nmsgs < 0) {
+    if (errno != EAGAIN) {
+      vde_warning("%s: error reading from shared data socket: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+    }
+    nmsgs = 0;
+  }
+
+  // demultiplex by sender, each run of packets from a port is a batch
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < nmsgs; i++) {
+    if (msgs[i].msg_len < sizeof(struct eth_hdr)) {
+      continue;
+    }
+    if (v2_conn == NULL ||
+        !vde2_path_equal(addrs[i].sun_path, v2_conn->remote_sa.sun_path)) {
+      if (batch.len > 0) {
+        vde2_shared_deliver(v2_conn, &batch);
       }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
-      if (cb_errno == EPIPE) {
-        goto err_close;
+      // datagrams from unknown senders are dropped
+      v2_conn = vde_hash_lookup(tr->shared_conns, addrs[i].sun_path);
+      if (v2_conn == NULL) {
+        continue;
       }
-    } else if ((len < 0) && (errno != EAGAIN)) {
-      if (vde_connection_call_error(conn, pkt, CONN_WRITE_CLOSED)) {
+    }
+    conn = v2_conn->conn;
+    if ( (vde_connection_get_pkt_headsize(conn) > MAX_HEAD_SZ)
+          || (vde_connection_get_pkt_tailsize(conn) > MAX_TAIL_SZ) ) {
+      // XXX: perform dynamic allocation
+      vde_warning("%s: requested head + tail size too large, skipping",
+                  __PRETTY_FUNCTION__);
+      continue;
+    }
+    // XXX: set hdr version and type
+    pkts[i]->hdr->pkt_len = msgs[i].msg_len;
+    vde_pkt_batch_add(&batch, pkts[i]);
+  }
+  if (batch.len > 0) {
+    vde2_shared_deliver(v2_conn, &batch);
+  }
+
+  // drop our references, whoever still needs a packet holds its own
+  for (i = 0; i < n; i++) {
+    if (vde_pkt_is_shared(pkts[i])) {
+      vde_pkt_put(pkts[i]);
+    }
+  }
+}
+
+void vde2_conn_write_data_event(int data_fd, short event_type, void *arg)
+{
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX];
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iovs[VDE_PKT_BATCH_MAX];
+  int i, n, nsent;
+  int cb_errno = 0;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+
+  // restart the send timeout on each attempt, as a persistent event would do
+  vde_timer_arm(v2_conn->send_timer, vde_connection_get_send_maxtimeout(conn),
+                VDE_EV_PERSIST);
+
+  while (!vde_ring_is_empty(v2_conn->pkt_queue)) {
+    // look at up to a batch of packets from the head of the queue, they are
+    // removed only once sent or dropped
+    memset(msgs, 0, sizeof(msgs));
+    for (n = 0; n < v2_conn->batch; n++) {
+      pkts[n] = vde_ring_peek_nth(v2_conn->pkt_queue, n);
+      if (pkts[n] == NULL) {
+        break;
+      }
+      iovs[n].iov_base = pkts[n]->payload;
+      iovs[n].iov_len = pkts[n]->hdr->pkt_len;
+      msgs[n].msg_hdr.msg_name = &v2_conn->remote_sa;
+      msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    nsent = sendmmsg(v2_conn->data_fd, msgs, n, 0);
+
+    if ((nsent < 0) && (errno != EAGAIN)) {
+      v2_conn->numtries = 0;
+      vde_ring_discard(v2_conn->pkt_queue, 1);
+      if (vde_connection_call_error(conn, pkts[0], CONN_WRITE_CLOSED)) {
         cb_errno = errno;
       }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
+      vde_pkt_put(pkts[0]);
       if (cb_errno == EPIPE) {
         goto err_close;
-      } else {
-        vde_warning("%s: fatal error on data_fd %d but connection not closed",
-                    __PRETTY_FUNCTION__, v2_conn->data_fd);
-        break;
       }
-    } else { /* (0 < len < pkt_len) || (len < 0 && errno == EAGAIN) */
-      v2_pkt->numtries++;
-      if (v2_pkt->numtries > vde_connection_get_send_maxtries(conn)) {
-        if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY)) {
+      vde_warning("%s: fatal error on data_fd %d but connection not closed",
+                  __PRETTY_FUNCTION__, v2_conn->data_fd);
+      return;
+    }
+    if (nsent < 0) {
+      /* the packet at the head of the queue got EAGAIN */
+      v2_conn->numtries++;
+      if (v2_conn->numtries > vde_connection_get_send_maxtries(conn)) {
+        v2_conn->numtries = 0;
+        vde_ring_discard(v2_conn->pkt_queue, 1);
+        if (vde_connection_call_error(conn, pkts[0], CONN_WRITE_DELAY)) {
           cb_errno = errno;
         }
-        vde_cached_free_type(vde2_pkt, v2_pkt);
+        vde_pkt_put(pkts[0]);
         if (cb_errno == EPIPE) {
           goto err_close;
         }
-      } else {
-        vde_queue_push_tail(v2_conn->pkt_queue, v2_pkt);
       }
-      break; // give up sending
+      return; // give up sending
     }
-    v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  }
 
-  if (v2_pkt == NULL) {
-    vde_context_event_del(vde_connection_get_context(conn),
-                          v2_conn->data_ev_wr);
-    v2_conn->data_ev_wr = NULL;
+    vde_ring_discard(v2_conn->pkt_queue, nsent);
+    for (i = 0; i < nsent; i++) {
+      // datagrams are sent as a whole
+      v2_conn->numtries = 0;
+      if (vde_connection_call_write(conn, pkts[i])) {
+        cb_errno = errno;
+      }
+      vde_pkt_put(pkts[i]);
+      if (cb_errno == EPIPE) {
+        // release the rest of the sent packets before closing
+        while (++i < nsent) {
+          vde_pkt_put(pkts[i]);
+        }
+        goto err_close;
+      }
+    }
+    // a short count does not tell why the next packet was not sent, it is
+    // now at the head of the queue and the next sendmmsg() reports its error
   }
 
+  vde_context_event_del(vde_connection_get_context(conn),
+                        v2_conn->data_ev_wr);
+  v2_conn->data_ev_wr = NULL;
+  vde_timer_cancel(v2_conn->send_timer);
+
   return;
 
 err_close:
@@ -260,56 +610,478 @@ err_close:
   vde_connection_delete(conn);
 }
 
-int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
+/**
+ * @brief Drop the packet at the head of the send queue of a port on the
+ * shared socket
+ *
+ * @return zero on success, -1 if the connection has been closed
+ */
+static int vde2_shared_drop(vde2_conn *v2_conn, vde_conn_error err)
+{
+  int cb_errno = 0;
+  vde_pkt *pkt = vde_ring_pop(v2_conn->pkt_queue);
+  vde_connection *conn = v2_conn->conn;
+
+  v2_conn->numtries = 0;
+  if (vde_connection_call_error(conn, pkt, err)) {
+    cb_errno = errno;
+  }
+  vde_pkt_put(pkt);
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return 0;
+}
+
+void vde2_shared_write_event(int data_fd, short event_type, void *arg)
+{
+  vde_pkt *pkts[SHARED_SEND_MAX];
+  vde2_conn *owners[SHARED_SEND_MAX];
+  struct mmsghdr msgs[SHARED_SEND_MAX];
+  struct iovec iovs[SHARED_SEND_MAX];
+  vde_list *l, *next;
+  vde2_conn *v2_conn;
+  vde_connection *conn;
+  int i, k, n, nsent, send_errno;
+  int cb_errno;
+  vde_component *component = (vde_component *)arg;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  // callbacks can close any port, owners[] stays valid until we are done
+  tr->shared_writing++;
+  for (;;) {
+    // queued packets of every port go out in a single sendmmsg(), each to
+    // its own destination
+    memset(msgs, 0, sizeof(msgs));
+    n = 0;
+    for (l = vde_list_first(tr->shared_wr_conns); l && n < SHARED_SEND_MAX;
+         l = vde_list_next(l)) {
+      v2_conn = vde_list_get_data(l);
+      if (v2_conn->wr_blocked) {
+        continue;
+      }
+      // restart the send timeout on each attempt
+      vde_timer_arm(v2_conn->send_timer,
+                    vde_connection_get_send_maxtimeout(v2_conn->conn),
+                    VDE_EV_PERSIST);
+      for (k = 0; k < v2_conn->batch && n < SHARED_SEND_MAX; k++, n++) {
+        pkts[n] = vde_ring_peek_nth(v2_conn->pkt_queue, k);
+        if (pkts[n] == NULL) {
+          break;
+        }
+        owners[n] = v2_conn;
+        iovs[n].iov_base = pkts[n]->payload;
+        iovs[n].iov_len = pkts[n]->hdr->pkt_len;
+        msgs[n].msg_hdr.msg_name = &v2_conn->remote_sa;
+        msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        msgs[n].msg_hdr.msg_iov = &iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+
+    nsent = sendmmsg(tr->shared_fd, msgs, n, MSG_DONTWAIT);
+    send_errno = nsent < 0 ? errno : 0;
+    if (nsent < 0) {
+      nsent = 0;
+    }
+
+    // once a port is closed by a callback, by its own or by another one,
+    // its queue has been released: skip the rest of its packets
+    for (i = 0; i < nsent; i++) {
+      v2_conn = owners[i];
+      if (v2_conn->conn == NULL) {
+        continue;
+      }
+      // closing the port clears v2_conn->conn, keep it for the delete
+      conn = v2_conn->conn;
+      cb_errno = 0;
+      v2_conn->numtries = 0;
+      vde_ring_discard(v2_conn->pkt_queue, 1);
+      if (vde_connection_call_write(conn, pkts[i])) {
+        cb_errno = errno;
+      }
+      vde_pkt_put(pkts[i]);
+      if (cb_errno == EPIPE) {
+        vde_connection_fini(conn);
+        vde_connection_delete(conn);
+      }
+    }
+
+    // a failure concerns only the port it was sent to, a short count is
+    // followed by the error of the next datagram in the following round
+    if (nsent == 0 && owners[0]->conn != NULL) {
+      v2_conn = owners[0];
+      if (send_errno == EAGAIN) {
+        // the port is not reading, try the others
+        v2_conn->wr_blocked = 1;
+        v2_conn->numtries++;
+        if (v2_conn->numtries >
+            vde_connection_get_send_maxtries(v2_conn->conn)) {
+          vde2_shared_drop(v2_conn, CONN_WRITE_DELAY);
+        }
+      } else if (vde2_shared_drop(v2_conn, CONN_WRITE_CLOSED) == 0) {
+        vde_warning("%s: fatal error on shared data socket but connection not "
+                    "closed", __PRETTY_FUNCTION__);
+      }
+    }
+
+    // ports with nothing left to send leave the list
+    for (l = vde_list_first(tr->shared_wr_conns); l; l = next) {
+      next = vde_list_next(l);
+      v2_conn = vde_list_get_data(l);
+      if (vde_ring_is_empty(v2_conn->pkt_queue)) {
+        tr->shared_wr_conns = vde_list_remove(tr->shared_wr_conns, v2_conn);
+        v2_conn->wr_pending = 0;
+        v2_conn->wr_blocked = 0;
+        vde_timer_cancel(v2_conn->send_timer);
+      }
+    }
+  }
+
+  // blocked ports are retried on the next event
+  for (l = vde_list_first(tr->shared_wr_conns); l; l = vde_list_next(l)) {
+    v2_conn = vde_list_get_data(l);
+    v2_conn->wr_blocked = 0;
+  }
+  if (tr->shared_wr_conns == NULL) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->shared_ev_wr);
+    tr->shared_ev_wr = NULL;
+  }
+
+  if (--tr->shared_writing == 0) {
+    while (tr->shared_closed != NULL) {
+      v2_conn = vde_list_get_data(tr->shared_closed);
+      tr->shared_closed = vde_list_remove(tr->shared_closed, v2_conn);
+      vde_free(v2_conn);
+    }
+  }
+}
+
+/**
+ * @brief Put a packet in the send queue of a connection
+ *
+ * @param v2_conn The connection
+ * @param pkt The packet to enqueue
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_conn_enqueue(vde2_conn *v2_conn, vde_pkt *pkt)
 {
   vde2_pkt *v2_pkt;
-  vde2_conn *v2_conn = vde_connection_get_priv(conn);
 
-  if (vde_queue_get_length(v2_conn->pkt_queue) >= MAXQLEN) {
+  if (vde_ring_check_push(v2_conn->pkt_queue)) {
     vde_warning("%s: packet queue for %d is full, discarding",
                 __PRETTY_FUNCTION__, v2_conn->data_fd);
     errno = EAGAIN;
     return -1; // discard pkt
   }
-  if (pkt->data_size > PKT_DATA_SZ) {
+  if (vde_pkt_needs_gso(pkt)) {
+    // vde2 peers expect ethernet sized datagrams
+    vde_warning("%s: packet needs segmentation, discarding",
+                __PRETTY_FUNCTION__);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  // partial checksums are completed on a private copy
+  if (vde_pkt_is_shared(pkt) &&
+      !(pkt->offload.flags & VDE_PKT_CSUM_PARTIAL)) {
+    // keep a reference, the packet is not going to change under us
+    vde_ring_push(v2_conn->pkt_queue, vde_pkt_get(pkt));
+    return 0;
+  }
+
+  if (sizeof(vde_hdr) + pkt->hdr->pkt_len > PKT_DATA_SZ) {
     // XXX: should alloc a struct greater than sizeof(vde2_pkt)
     vde_warning("%s: packet size larger than vde2_pkt, discarding",
                 __PRETTY_FUNCTION__);
     errno = EBADMSG;
     return -1;
   }
-  v2_pkt = vde_cached_alloc(sizeof(vde2_pkt));
+  v2_pkt = vde_cached_pool_alloc(v2_conn->pkt_pool);
   if (v2_pkt == NULL) {
     vde_warning("%s: cannot alloc new pkt, discarding", __PRETTY_FUNCTION__);
-    errno = ENOMEM;
+    errno = ENOBUFS;
     return -1;
   }
 
-  v2_pkt->numtries = 0;
-
   vde_pkt_compact_cpy(&v2_pkt->pkt, pkt);
+  vde_pkt_set_release(&v2_pkt->pkt, vde2_pkt_release, v2_conn->pkt_pool);
+  if (vde_pkt_csum_complete(&v2_pkt->pkt.offload, v2_pkt->pkt.payload,
+                            v2_pkt->pkt.hdr->pkt_len)) {
+    vde_warning("%s: bad checksum offsets, discarding", __PRETTY_FUNCTION__);
+    vde_pkt_put(&v2_pkt->pkt);
+    errno = EBADMSG;
+    return -1;
+  }
 
-  // XXX: check push ok
-  vde_queue_push_head(v2_conn->pkt_queue, v2_pkt);
+  // cannot fail, the ring is not full
+  vde_ring_push(v2_conn->pkt_queue, &v2_pkt->pkt);
+  return 0;
+}
+
+static void vde2_uring_sent(vde_uring_io *io, vde_pkt *pkt, int res,
+                            void *arg);
+
+/**
+ * @brief Submit up to a batch of packets from the head of the send queue, as
+ * linked sends, unless the previous ones are still in flight or data_fd must
+ * become writable first
+ */
+static void vde2_uring_kick(vde2_conn *v2_conn)
+{
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX];
+  int n;
+  vde_connection *conn = v2_conn->conn;
 
+  if (v2_conn->uring_inflight > 0 || v2_conn->data_ev_wr != NULL) {
+    return;
+  }
+  for (n = 0; n < v2_conn->batch; n++) {
+    pkts[n] = vde_ring_peek_nth(v2_conn->pkt_queue, n);
+    if (pkts[n] == NULL) {
+      break;
+    }
+  }
+  if (n == 0) {
+    vde_timer_cancel(v2_conn->send_timer);
+    return;
+  }
+
+  // restart the send timeout on each attempt, if the submission fails the
+  // timeout retries it
+  vde_timer_arm(v2_conn->send_timer, vde_connection_get_send_maxtimeout(conn),
+                VDE_EV_PERSIST);
+  if (vde_uring_io_sendv(v2_conn->uring, pkts, n,
+                         (struct sockaddr *)&v2_conn->remote_sa,
+                         sizeof(struct sockaddr_un), &vde2_uring_sent)) {
+    vde_warning("%s: cannot submit sends on data_fd %d: %s",
+                __PRETTY_FUNCTION__, v2_conn->data_fd, strerror(errno));
+    return;
+  }
+  v2_conn->uring_inflight = n;
+}
+
+static void vde2_uring_write_ready(int data_fd, short event_type, void *arg)
+{
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+
+  // one-shot event, already gone
+  v2_conn->data_ev_wr = NULL;
+  vde2_uring_kick(v2_conn);
+}
+
+static void vde2_uring_sent(vde_uring_io *io, vde_pkt *pkt, int res,
+                            void *arg)
+{
+  vde_conn_error err = CONN_WRITE_CLOSED;
+  int cb_errno = 0;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+
+  v2_conn->uring_inflight--;
+
+  // sends complete in order, pkt is at the head of the queue
+  if (res >= 0) {
+    // datagrams are sent as a whole
+    v2_conn->numtries = 0;
+    vde_ring_discard(v2_conn->pkt_queue, 1);
+    if (vde_connection_call_write(conn, pkt)) {
+      cb_errno = errno;
+    }
+    vde_pkt_put(pkt);
+  } else if (res == -EAGAIN) {
+    v2_conn->numtries++;
+    if (v2_conn->numtries > vde_connection_get_send_maxtries(conn)) {
+      err = CONN_WRITE_DELAY;
+      goto drop;
+    }
+    // retry once data_fd is writable
+    if (v2_conn->data_ev_wr == NULL) {
+      v2_conn->data_ev_wr = vde_context_event_add(
+                              vde_connection_get_context(conn),
+                              v2_conn->data_fd, VDE_EV_WRITE, NULL,
+                              &vde2_uring_write_ready, (void *)v2_conn);
+    }
+  } else if (res != -ECANCELED) {
+    // a previous send failed, this one is still queued
+    goto drop;
+  }
+  goto out;
+
+drop:
+  v2_conn->numtries = 0;
+  vde_ring_discard(v2_conn->pkt_queue, 1);
+  if (vde_connection_call_error(conn, pkt, err)) {
+    cb_errno = errno;
+  }
+  vde_pkt_put(pkt);
+
+out:
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (v2_conn->uring_inflight == 0) {
+    vde2_uring_kick(v2_conn);
+  }
+}
+
+static void vde2_conn_send_timeout(int fd, short events, void *arg)
+{
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde2_tr *tr;
+
+  if (v2_conn->shared) {
+    tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+    vde2_shared_write_event(tr->shared_fd, VDE_EV_TIMEOUT,
+                            (void *)v2_conn->transport);
+    return;
+  }
+  if (v2_conn->uring != NULL) {
+    // stop waiting for data_fd and try again
+    if (v2_conn->data_ev_wr != NULL) {
+      vde_context_event_del(vde_connection_get_context(v2_conn->conn),
+                            v2_conn->data_ev_wr);
+      v2_conn->data_ev_wr = NULL;
+    }
+    vde2_uring_kick(v2_conn);
+    return;
+  }
+  vde2_conn_write_data_event(v2_conn->data_fd, VDE_EV_TIMEOUT, arg);
+}
+
+static void vde2_shared_schedule_write(vde2_conn *v2_conn)
+{
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  if (!v2_conn->wr_pending) {
+    tr->shared_wr_conns = vde_list_prepend(tr->shared_wr_conns, v2_conn);
+    v2_conn->wr_pending = 1;
+    vde_timer_arm(v2_conn->send_timer,
+                  vde_connection_get_send_maxtimeout(conn), VDE_EV_PERSIST);
+  }
+  // the ports written before the event fires are flushed together
+  if (tr->shared_ev_wr == NULL) {
+    // XXX: check event not NULL
+    tr->shared_ev_wr = vde_context_event_add(
+                         vde_connection_get_context(conn), tr->shared_fd,
+                         VDE_EV_WRITE|VDE_EV_PERSIST, NULL,
+                         &vde2_shared_write_event,
+                         (void *)v2_conn->transport);
+  }
+}
+
+static void vde2_conn_schedule_write(vde2_conn *v2_conn)
+{
+  vde_connection *conn = v2_conn->conn;
+
+  if (v2_conn->shared) {
+    vde2_shared_schedule_write(v2_conn);
+    return;
+  }
+  if (v2_conn->uring != NULL) {
+    vde2_uring_kick(v2_conn);
+    return;
+  }
   if (v2_conn->data_ev_wr == NULL) {
+    // the send timeout is kept on the context timer wheel, re-arming it on
+    // every write is cheaper than re-adding the event with a timeout
     v2_conn->data_ev_wr = vde_context_event_add(
                             vde_connection_get_context(conn),
                             v2_conn->data_fd,
-                            VDE_EV_WRITE|VDE_EV_PERSIST,
-                            vde_connection_get_send_maxtimeout(conn),
+                            VDE_EV_WRITE|VDE_EV_PERSIST, NULL,
                             &vde2_conn_write_data_event,
                             (void *)v2_conn);
+    vde_timer_arm(v2_conn->send_timer,
+                  vde_connection_get_send_maxtimeout(conn), VDE_EV_PERSIST);
+  }
+}
+
+int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+
+  if (vde2_conn_enqueue(v2_conn, pkt)) {
+    return -1;
   }
+  vde2_conn_schedule_write(v2_conn);
   return 0;
 }
 
-void vde2_conn_close(vde_connection *conn)
+int vde2_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+
+  for (i = 0; i < batch->len; i++) {
+    if (vde2_conn_enqueue(v2_conn, batch->pkts[i])) {
+      break;
+    }
+  }
+  if (i > 0) {
+    tmp_errno = errno;
+    vde2_conn_schedule_write(v2_conn);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+void vde2_conn_queue_stats(vde_connection *conn, vde_conn_queue_stats *stats)
 {
-  vde2_pkt *pkt;
   vde2_conn *v2_conn = vde_connection_get_priv(conn);
-  vde_context *ctx = vde_connection_get_context(conn);
 
+  vde_connection_ring_stats(v2_conn->pkt_queue, stats);
+}
+
+/**
+ * @brief Take a port off the shared socket, it is no longer reachable from
+ * the transport
+ */
+static void vde2_shared_detach(vde2_tr *tr, vde2_conn *v2_conn)
+{
+  // a newer port from the same peer might have taken over the path
+  if (vde_hash_lookup(tr->shared_conns, v2_conn->remote_sa.sun_path) ==
+      v2_conn) {
+    vde_hash_remove(tr->shared_conns, v2_conn->remote_sa.sun_path);
+  }
+  if (v2_conn->wr_pending) {
+    tr->shared_wr_conns = vde_list_remove(tr->shared_wr_conns, v2_conn);
+    v2_conn->wr_pending = 0;
+    vde_timer_cancel(v2_conn->send_timer);
+  }
+  tr->shared_ports = vde_list_remove(tr->shared_ports, v2_conn);
+  v2_conn->shared = 0;
+}
+
+/**
+ * @brief Release a connection backend, conn is not touched
+ */
+static void vde2_conn_free(vde2_conn *v2_conn)
+{
+  vde_pkt *pkt;
+  int shared = v2_conn->shared;
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  if (shared) {
+    vde2_shared_detach(tr, v2_conn);
+  }
+  if (v2_conn->uring != NULL) {
+    // sends in flight complete without calling us back
+    vde_uring_io_delete(v2_conn->uring);
+    while (v2_conn->uring_rx.len > 0) {
+      vde_pkt_put(v2_conn->uring_rx.pkts[--v2_conn->uring_rx.len]);
+    }
+  }
   if (v2_conn->data_fd >= 0){
     close(v2_conn->data_fd);
   }
@@ -319,7 +1091,10 @@ void vde2_conn_close(vde_connection *conn)
   if (v2_conn->data_ev_wr != NULL) {
     vde_context_event_del(ctx, v2_conn->data_ev_wr);
   }
-  if (v2_conn->local_sa.sun_path != NULL) {
+  if (v2_conn->send_timer != NULL) {
+    vde_timer_delete(v2_conn->send_timer);
+  }
+  if (v2_conn->local_sa.sun_path[0] != '\0') {
     unlink(v2_conn->local_sa.sun_path);
   }
   if (v2_conn->ctl_fd >= 0){
@@ -331,15 +1106,178 @@ void vde2_conn_close(vde_connection *conn)
   if (v2_conn->remote_request) {
     vde_free(v2_conn->remote_request);
   }
-  pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
+  pkt = vde_ring_pop(v2_conn->pkt_queue);
   while (pkt != NULL) {
-    // XXX: handle dynamic allocation case
-    vde_cached_free_type(vde2_pkt, pkt);
-    pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
+    vde_pkt_put(pkt);
+    pkt = vde_ring_pop(v2_conn->pkt_queue);
+  }
+  vde_ring_delete(v2_conn->pkt_queue);
+  // packets of this connection still referenced elsewhere keep the pool alive
+  vde_pool_delete(v2_conn->pkt_pool);
+
+  if (shared && tr->shared_writing) {
+    // the send round on the shared socket still points to it
+    v2_conn->conn = NULL;
+    tr->shared_closed = vde_list_prepend(tr->shared_closed, v2_conn);
+    return;
+  }
+  vde_free(v2_conn);
+}
+
+void vde2_conn_close(vde_connection *conn)
+{
+  vde2_conn_free(vde_connection_get_priv(conn));
+}
+
+/**
+ * @brief Alloc the backend of a connection, with no sockets yet
+ *
+ * @return the backend on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static vde2_conn *vde2_conn_new(vde_component *component, vde_connection *conn)
+{
+  unsigned int low_wm;
+  vde2_conn *v2_conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
+  if (!v2_conn) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  v2_conn->ctl_fd = -1;
+  v2_conn->data_fd = -1;
+  v2_conn->conn = conn;
+  v2_conn->transport = component;
+  v2_conn->batch = tr->batch;
+  v2_conn->pkt_queue = vde_ring_new(tr->queue_len);
+  if (!v2_conn->pkt_queue) {
+    vde_error("%s: cannot create packets queue", __PRETTY_FUNCTION__);
+    goto err_free;
+  }
+  low_wm = tr->queue_len < PKT_POOL_LOW_WM ? tr->queue_len : PKT_POOL_LOW_WM;
+  v2_conn->pkt_pool = vde_pool_new(sizeof(vde2_pkt), PKT_POOL_SLAB, low_wm,
+                                   tr->queue_len);
+  if (!v2_conn->pkt_pool) {
+    vde_error("%s: cannot create packets pool", __PRETTY_FUNCTION__);
+    goto err_queue;
+  }
+  v2_conn->send_timer = vde_context_timer_new(ctx, &vde2_conn_send_timeout,
+                                              (void *)v2_conn);
+  if (!v2_conn->send_timer) {
+    vde_error("%s: cannot create send timer", __PRETTY_FUNCTION__);
+    goto err_pool;
+  }
+  return v2_conn;
+
+err_pool:
+  vde_pool_delete(v2_conn->pkt_pool);
+err_queue:
+  vde_ring_delete(v2_conn->pkt_queue);
+err_free:
+  vde_free(v2_conn);
+  errno = ENOMEM;
+  return NULL;
+}
+
+/**
+ * @brief Create the datagram socket of a connection and bind it to
+ * v2_conn->local_sa, which must be filled by the caller
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+// XXX: check VDE_DARWIN defines here!!!
+static int vde2_conn_open_data(vde2_conn *v2_conn)
+{
+  int tmp_errno;
+#ifdef VDE_DARWIN
+  int sockbufsize = DATA_BUF_SIZE;
+  int optsize = sizeof(sockbufsize);
+#endif
+
+  if ((v2_conn->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create datagram socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (fcntl(v2_conn->data_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set O_NONBLOCK for datagram socket: %s",
+              __PRETTY_FUNCTION__, strerror(errno));
+    goto error;
+  }
+#ifdef VDE_DARWIN
+  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_SNDBUF, &sockbufsize,
+      optsize) < 0) {
+      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
+                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
+                  strerror(errno));
+  }
+  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_RCVBUF, &sockbufsize,
+      optsize) < 0) {
+      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
+                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
+                  strerror(errno));
+  }
+#endif
+
+  v2_conn->local_sa.sun_family = AF_UNIX;
+  if (unlink(v2_conn->local_sa.sun_path) < 0 && errno != ENOENT) {
+    tmp_errno = errno;
+    vde_error("%s: cannot remove old datagram socket %s: %s",
+              __PRETTY_FUNCTION__, v2_conn->local_sa.sun_path,
+              strerror(errno));
+    goto error;
+  }
+  if (bind(v2_conn->data_fd, (struct sockaddr *) &v2_conn->local_sa,
+           sizeof(struct sockaddr_un)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
+              v2_conn->local_sa.sun_path, strerror(errno));
+    goto error;
   }
-  vde_queue_delete(v2_conn->pkt_queue);
+  return 0;
 
-  vde_free(v2_conn);
+error:
+  // nothing to unlink on close
+  v2_conn->local_sa.sun_path[0] = '\0';
+  errno = tmp_errno;
+  return -1;
+}
+
+/**
+ * @brief Start receiving on the data socket of a connection, through io_uring
+ * if the context runs on it and with readiness events otherwise
+ */
+static void vde2_conn_start_data(vde2_conn *v2_conn)
+{
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  if (vde_uring_io_available(ctx)) {
+    v2_conn->uring = vde_uring_io_new(v2_conn->data_fd, (void *)v2_conn);
+    if (v2_conn->uring != NULL &&
+        vde_uring_io_recv(v2_conn->uring, sizeof(struct eth_frame),
+                          URING_RX_BUFS, &vde2_uring_recv,
+                          &vde2_uring_flush) == 0) {
+      return;
+    }
+    vde_warning("%s: cannot use io_uring on data_fd %d, falling back to "
+                "events", __PRETTY_FUNCTION__, v2_conn->data_fd);
+    if (v2_conn->uring != NULL) {
+      vde_uring_io_delete(v2_conn->uring);
+      v2_conn->uring = NULL;
+    }
+  }
+  // XXX: check event not NULL
+  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
+                                              VDE_EV_READ|VDE_EV_PERSIST,
+                                              NULL, &vde2_conn_read_data_event,
+                                              (void *)v2_conn);
 }
 
 static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
@@ -365,71 +1303,126 @@ static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
   return ret;
 }
 
-// XXX: check VDE_DARWIN defines here!!!
-void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
+/**
+ * @brief Create the data socket shared by the accepted ports, bound to
+ * <vdesock_dir>/data
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_shared_open(vde_component *component)
 {
-  int len;
-#ifdef VDE_DARWIN
-  int sockbufsize = DATA_BUF_SIZE;
-  int optsize = sizeof(sockbufsize);
-#endif
-  vde2_conn *v2_conn = (vde2_conn *)arg;
-  vde_connection *conn = v2_conn->conn;
-  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
-  vde_context *ctx = vde_component_get_context(v2_conn->transport);
-
-  vde_context_event_del(ctx, v2_conn->ctl_ev);
-  v2_conn->ctl_ev = NULL;
+  int tmp_errno;
+  unsigned int low_wm;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
 
-  // XXX: define a behaviour when called if event timeout expired
+  tr->shared_conns = vde_hash_init_full(vde2_path_hash, vde2_path_equal);
+  low_wm = tr->queue_len < PKT_POOL_LOW_WM ? tr->queue_len : PKT_POOL_LOW_WM;
+  tr->shared_pool = vde_pool_new(sizeof(vde2_pkt), PKT_POOL_SLAB, low_wm,
+                                 tr->queue_len);
+  if (!tr->shared_conns || !tr->shared_pool) {
+    tmp_errno = ENOMEM;
+    vde_error("%s: cannot create shared socket data", __PRETTY_FUNCTION__);
+    goto error;
+  }
 
-  if ((v2_conn->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
+  if ((tr->shared_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    tmp_errno = errno;
     vde_error("%s: cannot create datagram socket: %s", __PRETTY_FUNCTION__,
               strerror(errno));
     goto error;
   }
-  if (fcntl(v2_conn->data_fd, F_SETFL, O_NONBLOCK) < 0) {
+  if (fcntl(tr->shared_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
     vde_error("%s: cannot set O_NONBLOCK for datagram socket: %s",
               __PRETTY_FUNCTION__, strerror(errno));
-    goto error;
+    goto error_close;
   }
-#ifdef VDE_DARWIN
-  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_SNDBUF, &sockbufsize,
-      optsize) < 0) {
-      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
-                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
-                  strerror(errno));
+  tr->shared_sa.sun_family = AF_UNIX;
+  snprintf(tr->shared_sa.sun_path, sizeof(tr->shared_sa.sun_path), "%s/data",
+           tr->vdesock_dir);
+  if (unlink(tr->shared_sa.sun_path) < 0 && errno != ENOENT) {
+    tmp_errno = errno;
+    vde_error("%s: cannot remove old datagram socket %s: %s",
+              __PRETTY_FUNCTION__, tr->shared_sa.sun_path, strerror(errno));
+    goto error_close;
   }
-  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_RCVBUF, &sockbufsize,
-      optsize) < 0) {
-      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
-                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
-                  strerror(errno));
+  if (bind(tr->shared_fd, (struct sockaddr *)&tr->shared_sa,
+           sizeof(struct sockaddr_un)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
+              tr->shared_sa.sun_path, strerror(errno));
+    goto error_close;
   }
-#endif
-
-  v2_conn->local_sa.sun_family = AF_UNIX;
 
-  snprintf(v2_conn->local_sa.sun_path, sizeof(v2_conn->local_sa.sun_path),
-           "%s/%04d", tr->vdesock_dir, tr->connections);
+  tr->shared_ev_rd = vde_context_event_add(ctx, tr->shared_fd,
+                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                           &vde2_shared_read_event,
+                                           (void *)component);
+  if (tr->shared_ev_rd == NULL) {
+    tmp_errno = EIO;
+    vde_error("%s: cannot add shared socket event", __PRETTY_FUNCTION__);
+    goto error_unlink;
+  }
+  return 0;
 
-  if (unlink(v2_conn->local_sa.sun_path) < 0 && errno != ENOENT) {
-    vde_error("%s: cannot remove old datagram socket %s: %s",
-              __PRETTY_FUNCTION__, v2_conn->local_sa.sun_path,
-              strerror(errno));
-    goto error;
+error_unlink:
+  unlink(tr->shared_sa.sun_path);
+error_close:
+  close(tr->shared_fd);
+  tr->shared_fd = -1;
+error:
+  if (tr->shared_pool) {
+    vde_pool_delete(tr->shared_pool);
+    tr->shared_pool = NULL;
   }
-  if (bind(v2_conn->data_fd, (struct sockaddr *) &v2_conn->local_sa,
-           sizeof(struct sockaddr_un)) < 0) {
-    vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
-              v2_conn->local_sa.sun_path, strerror(errno));
-    goto error;
+  if (tr->shared_conns) {
+    vde_hash_delete(tr->shared_conns);
+    tr->shared_conns = NULL;
   }
+  errno = tmp_errno;
+  return -1;
+}
 
-  len = write(v2_conn->ctl_fd, &v2_conn->local_sa, sizeof(v2_conn->local_sa));
-  if (len != sizeof(v2_conn->local_sa)) {
-    vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
-    goto error;
+void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
+{
+  int len;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  // XXX: define a behaviour when called if event timeout expired
+
+  if (tr->shared_socket) {
+    // the peer sends to and receives from the single data socket, it can
+    // not tell the difference
+    len = write(v2_conn->ctl_fd, &tr->shared_sa, sizeof(tr->shared_sa));
+    if (len != sizeof(tr->shared_sa)) {
+      vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
+      goto error;
+    }
+    v2_conn->shared = 1;
+    tr->shared_ports = vde_list_prepend(tr->shared_ports, v2_conn);
+    // a peer reconnecting from the same path replaces its old port
+    vde_hash_remove(tr->shared_conns, v2_conn->remote_sa.sun_path);
+    vde_hash_insert(tr->shared_conns, v2_conn->remote_sa.sun_path, v2_conn);
+  } else {
+    snprintf(v2_conn->local_sa.sun_path, sizeof(v2_conn->local_sa.sun_path),
+             "%s/%04d", tr->vdesock_dir, tr->connections);
+    if (vde2_conn_open_data(v2_conn)) {
+      goto error;
+    }
+
+    len = write(v2_conn->ctl_fd, &v2_conn->local_sa,
+                sizeof(v2_conn->local_sa));
+    if (len != sizeof(v2_conn->local_sa)) {
+      vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
+      goto error;
+    }
   }
 
   tr->connections++;
@@ -440,10 +1433,9 @@ void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
                                           &vde2_conn_read_ctl_event,
                                           (void *)v2_conn);
-  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
-                                              VDE_EV_READ|VDE_EV_PERSIST,
-                                              NULL, &vde2_conn_read_data_event,
-                                              (void *)v2_conn);
+  if (!v2_conn->shared) {
+    vde2_conn_start_data(v2_conn);
+  }
 
   vde_transport_call_cm_accept_cb(v2_conn->transport, conn);
 
@@ -549,23 +1541,19 @@ void vde2_accept(int listen_fd, short event_type, void *arg)
     vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
     goto error_close;
   }
-  v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
+  v2_conn = vde2_conn_new(component, conn);
   if (!v2_conn) {
-    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
     goto error_conn_del;
   }
-
   v2_conn->ctl_fd = new;
-  v2_conn->conn = conn;
-  v2_conn->transport = component;
-  // XXX: check init result
-  v2_conn->pkt_queue = vde_queue_init();
 
   // XXX: check error on list
   tr->pending_conns = vde_list_prepend(tr->pending_conns, v2_conn);
 
   vde_connection_init(conn, ctx, sizeof(struct eth_frame), &vde2_conn_write,
                       &vde2_conn_close, (void *)v2_conn);
+  vde_connection_set_be_write_batch(conn, &vde2_conn_write_batch);
+  vde_connection_set_be_queue_stats(conn, &vde2_conn_queue_stats);
 
   // XXX: check event NULL and define a timeout
   v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
@@ -640,6 +1628,10 @@ int vde2_listen(vde_component *component)
               strerror(errno));
     goto error_unlink;
   }
+  if (tr->shared_socket && vde2_shared_open(component)) {
+    tmp_errno = errno;
+    goto error_unlink;
+  }
 
   // XXX: check event not NULL, define a timeout?
   tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
@@ -659,8 +1651,196 @@ error:
   return -1;
 }
 
+// client datagram sockets created by this process
+static unsigned int vde2_client_socks = 0;
+
+/**
+ * @brief Abort a connection being set up by vde2_connect()
+ */
+static void vde2_cli_error(vde2_conn *v2_conn, int tr_errno)
+{
+  vde_connection *conn = v2_conn->conn;
+  vde_component *component = v2_conn->transport;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  vde2_conn_free(v2_conn);
+  // the connection manager owns conn
+  vde_transport_call_cm_error_cb(component, conn, tr_errno);
+}
+
+void vde2_cli_get_reply(int ctl_fd, short event_type, void *arg)
+{
+  int len;
+  struct sockaddr_un reply;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+  vde_component *component = v2_conn->transport;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+  vde_context *ctx = vde_component_get_context(component);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  // the switch replies with the address of its datagram socket
+  len = read(v2_conn->ctl_fd, &reply, sizeof(reply));
+  if (len < 0 && errno == EAGAIN) {
+    v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
+                                            NULL, &vde2_cli_get_reply,
+                                            (void *)v2_conn);
+    if (v2_conn->ctl_ev != NULL) {
+      return;
+    }
+  }
+  if (len != sizeof(reply)) {
+    vde_error("%s: the switch refused the connection", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, len < 0 ? errno : ECONNREFUSED);
+    return;
+  }
+  if (reply.sun_family != AF_UNIX || reply.sun_path[0] == 0 ||
+      memchr(reply.sun_path, 0, sizeof(reply.sun_path)) == NULL) {
+    vde_error("%s: received an invalid socket path", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, EPROTO);
+    return;
+  }
+  memcpy(&v2_conn->remote_sa, &reply, sizeof(struct sockaddr_un));
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+
+  // from now on the connection behaves as an accepted one
+  vde_connection_init(conn, ctx, sizeof(struct eth_frame), &vde2_conn_write,
+                      &vde2_conn_close, (void *)v2_conn);
+  vde_connection_set_be_write_batch(conn, &vde2_conn_write_batch);
+  vde_connection_set_be_queue_stats(conn, &vde2_conn_queue_stats);
+
+  // XXX: check events not NULL
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                          VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                          &vde2_conn_read_ctl_event,
+                                          (void *)v2_conn);
+  vde2_conn_start_data(v2_conn);
+
+  vde_transport_call_cm_connect_cb(component, conn);
+}
+
+void vde2_cli_send_request(int ctl_fd, short event_type, void *arg)
+{
+  int len, sock_err = 0;
+  socklen_t sock_err_len = sizeof(sock_err);
+  char reqbuf[REQBUFLEN];
+  vde2_request *req = (vde2_request *)reqbuf;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_component *component = v2_conn->transport;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+  vde_context *ctx = vde_component_get_context(component);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  // the outcome of the non-blocking connect()
+  if (getsockopt(v2_conn->ctl_fd, SOL_SOCKET, SO_ERROR, &sock_err,
+                 &sock_err_len) < 0) {
+    sock_err = errno;
+  }
+  if (sock_err) {
+    vde_error("%s: cannot connect to %s/ctl: %s", __PRETTY_FUNCTION__,
+              tr->vdesock_dir, strerror(sock_err));
+    vde2_cli_error(v2_conn, sock_err);
+    return;
+  }
+
+  // the switch must be able to reach our datagram socket by path, which
+  // identifies the port: keep it unique among all the transports of the
+  // process
+  snprintf(v2_conn->local_sa.sun_path, sizeof(v2_conn->local_sa.sun_path),
+           "%s/vde3.%05d-%05d", VDE2_CLIENT_SOCK_DIR, getpid(),
+           vde2_client_socks++);
+  if (vde2_conn_open_data(v2_conn)) {
+    vde2_cli_error(v2_conn, errno);
+    return;
+  }
+
+  memset(reqbuf, 0, sizeof(reqbuf));
+  req->magic = SWITCH_MAGIC;
+  req->version = 3;
+  req->type = REQ_NEW_CONTROL;
+  memcpy(&req->sock, &v2_conn->local_sa, sizeof(struct sockaddr_un));
+  snprintf(req->description, REQBUFLEN - sizeof(vde2_request), "vde3 PID=%d",
+           getpid());
+  len = sizeof(vde2_request) + strlen(req->description) + 1;
+
+  if (write(v2_conn->ctl_fd, reqbuf, len) != len) {
+    vde_error("%s: cannot send request to %s/ctl", __PRETTY_FUNCTION__,
+              tr->vdesock_dir);
+    vde2_cli_error(v2_conn, errno ? errno : EIO);
+    return;
+  }
+
+  // XXX: define a timeout
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
+                                          NULL, &vde2_cli_get_reply,
+                                          (void *)v2_conn);
+  if (v2_conn->ctl_ev == NULL) {
+    vde2_cli_error(v2_conn, errno);
+  }
+}
+
 int vde2_connect(vde_component *component, vde_connection *conn)
 {
+  int tmp_errno;
+  struct sockaddr_un sa_unix;
+  vde2_conn *v2_conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  v2_conn = vde2_conn_new(component, conn);
+  if (!v2_conn) {
+    return -1;
+  }
+
+  v2_conn->ctl_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (v2_conn->ctl_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (fcntl(v2_conn->ctl_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  memset(&sa_unix, 0, sizeof(sa_unix));
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s/ctl",
+           tr->vdesock_dir);
+  if (connect(v2_conn->ctl_fd, (struct sockaddr *)&sa_unix,
+              sizeof(sa_unix)) < 0 && errno != EINPROGRESS) {
+    tmp_errno = errno;
+    vde_error("%s: Could not connect to %s/ctl: %s", __PRETTY_FUNCTION__,
+              tr->vdesock_dir, strerror(errno));
+    goto error;
+  }
+
+  // the request is sent once the socket is connected
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_WRITE,
+                                          NULL, &vde2_cli_send_request,
+                                          (void *)v2_conn);
+  if (v2_conn->ctl_ev == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: Could not add connect event", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, v2_conn);
+  return 0;
+
+error:
+  vde2_conn_free(v2_conn);
+  errno = tmp_errno;
   return -1;
 }
 
@@ -668,8 +1848,11 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
 {
 
   vde2_tr *tr;
-  vde_sobj *path_sobj;
+  vde_sobj *path_sobj, *batch_sobj, *qlen_sobj, *shared_sobj;
   const char *path;
+  int batch = VDE_PKT_BATCH_MAX;
+  int queue_len = MAXQLEN;
+  int shared_socket = 0;
 
   vde_assert(component != NULL);
 
@@ -692,6 +1875,56 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
     errno = EINVAL;
     return -1;
   }
+
+  // optional: packets read/written with a single syscall
+  batch_sobj = vde_sobj_hash_lookup(params, "batch");
+  if (batch_sobj) {
+    if (!vde_sobj_is_type(batch_sobj, vde_sobj_type_int)) {
+      vde_error("%s: batch must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    batch = vde_sobj_get_int(batch_sobj);
+    if (batch < 1 || batch > VDE_PKT_BATCH_MAX) {
+      vde_error("%s: batch must be between 1 and %d", __PRETTY_FUNCTION__,
+                VDE_PKT_BATCH_MAX);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  // optional: maximum number of packets queued for sending by a connection
+  qlen_sobj = vde_sobj_hash_lookup(params, "queue_len");
+  if (qlen_sobj) {
+    if (!vde_sobj_is_type(qlen_sobj, vde_sobj_type_int)) {
+      vde_error("%s: queue_len must be an integer", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    queue_len = vde_sobj_get_int(qlen_sobj);
+    if (queue_len < 1) {
+      vde_error("%s: queue_len must be positive", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  // optional: accepted ports share a single datagram socket
+  shared_sobj = vde_sobj_hash_lookup(params, "shared_socket");
+  if (shared_sobj) {
+    if (!vde_sobj_is_type(shared_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: shared_socket must be a boolean", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    shared_socket = vde_sobj_get_bool(shared_sobj);
+    if (shared_socket && strlen(path) > UNIX_PATH_MAX - 6) { // '/data'
+      vde_error("%s: directory name is too long", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
   tr = (vde2_tr *)vde_calloc(sizeof(vde2_tr));
   if (tr == NULL) {
     vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
@@ -699,6 +1932,11 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
     return -1;
   }
 
+  tr->batch = batch;
+  tr->queue_len = queue_len;
+  tr->shared_socket = shared_socket;
+  tr->shared_fd = -1;
+
   // XXX: path needs to be normalized/checked somewhere
   tr->vdesock_dir = strdup(path);
   if (tr->vdesock_dir == NULL) {
@@ -712,9 +1950,55 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
   return 0;
 }
 
-// XXX to be defined
+// XXX the listening socket and the connections being negotiated are not
+// released yet
 void transport_vde2_fini(vde_component *component) {
+  vde_connection *conn;
+  vde2_conn *v2_conn;
+  vde2_tr *tr;
+  vde_context *ctx;
+
   vde_assert(component != NULL);
+
+  tr = (vde2_tr *)vde_component_get_priv(component);
+  ctx = vde_component_get_context(component);
+
+  // ports on the shared socket cannot outlive it
+  while (tr->shared_ports != NULL) {
+    v2_conn = vde_list_get_data(tr->shared_ports);
+    conn = v2_conn->conn;
+    if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      continue;
+    }
+    vde_warning("%s: shared data socket closed but connection not closed",
+                __PRETTY_FUNCTION__);
+    vde2_shared_detach(tr, v2_conn);
+  }
+  if (tr->shared_ev_rd != NULL) {
+    vde_context_event_del(ctx, tr->shared_ev_rd);
+    tr->shared_ev_rd = NULL;
+  }
+  if (tr->shared_ev_wr != NULL) {
+    vde_context_event_del(ctx, tr->shared_ev_wr);
+    tr->shared_ev_wr = NULL;
+  }
+  if (tr->shared_fd >= 0) {
+    close(tr->shared_fd);
+    unlink(tr->shared_sa.sun_path);
+    tr->shared_fd = -1;
+  }
+  // packets still referenced elsewhere keep the pool alive
+  if (tr->shared_pool != NULL) {
+    vde_pool_delete(tr->shared_pool);
+    tr->shared_pool = NULL;
+  }
+  if (tr->shared_conns != NULL) {
+    vde_hash_delete(tr->shared_conns);
+    tr->shared_conns = NULL;
+  }
 }
 
 component_ops transport_vde2_component_ops = {
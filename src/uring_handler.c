@@ -0,0 +1,1282 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/timeout_heap.h>
+#include <vde3/uring.h>
+
+/*
+ * vde_event_handler which uses io_uring through its system calls, usage is
+ * the same as epoll_eh:
+ *
+ * vde_uring_init(0);
+ * ...
+ * vde_context_init(ctx, &uring_eh, NULL);
+ * ...
+ * vde_uring_dispatch();
+ *
+ * Readiness events are one-shot poll requests, re-armed after persistent
+ * callbacks so that they are level-triggered as with epoll, and timeouts are
+ * kept in a binary heap. Components which know about the ring submit their
+ * I/O with vde_uring_io (see vde3/uring.h) instead: multishot receives into
+ * provided buffer rings and linked sends on fixed files.
+ *
+ * Requests queued during a loop iteration, poll re-arms included, are
+ * submitted with the same io_uring_enter() which waits for the next
+ * completions.
+ */
+
+#define URING_DEFAULT_ENTRIES 256
+#define URING_MIN_ENTRIES (2 * VDE_PKT_BATCH_MAX)
+#define URING_REC_SLAB 64
+#define URING_SEND_SLAB 64
+#define URING_MAX_FILES 1024 // fixed file table size
+
+typedef unsigned long long uring_usec;
+
+enum uring_req_type {
+  URING_REQ_POLL,
+  URING_REQ_RECV,
+  URING_REQ_SEND,
+};
+
+/*
+ * requests carry a pointer to the object they belong to as user_data, the
+ * object starts with its type. Cancel requests have no user_data.
+ */
+
+struct uring_rec {
+  enum uring_req_type type; // URING_REQ_POLL
+  int fd; // -1 for timeouts
+  short events;
+  event_cb cb;
+  void *arg;
+  int has_timeout;
+  uring_usec timeout;
+  vde_timeout timeout_node; // position in the timeout heap
+  int active; // zero once a non persistent event has been triggered
+  int dead; // deleted, freed once the poll request is over
+  int polling; // a poll request is in flight
+  struct uring_rec *fire_next; // next expired timeout or deleted record
+};
+
+struct vde_uring_io {
+  enum uring_req_type type; // URING_REQ_RECV
+  int fd;
+  int slot; // fixed file index, -1 if not registered
+  void *arg;
+  int dead; // deleted, freed once no request is in flight
+  unsigned int inflight;
+  // multishot receive
+  vde_uring_recv_cb recv_cb;
+  vde_uring_flush_cb flush_cb;
+  int receiving; // the receive request is in flight
+  struct msghdr recv_msg;
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  char *bufs;
+  unsigned int buf_size;
+  unsigned int nbufs;
+  int bgid; // -1 if no buffer ring is registered
+  int flush_pending;
+  struct vde_uring_io *flush_next;
+  struct vde_uring_io *prev, *next; // all the I/O objects of the loop
+};
+
+struct uring_send {
+  enum uring_req_type type; // URING_REQ_SEND
+  vde_uring_io *io;
+  vde_pkt *pkt;
+  vde_uring_send_cb cb;
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_storage to;
+};
+
+struct uring_loop {
+  int ring_fd;
+  // submission queue
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_flags;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int sqe_tail; // queued sqes, published before io_uring_enter()
+  // completion queue
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  unsigned int *cq_overflow; // completions dropped by the kernel
+  unsigned int cq_dropped; // dropped completions already reported
+  struct io_uring_cqe *cqes;
+  // fixed files, free slots are kept in a stack
+  int files_registered;
+  int *free_slots;
+  unsigned int nfree_slots;
+  int next_bgid;
+  vde_pool *rec_pool;
+  vde_pool *send_pool;
+  unsigned int nactive; // records waiting for events or timeouts, receives
+  unsigned int inflight; // requests which will post a completion
+  // timeouts, ordered by deadline
+  vde_timeout_heap timeouts;
+  struct vde_uring_io *ios;
+  struct vde_uring_io *flush; // I/O objects which received data
+  struct uring_rec *gc; // deleted records
+  int exit;
+  int closing; // vde_uring_fini() is draining the ring, nothing is re-armed
+};
+
+static __thread struct uring_loop *loop;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags, void *arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, loop->ring_fd, to_submit,
+                      min_complete, flags, arg, argsz);
+}
+
+static int uring_register(unsigned int opcode, void *arg,
+                          unsigned int nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, loop->ring_fd, opcode, arg,
+                      nr_args);
+}
+
+static uring_usec uring_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uring_usec)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Submit the queued requests without waiting for completions
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int sq_flush(void)
+{
+  unsigned int pending;
+
+  __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+  pending = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+  while (pending > 0) {
+    if (uring_enter(pending, 0, 0, NULL, 0) < 0 && errno != EINTR &&
+        errno != EAGAIN && errno != EBUSY) {
+      vde_error("%s: io_uring_enter failed: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      return -1;
+    }
+    pending = loop->sqe_tail - __atomic_load_n(loop->sq_head,
+                                               __ATOMIC_ACQUIRE);
+  }
+  return 0;
+}
+
+/**
+ * @brief Reserve room for n requests in the submission queue, submitting the
+ * queued ones if needed
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int sq_reserve(unsigned int n)
+{
+  unsigned int used;
+
+  used = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+  if (used + n > loop->sq_entries) {
+    return sq_flush();
+  }
+  return 0;
+}
+
+/**
+ * @brief Get a zeroed submission queue entry, room must have been reserved
+ */
+static struct io_uring_sqe *sqe_get(void)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = &loop->sqes[loop->sqe_tail & loop->sq_mask];
+  loop->sqe_tail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+/**
+ * @brief Queue the cancellation of the request with the given user_data
+ */
+static void sqe_cancel(uint64_t user_data, int poll)
+{
+  struct io_uring_sqe *sqe;
+
+  if (sq_reserve(1)) {
+    return;
+  }
+  sqe = sqe_get();
+  sqe->opcode = poll ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+}
+
+static void sqe_set_fd(struct io_uring_sqe *sqe, vde_uring_io *io)
+{
+  if (io->slot >= 0) {
+    sqe->fd = io->slot;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = io->fd;
+  }
+}
+
+static void rec_poll(struct uring_rec *rec)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t mask = 0;
+
+  if (rec->polling || rec->fd < 0 || loop->closing) {
+    return;
+  }
+  if (rec->events & VDE_EV_READ) {
+    mask |= POLLIN;
+  }
+  if (rec->events & VDE_EV_WRITE) {
+    mask |= POLLOUT;
+  }
+  if (mask == 0 || sq_reserve(1)) {
+    return;
+  }
+  sqe = sqe_get();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = rec->fd;
+  sqe->poll32_events = mask;
+  sqe->user_data = (uint64_t)(uintptr_t)rec;
+  rec->polling = 1;
+  loop->inflight++;
+}
+
+static void rec_arm(struct uring_rec *rec, uring_usec now)
+{
+  if (!rec->active) {
+    rec->active = 1;
+    loop->nactive++;
+  }
+  if (rec->has_timeout) {
+    if (vde_timeout_is_queued(&rec->timeout_node)) {
+      vde_timeout_heap_remove(&loop->timeouts, &rec->timeout_node);
+    }
+    rec->timeout_node.deadline = now + rec->timeout;
+    vde_timeout_heap_insert(&loop->timeouts, &rec->timeout_node);
+  }
+  rec_poll(rec);
+}
+
+static void rec_disarm(struct uring_rec *rec)
+{
+  if (rec->active) {
+    rec->active = 0;
+    loop->nactive--;
+  }
+  if (vde_timeout_is_queued(&rec->timeout_node)) {
+    vde_timeout_heap_remove(&loop->timeouts, &rec->timeout_node);
+  }
+  if (rec->polling) {
+    sqe_cancel((uint64_t)(uintptr_t)rec, 1);
+  }
+}
+
+static struct uring_rec *rec_new(int fd, short events,
+                                 const struct timeval *timeout, event_cb cb,
+                                 void *arg)
+{
+  struct uring_rec *rec;
+
+  if (loop == NULL) {
+    vde_error("%s: io_uring loop not initialized in this thread",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rec = vde_cached_pool_alloc(loop->rec_pool);
+  if (rec == NULL) {
+    vde_error("%s: can't allocate memory for new event", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(rec, 0, sizeof(struct uring_rec));
+  rec->type = URING_REQ_POLL;
+  rec->fd = fd;
+  rec->events = events;
+  rec->cb = cb;
+  rec->arg = arg;
+  vde_timeout_init(&rec->timeout_node, rec);
+  if (timeout != NULL) {
+    rec->has_timeout = 1;
+    rec->timeout = (uring_usec)timeout->tv_sec * 1000000 + timeout->tv_usec;
+  }
+
+  rec_arm(rec, uring_now());
+  return rec;
+}
+
+static void rec_del(struct uring_rec *rec)
+{
+  vde_assert(!rec->dead);
+
+  rec_disarm(rec);
+  rec->dead = 1;
+  // a record with a poll in flight is collected when the poll is over
+  if (!rec->polling) {
+    rec->fire_next = loop->gc;
+    loop->gc = rec;
+  }
+}
+
+static void gc_collect(void)
+{
+  struct uring_rec *rec;
+
+  while (loop->gc != NULL) {
+    rec = loop->gc;
+    loop->gc = rec->fire_next;
+    vde_cached_pool_free(loop->rec_pool, rec);
+  }
+}
+
+/**
+ * @brief Handle the completion of a poll request
+ */
+static void dispatch_poll(struct uring_rec *rec, int res, uring_usec now)
+{
+  short what = 0, fired;
+
+  rec->polling = 0;
+  loop->inflight--;
+  if (rec->dead) {
+    rec->fire_next = loop->gc;
+    loop->gc = rec;
+    return;
+  }
+  if (!rec->active) {
+    return;
+  }
+  if (res < 0) {
+    if (res != -ECANCELED) {
+      vde_warning("%s: poll on fd %d failed: %s", __PRETTY_FUNCTION__,
+                  rec->fd, strerror(-res));
+    }
+    // poll again unless the fd is gone
+    if (res != -EBADF) {
+      rec_poll(rec);
+    }
+    return;
+  }
+
+  if (res & (POLLIN | POLLHUP | POLLERR)) {
+    what |= VDE_EV_READ;
+  }
+  if (res & (POLLOUT | POLLHUP | POLLERR)) {
+    what |= VDE_EV_WRITE;
+  }
+  fired = rec->events & what;
+  if (!fired) {
+    rec_poll(rec);
+    return;
+  }
+
+  if (!(rec->events & VDE_EV_PERSIST)) {
+    rec_disarm(rec);
+  } else if (rec->has_timeout) {
+    rec_arm(rec, now);
+  }
+  rec->cb(rec->fd, fired, rec->arg);
+  // level-triggered: poll again, the fd is still ready if not drained
+  if (!rec->dead && rec->active) {
+    rec_poll(rec);
+  }
+}
+
+/**
+ * @brief Call the callbacks of expired timeouts
+ */
+static void dispatch_timeouts(uring_usec now)
+{
+  struct uring_rec *rec, *head = NULL, **tail = &head;
+  vde_timeout *t;
+
+  // pick expired timeouts first, so that zero timeouts re-armed by their
+  // callback are not called again in this iteration
+  while ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL &&
+         t->deadline <= now) {
+    rec = (struct uring_rec *)t->data;
+    vde_timeout_heap_remove(&loop->timeouts, t);
+    rec->fire_next = NULL;
+    *tail = rec;
+    tail = &rec->fire_next;
+  }
+
+  while (head != NULL) {
+    rec = head;
+    head = rec->fire_next;
+    if (rec->dead) {
+      continue;
+    }
+    if (rec->events & VDE_EV_PERSIST) {
+      rec_arm(rec, now);
+    } else {
+      rec_disarm(rec);
+    }
+    rec->cb(rec->fd, VDE_EV_TIMEOUT, rec->arg);
+  }
+}
+
+static void io_free(vde_uring_io *io)
+{
+  struct io_uring_buf_reg reg;
+  struct io_uring_files_update update;
+  int fd = -1;
+
+  if (io->prev != NULL) {
+    io->prev->next = io->next;
+  } else {
+    loop->ios = io->next;
+  }
+  if (io->next != NULL) {
+    io->next->prev = io->prev;
+  }
+
+  if (io->bgid >= 0) {
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = io->bgid;
+    uring_register(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  if (io->br != NULL) {
+    munmap(io->br, io->br_size);
+  }
+  vde_free(io->bufs);
+  if (io->slot >= 0) {
+    memset(&update, 0, sizeof(update));
+    update.offset = io->slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1);
+    loop->free_slots[loop->nfree_slots++] = io->slot;
+  }
+  vde_free(io);
+}
+
+static void io_put_buf(vde_uring_io *io, unsigned int bid)
+{
+  struct io_uring_buf *buf;
+  uint16_t tail = io->br->tail;
+
+  buf = &io->br->bufs[tail & (io->nbufs - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(io->bufs + bid * io->buf_size);
+  buf->len = io->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&io->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void io_recv_arm(vde_uring_io *io)
+{
+  struct io_uring_sqe *sqe;
+
+  if (io->receiving || sq_reserve(1)) {
+    return;
+  }
+  sqe = sqe_get();
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe_set_fd(sqe, io);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = io->bgid;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->addr = (uint64_t)(uintptr_t)&io->recv_msg;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)io;
+  io->receiving = 1;
+  io->inflight++;
+  loop->inflight++;
+}
+
+/**
+ * @brief Handle a completion of the multishot receive of an I/O object
+ */
+static void dispatch_recv(vde_uring_io *io, int res, unsigned int flags)
+{
+  struct io_uring_recvmsg_out *out;
+  unsigned int bid;
+  char *buf;
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = io->bufs + bid * io->buf_size;
+    out = (struct io_uring_recvmsg_out *)buf;
+    if (!io->dead && res >= (int)sizeof(*out)) {
+      if (out->flags & MSG_TRUNC) {
+        vde_warning("%s: datagram larger than %u bytes, discarding",
+                    __PRETTY_FUNCTION__,
+                    (unsigned int)(io->buf_size - sizeof(*out) -
+                                   io->recv_msg.msg_namelen));
+      } else {
+        io->recv_cb(io, buf + sizeof(*out) + io->recv_msg.msg_namelen,
+                    out->payloadlen, (struct sockaddr *)(buf + sizeof(*out)),
+                    out->namelen < io->recv_msg.msg_namelen ?
+                      out->namelen : io->recv_msg.msg_namelen,
+                    io->arg);
+        if (!io->dead && io->flush_cb != NULL && !io->flush_pending) {
+          io->flush_pending = 1;
+          io->flush_next = loop->flush;
+          loop->flush = io;
+        }
+      }
+    }
+    // the payload has been consumed, give the buffer back
+    if (!io->dead) {
+      io_put_buf(io, bid);
+    }
+  }
+
+  if (flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  // the multishot request is over
+  io->receiving = 0;
+  io->inflight--;
+  loop->inflight--;
+  if (io->dead) {
+    if (io->inflight == 0 && !io->flush_pending) {
+      io_free(io);
+    }
+    return;
+  }
+  // out of buffers or stopped by the kernel, start again
+  if (res < 0 && res != -ENOBUFS) {
+    vde_warning("%s: receive on fd %d failed: %s", __PRETTY_FUNCTION__,
+                io->fd, strerror(-res));
+  }
+  if (res >= 0 || res == -ENOBUFS || res == -EINTR) {
+    io_recv_arm(io);
+  }
+}
+
+/**
+ * @brief Handle the completion of a send
+ */
+static void dispatch_send(struct uring_send *send, int res)
+{
+  vde_uring_io *io = send->io;
+
+  io->inflight--;
+  loop->inflight--;
+  if (!io->dead) {
+    send->cb(io, send->pkt, res, io->arg);
+  }
+  vde_pkt_put(send->pkt);
+  vde_cached_pool_free(loop->send_pool, send);
+
+  if (io->dead && io->inflight == 0 && !io->flush_pending) {
+    io_free(io);
+  }
+}
+
+/**
+ * @brief Call the flush callbacks of I/O objects which received data
+ */
+static void dispatch_flush(void)
+{
+  vde_uring_io *io;
+
+  while (loop->flush != NULL) {
+    io = loop->flush;
+    loop->flush = io->flush_next;
+    io->flush_pending = 0;
+    if (!io->dead) {
+      io->flush_cb(io, io->arg);
+    } else if (io->inflight == 0) {
+      io_free(io);
+    }
+  }
+}
+
+/**
+ * @brief Check whether the completion queue overflowed
+ *
+ * Completions which do not fit in the queue are kept by the kernel
+ * (IORING_FEAT_NODROP) until the next io_uring_enter() asking for events, and
+ * dropped only if it cannot allocate memory for them.
+ *
+ * @return 1 if completions are waiting in the kernel, 0 otherwise
+ */
+static int cq_overflowed(void)
+{
+  unsigned int overflow;
+
+  overflow = __atomic_load_n(loop->cq_overflow, __ATOMIC_ACQUIRE);
+  if (overflow != loop->cq_dropped) {
+    // XXX: the requests whose completion was dropped stay in flight forever,
+    // there's no way to tell which ones they are
+    vde_warning("%s: %u completions dropped by the kernel",
+                __PRETTY_FUNCTION__, overflow - loop->cq_dropped);
+    loop->cq_dropped = overflow;
+  }
+  return (__atomic_load_n(loop->sq_flags, __ATOMIC_ACQUIRE) &
+          IORING_SQ_CQ_OVERFLOW) != 0;
+}
+
+/**
+ * @brief Handle the completions posted so far, flushing the ones the kernel
+ * kept aside because the completion queue was full
+ */
+static void cq_reap(uring_usec now)
+{
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail, flags;
+  uint64_t user_data;
+  int res, flushed = 0;
+
+  head = *loop->cq_head;
+  for (;;) {
+    tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // stop once a flush brings nothing new
+      if (flushed || !cq_overflowed()) {
+        break;
+      }
+      flushed = 1;
+      if (uring_enter(0, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        vde_error("%s: cannot flush the completion queue: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+        break;
+      }
+      continue;
+    }
+    flushed = 0;
+    for (; head != tail; head++) {
+      cqe = &loop->cqes[head & loop->cq_mask];
+      user_data = cqe->user_data;
+      res = cqe->res;
+      flags = cqe->flags;
+      // free the slot before calling back, callbacks can submit requests
+      __atomic_store_n(loop->cq_head, head + 1, __ATOMIC_RELEASE);
+
+      if (user_data == 0) {
+        // cancellations
+        continue;
+      }
+      switch (*(enum uring_req_type *)(uintptr_t)user_data) {
+        case URING_REQ_POLL:
+          dispatch_poll((struct uring_rec *)(uintptr_t)user_data, res, now);
+          break;
+        case URING_REQ_RECV:
+          dispatch_recv((vde_uring_io *)(uintptr_t)user_data, res, flags);
+          break;
+        case URING_REQ_SEND:
+          dispatch_send((struct uring_send *)(uintptr_t)user_data, res);
+          break;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Run a single loop iteration: submit the queued requests and wait for
+ * completions with a single io_uring_enter()
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int uring_loop_once(void)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned int pending, min_complete = 1;
+  uring_usec now, wait = 0;
+  int has_wait = 0;
+  vde_timeout *t;
+
+  if ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL) {
+    now = uring_now();
+    has_wait = 1;
+    if (t->deadline <= now) {
+      min_complete = 0;
+    } else {
+      wait = t->deadline - now;
+    }
+  }
+
+  memset(&arg, 0, sizeof(arg));
+  if (has_wait && min_complete > 0) {
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (wait % 1000000) * 1000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+  pending = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+  if (uring_enter(pending, min_complete,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg)) < 0 &&
+      errno != EINTR && errno != ETIME && errno != EBUSY &&
+      errno != EAGAIN) {
+    vde_error("%s: io_uring_enter failed: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+
+  now = uring_now();
+  cq_reap(now);
+  dispatch_flush();
+  dispatch_timeouts(now);
+
+  gc_collect();
+  return 0;
+}
+
+static void uring_unmap(void)
+{
+  if (loop->sqes != NULL) {
+    munmap(loop->sqes, loop->sqes_size);
+  }
+  if (loop->cq_ring != NULL && loop->cq_ring != loop->sq_ring) {
+    munmap(loop->cq_ring, loop->cq_ring_size);
+  }
+  if (loop->sq_ring != NULL) {
+    munmap(loop->sq_ring, loop->sq_ring_size);
+  }
+}
+
+/**
+ * @brief Map the rings of a new io_uring instance
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int uring_map(struct io_uring_params *p)
+{
+  char *sq, *cq;
+  unsigned int *sq_array, i;
+
+  loop->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+  loop->cq_ring_size = p->cq_off.cqes +
+                       p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    if (loop->cq_ring_size > loop->sq_ring_size) {
+      loop->sq_ring_size = loop->cq_ring_size;
+    }
+  }
+
+  loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (loop->sq_ring == MAP_FAILED) {
+    loop->sq_ring = NULL;
+    return -1;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    loop->cq_ring = loop->sq_ring;
+  } else {
+    loop->cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (loop->cq_ring == MAP_FAILED) {
+      loop->cq_ring = NULL;
+      return -1;
+    }
+  }
+  loop->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+  if (loop->sqes == MAP_FAILED) {
+    loop->sqes = NULL;
+    return -1;
+  }
+
+  sq = (char *)loop->sq_ring;
+  loop->sq_head = (unsigned int *)(sq + p->sq_off.head);
+  loop->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+  loop->sq_flags = (unsigned int *)(sq + p->sq_off.flags);
+  loop->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+  loop->sq_entries = p->sq_entries;
+  loop->sqe_tail = *loop->sq_tail;
+  // sqes are used in ring order
+  sq_array = (unsigned int *)(sq + p->sq_off.array);
+  for (i = 0; i < p->sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  cq = (char *)loop->cq_ring;
+  loop->cq_head = (unsigned int *)(cq + p->cq_off.head);
+  loop->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+  loop->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+  loop->cq_overflow = (unsigned int *)(cq + p->cq_off.overflow);
+  loop->cq_dropped = *loop->cq_overflow;
+  loop->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+/**
+ * @brief Create a sparse fixed file table, I/O objects use plain fds if the
+ * kernel does not support it
+ */
+static void uring_register_files(void)
+{
+  struct io_uring_rsrc_register rr;
+  unsigned int i;
+
+  memset(&rr, 0, sizeof(rr));
+  rr.nr = URING_MAX_FILES;
+  rr.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (uring_register(IORING_REGISTER_FILES2, &rr, sizeof(rr)) < 0) {
+    vde_warning("%s: cannot register fixed files: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+    return;
+  }
+  loop->free_slots = vde_alloc(URING_MAX_FILES * sizeof(int));
+  for (i = 0; i < URING_MAX_FILES; i++) {
+    loop->free_slots[i] = URING_MAX_FILES - 1 - i;
+  }
+  loop->nfree_slots = URING_MAX_FILES;
+  loop->files_registered = 1;
+}
+
+int vde_uring_init(unsigned int entries)
+{
+  struct io_uring_params p;
+  int tmp_errno;
+
+  if (loop != NULL) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (entries == 0) {
+    entries = URING_DEFAULT_ENTRIES;
+  }
+  if (entries < URING_MIN_ENTRIES) {
+    entries = URING_MIN_ENTRIES;
+  }
+
+  loop = (struct uring_loop *)vde_calloc(sizeof(struct uring_loop));
+  if (loop == NULL) {
+    vde_error("%s: can't allocate io_uring loop", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // completions of a whole iteration must fit, one receive can post many
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+            IORING_SETUP_COOP_TASKRUN;
+  p.cq_entries = entries * 8;
+  loop->ring_fd = uring_setup(entries, &p);
+  if (loop->ring_fd < 0 && errno == EINVAL) {
+    // older kernels
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8;
+    loop->ring_fd = uring_setup(entries, &p);
+  }
+  if (loop->ring_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: can't create io_uring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto cleanup_loop;
+  }
+  if (!(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    tmp_errno = EOPNOTSUPP;
+    vde_error("%s: io_uring lacks required features", __PRETTY_FUNCTION__);
+    goto cleanup_fd;
+  }
+  if (uring_map(&p)) {
+    tmp_errno = errno;
+    vde_error("%s: can't map io_uring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto cleanup_map;
+  }
+
+  loop->rec_pool = vde_pool_new(sizeof(struct uring_rec), URING_REC_SLAB,
+                                URING_REC_SLAB, 0);
+  loop->send_pool = vde_pool_new(sizeof(struct uring_send), URING_SEND_SLAB,
+                                 URING_SEND_SLAB, 0);
+  if (loop->rec_pool == NULL || loop->send_pool == NULL) {
+    tmp_errno = ENOMEM;
+    vde_error("%s: can't create request pools", __PRETTY_FUNCTION__);
+    goto cleanup_pools;
+  }
+
+  uring_register_files();
+  return 0;
+
+cleanup_pools:
+  if (loop->rec_pool != NULL) {
+    vde_pool_delete(loop->rec_pool);
+  }
+  if (loop->send_pool != NULL) {
+    vde_pool_delete(loop->send_pool);
+  }
+cleanup_map:
+  uring_unmap();
+cleanup_fd:
+  close(loop->ring_fd);
+cleanup_loop:
+  vde_free(loop);
+  loop = NULL;
+  errno = tmp_errno;
+  return -1;
+}
+
+void vde_uring_fini(void)
+{
+  struct io_uring_sqe *sqe;
+  struct __kernel_timespec ts = { 0, 100000000 };
+  struct io_uring_getevents_arg arg;
+  vde_uring_io *io;
+  vde_timeout *t;
+  int tries;
+
+  if (loop == NULL) {
+    return;
+  }
+
+  // events and I/O objects still registered are leaked by their owners, just
+  // drop them once the kernel is done with their requests
+  loop->closing = 1;
+  while ((t = vde_timeout_heap_first(&loop->timeouts)) != NULL) {
+    rec_del((struct uring_rec *)t->data);
+  }
+  for (io = loop->ios; io != NULL; io = io->next) {
+    io->dead = 1;
+  }
+  if (loop->inflight > 0 && sq_reserve(1) == 0) {
+    sqe = sqe_get();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+  }
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+  for (tries = 0; tries < 10 && loop->inflight > 0; tries++) {
+    __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+    uring_enter(loop->sqe_tail - *loop->sq_head, 1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                sizeof(arg));
+    cq_reap(uring_now());
+    dispatch_flush();
+  }
+  if (loop->inflight > 0) {
+    vde_warning("%s: %u requests still in flight", __PRETTY_FUNCTION__,
+                loop->inflight);
+  }
+  gc_collect();
+  while (loop->ios != NULL) {
+    io_free(loop->ios);
+  }
+
+  vde_pool_delete(loop->rec_pool);
+  vde_pool_delete(loop->send_pool);
+  uring_unmap();
+  close(loop->ring_fd);
+  vde_free(loop->free_slots);
+  vde_timeout_heap_fini(&loop->timeouts);
+  vde_free(loop);
+  loop = NULL;
+}
+
+int vde_uring_dispatch(void)
+{
+  if (loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  loop->exit = 0;
+  while (!loop->exit && (loop->nactive > 0 || loop->inflight > 0)) {
+    if (uring_loop_once()) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void vde_uring_loopexit(void)
+{
+  if (loop != NULL) {
+    loop->exit = 1;
+  }
+}
+
+void *uring_event_add(int fd, short events, const struct timeval *timeout,
+                      event_cb cb, void *arg)
+{
+  if (fd < 0) {
+    errno = EBADF;
+    return NULL;
+  }
+  return rec_new(fd, events, timeout, cb, arg);
+}
+
+void uring_event_del(void *event)
+{
+  rec_del((struct uring_rec *)event);
+}
+
+void *uring_timeout_add(const struct timeval *timeout, short events,
+                        event_cb cb, void *arg)
+{
+  if (timeout == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return rec_new(-1, events, timeout, cb, arg);
+}
+
+void uring_timeout_del(void *timeout)
+{
+  rec_del((struct uring_rec *)timeout);
+}
+
+vde_event_handler uring_eh = {
+  .event_add = uring_event_add,
+  .event_del = uring_event_del,
+  .timeout_add = uring_timeout_add,
+  .timeout_del = uring_timeout_del,
+};
+
+int vde_uring_io_available(vde_context *ctx)
+{
+  return loop != NULL && ctx->event_handler.event_add == uring_event_add;
+}
+
+vde_uring_io *vde_uring_io_new(int fd, void *arg)
+{
+  struct io_uring_files_update update;
+  vde_uring_io *io;
+
+  if (loop == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  io = (vde_uring_io *)vde_calloc(sizeof(vde_uring_io));
+  if (io == NULL) {
+    vde_error("%s: can't allocate I/O object", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  io->type = URING_REQ_RECV;
+  io->fd = fd;
+  io->arg = arg;
+  io->slot = -1;
+  io->bgid = -1;
+
+  // the fixed file saves a lookup per request, plain fds work anyway
+  if (loop->files_registered && loop->nfree_slots > 0) {
+    io->slot = loop->free_slots[--loop->nfree_slots];
+    memset(&update, 0, sizeof(update));
+    update.offset = io->slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    if (uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+      loop->free_slots[loop->nfree_slots++] = io->slot;
+      io->slot = -1;
+    }
+  }
+
+  io->next = loop->ios;
+  if (loop->ios != NULL) {
+    loop->ios->prev = io;
+  }
+  loop->ios = io;
+  return io;
+}
+
+void vde_uring_io_delete(vde_uring_io *io)
+{
+  vde_assert(!io->dead);
+
+  io->dead = 1;
+  if (io->recv_cb != NULL) {
+    loop->nactive--;
+  }
+  if (io->receiving) {
+    sqe_cancel((uint64_t)(uintptr_t)io, 0);
+  }
+  // freed once the kernel is done with its requests
+  if (io->inflight == 0 && !io->flush_pending) {
+    io_free(io);
+  }
+}
+
+int vde_uring_io_recv(vde_uring_io *io, unsigned int size, unsigned int nbufs,
+                      vde_uring_recv_cb recv_cb, vde_uring_flush_cb flush_cb)
+{
+  struct io_uring_buf_reg reg;
+  unsigned int i, n = 1;
+  int tmp_errno, tries;
+
+  if (io->recv_cb != NULL || nbufs == 0 || nbufs > 32768) {
+    errno = EINVAL;
+    return -1;
+  }
+  while (n < nbufs) {
+    n *= 2;
+  }
+  io->nbufs = n;
+
+  // each buffer holds the recvmsg header, the sender address and the payload
+  io->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+  io->buf_size = sizeof(struct io_uring_recvmsg_out) +
+                 io->recv_msg.msg_namelen + size;
+  io->bufs = vde_alloc(io->nbufs * io->buf_size);
+  io->br_size = io->nbufs * sizeof(struct io_uring_buf);
+  io->br = mmap(NULL, io->br_size, PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (io->bufs == NULL || io->br == MAP_FAILED) {
+    io->br = NULL;
+    tmp_errno = ENOMEM;
+    vde_error("%s: can't allocate receive buffers", __PRETTY_FUNCTION__);
+    goto error;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)io->br;
+  reg.ring_entries = io->nbufs;
+  for (tries = 0; tries < 65536; tries++) {
+    reg.bgid = loop->next_bgid++ & 0xffff;
+    if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+      break;
+    }
+    if (errno != EEXIST) {
+      tmp_errno = errno;
+      vde_error("%s: can't register buffer ring: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error;
+    }
+  }
+  io->bgid = reg.bgid;
+  io->br->tail = 0;
+  for (i = 0; i < io->nbufs; i++) {
+    io_put_buf(io, i);
+  }
+
+  io->recv_cb = recv_cb;
+  io->flush_cb = flush_cb;
+  loop->nactive++;
+  io_recv_arm(io);
+  return 0;
+
+error:
+  if (io->br != NULL) {
+    munmap(io->br, io->br_size);
+    io->br = NULL;
+  }
+  vde_free(io->bufs);
+  io->bufs = NULL;
+  errno = tmp_errno;
+  return -1;
+}
+
+int vde_uring_io_sendv(vde_uring_io *io, vde_pkt **pkts, unsigned int n,
+                       const struct sockaddr *to, socklen_t tolen,
+                       vde_uring_send_cb cb)
+{
+  struct uring_send *sends[VDE_PKT_BATCH_MAX];
+  struct io_uring_sqe *sqe;
+  unsigned int i;
+
+  if (n == 0 || n > VDE_PKT_BATCH_MAX ||
+      tolen > sizeof(struct sockaddr_storage)) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    sends[i] = vde_cached_pool_alloc(loop->send_pool);
+    if (sends[i] == NULL) {
+      while (i > 0) {
+        vde_cached_pool_free(loop->send_pool, sends[--i]);
+      }
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  // the chain must be submitted as a whole
+  if (sq_reserve(n)) {
+    for (i = 0; i < n; i++) {
+      vde_cached_pool_free(loop->send_pool, sends[i]);
+    }
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    memset(sends[i], 0, sizeof(struct uring_send));
+    sends[i]->type = URING_REQ_SEND;
+    sends[i]->io = io;
+    sends[i]->pkt = vde_pkt_get(pkts[i]);
+    sends[i]->cb = cb;
+    sends[i]->iov.iov_base = pkts[i]->payload;
+    sends[i]->iov.iov_len = pkts[i]->hdr->pkt_len;
+    sends[i]->msg.msg_iov = &sends[i]->iov;
+    sends[i]->msg.msg_iovlen = 1;
+    if (to != NULL) {
+      memcpy(&sends[i]->to, to, tolen);
+      sends[i]->msg.msg_name = &sends[i]->to;
+      sends[i]->msg.msg_namelen = tolen;
+    }
+
+    sqe = sqe_get();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe_set_fd(sqe, io);
+    // fail with -EAGAIN instead of waiting, the caller decides when to retry
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->addr = (uint64_t)(uintptr_t)&sends[i]->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)sends[i];
+    if (i < n - 1) {
+      sqe->flags |= IOSQE_IO_LINK;
+    }
+    io->inflight++;
+    loop->inflight++;
+  }
+  return 0;
+}
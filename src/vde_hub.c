@@ -17,10 +17,17 @@
 
 #include <vde3.h>
 #include <stdio.h>
+#include <getopt.h>
 #include <event.h>
 
 extern vde_event_handler libevent_eh;
 
+static struct option long_options[] = {
+  {"epoll", no_argument, NULL, 'e'},
+  {"uring", no_argument, NULL, 'u'},
+  {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char **argv)
 {
   int res;
@@ -28,15 +35,45 @@ int main(int argc, char **argv)
   vde_component *transport, *engine, *cm;
   vde_component *ctransport, *cengine, *ccm;
   vde_sobj *params;
+  vde_event_handler *eh = &libevent_eh;
+  int opt, use_epoll = 0, use_uring = 0;
+
+  while ((opt = getopt_long(argc, argv, "eu", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'e':
+        use_epoll = 1;
+        break;
+      case 'u':
+        use_uring = 1;
+        break;
+      default:
+        printf("usage: %s [-e|--epoll] [-u|--uring]\n", argv[0]);
+        return 1;
+    }
+  }
 
-  event_init();
+  if (use_uring) {
+    if (vde_uring_init(0)) {
+      printf("no io_uring loop\n");
+      return 1;
+    }
+    eh = &uring_eh;
+  } else if (use_epoll) {
+    if (vde_epoll_init(0)) {
+      printf("no epoll loop\n");
+      return 1;
+    }
+    eh = &epoll_eh;
+  } else {
+    event_init();
+  }
 
   res = vde_context_new(&ctx);
   if (res) {
     printf("no new ctx, %d\n", res);
   }
 
-  res = vde_context_init(ctx, &libevent_eh, NULL);
+  res = vde_context_init(ctx, eh, NULL);
   if (res) {
     printf("no init ctx: %d\n", res);
   }
@@ -69,8 +106,8 @@ int main(int argc, char **argv)
 
   // control part
   params = vde_sobj_from_string("{'path': '/tmp/vde3_test_ctrl'}");
-  res = vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr2", &ctransport,
-                                  params);
+  res = vde_context_new_component(ctx, VDE_TRANSPORT, "stream", "tr2",
+                                  &ctransport, params);
   if (res) {
     printf("no new ctransport: %d\n", res);
   }
@@ -94,7 +131,13 @@ int main(int argc, char **argv)
     printf("no listen on ccm: %d\n", res);
   }
 
-  event_dispatch();
+  if (use_uring) {
+    vde_uring_dispatch();
+  } else if (use_epoll) {
+    vde_epoll_dispatch();
+  } else {
+    event_dispatch();
+  }
 
   return 0;
 }
@@ -17,25 +17,52 @@
 
 #include <vde3.h>
 #include <stdio.h>
+#include <getopt.h>
 #include <event.h>
 
 extern vde_event_handler libevent_eh;
 
+static struct option long_options[] = {
+  {"epoll", no_argument, NULL, 'e'},
+  {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char **argv)
 {
   int res;
   vde_context *ctx;
   vde_component *tr1, *tr2, *e1, *e2, *cm1, *cm2;
   vde_sobj *params;
+  vde_event_handler *eh = &libevent_eh;
+  int opt, use_epoll = 0;
+
+  while ((opt = getopt_long(argc, argv, "e", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'e':
+        use_epoll = 1;
+        break;
+      default:
+        printf("usage: %s [-e|--epoll]\n", argv[0]);
+        return 1;
+    }
+  }
 
-  event_init();
+  if (use_epoll) {
+    if (vde_epoll_init(0)) {
+      printf("no epoll loop\n");
+      return 1;
+    }
+    eh = &epoll_eh;
+  } else {
+    event_init();
+  }
 
   res = vde_context_new(&ctx);
   if (res) {
     printf("no new ctx, %d\n", res);
   }
 
-  res = vde_context_init(ctx, &libevent_eh, NULL);
+  res = vde_context_init(ctx, eh, NULL);
   if (res) {
     printf("no init ctx: %d\n", res);
   }
@@ -97,7 +124,11 @@ int main(int argc, char **argv)
     printf("no local connection: %d\n", res);
   }
 
-  event_dispatch();
+  if (use_epoll) {
+    vde_epoll_dispatch();
+  } else {
+    event_dispatch();
+  }
 
   return 0;
 }
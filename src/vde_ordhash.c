@@ -16,102 +16,255 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <vde3/vde_ordhash.h>
 
+// initial number of entries, the index has always twice as many slots
+#define ORDHASH_INITIAL_SIZE 8
+
+// index slot values which don't refer to an entry
+#define IDX_EMPTY UINT32_MAX
+#define IDX_DELETED (UINT32_MAX - 1)
+
+struct vde_ordhash_entry {
+  vde_ordhash *oh;
+  void *k;
+  void *v;
+  int used; // zero if the element has been removed
+};
+
 struct vde_ordhash {
-  vde_hash *hash;
-  vde_list *list;
+  // elements in insertion order, removed ones are left in place until the
+  // next compaction
+  vde_ordhash_entry *entries;
+  uint32_t size; // allocated entries
+  uint32_t len; // entries used so far, removed ones included
+  uint32_t count; // elements in the ordhash
+  uint32_t head; // entries before head have all been removed
+  // open-addressing index of entries, 2 * size slots
+  uint32_t *index;
+  uint32_t index_mask;
 };
 
 
+static inline uint32_t ordhash_hash(vde_ordhash *oh, void *k)
+{
+  uint64_t h = (uint64_t)(uintptr_t)k * 0x9e3779b97f4a7c15ULL;
+
+  return (uint32_t)(h >> 32) & oh->index_mask;
+}
+
+/**
+ * @brief Find the index slot of a key
+ *
+ * @param oh The ordhash
+ * @param k The key
+ *
+ * @return The slot holding the key, or the empty slot ending its probe
+ * sequence if the key is not present
+ */
+static uint32_t ordhash_find_slot(vde_ordhash *oh, void *k)
+{
+  uint32_t i = ordhash_hash(oh, k), idx;
+
+  while ((idx = oh->index[i]) != IDX_EMPTY) {
+    if (idx != IDX_DELETED && oh->entries[idx].k == k) {
+      break;
+    }
+    i = (i + 1) & oh->index_mask;
+  }
+  return i;
+}
+
+/**
+ * @brief Move live entries to the front of a (possibly bigger) entries array
+ * and rebuild the index, dropping deleted slots.
+ *
+ * @param oh The ordhash
+ * @param size The new number of entries, at least the number of elements
+ */
+static void ordhash_resize(vde_ordhash *oh, uint32_t size)
+{
+  uint32_t i, j, slot;
+
+  // compact first, the array might not change size
+  for (i = oh->head, j = 0; i < oh->len; i++) {
+    if (oh->entries[i].used) {
+      oh->entries[j++] = oh->entries[i];
+    }
+  }
+  vde_assert(j == oh->count);
+
+  if (size != oh->size) {
+    oh->entries = vde_realloc(oh->entries, size * sizeof(vde_ordhash_entry));
+    oh->size = size;
+    vde_free(oh->index);
+    oh->index = vde_alloc(2 * size * sizeof(uint32_t));
+    oh->index_mask = 2 * size - 1;
+  }
+  oh->len = oh->count;
+  oh->head = 0;
+
+  memset(oh->index, 0xff, 2 * size * sizeof(uint32_t));
+  for (i = 0; i < oh->len; i++) {
+    slot = ordhash_find_slot(oh, oh->entries[i].k);
+    oh->index[slot] = i;
+  }
+}
+
 vde_ordhash *vde_ordhash_new() {
   vde_ordhash *oh = calloc(1, sizeof(vde_ordhash));
   if (oh == NULL) {
     errno = ENOMEM;
     return NULL;
   }
-  oh->hash = vde_hash_init();
-  /* list init not needed */
+  ordhash_resize(oh, ORDHASH_INITIAL_SIZE);
   return oh;
 }
 
 void vde_ordhash_delete(vde_ordhash *oh) {
   vde_assert(oh != NULL);
-  vde_assert(vde_hash_size(oh->hash) == 0);
-  vde_assert(vde_list_length(oh->list) == 0);
-  vde_hash_delete(oh->hash);
-  /* list delete not needed as it's empty (NULL) */
+  vde_assert(oh->count == 0);
+  vde_free(oh->index);
+  vde_free(oh->entries);
+  free(oh);
 }
 
 void vde_ordhash_insert(vde_ordhash *oh, void *k, void *v) {
+  uint32_t slot, size;
+  vde_ordhash_entry *e;
+
   vde_assert(oh != NULL);
-  vde_assert(vde_hash_lookup(oh->hash, k) == NULL);
-  oh->list = vde_list_append(oh->list, k);
-  /*
-   * XXX: consider using vde_list_prepend if optimizations are needed, the list
-   * will then express an inverse temporal relation (e.g.: vde_ordhash_first()
-   * calls vde_list_last(), vde_ordhash_next() calls vde_list_prev())
-   */
-  vde_hash_insert(oh->hash, k, v);
+  vde_assert(vde_ordhash_lookup(oh, k) == NULL);
+
+  if (oh->len == oh->size) {
+    // make room: compact if at least half of the entries have been removed,
+    // grow otherwise
+    size = (oh->count <= oh->size / 2) ? oh->size : oh->size * 2;
+    ordhash_resize(oh, size);
+  }
+
+  slot = ordhash_find_slot(oh, k);
+  oh->index[slot] = oh->len;
+
+  e = &oh->entries[oh->len++];
+  e->oh = oh;
+  e->k = k;
+  e->v = v;
+  e->used = 1;
+  oh->count++;
 }
 
 int vde_ordhash_remove(vde_ordhash *oh, void *k) {
+  uint32_t slot;
+  vde_ordhash_entry *e;
+
   vde_assert(oh != NULL);
-  vde_assert(vde_hash_lookup(oh->hash, k) != NULL);
-  oh->list = vde_list_remove(oh->list, k);
-  return vde_hash_remove(oh->hash, k);
+  vde_assert(vde_ordhash_lookup(oh, k) != NULL);
+
+  slot = ordhash_find_slot(oh, k);
+  if (oh->index[slot] == IDX_EMPTY) {
+    return 0;
+  }
+  e = &oh->entries[oh->index[slot]];
+  e->used = 0;
+  e->v = NULL;
+  oh->index[slot] = IDX_DELETED;
+  oh->count--;
+  return 1;
 }
 
 void *vde_ordhash_lookup(vde_ordhash *oh, void *k) {
+  uint32_t idx;
+
   vde_assert(oh != NULL);
-  return vde_hash_lookup(oh->hash, k);
+
+  idx = oh->index[ordhash_find_slot(oh, k)];
+  if (idx == IDX_EMPTY) {
+    return NULL;
+  }
+  return oh->entries[idx].v;
 }
 
 vde_ordhash_entry *vde_ordhash_first(vde_ordhash *oh) {
   vde_assert(oh != NULL);
-  return (vde_ordhash_entry *)vde_list_first(oh->list);
+
+  while (oh->head < oh->len && !oh->entries[oh->head].used) {
+    oh->head++;
+  }
+  if (oh->head == oh->len) {
+    return NULL;
+  }
+  return &oh->entries[oh->head];
 }
 
 vde_ordhash_entry *vde_ordhash_last(vde_ordhash *oh) {
+  uint32_t i;
+
   vde_assert(oh != NULL);
-  return (vde_ordhash_entry *)vde_list_last(oh->list);
+
+  for (i = oh->len; i > oh->head; i--) {
+    if (oh->entries[i - 1].used) {
+      return &oh->entries[i - 1];
+    }
+  }
+  return NULL;
 }
 
 vde_ordhash_entry *vde_ordhash_next(vde_ordhash_entry *e) {
-  return (vde_ordhash_entry *)vde_list_next(e);
+  vde_ordhash *oh;
+  vde_ordhash_entry *end;
+
+  vde_assert(e != NULL);
+
+  oh = e->oh;
+  end = &oh->entries[oh->len];
+  for (e++; e < end; e++) {
+    if (e->used) {
+      return e;
+    }
+  }
+  return NULL;
 }
 
 vde_ordhash_entry *vde_ordhash_prev(vde_ordhash_entry *e) {
-  return (vde_ordhash_entry *)vde_list_prev(e);
+  vde_ordhash *oh;
+  vde_ordhash_entry *begin;
+
+  vde_assert(e != NULL);
+
+  oh = e->oh;
+  begin = &oh->entries[oh->head];
+  while (e > begin) {
+    e--;
+    if (e->used) {
+      return e;
+    }
+  }
+  return NULL;
 }
 
 void *vde_ordhash_entry_lookup(vde_ordhash *oh, vde_ordhash_entry *e) {
-  void *k, *v;
   vde_assert(oh != NULL);
   vde_assert(e != NULL);
-  k = vde_list_get_data((vde_list *)e);
-  v = vde_hash_lookup(oh->hash, k);
-  vde_assert(v); /* Ensure the given entry has a corresponding value */
-  return v;
+  vde_assert(e->oh == oh && e->used);
+  return e->v;
 }
 
 void *vde_ordhash_entry_getkey(vde_ordhash *oh, vde_ordhash_entry *e) {
-  void *k;
   vde_assert(oh != NULL);
   vde_assert(e != NULL);
-  k = vde_list_get_data((vde_list *)e);
-  vde_assert(k); /* Ensure the given entry has a corresponding key */
-  return k;
+  vde_assert(e->oh == oh && e->used);
+  return e->k;
 }
 
 void vde_ordhash_remove_all(vde_ordhash *oh) {
-  vde_list *head;
-  void *k;
   vde_assert(oh != NULL);
-  while ((head = vde_list_first(oh->list))){
-    k = vde_list_get_data(head);
-    vde_ordhash_remove(oh, k);
-  }
-}
 
+  oh->count = 0;
+  oh->len = 0;
+  oh->head = 0;
+  memset(oh->index, 0xff, (oh->index_mask + 1) * sizeof(uint32_t));
+}
@@ -0,0 +1,306 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include <vde3/common.h>
+#include <vde3/timer.h>
+#include <vde3/worker.h>
+
+// pending calls per worker, calls are a control path
+#define WORKER_CALLS_QLEN 1024
+
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+  sem_t *done; // posted once fn returned, NULL for asynchronous calls
+} worker_call;
+
+struct vde_worker {
+  unsigned int id;
+  pthread_t thread;
+  vde_event_handler handler;
+  // calls are pushed under lock, so that any thread can post them, and popped
+  // by the worker alone
+  pthread_mutex_t lock;
+  vde_ring *calls;
+  int doorbell; // eventfd written after pushing calls
+  void *doorbell_ev;
+  vde_timer_wheel *timers;
+  sem_t started;
+  int failed;
+};
+
+static __thread vde_worker *current_worker;
+
+static void worker_doorbell_cb(int fd, short events, void *arg)
+{
+  uint64_t count;
+  worker_call *call;
+  vde_worker *worker = (vde_worker *)arg;
+
+  // reset the counter before looking at the ring, calls pushed from now on
+  // ring the doorbell again
+  if (read(worker->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot read doorbell of worker %u: %s",
+                __PRETTY_FUNCTION__, worker->id, strerror(errno));
+  }
+
+  while ((call = vde_ring_pop(worker->calls)) != NULL) {
+    call->fn(call->arg);
+    if (call->done != NULL) {
+      sem_post(call->done);
+    } else {
+      vde_free(call);
+    }
+  }
+}
+
+static void worker_stop_cb(void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+static void *worker_main(void *arg)
+{
+  vde_worker *worker = (vde_worker *)arg;
+
+  current_worker = worker;
+
+  if (vde_epoll_init(0)) {
+    goto err_started;
+  }
+  worker->timers = vde_timer_wheel_new(&worker->handler);
+  if (worker->timers == NULL) {
+    goto err_epoll;
+  }
+  worker->doorbell_ev = worker->handler.event_add(worker->doorbell,
+                                                  VDE_EV_READ|VDE_EV_PERSIST,
+                                                  NULL, &worker_doorbell_cb,
+                                                  (void *)worker);
+  if (worker->doorbell_ev == NULL) {
+    goto err_timers;
+  }
+  sem_post(&worker->started);
+
+  vde_epoll_dispatch();
+
+  // events still registered by components are dropped with the loop
+  worker->handler.event_del(worker->doorbell_ev);
+  vde_timer_wheel_delete(worker->timers);
+  vde_epoll_fini();
+  return NULL;
+
+err_timers:
+  vde_timer_wheel_delete(worker->timers);
+err_epoll:
+  vde_epoll_fini();
+err_started:
+  vde_error("%s: cannot start worker %u", __PRETTY_FUNCTION__, worker->id);
+  worker->failed = 1;
+  sem_post(&worker->started);
+  return NULL;
+}
+
+static void worker_delete(vde_worker *worker)
+{
+  worker_call *call;
+
+  // calls posted after the stop request are never run
+  while ((call = vde_ring_pop(worker->calls)) != NULL) {
+    if (call->done != NULL) {
+      sem_post(call->done);
+    } else {
+      vde_free(call);
+    }
+  }
+  close(worker->doorbell);
+  vde_ring_delete(worker->calls);
+  pthread_mutex_destroy(&worker->lock);
+  sem_destroy(&worker->started);
+  vde_free(worker);
+}
+
+static vde_worker *worker_new(unsigned int id, vde_event_handler *handler)
+{
+  vde_worker *worker;
+
+  worker = (vde_worker *)vde_calloc(sizeof(vde_worker));
+  if (worker == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  worker->id = id;
+  memcpy(&worker->handler, handler, sizeof(vde_event_handler));
+  worker->calls = vde_ring_new(WORKER_CALLS_QLEN);
+  if (worker->calls == NULL) {
+    goto err_worker;
+  }
+  worker->doorbell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (worker->doorbell < 0) {
+    goto err_calls;
+  }
+  pthread_mutex_init(&worker->lock, NULL);
+  sem_init(&worker->started, 0, 0);
+
+  errno = pthread_create(&worker->thread, NULL, &worker_main, worker);
+  if (errno) {
+    vde_error("%s: cannot create thread: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    pthread_mutex_destroy(&worker->lock);
+    sem_destroy(&worker->started);
+    close(worker->doorbell);
+    goto err_calls;
+  }
+  while (sem_wait(&worker->started) && errno == EINTR);
+  if (worker->failed) {
+    pthread_join(worker->thread, NULL);
+    worker_delete(worker);
+    errno = EINVAL;
+    return NULL;
+  }
+  return worker;
+
+err_calls:
+  vde_ring_delete(worker->calls);
+err_worker:
+  vde_free(worker);
+  return NULL;
+}
+
+vde_worker **vde_workers_start(vde_context *ctx, vde_event_handler *handler,
+                               unsigned int nworkers)
+{
+  unsigned int i;
+  int tmp_errno;
+  vde_worker **workers;
+
+  // only handlers keeping a loop per thread can drive workers
+  if (handler == NULL || handler->event_add != epoll_eh.event_add ||
+      nworkers == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  workers = (vde_worker **)vde_calloc(nworkers * sizeof(vde_worker *));
+  if (workers == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (i = 0; i < nworkers; i++) {
+    workers[i] = worker_new(i, handler);
+    if (workers[i] == NULL) {
+      tmp_errno = errno;
+      vde_workers_stop(workers, i);
+      errno = tmp_errno;
+      return NULL;
+    }
+  }
+  return workers;
+}
+
+void vde_workers_stop(vde_worker **workers, unsigned int nworkers)
+{
+  unsigned int i;
+
+  for (i = 0; i < nworkers; i++) {
+    if (vde_worker_call(workers[i], &worker_stop_cb, NULL, 0)) {
+      vde_error("%s: cannot stop worker %u", __PRETTY_FUNCTION__, i);
+      continue;
+    }
+    pthread_join(workers[i]->thread, NULL);
+    worker_delete(workers[i]);
+  }
+  vde_free(workers);
+}
+
+int vde_worker_call(vde_worker *worker, void (*fn)(void *), void *arg,
+                    int wait)
+{
+  uint64_t one = 1;
+  int rv;
+  sem_t done;
+  worker_call sync_call, *call;
+
+  vde_assert(worker != NULL);
+  vde_assert(fn != NULL);
+
+  if (wait && current_worker == worker) {
+    // waiting for ourselves would never return
+    fn(arg);
+    return 0;
+  }
+
+  if (wait) {
+    sem_init(&done, 0, 0);
+    call = &sync_call;
+    call->done = &done;
+  } else {
+    call = (worker_call *)vde_alloc(sizeof(worker_call));
+    if (call == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    call->done = NULL;
+  }
+  call->fn = fn;
+  call->arg = arg;
+
+  pthread_mutex_lock(&worker->lock);
+  rv = vde_ring_push(worker->calls, call);
+  pthread_mutex_unlock(&worker->lock);
+  if (rv) {
+    vde_error("%s: too many calls pending for worker %u", __PRETTY_FUNCTION__,
+              worker->id);
+    if (wait) {
+      sem_destroy(&done);
+    } else {
+      vde_free(call);
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (write(worker->doorbell, &one, sizeof(one)) < 0) {
+    // only fails if the counter overflows, the worker is ringing anyway
+    vde_warning("%s: cannot ring doorbell of worker %u: %s",
+                __PRETTY_FUNCTION__, worker->id, strerror(errno));
+  }
+
+  if (wait) {
+    while (sem_wait(&done) && errno == EINTR);
+    sem_destroy(&done);
+  }
+  return 0;
+}
+
+vde_timer_wheel *vde_worker_current_timers(void)
+{
+  return current_worker ? current_worker->timers : NULL;
+}
+
+int vde_worker_current(void)
+{
+  return current_worker ? (int)current_worker->id : -1;
+}
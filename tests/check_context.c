@@ -4,6 +4,7 @@
 
 #include <check.h>
 #include <vde3.h>
+#include <vde3/context.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -169,6 +170,27 @@ V_START_TEST (test_component_del_invalid)
 }
 END_TEST
 
+V_START_TEST (test_component_generation)
+{
+  unsigned int gen;
+  vde_component *comp;
+
+  gen = vde_context_get_generation(f_ctx);
+  vde_context_new_component(f_ctx, VDE_ENGINE, "hub", "test_e", &comp, NULL);
+  fail_unless(vde_context_get_generation(f_ctx) != gen,
+              "generation not changed by new component");
+
+  gen = vde_context_get_generation(f_ctx);
+  vde_context_get_component(f_ctx, "test_e");
+  fail_unless(vde_context_get_generation(f_ctx) == gen,
+              "generation changed by lookup");
+
+  vde_context_component_del(f_ctx, comp);
+  fail_unless(vde_context_get_generation(f_ctx) != gen,
+              "generation not changed by component del");
+}
+END_TEST
+
 Suite *
 context_suite (void)
 {
@@ -191,6 +213,7 @@ context_suite (void)
   tcase_add_test (tc_component, test_component_get);
   tcase_add_test (tc_component, test_component_del);
   tcase_add_test (tc_component, test_component_del_invalid);
+  tcase_add_test (tc_component, test_component_generation);
   suite_add_tcase (s, tc_component);
   return s;
 }
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/localconnection.h>
+#include <vde3/command.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the engine is linked in the test, see Makefile.am
+extern vde_module VDE_MODULE_START;
+
+#define MAX_REPLIES 16
+#define RX_SZ (256 * 1024)
+
+/*
+ * A client engine connected to the ctrl engine: it collects the payload of
+ * the packets received, replies are separated by \0.
+ */
+struct client {
+  vde_connection *conn;
+  int pkts;
+  char rx[RX_SZ];
+  size_t rx_len;
+};
+
+static int client_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct client *c = (struct client *)arg;
+
+  fail_unless (c->rx_len + pkt->hdr->pkt_len <= RX_SZ, "too many replies");
+  memcpy(c->rx + c->rx_len, pkt->payload, pkt->hdr->pkt_len);
+  c->rx_len += pkt->hdr->pkt_len;
+  c->pkts++;
+  return 0;
+}
+
+static int client_errorcb(vde_connection *conn, vde_pkt *pkt,
+                          vde_conn_error err, void *arg)
+{
+  struct client *c = (struct client *)arg;
+
+  if (err == CONN_READ_CLOSED) {
+    c->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static int client_new_conn(vde_component *component, vde_connection *conn,
+                           vde_request *req)
+{
+  struct client *c = (struct client *)vde_component_get_priv(component);
+
+  c->conn = conn;
+  vde_connection_set_callbacks(conn, &client_readcb, NULL, &client_errorcb,
+                               c);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+  return 0;
+}
+
+/*
+ * Commands called by the tests: echo replies with its parameters, fail
+ * always fails
+ */
+static int client_echo(vde_component *component, vde_sobj *in,
+                       vde_sobj **out)
+{
+  *out = vde_sobj_get(in);
+  return 0;
+}
+
+static int client_fail(vde_component *component, vde_sobj *in,
+                       vde_sobj **out)
+{
+  *out = vde_sobj_new_string("failed");
+  errno = EPERM;
+  return -1;
+}
+
+static vde_command client_commands[] = {
+  { "echo", client_echo, "Reply with the parameters", NULL },
+  { "fail", client_fail, "Fail", NULL },
+  { NULL, NULL, NULL, NULL },
+};
+
+static int client_init(vde_component *component, vde_sobj *params)
+{
+  return vde_component_commands_register(component, client_commands);
+}
+
+static void client_fini(vde_component *component)
+{
+}
+
+static component_ops client_cops = {
+  .init = client_init,
+  .fini = client_fini,
+};
+
+static vde_module client_module = {
+  .kind = VDE_ENGINE,
+  .family = "client",
+  .cops = &client_cops,
+  .eng_new_conn = client_new_conn,
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_ctrl, *f_engine;
+struct client f_client;
+vde_sobj *f_replies[MAX_REPLIES];
+int f_nreplies;
+
+void
+setup (void)
+{
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+
+  // methods are looked up in the context, the ctrl module could have been
+  // loaded from the modules path already
+  fail_unless (vde_context_register_module(f_ctx, &VDE_MODULE_START) == 0 ||
+               errno == EEXIST, "cannot register ctrl module");
+  fail_unless (vde_context_register_module(f_ctx, &client_module) == 0,
+               "cannot register client module");
+  fail_unless (vde_context_new_component(f_ctx, VDE_ENGINE, "ctrl", "ctrl",
+                                         &f_ctrl, NULL) == 0,
+               "cannot create ctrl: %s", strerror(errno));
+
+  memset(&f_client, 0, sizeof(f_client));
+  fail_unless (vde_context_new_component(f_ctx, VDE_ENGINE, "client",
+                                         "client", &f_engine, NULL) == 0,
+               "cannot create client: %s", strerror(errno));
+  vde_component_set_priv(f_engine, &f_client);
+  fail_unless (vde_connect_engines_unqueued(f_ctx, f_engine, NULL, f_ctrl,
+                                            NULL) == 0,
+               "cannot connect client: %s", strerror(errno));
+
+  f_nreplies = 0;
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  for (i = 0; i < f_nreplies; i++) {
+    vde_sobj_put(f_replies[i]);
+  }
+  // the ctrl engine closes its connections
+  vde_context_component_del(f_ctx, f_ctrl);
+  vde_context_component_del(f_ctx, f_engine);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static vde_pkt *data_pkt(const char *data, size_t len)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(len, 0, 0);
+  pkt->hdr->pkt_len = len;
+  memcpy(pkt->payload, data, len);
+  return pkt;
+}
+
+/*
+ * Send data in packets of at most chunk bytes, each one written on its own.
+ * The ctrl engine replies before the write returns.
+ */
+static void send_data(const char *data, size_t len, size_t chunk)
+{
+  vde_pkt *pkt;
+  size_t sz;
+
+  while (len > 0) {
+    sz = len < chunk ? len : chunk;
+    pkt = data_pkt(data, sz);
+    fail_unless (vde_connection_write(f_client.conn, pkt) == 0,
+                 "write failed: %s", strerror(errno));
+    vde_pkt_put(pkt);
+    data += sz;
+    len -= sz;
+  }
+}
+
+/*
+ * Parse the replies received so far
+ */
+static void parse_replies(void)
+{
+  size_t off = 0, len;
+
+  while (off < f_client.rx_len) {
+    len = strnlen(f_client.rx + off, f_client.rx_len - off);
+    fail_unless (off + len < f_client.rx_len, "reply not terminated");
+    fail_unless (f_nreplies < MAX_REPLIES, "too many replies");
+    f_replies[f_nreplies] = vde_sobj_from_string(f_client.rx + off);
+    fail_unless (f_replies[f_nreplies] != NULL, "cannot parse reply %s",
+                 f_client.rx + off);
+    f_nreplies++;
+    off += len + 1;
+  }
+  f_client.rx_len = 0;
+}
+
+/*
+ * The id of a reply, -1 if it is null
+ */
+static int reply_id(vde_sobj *reply)
+{
+  vde_sobj *id = vde_sobj_hash_lookup(reply, "id");
+
+  return id != NULL ? vde_sobj_get_int(id) : -1;
+}
+
+/*
+ * The error message of a reply, NULL if it has no error
+ */
+static const char *reply_error(vde_sobj *reply)
+{
+  vde_sobj *error = vde_sobj_hash_lookup(reply, "error");
+
+  if (error == NULL) {
+    return NULL;
+  }
+  return vde_sobj_get_string(vde_sobj_hash_lookup(error, "message"));
+}
+
+#define ECHO_REQ(id, arg) "{ \"id\": " #id ", \"method\": \"client.echo\", " \
+  "\"params\": [ \"" arg "\" ] }"
+
+V_START_TEST (test_split_request)
+{
+  const char req[] = ECHO_REQ(1, "split");
+  vde_sobj *result;
+
+  // the separator is in a packet of its own
+  send_data(req, sizeof(req) - 1, 7);
+  fail_unless (f_client.pkts == 0, "reply before the separator");
+  send_data("", 1, 1);
+  parse_replies();
+
+  fail_unless (f_nreplies == 1 && f_client.pkts == 1, "%d replies",
+               f_nreplies);
+  fail_unless (reply_id(f_replies[0]) == 1 && !reply_error(f_replies[0]),
+               "wrong reply");
+  result = vde_sobj_hash_lookup(f_replies[0], "result");
+  fail_unless (!strcmp(vde_sobj_get_string(vde_sobj_array_get_idx(result, 0)),
+                       "split"), "wrong result");
+}
+END_TEST
+
+V_START_TEST (test_large_request)
+{
+  char *req;
+  size_t len, arg_len = 20000;
+  vde_sobj *result;
+
+  // larger than the old 8 KB limit and than a packet
+  len = strlen(ECHO_REQ(1, "")) + arg_len;
+  req = malloc(len + 1);
+  snprintf(req, len + 1, "{ \"id\": 1, \"method\": \"client.echo\", "
+           "\"params\": [ \"%0*d\" ] }", (int)arg_len, 0);
+  send_data(req, len + 1, 1500);
+  parse_replies();
+
+  fail_unless (f_nreplies == 1 && reply_id(f_replies[0]) == 1 &&
+               !reply_error(f_replies[0]), "wrong reply");
+  result = vde_sobj_hash_lookup(f_replies[0], "result");
+  fail_unless (strlen(vde_sobj_get_string(vde_sobj_array_get_idx(result, 0)))
+               == arg_len, "wrong result");
+  free(req);
+}
+END_TEST
+
+V_START_TEST (test_many_requests)
+{
+  const char req[] = ECHO_REQ(1, "a") "\0" ECHO_REQ(2, "b") "\0"
+    "{ \"id\": 3, \"method\": \"client.fail\", \"params\": [ ] }";
+
+  // the separator of the last one is in the next packet
+  send_data(req, sizeof(req) - 1, sizeof(req) - 1);
+  parse_replies();
+  fail_unless (f_nreplies == 2, "%d replies", f_nreplies);
+  send_data("", 1, 1);
+  parse_replies();
+
+  fail_unless (f_nreplies == 3, "%d replies", f_nreplies);
+  fail_unless (reply_id(f_replies[0]) == 1 && !reply_error(f_replies[0]),
+               "wrong first reply");
+  fail_unless (reply_id(f_replies[1]) == 2 && !reply_error(f_replies[1]),
+               "wrong second reply");
+  fail_unless (reply_id(f_replies[2]) == 3 &&
+               !strcmp(reply_error(f_replies[2]), "failed"),
+               "wrong third reply");
+}
+END_TEST
+
+V_START_TEST (test_bad_request)
+{
+  const char req[] = "{ \"id\": ] this is skipped \0" ECHO_REQ(2, "ok") "\0";
+
+  // the request is skipped up to its separator, even in later packets
+  send_data(req, 10, 10);
+  send_data(req + 10, sizeof(req) - 1 - 10, 8);
+  parse_replies();
+
+  fail_unless (f_nreplies == 2, "%d replies", f_nreplies);
+  fail_unless (reply_id(f_replies[0]) == -1 &&
+               !strcmp(reply_error(f_replies[0]),
+                       "Cannot deserialize command"), "wrong error reply");
+  fail_unless (reply_id(f_replies[1]) == 2 && !reply_error(f_replies[1]),
+               "not recovered after the error");
+}
+END_TEST
+
+V_START_TEST (test_batch)
+{
+  const char req[] = "[ " ECHO_REQ(1, "a") ", "
+    "{ \"id\": 2, \"method\": \"client.echo\" }, "
+    "{ \"id\": 3, \"method\": \"none.echo\", \"params\": [ ] }, "
+    ECHO_REQ(4, "d") ", "
+    "{ \"id\": 5, \"method\": \"client.fail\", \"params\": [ ] } ]";
+  vde_sobj *replies, *result;
+
+  send_data(req, sizeof(req), sizeof(req));
+  parse_replies();
+
+  // a single reply holding the replies to the calls, in order
+  fail_unless (f_nreplies == 1 && f_client.pkts == 1, "%d replies",
+               f_nreplies);
+  replies = f_replies[0];
+  fail_unless (vde_sobj_is_type(replies, vde_sobj_type_array) &&
+               vde_sobj_array_length(replies) == 5, "wrong batch reply");
+  fail_unless (reply_id(vde_sobj_array_get_idx(replies, 0)) == 1 &&
+               !reply_error(vde_sobj_array_get_idx(replies, 0)),
+               "wrong first reply");
+  fail_unless (reply_id(vde_sobj_array_get_idx(replies, 1)) == -1 &&
+               !strcmp(reply_error(vde_sobj_array_get_idx(replies, 1)),
+                       "Invalid method call received"),
+               "invalid call not rejected");
+  fail_unless (reply_id(vde_sobj_array_get_idx(replies, 2)) == 3 &&
+               !strcmp(reply_error(vde_sobj_array_get_idx(replies, 2)),
+                       "Component not found"), "unknown method not rejected");
+  fail_unless (reply_id(vde_sobj_array_get_idx(replies, 3)) == 4 &&
+               !reply_error(vde_sobj_array_get_idx(replies, 3)),
+               "call after the errors not run");
+  result = vde_sobj_hash_lookup(vde_sobj_array_get_idx(replies, 3), "result");
+  fail_unless (!strcmp(vde_sobj_get_string(vde_sobj_array_get_idx(result, 0)),
+                       "d"), "wrong result");
+  fail_unless (reply_id(vde_sobj_array_get_idx(replies, 4)) == 5 &&
+               !strcmp(reply_error(vde_sobj_array_get_idx(replies, 4)),
+                       "failed"), "failure not reported");
+
+  // an empty batch is an error
+  send_data("[ ]", 4, 4);
+  parse_replies();
+  fail_unless (f_nreplies == 2 && reply_id(f_replies[1]) == -1 &&
+               !strcmp(reply_error(f_replies[1]), "Empty batch received"),
+               "empty batch not rejected");
+}
+END_TEST
+
+V_START_TEST (test_pipelined)
+{
+  const char *reqs[] = {
+    ECHO_REQ(1, "a"), ECHO_REQ(2, "b"), ECHO_REQ(3, "c")
+  };
+  vde_pkt_batch batch;
+  int i;
+
+  // requests read together are answered in a single packet
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < 3; i++) {
+    vde_pkt_batch_add(&batch, data_pkt(reqs[i], strlen(reqs[i]) + 1));
+  }
+  fail_unless (vde_connection_write_batch(f_client.conn, &batch) == 3,
+               "batch write failed: %s", strerror(errno));
+  for (i = 0; i < batch.len; i++) {
+    vde_pkt_put(batch.pkts[i]);
+  }
+  parse_replies();
+
+  fail_unless (f_client.pkts == 1, "replies in %d packets", f_client.pkts);
+  fail_unless (f_nreplies == 3, "%d replies", f_nreplies);
+  for (i = 0; i < 3; i++) {
+    fail_unless (reply_id(f_replies[i]) == i + 1 &&
+                 !reply_error(f_replies[i]), "wrong reply %d", i);
+  }
+}
+END_TEST
+
+Suite *
+ctrl_suite (void)
+{
+  Suite *s = suite_create ("ctrl");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_split_request);
+  tcase_add_test (tc_core, test_large_request);
+  tcase_add_test (tc_core, test_many_requests);
+  tcase_add_test (tc_core, test_bad_request);
+  tcase_add_test (tc_core, test_batch);
+  tcase_add_test (tc_core, test_pipelined);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = ctrl_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// fixture components, always present
+int f_pipe[2];
+
+void
+setup (void)
+{
+  vde_epoll_init(0);
+  pipe(f_pipe);
+}
+
+void
+teardown (void)
+{
+  close(f_pipe[0]);
+  close(f_pipe[1]);
+  vde_epoll_fini();
+}
+
+struct counter {
+  int calls;
+  short events;
+  int limit;
+  void *ev;
+};
+
+static void count_cb(int fd, short events, void *arg)
+{
+  struct counter *c = (struct counter *)arg;
+
+  c->calls++;
+  c->events = events;
+  if (c->calls == c->limit) {
+    epoll_eh.event_del(c->ev);
+    vde_epoll_loopexit();
+  }
+}
+
+V_START_TEST (test_epoll_init_twice)
+{
+  fail_unless (vde_epoll_init(0) == -1 && errno == EEXIST,
+               "second init in the same thread succeeded");
+}
+END_TEST
+
+V_START_TEST (test_epoll_read_event)
+{
+  struct counter c = { 0, 0, 3, NULL };
+  char b = 'x';
+
+  c.ev = epoll_eh.event_add(f_pipe[0], VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                            &count_cb, &c);
+  fail_unless (c.ev != NULL, "could not add event");
+
+  // level-triggered: called until the callback deletes the event
+  write(f_pipe[1], &b, 1);
+  vde_epoll_dispatch();
+  fail_unless (c.calls == 3, "callback called %d times", c.calls);
+  fail_unless (c.events == VDE_EV_READ, "wrong events %d", c.events);
+}
+END_TEST
+
+V_START_TEST (test_epoll_same_fd)
+{
+  struct counter rd = { 0, 0, 1, NULL }, wr = { 0, 0, 1, NULL };
+
+  // two events on the same fd share a single registration
+  rd.ev = epoll_eh.event_add(f_pipe[1], VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                             &count_cb, &rd);
+  wr.ev = epoll_eh.event_add(f_pipe[1], VDE_EV_WRITE|VDE_EV_PERSIST, NULL,
+                             &count_cb, &wr);
+  vde_epoll_dispatch();
+  fail_unless (wr.calls == 1 && wr.events == VDE_EV_WRITE,
+               "write event not called");
+  fail_unless (rd.calls == 0, "read event called on write end");
+  epoll_eh.event_del(rd.ev);
+}
+END_TEST
+
+V_START_TEST (test_epoll_timeout)
+{
+  struct counter once = { 0, 0, 0, NULL }, rec = { 0, 0, 3, NULL };
+  struct timeval tv = { 0, 1000 };
+
+  once.ev = epoll_eh.timeout_add(&tv, 0, &count_cb, &once);
+  rec.ev = epoll_eh.timeout_add(&tv, VDE_EV_PERSIST, &count_cb, &rec);
+
+  vde_epoll_dispatch();
+  fail_unless (once.calls == 1 && once.events == VDE_EV_TIMEOUT,
+               "one-shot timeout called %d times", once.calls);
+  fail_unless (rec.calls == 3, "persistent timeout called %d times",
+               rec.calls);
+  epoll_eh.timeout_del(once.ev);
+}
+END_TEST
+
+Suite *
+epoll_suite (void)
+{
+  Suite *s = suite_create ("epoll");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_epoll_init_twice);
+  tcase_add_test (tc_core, test_epoll_read_event);
+  tcase_add_test (tc_core, test_epoll_same_fd);
+  tcase_add_test (tc_core, test_epoll_timeout);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = epoll_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
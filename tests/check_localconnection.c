@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/localconnection.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define NPKTS 100
+
+/*
+ * A probe engine with a single connection: it counts the packets received and
+ * records the first byte of each one, the one served by a worker echoes them
+ * back. It can stop the loop, refuse packets or close its connection when it
+ * has received a given number of packets.
+ */
+struct probe {
+  int refuse;
+  int echo;
+  int stop_rx;
+  int refuse_rx;
+  int close_rx;
+  vde_connection *conn;
+  int worker;
+  int rx;
+  int writes;
+  int delays;
+  int closed;
+  unsigned char order[NPKTS];
+};
+
+static int probe_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  p->worker = vde_worker_current();
+  __sync_add_and_fetch(&p->rx, 1);
+  if (p->rx <= NPKTS) {
+    p->order[p->rx - 1] = ((unsigned char *)pkt->payload)[0];
+  }
+  if (p->rx == p->stop_rx || (!p->echo && p->rx == NPKTS)) {
+    vde_epoll_loopexit();
+  }
+  if (p->rx == p->close_rx) {
+    p->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  if (p->rx <= p->refuse_rx) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (p->echo) {
+    vde_connection_write(conn, pkt);
+  }
+  return 0;
+}
+
+static int probe_writecb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  p->writes++;
+  return 0;
+}
+
+static int probe_errorcb(vde_connection *conn, vde_pkt *pkt,
+                         vde_conn_error err, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  if (err == CONN_READ_CLOSED) {
+    p->conn = NULL;
+    __sync_add_and_fetch(&p->closed, 1);
+    if (vde_worker_current() < 0) {
+      vde_epoll_loopexit();
+    }
+    errno = EPIPE;
+    return -1;
+  }
+  if (err == CONN_WRITE_DELAY) {
+    p->delays++;
+  }
+  return 0;
+}
+
+static int probe_new_conn(vde_component *component, vde_connection *conn,
+                          vde_request *req)
+{
+  struct probe *p = (struct probe *)vde_component_get_priv(component);
+
+  if (p->refuse) {
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  p->conn = conn;
+  vde_connection_set_callbacks(conn, &probe_readcb, &probe_writecb,
+                               &probe_errorcb, p);
+  return 0;
+}
+
+static int probe_init(vde_component *component, vde_sobj *params)
+{
+  return 0;
+}
+
+static void probe_fini(vde_component *component)
+{
+}
+
+static component_ops probe_cops = {
+  .init = probe_init,
+  .fini = probe_fini,
+};
+
+static vde_module probe_module = {
+  .kind = VDE_ENGINE,
+  .family = "probe",
+  .cops = &probe_cops,
+  .eng_new_conn = probe_new_conn,
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_engines[2];
+struct probe f_probes[2];
+
+void
+setup (void)
+{
+  int i;
+
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+  fail_unless (vde_context_set_workers(f_ctx, 1) == 0,
+               "cannot start workers");
+  for (i = 0; i < 2; i++) {
+    memset(&f_probes[i], 0, sizeof(struct probe));
+    vde_component_new(&f_engines[i]);
+    vde_component_init(f_engines[i], vde_quark_from_string("probe"),
+                       &probe_module, f_ctx, NULL);
+    vde_component_set_priv(f_engines[i], &f_probes[i]);
+  }
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  vde_context_set_workers(f_ctx, 0);
+  for (i = 0; i < 2; i++) {
+    vde_component_fini(f_engines[i]);
+    vde_component_delete(f_engines[i]);
+  }
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+/*
+ * Run the loop of the context thread until a callback stops it, or a second
+ */
+static void dispatch(void)
+{
+  struct timeval tv = { 1, 0 };
+  void *timeout;
+
+  timeout = vde_context_timeout_add(f_ctx, VDE_EV_TIMEOUT, &tv, &stop_cb,
+                                    NULL);
+  vde_epoll_dispatch();
+  vde_context_timeout_del(f_ctx, timeout);
+}
+
+/*
+ * Write n packets on conn, the first byte of each one is its sequence number
+ */
+static void write_seq(vde_connection *conn, int n)
+{
+  int i;
+  vde_pkt *pkt;
+
+  for (i = 0; i < n; i++) {
+    pkt = vde_pkt_new(64, 0, 0);
+    pkt->hdr->pkt_len = 64;
+    memset(pkt->payload, i, 64);
+    fail_unless (vde_connection_write(conn, pkt) == 0, "write failed: %s",
+                 strerror(errno));
+    vde_pkt_put(pkt);
+  }
+}
+
+/*
+ * Wait for a counter written by a worker, up to a second
+ */
+static int wait_for(int *counter)
+{
+  int i;
+
+  for (i = 0; i < 1000 && !__sync_fetch_and_add(counter, 0); i++) {
+    usleep(1000);
+  }
+  return *counter;
+}
+
+V_START_TEST (test_threaded_traffic)
+{
+  int i;
+  vde_pkt *pkt;
+
+  f_probes[1].echo = 1;
+  fail_unless (vde_connect_engines_threaded(f_ctx, f_engines[0], NULL, -1,
+                                            f_engines[1], NULL, 0, 0) == 0,
+               "cannot connect engines: %s", strerror(errno));
+  fail_unless (f_probes[0].conn != NULL && f_probes[1].conn != NULL,
+               "engines have no connection");
+
+  for (i = 0; i < NPKTS; i++) {
+    pkt = vde_pkt_new(64, 0, 0);
+    pkt->hdr->pkt_len = 64;
+    memset(pkt->payload, i, 64);
+    fail_unless (vde_connection_write(f_probes[0].conn, pkt) == 0,
+                 "write failed: %s", strerror(errno));
+    vde_pkt_put(pkt);
+  }
+  dispatch();
+  fail_unless (f_probes[1].rx == NPKTS, "worker received %d packets",
+               f_probes[1].rx);
+  fail_unless (f_probes[0].rx == NPKTS, "echo of %d packets received",
+               f_probes[0].rx);
+  fail_unless (f_probes[1].worker == 0 && f_probes[0].worker == -1,
+               "packets delivered by the wrong threads");
+
+  // the worker side is told that its peer has gone
+  vde_connection_fini(f_probes[0].conn);
+  vde_connection_delete(f_probes[0].conn);
+  fail_unless (wait_for(&f_probes[1].closed) == 1, "peer close not notified");
+}
+END_TEST
+
+V_START_TEST (test_threaded_refused)
+{
+  // refused by the engine in the worker, the first one is told by the loop
+  f_probes[1].refuse = 1;
+  fail_unless (vde_connect_engines_threaded(f_ctx, f_engines[0], NULL, -1,
+                                            f_engines[1], NULL, 0, 0) == -1 &&
+               errno == ECONNREFUSED, "refused connection succeeded");
+  dispatch();
+  fail_unless (f_probes[0].closed == 1, "first engine not notified");
+}
+END_TEST
+
+V_START_TEST (test_threaded_refused_first)
+{
+  // refused by the engine in the context thread, the second is never attached
+  f_probes[0].refuse = 1;
+  fail_unless (vde_connect_engines_threaded(f_ctx, f_engines[0], NULL, -1,
+                                            f_engines[1], NULL, 0, 0) == -1 &&
+               errno == ECONNREFUSED, "refused connection succeeded");
+  fail_unless (f_probes[1].conn == NULL, "second engine attached");
+}
+END_TEST
+
+V_START_TEST (test_queue_stats)
+{
+  int i, sent = 0;
+  vde_pkt *pkt;
+  vde_conn_queue_stats stats;
+
+  fail_unless (vde_connect_engines_queued(f_ctx, f_engines[0], NULL,
+                                          f_engines[1], NULL, 4, 0) == 0,
+               "cannot connect engines: %s", strerror(errno));
+
+  // nothing is delivered until the loop runs, the queue fills up
+  pkt = vde_pkt_new(64, 0, 0);
+  pkt->hdr->pkt_len = 64;
+  for (i = 0; i < 6; i++) {
+    sent += vde_connection_write(f_probes[0].conn, pkt) == 0;
+  }
+  vde_pkt_put(pkt);
+  fail_unless (sent == 4, "%d packets queued", sent);
+  fail_unless (vde_connection_get_queue_stats(f_probes[0].conn, &stats) == 0,
+               "no queue counters");
+  fail_unless (stats.length == 4 && stats.peak == 4 && stats.drops == 2,
+               "wrong counters: length %u peak %u drops %lu", stats.length,
+               stats.peak, stats.drops);
+
+  vde_connection_fini(f_probes[0].conn);
+  vde_connection_delete(f_probes[0].conn);
+}
+END_TEST
+
+V_START_TEST (test_queued_traffic)
+{
+  int i;
+  vde_conn_queue_stats stats;
+
+  fail_unless (vde_connect_engines_queued(f_ctx, f_engines[0], NULL,
+                                          f_engines[1], NULL, 0, 8) == 0,
+               "cannot connect engines: %s", strerror(errno));
+  write_seq(f_probes[0].conn, NPKTS);
+  fail_unless (f_probes[1].rx == 0, "packets delivered by the write");
+
+  // the loop stops after the first drain, which delivers a budget of packets
+  f_probes[1].stop_rx = 1;
+  dispatch();
+  fail_unless (f_probes[1].rx == 8, "first drain delivered %d packets",
+               f_probes[1].rx);
+  fail_unless (f_probes[0].writes == 8, "%d write callbacks",
+               f_probes[0].writes);
+  vde_connection_get_queue_stats(f_probes[0].conn, &stats);
+  fail_unless (stats.length == NPKTS - 8, "%u packets left in the queue",
+               stats.length);
+
+  // the rest is delivered by the drains rescheduled
+  f_probes[1].stop_rx = 0;
+  dispatch();
+  fail_unless (f_probes[1].rx == NPKTS, "%d packets delivered",
+               f_probes[1].rx);
+  fail_unless (f_probes[0].writes == NPKTS && f_probes[0].delays == 0,
+               "%d write callbacks, %d delays", f_probes[0].writes,
+               f_probes[0].delays);
+  for (i = 0; i < NPKTS; i++) {
+    fail_unless (f_probes[1].order[i] == i, "packet %d out of order", i);
+  }
+
+  vde_connection_fini(f_probes[0].conn);
+  vde_connection_delete(f_probes[0].conn);
+  fail_unless (f_probes[1].closed == 1, "peer close not notified");
+}
+END_TEST
+
+V_START_TEST (test_queued_delay)
+{
+  fail_unless (vde_connect_engines_queued(f_ctx, f_engines[0], NULL,
+                                          f_engines[1], NULL, 0, 0) == 0,
+               "cannot connect engines: %s", strerror(errno));
+
+  // refused packets are reported to the writer instead of written
+  f_probes[1].refuse_rx = 4;
+  f_probes[1].stop_rx = 4;
+  write_seq(f_probes[0].conn, 4);
+  dispatch();
+  fail_unless (f_probes[1].rx == 4, "%d packets delivered", f_probes[1].rx);
+  fail_unless (f_probes[0].delays == 4 && f_probes[0].writes == 0,
+               "%d delays, %d write callbacks", f_probes[0].delays,
+               f_probes[0].writes);
+
+  // the connection still works afterwards
+  f_probes[1].stop_rx = 6;
+  write_seq(f_probes[0].conn, 2);
+  dispatch();
+  fail_unless (f_probes[1].rx == 6, "%d packets delivered", f_probes[1].rx);
+  fail_unless (f_probes[0].delays == 4 && f_probes[0].writes == 2,
+               "%d delays, %d write callbacks", f_probes[0].delays,
+               f_probes[0].writes);
+
+  vde_connection_fini(f_probes[0].conn);
+  vde_connection_delete(f_probes[0].conn);
+}
+END_TEST
+
+V_START_TEST (test_queued_close)
+{
+  fail_unless (vde_connect_engines_queued(f_ctx, f_engines[0], NULL,
+                                          f_engines[1], NULL, 0, 8) == 0,
+               "cannot connect engines: %s", strerror(errno));
+
+  // the reader closes in the middle of a drain, the writer is told and the
+  // packets still queued are dropped
+  f_probes[1].close_rx = 3;
+  write_seq(f_probes[0].conn, 20);
+  dispatch();
+  fail_unless (f_probes[1].rx == 3 && f_probes[1].conn == NULL,
+               "%d packets delivered", f_probes[1].rx);
+  fail_unless (f_probes[0].closed == 1 && f_probes[0].conn == NULL,
+               "writer not notified");
+  fail_unless (f_probes[0].writes == 0, "%d write callbacks",
+               f_probes[0].writes);
+}
+END_TEST
+
+Suite *
+localconnection_suite (void)
+{
+  Suite *s = suite_create ("localconnection");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_threaded_traffic);
+  tcase_add_test (tc_core, test_threaded_refused);
+  tcase_add_test (tc_core, test_threaded_refused_first);
+  tcase_add_test (tc_core, test_queue_stats);
+  tcase_add_test (tc_core, test_queued_traffic);
+  tcase_add_test (tc_core, test_queued_delay);
+  tcase_add_test (tc_core, test_queued_close);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = localconnection_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define PAYLOAD_SZ 64
+
+static int released;
+
+static void count_release(vde_pkt *pkt, void *arg)
+{
+  released++;
+  vde_pkt_free(pkt, arg);
+}
+
+V_START_TEST (test_pkt_init_not_shared)
+{
+  char buf[sizeof(vde_pkt) + sizeof(vde_hdr) + PAYLOAD_SZ];
+  vde_pkt *pkt = (vde_pkt *)buf;
+
+  vde_pkt_init(pkt, sizeof(vde_hdr) + PAYLOAD_SZ, 0, 0);
+  fail_unless (!vde_pkt_is_shared(pkt), "initialized packet is shared");
+  fail_unless (vde_pkt_make_writable(pkt) == pkt,
+               "private packet copied on write");
+}
+END_TEST
+
+V_START_TEST (test_pkt_refcount)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(PAYLOAD_SZ, 0, 0);
+  fail_unless (pkt != NULL, "could not alloc packet");
+  fail_unless (vde_pkt_is_shared(pkt), "new packet is not shared");
+  vde_pkt_set_release(pkt, count_release, NULL);
+
+  released = 0;
+  fail_unless (vde_pkt_get(pkt) == pkt, "get returned another packet");
+  vde_pkt_put(pkt);
+  fail_unless (released == 0, "packet released while referenced");
+  vde_pkt_put(pkt);
+  fail_unless (released == 1, "packet not released on last put");
+}
+END_TEST
+
+V_START_TEST (test_pkt_make_writable)
+{
+  vde_pkt *pkt, *w;
+
+  pkt = vde_pkt_new(PAYLOAD_SZ, 0, 0);
+  fail_unless (pkt != NULL, "could not alloc packet");
+  pkt->hdr->pkt_len = PAYLOAD_SZ;
+  memset(pkt->payload, 0xaa, PAYLOAD_SZ);
+
+  fail_unless (vde_pkt_make_writable(pkt) == pkt,
+               "unreferenced packet copied on write");
+
+  vde_pkt_get(pkt);
+  w = vde_pkt_make_writable(pkt);
+  fail_unless (w != NULL && w != pkt, "referenced packet not copied on write");
+  fail_unless (w->refcount == 1, "copy is referenced");
+  fail_unless (w->hdr->pkt_len == PAYLOAD_SZ &&
+               !memcmp(w->payload, pkt->payload, PAYLOAD_SZ),
+               "copy content differs");
+
+  vde_pkt_put(w);
+  vde_pkt_put(pkt);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_csum_complete)
+{
+  vde_pkt *pkt, *w;
+  uint8_t *l4;
+  uint32_t sum = 0;
+  unsigned int i;
+
+  pkt = vde_pkt_new(PAYLOAD_SZ, 0, 0);
+  fail_unless (pkt != NULL, "could not alloc packet");
+  pkt->hdr->pkt_len = PAYLOAD_SZ - 1;
+  for (i = 0; i < PAYLOAD_SZ; i++) {
+    pkt->payload[i] = i * 7;
+  }
+  pkt->offload.flags = VDE_PKT_CSUM_PARTIAL;
+  pkt->offload.csum_start = 14;
+  pkt->offload.csum_offset = 6;
+  // no pseudo header to seed the checksum with
+  pkt->payload[20] = pkt->payload[21] = 0;
+
+  // metadata follows copies
+  vde_pkt_get(pkt);
+  w = vde_pkt_make_writable(pkt);
+  fail_unless (w != NULL && w != pkt, "referenced packet not copied on write");
+  fail_unless (!memcmp(&w->offload, &pkt->offload, sizeof(vde_pkt_offload)),
+               "copy offload differs");
+
+  fail_unless (vde_pkt_csum_complete(&w->offload, w->payload,
+                                     w->hdr->pkt_len) == 0,
+               "cannot complete checksum");
+  fail_unless (w->offload.flags == VDE_PKT_CSUM_VALID, "checksum not valid");
+
+  // a correct checksum sums up to all ones
+  l4 = (uint8_t *)w->payload + 14;
+  for (i = 0; i + 1 < w->hdr->pkt_len - 14; i += 2) {
+    sum += (l4[i] << 8) | l4[i + 1];
+  }
+  sum += l4[i] << 8;
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  fail_unless (sum == 0xffff, "wrong checksum");
+
+  pkt->offload.csum_offset = PAYLOAD_SZ;
+  fail_unless (vde_pkt_csum_complete(&pkt->offload, pkt->payload,
+                                     pkt->hdr->pkt_len) == -1 &&
+               errno == EINVAL, "checksum stored out of the frame");
+
+  vde_pkt_put(w);
+  vde_pkt_put(pkt);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+Suite *
+packet_suite (void)
+{
+  Suite *s = suite_create ("packet");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_test (tc_core, test_pkt_init_not_shared);
+  tcase_add_test (tc_core, test_pkt_refcount);
+  tcase_add_test (tc_core, test_pkt_make_writable);
+  tcase_add_test (tc_core, test_pkt_csum_complete);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = packet_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define OBJ_SIZE 100
+#define SLAB_OBJS 8
+#define LOW_WM 8
+#define HIGH_WM 20
+
+// fixture components, always present
+vde_pool *f_pool;
+
+void
+setup (void)
+{
+  f_pool = vde_pool_new(OBJ_SIZE, SLAB_OBJS, LOW_WM, HIGH_WM);
+}
+
+void
+teardown (void)
+{
+  vde_pool_delete(f_pool);
+}
+
+
+V_START_TEST (test_pool_new_invalid)
+{
+  vde_pool *pool;
+
+  pool = vde_pool_new(0, SLAB_OBJS, LOW_WM, HIGH_WM);
+  fail_unless (pool == NULL && errno == EINVAL, "success on zero obj size");
+
+  pool = vde_pool_new(OBJ_SIZE, 0, LOW_WM, HIGH_WM);
+  fail_unless (pool == NULL && errno == EINVAL, "success on zero slab size");
+
+  pool = vde_pool_new(OBJ_SIZE, SLAB_OBJS, HIGH_WM + 1, HIGH_WM);
+  fail_unless (pool == NULL && errno == EINVAL,
+               "success on low watermark above high watermark");
+}
+END_TEST
+
+V_START_TEST (test_pool_low_watermark)
+{
+  vde_pool_stats stats;
+
+  vde_pool_get_stats(f_pool, &stats);
+  fail_unless (stats.objects == LOW_WM, "low watermark not preallocated");
+  fail_unless (stats.in_use == 0, "objects in use after creation");
+}
+END_TEST
+
+V_START_TEST (test_pool_alloc_free)
+{
+  void *obj, *again;
+  vde_pool_stats stats;
+
+  obj = vde_pool_alloc(f_pool);
+  fail_unless (obj != NULL, "could not alloc object");
+  memset(obj, 0xff, OBJ_SIZE);
+
+  vde_pool_get_stats(f_pool, &stats);
+  fail_unless (stats.in_use == 1, "object not accounted as in use");
+
+  vde_pool_free(f_pool, obj);
+  again = vde_pool_alloc(f_pool);
+  fail_unless (again != NULL, "could not alloc object after free");
+  vde_pool_free(f_pool, again);
+
+  vde_pool_get_stats(f_pool, &stats);
+  fail_unless (stats.in_use == 0, "objects still in use after free");
+  fail_unless (stats.allocs == 2 && stats.frees == 2, "wrong counters");
+  fail_unless (stats.peak == 1, "wrong peak value");
+}
+END_TEST
+
+V_START_TEST (test_pool_high_watermark)
+{
+  int i;
+  void *objs[HIGH_WM], *obj;
+  vde_pool_stats stats;
+
+  for (i = 0; i < HIGH_WM; i++) {
+    objs[i] = vde_pool_alloc(f_pool);
+    fail_unless (objs[i] != NULL, "could not alloc object %d", i);
+  }
+
+  obj = vde_pool_alloc(f_pool);
+  fail_unless (obj == NULL && errno == ENOBUFS,
+               "success on alloc over high watermark");
+
+  vde_pool_get_stats(f_pool, &stats);
+  fail_unless (stats.objects == HIGH_WM, "pool grown over high watermark");
+  fail_unless (stats.failures == 1, "failure not accounted");
+
+  for (i = 0; i < HIGH_WM; i++) {
+    vde_pool_free(f_pool, objs[i]);
+  }
+
+  // steady state: no more slabs are needed
+  for (i = 0; i < HIGH_WM; i++) {
+    objs[i] = vde_pool_alloc(f_pool);
+  }
+  for (i = 0; i < HIGH_WM; i++) {
+    vde_pool_free(f_pool, objs[i]);
+  }
+  vde_pool_get_stats(f_pool, &stats);
+  fail_unless (stats.objects == HIGH_WM, "pool grown in steady state");
+  fail_unless (stats.peak == HIGH_WM, "wrong peak value");
+}
+END_TEST
+
+V_START_TEST (test_pool_delete_in_use)
+{
+  void *obj;
+  vde_pool *pool;
+
+  pool = vde_pool_new(OBJ_SIZE, SLAB_OBJS, LOW_WM, HIGH_WM);
+  obj = vde_pool_alloc(pool);
+  fail_unless (obj != NULL, "could not alloc object");
+
+  // the pool must stay around until obj is returned
+  vde_pool_delete(pool);
+  memset(obj, 0xff, OBJ_SIZE);
+  vde_pool_free(pool, obj);
+}
+END_TEST
+
+Suite *
+pool_suite (void)
+{
+  Suite *s = suite_create ("pool");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_pool_new_invalid);
+  tcase_add_test (tc_core, test_pool_low_watermark);
+  tcase_add_test (tc_core, test_pool_alloc_free);
+  tcase_add_test (tc_core, test_pool_high_watermark);
+  tcase_add_test (tc_core, test_pool_delete_in_use);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = pool_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
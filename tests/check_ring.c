@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3/common.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define LIMIT 5
+
+// fixture components, always present
+vde_ring *f_ring;
+
+void
+setup (void)
+{
+  f_ring = vde_ring_new(LIMIT);
+}
+
+void
+teardown (void)
+{
+  vde_ring_delete(f_ring);
+}
+
+
+V_START_TEST (test_ring_new_invalid)
+{
+  vde_ring *ring;
+
+  ring = vde_ring_new(0);
+  fail_unless (ring == NULL && errno == EINVAL, "success on zero limit");
+}
+END_TEST
+
+V_START_TEST (test_ring_fifo)
+{
+  long i;
+
+  fail_unless (vde_ring_is_empty(f_ring), "new ring is not empty");
+  fail_unless (vde_ring_pop(f_ring) == NULL, "pop from empty ring");
+
+  for (i = 1; i <= 3; i++) {
+    fail_unless (vde_ring_push(f_ring, (void *)i) == 0, "push failed");
+  }
+  fail_unless (vde_ring_get_length(f_ring) == 3, "wrong length");
+  fail_unless (vde_ring_peek(f_ring) == (void *)1, "wrong head");
+  fail_unless (vde_ring_peek_nth(f_ring, 2) == (void *)3, "wrong nth");
+  fail_unless (vde_ring_peek_nth(f_ring, 3) == NULL, "peek past the tail");
+
+  for (i = 1; i <= 3; i++) {
+    fail_unless (vde_ring_pop(f_ring) == (void *)i, "wrong order");
+  }
+  fail_unless (vde_ring_is_empty(f_ring), "ring not empty after pops");
+}
+END_TEST
+
+V_START_TEST (test_ring_limit)
+{
+  long i;
+
+  // the limit is not a power of two, slots are more than LIMIT
+  for (i = 1; i <= LIMIT; i++) {
+    fail_unless (vde_ring_push(f_ring, (void *)i) == 0, "push failed");
+  }
+  fail_unless (vde_ring_is_full(f_ring), "ring not full at limit");
+  fail_unless (vde_ring_push(f_ring, (void *)i) == -1 && errno == ENOBUFS,
+               "push over the limit");
+  fail_unless (vde_ring_get_drops(f_ring) == 1, "drop not accounted");
+  fail_unless (vde_ring_get_peak(f_ring) == LIMIT, "wrong peak");
+}
+END_TEST
+
+V_START_TEST (test_ring_check_push)
+{
+  long i;
+
+  for (i = 1; i <= LIMIT; i++) {
+    fail_unless (vde_ring_check_push(f_ring) == 0, "room not found");
+    vde_ring_push(f_ring, (void *)i);
+  }
+  // producers checking before a push count their drops too
+  fail_unless (vde_ring_check_push(f_ring) == -1 && errno == ENOBUFS,
+               "room found in a full ring");
+  fail_unless (vde_ring_get_drops(f_ring) == 1, "drop not accounted");
+  fail_unless (vde_ring_is_full(f_ring) && vde_ring_get_drops(f_ring) == 1,
+               "testing for a full ring counted a drop");
+  vde_ring_discard(f_ring, 1);
+  fail_unless (vde_ring_check_push(f_ring) == 0, "room not found");
+}
+END_TEST
+
+V_START_TEST (test_ring_wrap)
+{
+  long i, j;
+
+  // go around the slots several times
+  for (i = 0; i < 10 * LIMIT; i++) {
+    fail_unless (vde_ring_push(f_ring, (void *)(i + 1)) == 0, "push failed");
+    if (vde_ring_is_full(f_ring)) {
+      vde_ring_discard(f_ring, 2);
+    }
+  }
+  j = vde_ring_get_length(f_ring);
+  for (; j > 0; j--) {
+    fail_unless (vde_ring_pop(f_ring) == (void *)(i - j + 1), "wrong order");
+  }
+}
+END_TEST
+
+Suite *
+ring_suite (void)
+{
+  Suite *s = suite_create ("ring");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_ring_new_invalid);
+  tcase_add_test (tc_core, test_ring_fifo);
+  tcase_add_test (tc_core, test_ring_limit);
+  tcase_add_test (tc_core, test_ring_check_push);
+  tcase_add_test (tc_core, test_ring_wrap);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = ring_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the module is linked in the test, see Makefile.am
+extern vde_module VDE_MODULE_START;
+
+#define NPKTS 1000
+#define PKT_LEN 60
+
+/*
+ * One end of a shm connection: it counts the packets received and checks
+ * that they carry the pattern written by the other end.
+ */
+struct end {
+  vde_connection *conn;
+  int rx;
+  int bad;
+  int closed;
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_srv, *f_cli;
+struct end f_ends[2]; // server, client
+int f_wait, f_error;
+char f_path[64];
+
+static int end_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct end *e = (struct end *)arg;
+
+  if (pkt->hdr->pkt_len != PKT_LEN ||
+      pkt->payload[0] != (char)e->rx || pkt->payload[PKT_LEN - 1] != 'x') {
+    e->bad++;
+  }
+  e->rx++;
+  if (e->rx == f_wait) {
+    vde_epoll_loopexit();
+  }
+  return 0;
+}
+
+static int end_errorcb(vde_connection *conn, vde_pkt *pkt,
+                       vde_conn_error err, void *arg)
+{
+  struct end *e = (struct end *)arg;
+
+  if (err == CONN_READ_CLOSED) {
+    e->conn = NULL;
+    e->closed = 1;
+    vde_epoll_loopexit();
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static void accept_cb(vde_connection *conn, void *arg)
+{
+  f_ends[0].conn = conn;
+  vde_connection_set_callbacks(conn, &end_readcb, NULL, &end_errorcb,
+                               &f_ends[0]);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+}
+
+static void connect_cb(vde_connection *conn, void *arg)
+{
+  f_ends[1].conn = conn;
+  vde_connection_set_callbacks(conn, &end_readcb, NULL, &end_errorcb,
+                               &f_ends[1]);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+  vde_epoll_loopexit();
+}
+
+static void error_cb(vde_connection *conn, int err, void *arg)
+{
+  f_error = err;
+  vde_epoll_loopexit();
+}
+
+void
+setup (void)
+{
+  vde_sobj *params;
+
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+
+  memset(f_ends, 0, sizeof(f_ends));
+  f_wait = f_error = 0;
+  snprintf(f_path, sizeof(f_path), "/tmp/check_shm.%d", getpid());
+  params = vde_sobj_new_hash();
+  vde_sobj_hash_insert(params, "path", vde_sobj_new_string(f_path));
+  vde_sobj_hash_insert(params, "slots", vde_sobj_new_int(64));
+
+  vde_component_new(&f_srv);
+  fail_unless (vde_component_init(f_srv, vde_quark_from_string("srv"),
+                                  &VDE_MODULE_START, f_ctx, params) == 0,
+               "cannot init server");
+  vde_component_new(&f_cli);
+  fail_unless (vde_component_init(f_cli, vde_quark_from_string("cli"),
+                                  &VDE_MODULE_START, f_ctx, params) == 0,
+               "cannot init client");
+  vde_sobj_put(params);
+  vde_transport_set_cm_callbacks(f_srv, &connect_cb, &accept_cb, &error_cb,
+                                 NULL);
+  vde_transport_set_cm_callbacks(f_cli, &connect_cb, &accept_cb, &error_cb,
+                                 NULL);
+  fail_unless (vde_transport_listen(f_srv) == 0, "cannot listen: %s",
+               strerror(errno));
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (f_ends[i].conn != NULL) {
+      vde_connection_fini(f_ends[i].conn);
+      vde_connection_delete(f_ends[i].conn);
+    }
+  }
+  vde_component_fini(f_cli);
+  vde_component_delete(f_cli);
+  vde_component_fini(f_srv);
+  vde_component_delete(f_srv);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+/*
+ * Run the loop until a callback stops it, or a second
+ */
+static void dispatch(void)
+{
+  struct timeval tv = { 1, 0 };
+  void *timeout;
+
+  timeout = vde_context_timeout_add(f_ctx, VDE_EV_TIMEOUT, &tv, &stop_cb,
+                                    NULL);
+  vde_epoll_dispatch();
+  vde_context_timeout_del(f_ctx, timeout);
+}
+
+static void connect_ends(void)
+{
+  vde_connection *conn;
+
+  vde_connection_new(&conn);
+  fail_unless (vde_transport_connect(f_cli, conn) == 0, "cannot connect: %s",
+               strerror(errno));
+  dispatch();
+  fail_unless (f_error == 0, "negotiation failed: %s", strerror(f_error));
+  fail_unless (f_ends[0].conn != NULL && f_ends[1].conn != NULL,
+               "negotiation did not complete");
+}
+
+/*
+ * Write NPKTS packets numbered by their first byte, a full ring makes the
+ * loop run until the reader drains it
+ */
+static void send_pkts(vde_connection *conn, struct end *reader)
+{
+  int i;
+  vde_pkt *pkt;
+
+  f_wait = NPKTS;
+  for (i = 0; i < NPKTS; ) {
+    pkt = vde_pkt_new(PKT_LEN, 0, 0);
+    pkt->hdr->pkt_len = PKT_LEN;
+    memset(pkt->payload, 'x', PKT_LEN);
+    pkt->payload[0] = (char)i;
+    if (vde_connection_write(conn, pkt) == 0) {
+      i++;
+    } else {
+      fail_unless (errno == EAGAIN, "write failed: %s", strerror(errno));
+      f_wait = reader->rx + 1;
+      dispatch();
+      f_wait = NPKTS;
+    }
+    vde_pkt_put(pkt);
+  }
+  while (reader->rx < NPKTS && !reader->closed) {
+    dispatch();
+  }
+}
+
+V_START_TEST (test_negotiation)
+{
+  connect_ends();
+}
+END_TEST
+
+V_START_TEST (test_bad_hello)
+{
+  int fd;
+  char buf[16];
+  struct sockaddr_un sa_unix;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa_unix, 0, sizeof(sa_unix));
+  sa_unix.sun_family = AF_UNIX;
+  strncpy(sa_unix.sun_path, f_path, sizeof(sa_unix.sun_path) - 1);
+  fail_unless (connect(fd, (struct sockaddr *)&sa_unix, sizeof(sa_unix)) == 0,
+               "cannot connect: %s", strerror(errno));
+  memset(buf, 0xff, sizeof(buf));
+  fail_unless (write(fd, buf, sizeof(buf)) == sizeof(buf), "cannot write");
+  dispatch();
+  // the server hangs up without passing any descriptor, the bytes it did not
+  // read turn the hang up into a reset
+  fail_unless (read(fd, buf, sizeof(buf)) <= 0, "bad hello not refused");
+  fail_unless (f_ends[0].conn == NULL, "bad hello accepted");
+  close(fd);
+}
+END_TEST
+
+V_START_TEST (test_traffic)
+{
+  connect_ends();
+
+  send_pkts(f_ends[1].conn, &f_ends[0]);
+  fail_unless (f_ends[0].rx == NPKTS, "server received %d packets",
+               f_ends[0].rx);
+  fail_unless (f_ends[0].bad == 0, "server received %d bad packets",
+               f_ends[0].bad);
+
+  send_pkts(f_ends[0].conn, &f_ends[1]);
+  fail_unless (f_ends[1].rx == NPKTS, "client received %d packets",
+               f_ends[1].rx);
+  fail_unless (f_ends[1].bad == 0, "client received %d bad packets",
+               f_ends[1].bad);
+}
+END_TEST
+
+V_START_TEST (test_peer_close)
+{
+  connect_ends();
+
+  vde_connection_fini(f_ends[1].conn);
+  vde_connection_delete(f_ends[1].conn);
+  f_ends[1].conn = NULL;
+  dispatch();
+  fail_unless (f_ends[0].closed == 1, "peer close not notified");
+}
+END_TEST
+
+Suite *
+shm_suite (void)
+{
+  Suite *s = suite_create ("shm");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_negotiation);
+  tcase_add_test (tc_core, test_bad_hello);
+  tcase_add_test (tc_core, test_traffic);
+  tcase_add_test (tc_core, test_peer_close);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = shm_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+V_START_TEST (test_msgpack_roundtrip)
+{
+  const char *in = "{ \"id\": 1, \"method\": \"ctrl.notify_add\", "
+    "\"params\": [ \"hub.port_new\", true, false, null, -1, -33, 128, "
+    "-40000, 70000, 5000000000, -5000000000, 1.5, \"\", [ ], { } ] }";
+  vde_sobj *obj, *out;
+  char *buf, *json;
+  size_t len;
+
+  obj = vde_sobj_from_string(in);
+  fail_unless (obj != NULL, "cannot parse json");
+  fail_unless (vde_sobj_to_msgpack(obj, &buf, &len) == 0,
+               "cannot serialize");
+  fail_unless (vde_sobj_from_msgpack(buf, len, &out) == 0,
+               "cannot deserialize: %s", strerror(errno));
+
+  json = strdup(vde_sobj_to_string(obj));
+  fail_unless (!strcmp(json, vde_sobj_to_string(out)),
+               "roundtrip changed the object: %s", vde_sobj_to_string(out));
+
+  free(json);
+  vde_free(buf);
+  vde_sobj_put(obj);
+  vde_sobj_put(out);
+}
+END_TEST
+
+V_START_TEST (test_msgpack_encoding)
+{
+  // {"a": [1, -1, 255, "xy"]}
+  const char expected[] = "\x81\xa1" "a" "\x94\x01\xff\xcc\xff\xa2" "xy";
+  vde_sobj *obj;
+  char *buf;
+  size_t len;
+
+  obj = vde_sobj_from_string("{\"a\": [1, -1, 255, \"xy\"]}");
+  fail_unless (vde_sobj_to_msgpack(obj, &buf, &len) == 0,
+               "cannot serialize");
+  fail_unless (len == sizeof(expected) - 1 && !memcmp(buf, expected, len),
+               "wrong encoding");
+
+  vde_free(buf);
+  vde_sobj_put(obj);
+}
+END_TEST
+
+V_START_TEST (test_msgpack_large)
+{
+  vde_sobj *obj, *out;
+  char *buf, *str;
+  size_t len;
+  int i;
+
+  // 16 and 32 bit lengths
+  str = malloc(70000);
+  memset(str, 'a', 69999);
+  str[69999] = '\0';
+  obj = vde_sobj_new_array();
+  for (i = 0; i < 70000; i++) {
+    vde_sobj_array_add(obj, vde_sobj_new_int(i));
+  }
+  vde_sobj_array_add(obj, vde_sobj_new_string(str));
+
+  fail_unless (vde_sobj_to_msgpack(obj, &buf, &len) == 0,
+               "cannot serialize");
+  fail_unless (vde_sobj_from_msgpack(buf, len, &out) == 0,
+               "cannot deserialize");
+  fail_unless (vde_sobj_array_length(out) == 70001, "wrong length");
+  fail_unless (vde_sobj_get_int(vde_sobj_array_get_idx(out, 69999)) == 69999,
+               "wrong item");
+  fail_unless (!strcmp(vde_sobj_get_string(vde_sobj_array_get_idx(out, 70000)),
+                       str), "wrong string");
+
+  free(str);
+  vde_free(buf);
+  vde_sobj_put(obj);
+  vde_sobj_put(out);
+}
+END_TEST
+
+V_START_TEST (test_msgpack_invalid)
+{
+  vde_sobj *obj;
+  char deep[64];
+
+  // truncated string
+  fail_unless (vde_sobj_from_msgpack("\xa3" "ab", 3, &obj) == -1 &&
+               errno == EINVAL, "truncated data accepted");
+  // array longer than the data
+  fail_unless (vde_sobj_from_msgpack("\xdd\xff\xff\xff\xff", 5, &obj) == -1,
+               "bogus array length accepted");
+  // key is not a string
+  fail_unless (vde_sobj_from_msgpack("\x81\x01\x02", 3, &obj) == -1,
+               "integer key accepted");
+  // trailing data
+  fail_unless (vde_sobj_from_msgpack("\x01\x02", 2, &obj) == -1,
+               "trailing data accepted");
+  // extension type
+  fail_unless (vde_sobj_from_msgpack("\xd4\x01\x00", 3, &obj) == -1,
+               "extension accepted");
+  // too deep
+  memset(deep, 0x91, sizeof(deep));
+  deep[sizeof(deep) - 1] = 0x01;
+  fail_unless (vde_sobj_from_msgpack(deep, sizeof(deep), &obj) == -1,
+               "too deep nesting accepted");
+}
+END_TEST
+
+V_START_TEST (test_parser_chunks)
+{
+  const char *in = "{ \"id\": 1, \"method\": \"ctrl.notify_add\", "
+    "\"params\": [ \"hub.port_new\" ] }";
+  vde_sobj_parser *parser;
+  vde_sobj *obj = NULL;
+  size_t i, len, used;
+
+  parser = vde_sobj_parser_new();
+  len = strlen(in);
+
+  // a byte at a time, the object is completed by its last byte
+  for (i = 0; i < len - 1; i++) {
+    fail_unless (vde_sobj_parser_feed(parser, in + i, 1, &obj, &used) == 0,
+                 "object completed at byte %d", (int)i);
+    fail_unless (used == 1, "partial data not consumed");
+  }
+  fail_unless (vde_sobj_parser_feed(parser, in + i, 1, &obj, &used) == 1,
+               "object not completed");
+  fail_unless (used == 1, "wrong length used");
+  fail_unless (vde_sobj_get_int(vde_sobj_hash_lookup(obj, "id")) == 1,
+               "wrong object");
+  vde_sobj_put(obj);
+
+  // a bare number needs the NUL byte
+  fail_unless (vde_sobj_parser_feed(parser, "4", 1, &obj, &used) == 0,
+               "number completed early");
+  fail_unless (vde_sobj_parser_feed(parser, "2", 2, &obj, &used) == 1,
+               "number not completed");
+  fail_unless (vde_sobj_get_int(obj) == 42, "wrong number");
+  vde_sobj_put(obj);
+
+  vde_sobj_parser_delete(parser);
+}
+END_TEST
+
+V_START_TEST (test_parser_large)
+{
+  vde_sobj_parser *parser;
+  vde_sobj *obj = NULL;
+  char *in;
+  size_t i, len, chunk, used;
+  int rv = 0;
+
+  // larger than any packet, fed in pieces
+  len = 64 * 1024;
+  in = malloc(len + 1);
+  memset(in, 'a', len);
+  memcpy(in, "[ \"", 3);
+  memcpy(in + len - 3, "\" ]", 3);
+  in[len] = '\0';
+
+  parser = vde_sobj_parser_new();
+  for (i = 0; i < len && rv == 0; i += used) {
+    chunk = len - i < 1500 ? len - i : 1500;
+    rv = vde_sobj_parser_feed(parser, in + i, chunk, &obj, &used);
+    fail_unless (rv >= 0, "cannot parse at byte %d", (int)i);
+  }
+  fail_unless (rv == 1 && i == len, "object not completed");
+  fail_unless (strlen(vde_sobj_get_string(vde_sobj_array_get_idx(obj, 0))) ==
+               len - 6, "wrong string length");
+
+  vde_sobj_put(obj);
+  vde_sobj_parser_delete(parser);
+  free(in);
+}
+END_TEST
+
+V_START_TEST (test_parser_many)
+{
+  const char *in = "{ \"id\": 1 }[ 2 ]";
+  vde_sobj_parser *parser;
+  vde_sobj *obj = NULL;
+  size_t used, off;
+
+  parser = vde_sobj_parser_new();
+
+  // objects after the first one are left to the next call
+  fail_unless (vde_sobj_parser_feed(parser, in, strlen(in), &obj,
+                                    &used) == 1, "first object not completed");
+  fail_unless (used == strlen("{ \"id\": 1 }"), "wrong length used");
+  fail_unless (vde_sobj_is_type(obj, vde_sobj_type_hash), "wrong object");
+  vde_sobj_put(obj);
+
+  off = used;
+  fail_unless (vde_sobj_parser_feed(parser, in + off, strlen(in) - off, &obj,
+                                    &used) == 1,
+               "second object not completed");
+  fail_unless (off + used == strlen(in), "wrong length used");
+  fail_unless (vde_sobj_is_type(obj, vde_sobj_type_array), "wrong object");
+  vde_sobj_put(obj);
+
+  vde_sobj_parser_delete(parser);
+}
+END_TEST
+
+V_START_TEST (test_parser_error)
+{
+  vde_sobj_parser *parser;
+  vde_sobj *obj = NULL;
+  size_t used;
+
+  parser = vde_sobj_parser_new();
+
+  fail_unless (vde_sobj_parser_feed(parser, "{ \"id\": ", 8, &obj,
+                                    &used) == 0, "partial object rejected");
+  fail_unless (vde_sobj_parser_feed(parser, "] }", 3, &obj, &used) == -1 &&
+               errno == EINVAL, "invalid object accepted");
+  fail_unless (used == 0, "wrong error offset %d", (int)used);
+
+  // the parser starts over after an error
+  fail_unless (vde_sobj_parser_feed(parser, "[ 1 ]", 5, &obj, &used) == 1,
+               "parser not reset");
+  fail_unless (vde_sobj_array_length(obj) == 1, "wrong object");
+  vde_sobj_put(obj);
+
+  vde_sobj_parser_delete(parser);
+}
+END_TEST
+
+Suite *
+sobj_suite (void)
+{
+  Suite *s = suite_create ("sobj");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_test (tc_core, test_msgpack_roundtrip);
+  tcase_add_test (tc_core, test_msgpack_encoding);
+  tcase_add_test (tc_core, test_msgpack_large);
+  tcase_add_test (tc_core, test_msgpack_invalid);
+  tcase_add_test (tc_core, test_parser_chunks);
+  tcase_add_test (tc_core, test_parser_large);
+  tcase_add_test (tc_core, test_parser_many);
+  tcase_add_test (tc_core, test_parser_error);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = sobj_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
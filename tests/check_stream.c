@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the transport is linked in the test, see Makefile.am
+extern vde_module VDE_MODULE_START;
+
+#define MAX_FRAMES 2048
+#define BULK_FRAMES 1000
+#define BULK_MAX_LEN 3000
+#define HDR_LEN 4
+
+/*
+ * One end of a stream connection: it records the length and the sequence
+ * number of each packet received and counts the corrupted ones. A packet
+ * carries its sequence number in the first two bytes, then bytes counting
+ * from it.
+ */
+struct end {
+  vde_connection *conn;
+  int rx;
+  int bad;
+  int close_on_rx; // ask to be closed by the first packet received
+  unsigned int lens[MAX_FRAMES];
+  unsigned int seqs[MAX_FRAMES];
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_a, *f_b; // a connects to b
+struct end f_cli, f_srv; // the end of a and the one accepted by b
+int f_error;
+char f_path[64];
+
+static int end_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  unsigned int i, seq, len = pkt->hdr->pkt_len;
+  unsigned char *p = (unsigned char *)pkt->payload;
+  struct end *e = (struct end *)arg;
+
+  seq = len >= 2 ? (p[0] << 8) | p[1] : 0;
+  for (i = 2; i < len; i++) {
+    if (p[i] != ((seq + i) & 0xff)) {
+      e->bad++;
+      break;
+    }
+  }
+  if (e->rx < MAX_FRAMES) {
+    e->lens[e->rx] = len;
+    e->seqs[e->rx] = seq;
+  }
+  e->rx++;
+  if (e->close_on_rx) {
+    e->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static int end_errorcb(vde_connection *conn, vde_pkt *pkt,
+                       vde_conn_error err, void *arg)
+{
+  struct end *e = (struct end *)arg;
+
+  if (err == CONN_READ_CLOSED || err == CONN_WRITE_CLOSED) {
+    e->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static void end_attach(struct end *e, vde_connection *conn)
+{
+  e->conn = conn;
+  vde_connection_set_callbacks(conn, &end_readcb, NULL, &end_errorcb, e);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+}
+
+static void accept_cb(vde_connection *conn, void *arg)
+{
+  end_attach(&f_srv, conn);
+}
+
+static void connect_cb(vde_connection *conn, void *arg)
+{
+  end_attach(&f_cli, conn);
+}
+
+static void error_cb(vde_connection *conn, int err, void *arg)
+{
+  f_error = err;
+}
+
+static vde_component *stream_new(const char *name)
+{
+  vde_sobj *params;
+  vde_component *stream;
+
+  params = vde_sobj_new_hash();
+  vde_sobj_hash_insert(params, "path", vde_sobj_new_string(f_path));
+  vde_sobj_hash_insert(params, "queue_len", vde_sobj_new_int(MAX_FRAMES));
+
+  vde_component_new(&stream);
+  fail_unless (vde_component_init(stream, vde_quark_from_string(name),
+                                  &VDE_MODULE_START, f_ctx, params) == 0,
+               "cannot init %s: %s", name, strerror(errno));
+  vde_sobj_put(params);
+  vde_transport_set_cm_callbacks(stream, &connect_cb, &accept_cb, &error_cb,
+                                 NULL);
+  return stream;
+}
+
+void
+setup (void)
+{
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+
+  memset(&f_cli, 0, sizeof(f_cli));
+  memset(&f_srv, 0, sizeof(f_srv));
+  f_error = 0;
+  snprintf(f_path, sizeof(f_path), "/tmp/check_stream.%d", (int)getpid());
+
+  f_a = stream_new("a");
+  f_b = stream_new("b");
+  fail_unless (vde_transport_listen(f_b) == 0, "cannot listen: %s",
+               strerror(errno));
+}
+
+void
+teardown (void)
+{
+  if (f_cli.conn != NULL) {
+    vde_connection_fini(f_cli.conn);
+    vde_connection_delete(f_cli.conn);
+  }
+  if (f_srv.conn != NULL) {
+    vde_connection_fini(f_srv.conn);
+    vde_connection_delete(f_srv.conn);
+  }
+  vde_component_fini(f_a);
+  vde_component_delete(f_a);
+  vde_component_fini(f_b);
+  vde_component_delete(f_b);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+/*
+ * Run the loop until cond is true, for at most two seconds
+ */
+static void run_until(int (*cond)(void))
+{
+  struct timeval tv = { 0, 50000 };
+  void *timeout;
+  int i;
+
+  for (i = 0; i < 40 && !cond(); i++) {
+    timeout = vde_context_timeout_add(f_ctx, VDE_EV_TIMEOUT, &tv, &stop_cb,
+                                      NULL);
+    vde_epoll_dispatch();
+    vde_context_timeout_del(f_ctx, timeout);
+  }
+}
+
+static int connected(void)
+{
+  return f_cli.conn != NULL && f_srv.conn != NULL;
+}
+
+static int accepted(void)
+{
+  return f_srv.conn != NULL;
+}
+
+static int bulk_received(void)
+{
+  return f_srv.rx == BULK_FRAMES;
+}
+
+static int two_received(void)
+{
+  return f_srv.rx == 2;
+}
+
+static int srv_closed(void)
+{
+  return f_srv.rx > 0 && f_srv.conn == NULL;
+}
+
+static unsigned int bulk_len(unsigned int seq)
+{
+  return 2 + (seq * 37) % BULK_MAX_LEN;
+}
+
+/*
+ * Fill a packet, or a frame with its header if hdr is set
+ */
+static void frame_fill(unsigned char *buf, unsigned int len, unsigned int seq,
+                       int hdr)
+{
+  unsigned int i;
+
+  if (hdr) {
+    buf[0] = buf[1] = 0;
+    buf[2] = len >> 8;
+    buf[3] = len & 0xff;
+    buf += HDR_LEN;
+  }
+  if (len >= 2) {
+    buf[0] = seq >> 8;
+    buf[1] = seq & 0xff;
+  }
+  for (i = 2; i < len; i++) {
+    buf[i] = (seq + i) & 0xff;
+  }
+}
+
+/*
+ * A plain unix socket connected to b, accepted by the transport
+ */
+static int raw_connect(void)
+{
+  int fd;
+  struct sockaddr_un sa;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", f_path);
+  fail_unless (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0,
+               "cannot connect: %s", strerror(errno));
+  run_until(&accepted);
+  fail_unless (f_srv.conn != NULL, "connection not accepted");
+  return fd;
+}
+
+V_START_TEST (test_bulk)
+{
+  int i;
+  vde_pkt *pkt;
+  vde_connection *conn;
+
+  vde_connection_new(&conn);
+  fail_unless (vde_transport_connect(f_a, conn) == 0, "cannot connect: %s",
+               strerror(errno));
+  run_until(&connected);
+  fail_unless (connected() && f_error == 0, "connection not established");
+
+  // much more than the socket buffer holds: writev() is cut short in the
+  // middle of packets and the reader gets packets split across reads
+  for (i = 0; i < BULK_FRAMES; i++) {
+    pkt = vde_pkt_new(bulk_len(i), 0, 0);
+    pkt->hdr->pkt_len = bulk_len(i);
+    frame_fill((unsigned char *)pkt->payload, bulk_len(i), i, 0);
+    fail_unless (vde_connection_write(f_cli.conn, pkt) == 0,
+                 "write %d failed: %s", i, strerror(errno));
+    vde_pkt_put(pkt);
+  }
+  run_until(&bulk_received);
+
+  fail_unless (f_srv.rx == BULK_FRAMES, "%d packets received", f_srv.rx);
+  fail_unless (f_srv.bad == 0, "%d packets corrupted", f_srv.bad);
+  for (i = 0; i < BULK_FRAMES; i++) {
+    fail_unless (f_srv.seqs[i] == i && f_srv.lens[i] == bulk_len(i),
+                 "packet %d out of order or truncated", i);
+  }
+}
+END_TEST
+
+V_START_TEST (test_reassembly)
+{
+  unsigned char buf[3 * HDR_LEN + 200 + 300];
+  int fd;
+
+  fd = raw_connect();
+  frame_fill(buf, 200, 1, 1);
+  // an empty frame is skipped
+  frame_fill(buf + HDR_LEN + 200, 0, 0, 1);
+  frame_fill(buf + 2 * HDR_LEN + 200, 300, 2, 1);
+
+  // pieces cut in the header and just before the end of the payload, read
+  // one at a time
+  fail_unless (write(fd, buf, 2) == 2, "cannot write");
+  run_until(&two_received);
+  fail_unless (write(fd, buf + 2, 200) == 200, "cannot write");
+  run_until(&two_received);
+  fail_unless (f_srv.rx == 0, "partial packet delivered");
+  fail_unless (write(fd, buf + 202, sizeof(buf) - 202) == sizeof(buf) - 202,
+               "cannot write");
+  run_until(&two_received);
+  close(fd);
+
+  fail_unless (f_srv.rx == 2 && f_srv.bad == 0, "%d packets received",
+               f_srv.rx);
+  fail_unless (f_srv.lens[0] == 200 && f_srv.seqs[0] == 1 &&
+               f_srv.lens[1] == 300 && f_srv.seqs[1] == 2,
+               "wrong packets received");
+}
+END_TEST
+
+V_START_TEST (test_close_on_delivery)
+{
+  unsigned char buf[3 * (HDR_LEN + 100)];
+  int i, fd;
+
+  fd = raw_connect();
+  for (i = 0; i < 3; i++) {
+    frame_fill(buf + i * (HDR_LEN + 100), 100, i, 1);
+  }
+
+  // the first packet of the batch closes the connection
+  f_srv.close_on_rx = 1;
+  fail_unless (write(fd, buf, sizeof(buf)) == sizeof(buf), "cannot write");
+  run_until(&srv_closed);
+
+  fail_unless (f_srv.rx == 1 && f_srv.conn == NULL,
+               "packets delivered after close");
+  fail_unless (read(fd, buf, sizeof(buf)) == 0, "socket not closed");
+  close(fd);
+}
+END_TEST
+
+Suite *
+stream_suite (void)
+{
+  Suite *s = suite_create ("stream");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_bulk);
+  tcase_add_test (tc_core, test_reassembly);
+  tcase_add_test (tc_core, test_close_on_delivery);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = stream_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/localconnection.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the engine is linked in the test, see Makefile.am
+extern vde_module VDE_MODULE_START;
+int engine_switch_status(vde_component *component, vde_sobj **out);
+
+#define NPROBES 3
+#define FRAME_LEN 60
+
+/*
+ * A probe engine plugged in a switch port: it counts the frames and the
+ * bursts received and remembers the payload of the last frame.
+ */
+struct probe {
+  vde_connection *conn;
+  int rx;
+  int bursts;
+  char last;
+};
+
+static int probe_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  p->rx++;
+  p->last = pkt->payload[sizeof(struct eth_hdr)];
+  return 0;
+}
+
+static int probe_readbatchcb(vde_connection *conn, vde_pkt_batch *batch,
+                             void *arg)
+{
+  unsigned int i;
+  struct probe *p = (struct probe *)arg;
+
+  p->bursts++;
+  for (i = 0; i < batch->len; i++) {
+    probe_readcb(conn, batch->pkts[i], arg);
+  }
+  return 0;
+}
+
+static int probe_errorcb(vde_connection *conn, vde_pkt *pkt,
+                         vde_conn_error err, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  if (err == CONN_READ_CLOSED) {
+    p->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static int probe_new_conn(vde_component *component, vde_connection *conn,
+                          vde_request *req)
+{
+  struct probe *p = (struct probe *)vde_component_get_priv(component);
+
+  p->conn = conn;
+  vde_connection_set_callbacks(conn, &probe_readcb, NULL, &probe_errorcb, p);
+  vde_connection_set_read_batch_cb(conn, &probe_readbatchcb);
+  return 0;
+}
+
+static int probe_init(vde_component *component, vde_sobj *params)
+{
+  return 0;
+}
+
+static void probe_fini(vde_component *component)
+{
+}
+
+static component_ops probe_cops = {
+  .init = probe_init,
+  .fini = probe_fini,
+};
+
+static vde_module probe_module = {
+  .kind = VDE_ENGINE,
+  .family = "probe",
+  .cops = &probe_cops,
+  .eng_new_conn = probe_new_conn,
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_switch;
+vde_component *f_engines[NPROBES];
+struct probe f_probes[NPROBES];
+
+static const unsigned char bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const unsigned char macs[NPROBES][6] = {
+  { 0x02, 0, 0, 0, 0, 0x01 },
+  { 0x02, 0, 0, 0, 0, 0x02 },
+  { 0x02, 0, 0, 0, 0, 0x03 },
+};
+
+void
+setup (void)
+{
+  int i;
+  vde_sobj *params;
+
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+
+  params = vde_sobj_new_hash();
+  vde_sobj_hash_insert(params, "table_size", vde_sobj_new_int(16));
+  vde_sobj_hash_insert(params, "aging", vde_sobj_new_int(1));
+  vde_component_new(&f_switch);
+  fail_unless (vde_component_init(f_switch, vde_quark_from_string("switch"),
+                                  &VDE_MODULE_START, f_ctx, params) == 0,
+               "cannot init switch");
+  vde_sobj_put(params);
+
+  for (i = 0; i < NPROBES; i++) {
+    memset(&f_probes[i], 0, sizeof(struct probe));
+    vde_component_new(&f_engines[i]);
+    vde_component_init(f_engines[i], vde_quark_from_string("probe"),
+                       &probe_module, f_ctx, NULL);
+    vde_component_set_priv(f_engines[i], &f_probes[i]);
+    fail_unless (vde_connect_engines_unqueued(f_ctx, f_engines[i], NULL,
+                                              f_switch, NULL) == 0,
+                 "cannot connect probe %d: %s", i, strerror(errno));
+  }
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  // the switch closes its ports, probes are told by their connection
+  vde_component_fini(f_switch);
+  vde_component_delete(f_switch);
+  for (i = 0; i < NPROBES; i++) {
+    vde_component_fini(f_engines[i]);
+    vde_component_delete(f_engines[i]);
+  }
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static vde_pkt *frame_new(const unsigned char *dst, const unsigned char *src,
+                          char tag)
+{
+  vde_pkt *pkt;
+  struct eth_hdr *hdr;
+
+  pkt = vde_pkt_new(FRAME_LEN, 0, 0);
+  pkt->hdr->pkt_len = FRAME_LEN;
+  memset(pkt->payload, 0, FRAME_LEN);
+  hdr = (struct eth_hdr *)pkt->payload;
+  memcpy(hdr->dest, dst, 6);
+  memcpy(hdr->src, src, 6);
+  pkt->payload[sizeof(struct eth_hdr)] = tag;
+  return pkt;
+}
+
+/*
+ * Send a frame from a probe, the switch forwards it before returning
+ */
+static void send_frame(int from, const unsigned char *dst, char tag)
+{
+  vde_pkt *pkt;
+
+  pkt = frame_new(dst, macs[from], tag);
+  fail_unless (vde_connection_write(f_probes[from].conn, pkt) == 0,
+               "write failed: %s", strerror(errno));
+  vde_pkt_put(pkt);
+}
+
+static void reset_probes(void)
+{
+  int i;
+
+  for (i = 0; i < NPROBES; i++) {
+    f_probes[i].rx = f_probes[i].bursts = 0;
+    f_probes[i].last = 0;
+  }
+}
+
+static int switch_counter(const char *name)
+{
+  int value;
+  vde_sobj *status;
+
+  fail_unless (engine_switch_status(f_switch, &status) == 0,
+               "cannot read switch status");
+  value = vde_sobj_get_int(vde_sobj_hash_lookup(status, name));
+  vde_sobj_put(status);
+  return value;
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+/*
+ * Run the loop for a second
+ */
+static void dispatch(void)
+{
+  struct timeval tv = { 1, 0 };
+  void *timeout;
+
+  timeout = vde_context_timeout_add(f_ctx, VDE_EV_TIMEOUT, &tv, &stop_cb,
+                                    NULL);
+  vde_epoll_dispatch();
+  vde_context_timeout_del(f_ctx, timeout);
+}
+
+V_START_TEST (test_flooding)
+{
+  // broadcast goes everywhere but back
+  send_frame(0, bcast, 'b');
+  fail_unless (f_probes[0].rx == 0, "broadcast sent back");
+  fail_unless (f_probes[1].rx == 1 && f_probes[2].rx == 1,
+               "broadcast not flooded");
+
+  // unknown destinations are flooded as well
+  reset_probes();
+  send_frame(0, macs[1], 'u');
+  fail_unless (f_probes[0].rx == 0, "unknown unicast sent back");
+  fail_unless (f_probes[1].rx == 1 && f_probes[2].rx == 1,
+               "unknown unicast not flooded");
+  fail_unless (switch_counter("misses") == 1, "miss not counted");
+}
+END_TEST
+
+V_START_TEST (test_learning)
+{
+  int i;
+  vde_pkt_batch batch;
+
+  // the switch learns where the sources are
+  send_frame(1, bcast, 'b');
+  send_frame(2, bcast, 'b');
+  fail_unless (switch_counter("table_entries") == 2, "sources not learned");
+
+  reset_probes();
+  send_frame(2, macs[1], 'x');
+  fail_unless (f_probes[1].rx == 1 && f_probes[1].last == 'x',
+               "unicast not forwarded");
+  fail_unless (f_probes[0].rx == 0 && f_probes[2].rx == 0,
+               "unicast flooded");
+  fail_unless (switch_counter("hits") == 1, "hit not counted");
+
+  // a burst is forwarded in order, one burst per port
+  reset_probes();
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < 6; i++) {
+    vde_pkt_batch_add(&batch,
+                      frame_new(i % 2 ? macs[2] : macs[1], macs[0], 'a' + i));
+  }
+  fail_unless (vde_connection_write_batch(f_probes[0].conn, &batch) == 6,
+               "batch write failed: %s", strerror(errno));
+  fail_unless (f_probes[1].rx == 3 && f_probes[1].bursts == 1 &&
+               f_probes[1].last == 'e', "burst not forwarded to port 1");
+  fail_unless (f_probes[2].rx == 3 && f_probes[2].bursts == 1 &&
+               f_probes[2].last == 'f', "burst not forwarded to port 2");
+  for (i = 0; i < batch.len; i++) {
+    vde_pkt_put(batch.pkts[i]);
+  }
+
+  // a flooded frame in a burst reaches each port after what precedes it
+  reset_probes();
+  vde_pkt_batch_init(&batch);
+  vde_pkt_batch_add(&batch, frame_new(macs[1], macs[0], 'p'));
+  vde_pkt_batch_add(&batch, frame_new(bcast, macs[0], 'q'));
+  fail_unless (vde_connection_write_batch(f_probes[0].conn, &batch) == 2,
+               "batch write failed: %s", strerror(errno));
+  fail_unless (f_probes[1].rx == 2 && f_probes[1].last == 'q',
+               "frames reordered");
+  fail_unless (f_probes[2].rx == 1 && f_probes[2].last == 'q',
+               "flooded frame lost");
+
+  for (i = 0; i < batch.len; i++) {
+    vde_pkt_put(batch.pkts[i]);
+  }
+}
+END_TEST
+
+V_START_TEST (test_aging)
+{
+  int i;
+
+  send_frame(1, bcast, 'b');
+  fail_unless (switch_counter("table_entries") == 1, "source not learned");
+
+  // entries older than a second are removed by the aging timer
+  for (i = 0; i < 4 && switch_counter("table_entries") > 0; i++) {
+    dispatch();
+  }
+  fail_unless (switch_counter("table_entries") == 0, "entry not aged");
+
+  // the destination is unknown again
+  reset_probes();
+  send_frame(0, macs[1], 'x');
+  fail_unless (f_probes[1].rx == 1 && f_probes[2].rx == 1,
+               "aged destination not flooded");
+}
+END_TEST
+
+Suite *
+switch_suite (void)
+{
+  Suite *s = suite_create ("switch");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  // aging takes a few seconds
+  tcase_set_timeout (tc_core, 10);
+  tcase_add_test (tc_core, test_flooding);
+  tcase_add_test (tc_core, test_learning);
+  tcase_add_test (tc_core, test_aging);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = switch_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
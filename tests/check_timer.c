@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/timer.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// fixture components, always present
+vde_timer_wheel *f_tw;
+
+void
+setup (void)
+{
+  vde_epoll_init(0);
+  f_tw = vde_timer_wheel_new(&epoll_eh);
+}
+
+void
+teardown (void)
+{
+  vde_timer_wheel_delete(f_tw);
+  vde_epoll_fini();
+}
+
+struct counter {
+  int calls;
+  int limit;
+  vde_timer *timer;
+  struct timespec fired;
+};
+
+static void count_cb(int fd, short events, void *arg)
+{
+  struct counter *c = (struct counter *)arg;
+
+  fail_unless (fd == -1 && events == VDE_EV_TIMEOUT, "wrong callback args");
+  clock_gettime(CLOCK_MONOTONIC, &c->fired);
+  c->calls++;
+  if (c->calls == c->limit) {
+    vde_timer_delete(c->timer);
+    vde_epoll_loopexit();
+  }
+}
+
+static long elapsed_ms(struct timespec *from, struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000 +
+         (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+V_START_TEST (test_timer_oneshot)
+{
+  struct counter c = { 0, 1, NULL };
+  struct timeval tv = { 0, 5000 };
+
+  c.timer = vde_timer_new(f_tw, &count_cb, &c);
+  fail_unless (c.timer != NULL, "could not create timer");
+  fail_unless (vde_timer_arm(c.timer, &tv, 0) == 0, "could not arm timer");
+  fail_unless (vde_timer_is_armed(c.timer), "timer not armed");
+
+  vde_epoll_dispatch();
+  fail_unless (c.calls == 1, "timer expired %d times", c.calls);
+}
+END_TEST
+
+V_START_TEST (test_timer_persist)
+{
+  struct counter c = { 0, 5, NULL };
+  struct timeval tv = { 0, 2000 };
+
+  c.timer = vde_timer_new(f_tw, &count_cb, &c);
+  vde_timer_arm(c.timer, &tv, VDE_EV_PERSIST);
+
+  vde_epoll_dispatch();
+  fail_unless (c.calls == 5, "timer expired %d times", c.calls);
+}
+END_TEST
+
+V_START_TEST (test_timer_cancel)
+{
+  struct counter cancelled = { 0, 0, NULL }, c = { 0, 1, NULL };
+  struct timeval short_tv = { 0, 1000 }, tv = { 0, 10000 };
+
+  cancelled.timer = vde_timer_new(f_tw, &count_cb, &cancelled);
+  vde_timer_arm(cancelled.timer, &short_tv, 0);
+  vde_timer_cancel(cancelled.timer);
+  fail_unless (!vde_timer_is_armed(cancelled.timer), "timer still armed");
+
+  c.timer = vde_timer_new(f_tw, &count_cb, &c);
+  vde_timer_arm(c.timer, &tv, 0);
+
+  vde_epoll_dispatch();
+  fail_unless (cancelled.calls == 0, "cancelled timer expired");
+  fail_unless (c.calls == 1, "timer expired %d times", c.calls);
+  vde_timer_delete(cancelled.timer);
+}
+END_TEST
+
+V_START_TEST (test_timer_cascade)
+{
+  struct counter c = { 0, 1, NULL };
+  struct timeval tv = { 0, 150000 }; // beyond the first level of the wheel
+  struct timespec start;
+
+  c.timer = vde_timer_new(f_tw, &count_cb, &c);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  vde_timer_arm(c.timer, &tv, 0);
+
+  vde_epoll_dispatch();
+  fail_unless (c.calls == 1, "timer expired %d times", c.calls);
+  fail_unless (elapsed_ms(&start, &c.fired) >= 150, "timer expired early");
+}
+END_TEST
+
+V_START_TEST (test_timer_wrap)
+{
+  int i;
+  long ms;
+  struct counter c;
+  struct timeval tv;
+  struct timespec start;
+
+  // from most positions of the wheel these timers fall in a slot before the
+  // current one, in the next round of the first level
+  for (i = 0; i < 8; i++) {
+    memset(&c, 0, sizeof(c));
+    c.limit = 1;
+    tv.tv_sec = 0;
+    tv.tv_usec = (40 + i * 3) * 1000;
+    c.timer = vde_timer_new(f_tw, &count_cb, &c);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vde_timer_arm(c.timer, &tv, 0);
+
+    vde_epoll_dispatch();
+    ms = elapsed_ms(&start, &c.fired);
+    fail_unless (c.calls == 1, "timer expired %d times", c.calls);
+    fail_unless (ms >= tv.tv_usec / 1000, "timer expired early");
+    fail_unless (ms <= tv.tv_usec / 1000 + 10, "timer expired %ld ms late",
+                 ms - tv.tv_usec / 1000);
+  }
+}
+END_TEST
+
+Suite *
+timer_suite (void)
+{
+  Suite *s = suite_create ("timer");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_timer_oneshot);
+  tcase_add_test (tc_core, test_timer_persist);
+  tcase_add_test (tc_core, test_timer_cancel);
+  tcase_add_test (tc_core, test_timer_cascade);
+  tcase_add_test (tc_core, test_timer_wrap);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = timer_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/module.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the transport is linked in the test, see Makefile.am
+extern vde_module VDE_MODULE_START;
+int transport_udp_peers(vde_component *component, vde_sobj **out);
+int transport_udp_status(vde_component *component, vde_sobj **out);
+
+#define MAX_ENDS 4
+#define MAX_FRAMES 64
+#define FRAME_LEN 100
+#define VXLAN_HDR_LEN 8
+#define VNI 42
+
+/*
+ * One end of a udp connection: it records the length and the number carried
+ * by each frame received.
+ */
+struct end {
+  vde_connection *conn;
+  int rx;
+  unsigned int lens[MAX_FRAMES];
+  char nums[MAX_FRAMES];
+};
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_a, *f_b; // a connects to b, b learns its peers
+struct end f_ends[MAX_ENDS]; // the first one is a's
+int f_nends, f_wait, f_error;
+unsigned int f_port_a, f_port_b;
+
+static int end_rx(void)
+{
+  int i, rx = 0;
+
+  for (i = 0; i < f_nends; i++) {
+    rx += f_ends[i].rx;
+  }
+  return rx;
+}
+
+static int end_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  struct end *e = (struct end *)arg;
+
+  if (e->rx < MAX_FRAMES) {
+    e->lens[e->rx] = pkt->hdr->pkt_len;
+    e->nums[e->rx] = pkt->payload[sizeof(struct eth_hdr)];
+  }
+  e->rx++;
+  if (end_rx() == f_wait) {
+    vde_epoll_loopexit();
+  }
+  return 0;
+}
+
+static int end_errorcb(vde_connection *conn, vde_pkt *pkt,
+                       vde_conn_error err, void *arg)
+{
+  struct end *e = (struct end *)arg;
+
+  if (err == CONN_READ_CLOSED) {
+    e->conn = NULL;
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+static void end_attach(vde_connection *conn)
+{
+  struct end *e;
+
+  vde_assert(f_nends < MAX_ENDS);
+  e = &f_ends[f_nends++];
+  e->conn = conn;
+  vde_connection_set_callbacks(conn, &end_readcb, NULL, &end_errorcb, e);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+}
+
+static void accept_cb(vde_connection *conn, void *arg)
+{
+  end_attach(conn);
+}
+
+static void connect_cb(vde_connection *conn, void *arg)
+{
+  end_attach(conn);
+}
+
+static void error_cb(vde_connection *conn, int err, void *arg)
+{
+  f_error = err;
+}
+
+static vde_component *udp_new(const char *name, unsigned int local,
+                              unsigned int peer, int vxlan)
+{
+  char addr[32];
+  vde_sobj *params, *peers;
+  vde_component *udp;
+
+  params = vde_sobj_new_hash();
+  snprintf(addr, sizeof(addr), "127.0.0.1:%u", local);
+  vde_sobj_hash_insert(params, "local", vde_sobj_new_string(addr));
+  if (peer != 0) {
+    peers = vde_sobj_new_array();
+    snprintf(addr, sizeof(addr), "127.0.0.1:%u", peer);
+    vde_sobj_array_add(peers, vde_sobj_new_string(addr));
+    vde_sobj_hash_insert(params, "peers", peers);
+  }
+  if (vxlan) {
+    vde_sobj_hash_insert(params, "vxlan", vde_sobj_new_bool(1));
+    vde_sobj_hash_insert(params, "vni", vde_sobj_new_int(VNI));
+  }
+
+  vde_component_new(&udp);
+  fail_unless (vde_component_init(udp, vde_quark_from_string(name),
+                                  &VDE_MODULE_START, f_ctx, params) == 0,
+               "cannot init %s: %s", name, strerror(errno));
+  vde_sobj_put(params);
+  vde_transport_set_cm_callbacks(udp, &connect_cb, &accept_cb, &error_cb,
+                                 NULL);
+  return udp;
+}
+
+/*
+ * Open a with b as its peer and b learning peers, then connect a to b
+ */
+static void open_transports(int vxlan)
+{
+  vde_connection *conn;
+
+  f_a = udp_new("a", f_port_a, f_port_b, vxlan);
+  f_b = udp_new("b", f_port_b, 0, vxlan);
+  fail_unless (vde_transport_listen(f_b) == 0, "cannot listen: %s",
+               strerror(errno));
+  vde_connection_new(&conn);
+  fail_unless (vde_transport_connect(f_a, conn) == 0, "cannot connect: %s",
+               strerror(errno));
+  fail_unless (f_nends == 1 && f_error == 0, "connection not established");
+}
+
+void
+setup (void)
+{
+  vde_epoll_init(0);
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+
+  memset(f_ends, 0, sizeof(f_ends));
+  f_nends = f_wait = f_error = 0;
+  f_a = f_b = NULL;
+  f_port_a = 20000 + getpid() % 20000 * 2;
+  f_port_b = f_port_a + 1;
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  for (i = 0; i < f_nends; i++) {
+    if (f_ends[i].conn != NULL) {
+      vde_connection_fini(f_ends[i].conn);
+      vde_connection_delete(f_ends[i].conn);
+    }
+  }
+  if (f_a != NULL) {
+    vde_component_fini(f_a);
+    vde_component_delete(f_a);
+  }
+  if (f_b != NULL) {
+    vde_component_fini(f_b);
+    vde_component_delete(f_b);
+  }
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+  vde_epoll_fini();
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  vde_epoll_loopexit();
+}
+
+/*
+ * Run the loop until the ends received n frames in total, or a second
+ */
+static void wait_frames(int n)
+{
+  struct timeval tv = { 1, 0 };
+  void *timeout;
+
+  f_wait = n;
+  if (end_rx() == n) {
+    return;
+  }
+  timeout = vde_context_timeout_add(f_ctx, VDE_EV_TIMEOUT, &tv, &stop_cb,
+                                    NULL);
+  vde_epoll_dispatch();
+  vde_context_timeout_del(f_ctx, timeout);
+}
+
+static vde_pkt *frame_new(unsigned int len, char num)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(len, 0, 0);
+  pkt->hdr->pkt_len = len;
+  memset(pkt->payload, 0, len);
+  memset(pkt->payload, 0xff, 6);
+  pkt->payload[sizeof(struct eth_hdr)] = num;
+  return pkt;
+}
+
+/*
+ * Send a datagram from a plain socket bound to the loopback, with a VXLAN
+ * header carrying vni if it is not negative
+ */
+static void raw_send(int fd, unsigned int port, int vni, char num)
+{
+  unsigned char buf[VXLAN_HDR_LEN + FRAME_LEN];
+  unsigned int hdr_len = vni >= 0 ? VXLAN_HDR_LEN : 0;
+  struct sockaddr_in to;
+
+  memset(buf, 0, sizeof(buf));
+  if (vni >= 0) {
+    buf[0] = 0x08;
+    buf[4] = (vni >> 16) & 0xff;
+    buf[5] = (vni >> 8) & 0xff;
+    buf[6] = vni & 0xff;
+  }
+  memset(buf + hdr_len, 0xff, 6);
+  buf[hdr_len + sizeof(struct eth_hdr)] = num;
+
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fail_unless (sendto(fd, buf, hdr_len + FRAME_LEN, 0, (struct sockaddr *)&to,
+                      sizeof(to)) == hdr_len + FRAME_LEN,
+               "cannot send: %s", strerror(errno));
+}
+
+static int raw_socket(void)
+{
+  int fd;
+  struct sockaddr_in sa;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fail_unless (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0,
+               "cannot bind: %s", strerror(errno));
+  return fd;
+}
+
+/*
+ * Look up a counter of a peer of a transport, by the peer name
+ */
+static int peer_counter(vde_component *udp, const char *peer,
+                        const char *name, int *npeers)
+{
+  int i, value = -1;
+  vde_sobj *peers, *p;
+
+  fail_unless (transport_udp_peers(udp, &peers) == 0, "cannot read peers");
+  *npeers = vde_sobj_array_length(peers);
+  for (i = 0; i < *npeers; i++) {
+    p = vde_sobj_array_get_idx(peers, i);
+    if (!strcmp(vde_sobj_get_string(vde_sobj_hash_lookup(p, "peer")), peer)) {
+      value = vde_sobj_get_int(vde_sobj_hash_lookup(p, name));
+    }
+  }
+  vde_sobj_put(peers);
+  return value;
+}
+
+V_START_TEST (test_plain_peers)
+{
+  int fd, npeers;
+  char name[32];
+  vde_pkt *pkt;
+
+  open_transports(0);
+
+  // b learns a from its first frame
+  pkt = frame_new(FRAME_LEN, 1);
+  fail_unless (vde_connection_write(f_ends[0].conn, pkt) == 0,
+               "write failed: %s", strerror(errno));
+  vde_pkt_put(pkt);
+  wait_frames(1);
+  fail_unless (f_nends == 2 && f_ends[1].rx == 1 && f_ends[1].nums[0] == 1,
+               "frame not received by b");
+
+  // and answers
+  pkt = frame_new(FRAME_LEN, 2);
+  fail_unless (vde_connection_write(f_ends[1].conn, pkt) == 0,
+               "write failed: %s", strerror(errno));
+  vde_pkt_put(pkt);
+  wait_frames(2);
+  fail_unless (f_ends[0].rx == 1 && f_ends[0].nums[0] == 2,
+               "frame not received by a");
+
+  // another port of the same host is another peer
+  fd = raw_socket();
+  raw_send(fd, f_port_b, -1, 3);
+  wait_frames(3);
+  close(fd);
+  fail_unless (f_nends == 3 && f_ends[2].rx == 1 && f_ends[2].nums[0] == 3,
+               "second peer not learned");
+  snprintf(name, sizeof(name), "127.0.0.1:%u", f_port_a);
+  fail_unless (peer_counter(f_b, name, "rx_packets", &npeers) == 1 &&
+               npeers == 2, "wrong peers");
+}
+END_TEST
+
+V_START_TEST (test_vxlan_peer_key)
+{
+  int fd, npeers;
+  char name[32];
+  vde_pkt *pkt;
+
+  open_transports(1);
+
+  pkt = frame_new(FRAME_LEN, 1);
+  fail_unless (vde_connection_write(f_ends[0].conn, pkt) == 0,
+               "write failed: %s", strerror(errno));
+  vde_pkt_put(pkt);
+  wait_frames(1);
+  fail_unless (f_nends == 2 && f_ends[1].rx == 1 && f_ends[1].nums[0] == 1,
+               "frame not received by b");
+
+  // VTEPs are hosts: any source port of the same host is the same peer,
+  // whose frames must carry the right network identifier
+  fd = raw_socket();
+  raw_send(fd, f_port_b, VNI + 1, 2);
+  raw_send(fd, f_port_b, VNI, 3);
+  wait_frames(2);
+  close(fd);
+  fail_unless (f_nends == 2 && f_ends[1].rx == 2 && f_ends[1].nums[1] == 3,
+               "frame from another port not received");
+
+  // replies go to the VXLAN port of the host
+  snprintf(name, sizeof(name), "127.0.0.1:%u", f_port_b);
+  fail_unless (peer_counter(f_b, name, "rx_drops", &npeers) == 1 &&
+               npeers == 1, "wrong peers");
+}
+END_TEST
+
+V_START_TEST (test_gro_split)
+{
+  int i, npeers;
+  char name[32];
+  vde_pkt_batch batch;
+
+  open_transports(0);
+
+  // equal sized frames and a shorter one leave as a single segmented
+  // datagram, which b receives coalesced if the kernel has UDP_GRO
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < 16; i++) {
+    vde_pkt_batch_add(&batch, frame_new(i < 15 ? FRAME_LEN : FRAME_LEN - 30,
+                                        i));
+  }
+  fail_unless (vde_connection_write_batch(f_ends[0].conn, &batch) == 16,
+               "write failed: %s", strerror(errno));
+  for (i = 0; i < batch.len; i++) {
+    vde_pkt_put(batch.pkts[i]);
+  }
+  wait_frames(16);
+
+  fail_unless (f_nends == 2 && f_ends[1].rx == 16, "%d frames received",
+               f_ends[1].rx);
+  for (i = 0; i < 16; i++) {
+    fail_unless (f_ends[1].nums[i] == i, "frame %d out of order", i);
+    fail_unless (f_ends[1].lens[i] == (i < 15 ? FRAME_LEN : FRAME_LEN - 30),
+                 "frame %d has length %u", i, f_ends[1].lens[i]);
+  }
+  snprintf(name, sizeof(name), "127.0.0.1:%u", f_port_a);
+  fail_unless (peer_counter(f_b, name, "rx_drops", &npeers) == 0,
+               "frames dropped");
+}
+END_TEST
+
+Suite *
+udp_suite (void)
+{
+  Suite *s = suite_create ("udp");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_plain_peers);
+  tcase_add_test (tc_core, test_vxlan_peer_key);
+  tcase_add_test (tc_core, test_gro_split);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = udp_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/packet.h>
+#include <vde3/uring.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// fixture components, always present
+int f_pipe[2];
+
+void
+setup (void)
+{
+  fail_unless (vde_uring_init(0) == 0, "cannot init io_uring: %s",
+               strerror(errno));
+  pipe(f_pipe);
+}
+
+void
+teardown (void)
+{
+  close(f_pipe[0]);
+  close(f_pipe[1]);
+  vde_uring_fini();
+}
+
+struct counter {
+  int calls;
+  short events;
+  int limit;
+  void *ev;
+};
+
+static void count_cb(int fd, short events, void *arg)
+{
+  struct counter *c = (struct counter *)arg;
+
+  c->calls++;
+  c->events = events;
+  if (c->calls == c->limit) {
+    uring_eh.event_del(c->ev);
+    vde_uring_loopexit();
+  }
+}
+
+V_START_TEST (test_uring_init_twice)
+{
+  fail_unless (vde_uring_init(0) == -1 && errno == EEXIST,
+               "second init in the same thread succeeded");
+}
+END_TEST
+
+V_START_TEST (test_uring_read_event)
+{
+  struct counter c = { 0, 0, 3, NULL };
+  char b = 'x';
+
+  c.ev = uring_eh.event_add(f_pipe[0], VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                            &count_cb, &c);
+  fail_unless (c.ev != NULL, "could not add event");
+
+  // level-triggered: called until the callback deletes the event
+  write(f_pipe[1], &b, 1);
+  vde_uring_dispatch();
+  fail_unless (c.calls == 3, "callback called %d times", c.calls);
+  fail_unless (c.events == VDE_EV_READ, "wrong events %d", c.events);
+}
+END_TEST
+
+V_START_TEST (test_uring_same_fd)
+{
+  struct counter rd = { 0, 0, 1, NULL }, wr = { 0, 0, 1, NULL };
+
+  rd.ev = uring_eh.event_add(f_pipe[1], VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                             &count_cb, &rd);
+  wr.ev = uring_eh.event_add(f_pipe[1], VDE_EV_WRITE|VDE_EV_PERSIST, NULL,
+                             &count_cb, &wr);
+  vde_uring_dispatch();
+  fail_unless (wr.calls == 1 && wr.events == VDE_EV_WRITE,
+               "write event not called");
+  fail_unless (rd.calls == 0, "read event called on write end");
+  uring_eh.event_del(rd.ev);
+}
+END_TEST
+
+V_START_TEST (test_uring_timeout)
+{
+  struct counter once = { 0, 0, 0, NULL }, rec = { 0, 0, 3, NULL };
+  struct timeval tv = { 0, 1000 };
+
+  once.ev = uring_eh.timeout_add(&tv, 0, &count_cb, &once);
+  rec.ev = uring_eh.timeout_add(&tv, VDE_EV_PERSIST, &count_cb, &rec);
+
+  vde_uring_dispatch();
+  fail_unless (once.calls == 1 && once.events == VDE_EV_TIMEOUT,
+               "one-shot timeout called %d times", once.calls);
+  fail_unless (rec.calls == 3, "persistent timeout called %d times",
+               rec.calls);
+  uring_eh.timeout_del(once.ev);
+}
+END_TEST
+
+#define IO_PKTS 8
+#define IO_LEN 100
+
+struct io_counter {
+  int recvd;
+  int flushes;
+  int sent;
+  int bad;
+};
+
+static void io_recv_cb(vde_uring_io *io, void *data, unsigned int len,
+                       struct sockaddr *name, socklen_t namelen, void *arg)
+{
+  struct io_counter *c = (struct io_counter *)arg;
+
+  if (len != IO_LEN || ((char *)data)[0] != (char)c->recvd) {
+    c->bad++;
+  }
+  c->recvd++;
+}
+
+static void io_flush_cb(vde_uring_io *io, void *arg)
+{
+  struct io_counter *c = (struct io_counter *)arg;
+
+  c->flushes++;
+  if (c->recvd == IO_PKTS) {
+    vde_uring_loopexit();
+  }
+}
+
+static void io_send_cb(vde_uring_io *io, vde_pkt *pkt, int res, void *arg)
+{
+  struct io_counter *c = (struct io_counter *)arg;
+
+  if (res == IO_LEN) {
+    c->sent++;
+  }
+}
+
+static void io_pkt_release(vde_pkt *pkt, void *arg)
+{
+  free(pkt);
+}
+
+V_START_TEST (test_uring_io_datagrams)
+{
+  int sp[2], i;
+  struct io_counter c;
+  vde_uring_io *rd, *wr;
+  vde_pkt *pkts[IO_PKTS];
+
+  memset(&c, 0, sizeof(c));
+  fail_unless (socketpair(AF_UNIX, SOCK_DGRAM, 0, sp) == 0,
+               "cannot create socket pair");
+  rd = vde_uring_io_new(sp[0], &c);
+  wr = vde_uring_io_new(sp[1], &c);
+  fail_unless (rd != NULL && wr != NULL, "cannot create I/O objects");
+  // less buffers than datagrams, the receive must start over
+  fail_unless (vde_uring_io_recv(rd, IO_LEN, 4, &io_recv_cb,
+                                 &io_flush_cb) == 0,
+               "cannot start receiving: %s", strerror(errno));
+
+  for (i = 0; i < IO_PKTS; i++) {
+    pkts[i] = malloc(sizeof(vde_pkt) + sizeof(vde_hdr) + IO_LEN);
+    vde_pkt_init(pkts[i], sizeof(vde_hdr) + IO_LEN, 0, 0);
+    vde_pkt_set_release(pkts[i], &io_pkt_release, NULL);
+    pkts[i]->hdr->pkt_len = IO_LEN;
+    memset(pkts[i]->payload, i, IO_LEN);
+  }
+  fail_unless (vde_uring_io_sendv(wr, pkts, IO_PKTS, NULL, 0,
+                                  &io_send_cb) == 0,
+               "cannot submit sends");
+  // the I/O layer holds its own references until completion
+  for (i = 0; i < IO_PKTS; i++) {
+    vde_pkt_put(pkts[i]);
+  }
+
+  vde_uring_dispatch();
+  fail_unless (c.sent == IO_PKTS, "%d datagrams sent", c.sent);
+  fail_unless (c.recvd == IO_PKTS, "%d datagrams received", c.recvd);
+  fail_unless (c.bad == 0, "%d datagrams corrupted or out of order", c.bad);
+  fail_unless (c.flushes > 0, "flush callback not called");
+
+  vde_uring_io_delete(rd);
+  vde_uring_io_delete(wr);
+  close(sp[0]);
+  close(sp[1]);
+}
+END_TEST
+
+Suite *
+uring_suite (void)
+{
+  Suite *s = suite_create ("uring");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_uring_init_twice);
+  tcase_add_test (tc_core, test_uring_read_event);
+  tcase_add_test (tc_core, test_uring_same_fd);
+  tcase_add_test (tc_core, test_uring_timeout);
+  tcase_add_test (tc_core, test_uring_io_datagrams);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = uring_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -136,6 +136,55 @@ V_START_TEST (test_ordhash_iterator_iterates)
 }
 END_TEST
 
+V_START_TEST (test_ordhash_bench_100k)
+{
+  long i, n;
+  vde_ordhash_entry *e;
+
+  // insert, lookup, remove half of the elements and iterate over the rest,
+  // the timeout catches regressions to linear time removal
+
+#define BENCHKEYS 100000
+
+  for (i=1; i<=BENCHKEYS; i++) {
+    vde_ordhash_insert(f_oh, (void *)i, (void *)(i+1));
+  }
+  for (i=1; i<=BENCHKEYS; i++) {
+    fail_unless (vde_ordhash_lookup(f_oh, (void *)i) == (void *)(i+1),
+                 "could not lookup element %ld", i);
+  }
+
+  // remove odd keys
+  for (i=1; i<=BENCHKEYS; i+=2) {
+    fail_unless (vde_ordhash_remove(f_oh, (void *)i) != 0,
+                 "could not remove element %ld", i);
+  }
+  for (i=1; i<=BENCHKEYS; i+=2) {
+    fail_unless (vde_ordhash_lookup(f_oh, (void *)i) == NULL,
+                 "element %ld still present after remove", i);
+  }
+
+  // insertions after removals must keep the order
+  for (i=BENCHKEYS+2; i<=2*BENCHKEYS; i+=2) {
+    vde_ordhash_insert(f_oh, (void *)i, (void *)(i+1));
+  }
+
+  n = 0;
+  i = 2;
+  e = vde_ordhash_first(f_oh);
+  while (e != NULL) {
+    fail_unless ((long)vde_ordhash_entry_getkey(f_oh, e) == i,
+                 "the element is not following the insertion order");
+    i += 2;
+    n++;
+    e = vde_ordhash_next(e);
+  }
+  fail_unless (n==BENCHKEYS, "the iterator has not iterated the whole ordhash");
+
+  vde_ordhash_remove_all(f_oh);
+}
+END_TEST
+
 Suite *
 vde_ordhash_suite (void)
 {
@@ -155,6 +204,13 @@ vde_ordhash_suite (void)
   tcase_add_test (tc_iterators, test_ordhash_iterator_empty);
   tcase_add_test (tc_iterators, test_ordhash_iterator_iterates);
   suite_add_tcase (s, tc_iterators);
+
+  /* Benchmark test case */
+  TCase *tc_bench = tcase_create ("Benchmark");
+  tcase_add_checked_fixture (tc_bench, setup, teardown);
+  tcase_set_timeout (tc_bench, 10);
+  tcase_add_test (tc_bench, test_ordhash_bench_100k);
+  suite_add_tcase (s, tc_bench);
   return s;
 }
 
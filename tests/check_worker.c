@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <semaphore.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/worker.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define NWORKERS 2
+
+// fixture components, always present
+vde_worker **f_workers;
+
+void
+setup (void)
+{
+  f_workers = vde_workers_start(NULL, &epoll_eh, NWORKERS);
+}
+
+void
+teardown (void)
+{
+  if (f_workers != NULL) {
+    vde_workers_stop(f_workers, NWORKERS);
+  }
+}
+
+struct probe {
+  int worker;
+  int has_timers;
+  int fired;
+  vde_timer *timer;
+  sem_t done;
+};
+
+static void probe_cb(void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  p->worker = vde_worker_current();
+  p->has_timers = vde_worker_current_timers() != NULL;
+}
+
+static void probe_timer_cb(int fd, short events, void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+
+  p->fired = vde_worker_current();
+  vde_timer_delete(p->timer);
+  sem_post(&p->done);
+}
+
+static void probe_arm_cb(void *arg)
+{
+  struct probe *p = (struct probe *)arg;
+  struct timeval tv = { 0, 1000 };
+
+  p->timer = vde_timer_new(vde_worker_current_timers(), &probe_timer_cb, p);
+  vde_timer_arm(p->timer, &tv, 0);
+}
+
+V_START_TEST (test_worker_refuse_handler)
+{
+  vde_event_handler eh = { NULL, NULL, NULL, NULL };
+
+  fail_unless (vde_workers_start(NULL, &eh, 1) == NULL && errno == EINVAL,
+               "started workers without a loop per thread");
+}
+END_TEST
+
+V_START_TEST (test_worker_call)
+{
+  int i;
+  struct probe p;
+
+  fail_unless (f_workers != NULL, "cannot start workers");
+  fail_unless (vde_worker_current() == -1, "main thread is a worker");
+
+  for (i = 0; i < NWORKERS; i++) {
+    p.worker = -1;
+    p.has_timers = 0;
+    fail_unless (vde_worker_call(f_workers[i], &probe_cb, &p, 1) == 0,
+                 "call failed");
+    fail_unless (p.worker == i, "call run in worker %d", p.worker);
+    fail_unless (p.has_timers, "worker has no timers");
+  }
+}
+END_TEST
+
+V_START_TEST (test_worker_timer)
+{
+  struct probe p;
+
+  fail_unless (f_workers != NULL, "cannot start workers");
+
+  // timers armed from a worker expire in that worker
+  p.fired = -1;
+  sem_init(&p.done, 0, 0);
+  fail_unless (vde_worker_call(f_workers[1], &probe_arm_cb, &p, 0) == 0,
+               "call failed");
+  sem_wait(&p.done);
+  sem_destroy(&p.done);
+  fail_unless (p.fired == 1, "timer fired in worker %d", p.fired);
+}
+END_TEST
+
+Suite *
+worker_suite (void)
+{
+  Suite *s = suite_create ("worker");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_worker_refuse_handler);
+  tcase_add_test (tc_core, test_worker_call);
+  tcase_add_test (tc_core, test_worker_timer);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = worker_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}